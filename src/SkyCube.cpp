@@ -25,6 +25,52 @@ SkyCube::SkyCube(String xPos, String xNeg,
     } else if (image == 1) {
         m_skyImage = HIPSHOT;
     }
+
+    buildMipLevels();
+}
+
+void SkyCube::buildMipLevels()
+{
+    const shared_ptr<Image> faces[] = { m_xPos, m_xNeg, m_yPos, m_yNeg, m_zPos, m_zNeg };
+
+    for (int f = 0; f < 6; ++f) {
+        m_levels[f].clear();
+        m_levels[f].append(faces[f]);
+
+        while (m_levels[f].last()->width() > 1 || m_levels[f].last()->height() > 1) {
+            const shared_ptr<Image> &src = m_levels[f].last();
+            const int w = max(1, src->width() / 2), h = max(1, src->height() / 2);
+            shared_ptr<Image> dst = Image::create(w, h, src->format());
+
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x) {
+                    const int x0 = min(2 * x, src->width() - 1), x1 = min(2 * x + 1, src->width() - 1);
+                    const int y0 = min(2 * y, src->height() - 1), y1 = min(2 * y + 1, src->height() - 1);
+                    Color4 a, b, c, d;
+                    src->get(Point2int32(x0, y0), a);
+                    src->get(Point2int32(x1, y0), b);
+                    src->get(Point2int32(x0, y1), c);
+                    src->get(Point2int32(x1, y1), d);
+                    dst->set(Point2int32(x, y), (a + b + c + d) * 0.25f);
+                }
+            }
+            m_levels[f].append(dst);
+        }
+    }
+}
+
+int SkyCube::mipLevel(float spread) const
+{
+    if (m_levels[0].size() == 0) {
+        return 0;
+    }
+
+    // A face spans a quarter turn
+    const float texels = spread * m_xPos->width() / (0.5f * pif());
+    if (!(texels > 1.f)) {
+        return 0;
+    }
+    return min(int(log2f(texels)), m_levels[0].size() - 1);
 }
 
 SkyCube::~SkyCube()
@@ -32,9 +78,29 @@ SkyCube::~SkyCube()
 
 }
 
+size_t SkyCube::sizeInBytes() const
+{
+    const shared_ptr<Image> faces[] = { m_xPos, m_xNeg, m_yPos, m_yNeg, m_zPos, m_zNeg };
+    size_t bytes = 0;
+    for (int i = 0; i < 6; ++i) {
+        if (faces[i]) {
+            bytes += size_t(faces[i]->width()) * faces[i]->height() * faces[i]->format()->cpuBitsPerPixel / 8;
+        }
+
+        // The levels below the face add about a third
+        for (int l = 1; l < m_levels[i].size(); ++l) {
+            const shared_ptr<Image> &level = m_levels[i][l];
+            bytes += size_t(level->width()) * level->height() * level->format()->cpuBitsPerPixel / 8;
+        }
+    }
+    return bytes;
+}
+
 
-Color4 SkyCube::getIntersectedColor(const Ray &ray)
+Color4 SkyCube::getIntersectedColor(const Ray &ray, float spread) const
 {
+    const int level = mipLevel(spread);
+
     Point3 rayOrigin = ray.origin();
     Vector3 rayDirection = ray.direction();
 
@@ -55,7 +121,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(0, intersection2D);
+            return sampleSkyCube(0, intersection2D, level);
         }
 
     }
@@ -70,7 +136,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(1, intersection2D);
+            return sampleSkyCube(1, intersection2D, level);
         }
     }
 
@@ -86,7 +152,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(2, intersection2D);
+            return sampleSkyCube(2, intersection2D, level);
         }
     }
 
@@ -101,7 +167,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(3, intersection2D);
+            return sampleSkyCube(3, intersection2D, level);
         }
     }
 
@@ -115,7 +181,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(4, intersection2D);
+            return sampleSkyCube(4, intersection2D, level);
         }
     }
 
@@ -129,7 +195,7 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
         intersection2D = Point2(intersectionPt.x, intersectionPt.y);
 
         if (intersectionInBounds(intersection2D)) {
-            return sampleSkyCube(5, intersection2D);
+            return sampleSkyCube(5, intersection2D, level);
         }
     }
 
@@ -137,11 +203,12 @@ Color4 SkyCube::getIntersectedColor(const Ray &ray)
 
 }
 
-Color4 SkyCube::sampleSkyCube(int faceNum, Point2 intersectionP)
+Color4 SkyCube::sampleSkyCube(int faceNum, Point2 intersectionP, int level) const
 {
+    const shared_ptr<Image> &image = m_levels[faceNum][level];
 
-    float imageHeight = static_cast<float>(m_xPos->height());
-    float imageWidth = static_cast<float>(m_xPos->width());
+    float imageHeight = static_cast<float>(image->height());
+    float imageWidth = static_cast<float>(image->width());
 
     // scale world space 2D intersection point within image bounds
     float translatedXpt = intersectionP.x + DIST;
@@ -154,34 +221,17 @@ Color4 SkyCube::sampleSkyCube(int faceNum, Point2 intersectionP)
     int scaledXcoordInt = floor(scaledXcoord);
     int scaledYcoordInt = floor(scaledYcoord);
 
-    scaledXcoordInt = G3D::clamp(scaledXcoordInt, 1, m_xPos->height() - 1);
-    scaledYcoordInt = G3D::clamp(scaledYcoordInt, 1, m_xPos->height() - 1);
+    scaledXcoordInt = G3D::clamp(scaledXcoordInt, min(1, image->width() - 1), image->width() - 1);
+    scaledYcoordInt = G3D::clamp(scaledYcoordInt, min(1, image->height() - 1), image->height() - 1);
 
     Point2int32 sampleCoord = Point2int32(scaledXcoordInt, scaledYcoordInt);
 
-    if (faceNum == 0) {
-        // xPos
-        m_xPos->get(sampleCoord, toReturn);
-    } else if (faceNum == 1) {
-        // xNeg
-        m_xNeg->get(sampleCoord, toReturn);
-    } else if (faceNum == 2) {
-        m_yPos->get(sampleCoord, toReturn);
-    } else if (faceNum == 3) {
-        // y Pos
-        m_yNeg->get(sampleCoord, toReturn);
-    } else if (faceNum == 4) {
-        m_zPos->get(sampleCoord, toReturn);
-    } else { // faceNum == 5
-        // zNeg
-
-        m_zNeg->get(sampleCoord, toReturn);
-    }
+    image->get(sampleCoord, toReturn);
 
     return toReturn;
 }
 
-bool SkyCube::intersectionInBounds(Point2 intrsct2D)
+bool SkyCube::intersectionInBounds(Point2 intrsct2D) const
 {
     return (intrsct2D.x <= DIST &&
             intrsct2D.x >= -DIST &&
@@ -31,9 +31,16 @@ public:
      * the intersection point, samples the appropiate image at the correct spot,
      * and returns that color.
      * @param ray: the ray being cast into the skycube.
+     * @param spread: angular width of the ray's footprint in radians, which
+     * picks the mip level of the faces; 0 reads full resolution.
      * @return: the color at intersected point.
      */
-    Color4 getIntersectedColor(const Ray &ray);
+    Color4 getIntersectedColor(const Ray &ray, float spread = 0.f) const;
+
+    /**
+     * @brief sizeInBytes: memory held by the six face images.
+     */
+    size_t sizeInBytes() const;
 
 private:
 
@@ -43,11 +50,22 @@ private:
      * for 'getIntersectedColor'
      * @param faceNum - int signaling which face to sample.
      * @param intersectionP - 2D intersection point.
+     * @param level - mip level to read.
      * @return: color of skycube at point.
      */
-    Color4 sampleSkyCube(int faceNum, Point2 intersectionP);
+    Color4 sampleSkyCube(int faceNum, Point2 intersectionP, int level) const;
+
+    bool intersectionInBounds(Point2 intrsct2D) const;
+
+    /**
+     * @brief buildMipLevels: box filters each face down to 1x1 into m_levels.
+     */
+    void buildMipLevels();
 
-    bool intersectionInBounds(Point2 intrsct2D);
+    /**
+     * @brief mipLevel: the level whose texels are about @p spread radians wide.
+     */
+    int mipLevel(float spread) const;
 
     shared_ptr<Image> m_xPos;
     shared_ptr<Image> m_xNeg;
@@ -56,6 +74,9 @@ private:
     shared_ptr<Image> m_zPos;
     shared_ptr<Image> m_zNeg;
 
+    // Mip levels of each face, in face order; level 0 is the face itself
+    Array<shared_ptr<Image>> m_levels[6];
+
     SkyImage m_skyImage;
 
 
@@ -0,0 +1,135 @@
+#include "aov.h"
+#include "memorytracker.h"
+
+#include <new>
+
+AOVBuffers::AOVBuffers() :
+    m_radiance(NULL),
+    m_features(NULL),
+    m_samples(NULL),
+    m_width(0),
+    m_height(0)
+{ }
+
+const char *AOVBuffers::name( AOV aov )
+{
+    switch (aov)
+    {
+    case AOV_COLOR:     return "color";
+    case AOV_EMITTED:   return "emitted";
+    case AOV_DIRECT:    return "direct";
+    case AOV_SPECULAR:  return "specular";
+    case AOV_INDIRECT:  return "indirect";
+    case AOV_ALBEDO:    return "albedo";
+    case AOV_NORMAL:    return "normal";
+    case AOV_DEPTH:     return "depth";
+    case AOV_SAMPLES:   return "samples";
+    default:            return "?";
+    }
+}
+
+void AOVBuffers::resize( int width, int height )
+{
+    if (!m_radiance || width != m_width || height != m_height)
+    {
+        m_width = width;
+        m_height = height;
+
+        const int numPixels = width * height;
+        m_arena.reset();
+        m_radiance = m_arena.alloc<RadianceComponents>(numPixels);
+        m_features = m_arena.alloc<PixelFeatures>(numPixels);
+        m_samples = m_arena.alloc<int>(numPixels);
+
+        MemoryTracker::global().set(MemoryTracker::AOVS, sizeInBytes());
+    }
+    clear();
+}
+
+void AOVBuffers::clear()
+{
+    const int numPixels = m_width * m_height;
+    for (int i = 0; i < numPixels; ++i)
+    {
+        new (&m_radiance[i]) RadianceComponents();
+        new (&m_features[i]) PixelFeatures();
+        m_samples[i] = 0;
+    }
+}
+
+void AOVBuffers::accumulate( int i, int pass, const PixelAOVs &aovs )
+{
+    const float a = float(pass) / float(pass + 1), b = 1.f / float(pass + 1);
+
+    RadianceComponents &r = m_radiance[i];
+    r.emitted = r.emitted * a + aovs.radiance.emitted * b;
+    r.direct = r.direct * a + aovs.radiance.direct * b;
+    r.specular = r.specular * a + aovs.radiance.specular * b;
+    r.indirect = r.indirect * a + aovs.radiance.indirect * b;
+
+    PixelFeatures &f = m_features[i];
+    f.albedo = f.albedo * a + aovs.features.albedo * b;
+    f.normal = f.normal * a + aovs.features.normal * b;
+    f.depth = f.depth * a + aovs.features.depth * b;
+
+    m_samples[i] += aovs.paths;
+}
+
+void AOVBuffers::resolve( AOV aov, bool forDisplay, Radiance3 *out ) const
+{
+    const int numPixels = m_width * m_height;
+
+    // Depths and counts are unbounded; the display shows them relative
+    // to the largest
+    float scale = 1.f;
+    if (forDisplay && (aov == AOV_DEPTH || aov == AOV_SAMPLES))
+    {
+        float largest = 0.f;
+        for (int i = 0; i < numPixels; ++i)
+            largest = max(largest, aov == AOV_DEPTH ? m_features[i].depth : float(m_samples[i]));
+        scale = largest > 0.f ? 1.f / largest : 0.f;
+    }
+
+    for (int i = 0; i < numPixels; ++i)
+    {
+        switch (aov)
+        {
+        case AOV_EMITTED:   out[i] = m_radiance[i].emitted; break;
+        case AOV_DIRECT:    out[i] = m_radiance[i].direct; break;
+        case AOV_SPECULAR:  out[i] = m_radiance[i].specular; break;
+        case AOV_INDIRECT:  out[i] = m_radiance[i].indirect; break;
+        case AOV_ALBEDO:    out[i] = m_features[i].albedo; break;
+        case AOV_NORMAL:
+        {
+            const Vector3 &n = m_features[i].normal;
+            out[i] = forDisplay ? Radiance3(n.x, n.y, n.z) * 0.5f + Radiance3(0.5f)
+                                : Radiance3(n.x, n.y, n.z);
+            break;
+        }
+        case AOV_DEPTH:     out[i] = Radiance3(m_features[i].depth * scale); break;
+        case AOV_SAMPLES:   out[i] = Radiance3(float(m_samples[i]) * scale); break;
+        default:            out[i] = Radiance3::zero(); break;
+        }
+    }
+}
+
+void AOVBuffers::save( const String &prefix ) const
+{
+    if (!m_radiance)
+        return;
+
+    shared_ptr<Image3> image = Image3::createEmpty(m_width, m_height);
+    for (int aov = AOV_COLOR + 1; aov < NUM_AOVS; ++aov)
+    {
+        resolve(AOV(aov), false, (Radiance3*)image->getCArray());
+        const String filename = prefix + name(AOV(aov)) + ".exr";
+        image->save(filename);
+        printf("Saved %s\n", filename.c_str());
+    }
+    fflush( stdout );
+}
+
+size_t AOVBuffers::sizeInBytes() const
+{
+    return size_t(m_width) * m_height * (sizeof(RadianceComponents) + sizeof(PixelFeatures) + sizeof(int));
+}
@@ -0,0 +1,120 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include <G3D/G3DAll.h>
+
+#include "hugepagearena.h"
+
+/** What the first hits of a pixel's camera paths saw, averaged like its
+  * radiance: the material's reflectance, the shading normal and the depth
+  * along the view axis. Misses count as white albedo at depth 0 with no
+  * normal.
+  */
+struct PixelFeatures
+{
+    Color3      albedo;
+    Vector3     normal;
+    float       depth;
+
+    PixelFeatures() : albedo(Color3::zero()), normal(Vector3::zero()), depth(0.f) { }
+};
+
+/** A path's radiance split by how it left the first hit: light the surface
+  * emits (or the sky, on a miss), light from emitters sampled there,
+  * emitters seen in its mirrors, and everything that arrived by a bounce.
+  * Each part is clamped like the total, so they sum to the color except
+  * where the color itself was clamped.
+  */
+struct RadianceComponents
+{
+    Radiance3   emitted;
+    Radiance3   direct;
+    Radiance3   specular;
+    Radiance3   indirect;
+
+    RadianceComponents() : emitted(Radiance3::zero()), direct(Radiance3::zero()),
+                           specular(Radiance3::zero()), indirect(Radiance3::zero()) { }
+};
+
+/** Everything a pass of the path tracer reports for one pixel besides its
+  * color, averaged over the pass's paths
+  */
+struct PixelAOVs
+{
+    RadianceComponents  radiance;
+    PixelFeatures       features;
+    int                 paths;      // paths traced this pass
+
+    PixelAOVs() : paths(0) { }
+};
+
+/** Arbitrary output variables: the images a render produces alongside the
+  * final color
+  */
+enum AOV
+{
+    AOV_COLOR,
+    AOV_EMITTED,
+    AOV_DIRECT,
+    AOV_SPECULAR,
+    AOV_INDIRECT,
+    AOV_ALBEDO,
+    AOV_NORMAL,
+    AOV_DEPTH,
+    AOV_SAMPLES,
+    NUM_AOVS
+};
+
+/** Running per pixel averages of every AOV but the color, which App keeps,
+  * filled by the same paths as the color. A pass adds one PixelAOVs per
+  * pixel, so the cost is a few multiply-adds per pixel on top of the
+  * bookkeeping the path tracer does anyway at the first hit.
+  */
+class AOVBuffers
+{
+public:
+
+    AOVBuffers();
+
+    /** "color", "emitted", ... as used in file names */
+    static const char *name( AOV aov );
+
+    /** Allocates and clears the buffers for a @p width x @p height image */
+    void resize( int width, int height );
+
+    /** Zeroes every buffer */
+    void clear();
+
+    /** Folds pass @p pass of pixel @p i into the averages; the passes of a
+      * pixel are added in order from 0 by one thread
+      */
+    void accumulate( int i, int pass, const PixelAOVs &aovs );
+
+    /** Averaged first hit features, for the denoiser */
+    const PixelFeatures *features() const { return m_features; }
+
+    /** @p aov, other than the color, as an image into @p out. For display
+      * the normals are mapped to [0, 1] and depths and sample counts
+      * divided by their maxima; otherwise the values are raw.
+      */
+    void resolve( AOV aov, bool forDisplay, Radiance3 *out ) const;
+
+    /** Writes every AOV but the color to "<prefix><name>.exr" */
+    void save( const String &prefix ) const;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    size_t sizeInBytes() const;
+
+private:
+
+    HugePageArena       m_arena;
+    RadianceComponents *m_radiance;
+    PixelFeatures *     m_features;
+    int *               m_samples;  // paths summed over all passes
+    int                 m_width;
+    int                 m_height;
+};
+
+#endif // AOV_H
@@ -1,5 +1,8 @@
 
 #include "app.h"
+#include "benchmark.h"
+
+#include <sys/resource.h>
 
 #ifndef G3D_PATH
 #define G3D_PATH "/contrib/projects/g3d10/G3D10"
@@ -23,7 +26,25 @@ App::App(const GApp::Settings &settings)
     : GApp(settings),
     pass(0),
     continueRender(true),
-    m_renderer(new PathTracer)
+    activeMethod(PATH),
+    worldPending(false),
+    memoryReport(false),
+    m_renderer(new PathTracer),
+    m_photonMapper(new PhotonMapper),
+    m_rayTracer(new RayTracer),
+    m_bidirectional(new BidirectionalTracer),
+    m_cameraMoved(false),
+    m_accum(NULL),
+    m_shownAOV(AOV_COLOR),
+    m_denoised(NULL),
+    m_denoiseScratch(NULL),
+    m_denoisedValid(false),
+    m_showDenoised(false),
+    m_denoiseEvery(16),
+    m_denoiseRequested(false),
+    m_loadingModels(false),
+    m_benchmarkPasses(4),
+    m_benchmarkMode(Benchmark::HUGE_PAGES)
 {
     m_scenePath = dataDir + "/scene";
 
@@ -37,9 +58,10 @@ App::App(const GApp::Settings &settings)
     m_ptsettings.dofEnabled=false;
     m_ptsettings.dofFocus=-4.8f;
     m_ptsettings.dofLens=0.2f;
-    m_ptsettings.dofSamples=5;
+    m_ptsettings.dofMaxSamples=8;
 
     m_ptsettings.attenuation=true;
+    m_ptsettings.useMedium=false;
 }
 
 App::~App() { }
@@ -55,30 +77,261 @@ void App::threadCallback(int x, int y)
     if (!continueRender) return;
     // Set the pixel to green during calculation (makes it
     // easier to spot the 'scanline')
-    Radiance3 last = m_canvas->get( x, y );
-    m_canvas->set( x, y, Color3::green() );
-    Radiance3 sample = m_renderer->sample(x,y,m_canvas->rect2DBounds());
-    m_canvas->set( x, y, (float)pass/(float)(pass+1)*last + sample/(float)(pass+1) );
+    Radiance3 &accum = m_accum[y * m_canvas->width() + x];
+    Radiance3 last = accum;
+    accum = Color3::green();
+    Radiance3 sample;
+    switch (activeMethod) {
+    case RAY:
+        sample = m_rayTracer->sample(x,y,m_canvas->rect2DBounds());
+        break;
+    case PHOTON:
+        sample = m_photonMapper->sample(x,y,pass,m_canvas->rect2DBounds());
+        break;
+    case BIDIRECTIONAL:
+        sample = m_bidirectional->sample(x,y,pass,m_canvas->rect2DBounds());
+        break;
+    default: {
+        PixelAOVs aovs;
+        sample = m_renderer->sample(x,y,pass,m_canvas->rect2DBounds(),&aovs);
+        m_aovs.accumulate(y * m_canvas->width() + x, pass, aovs);
+        break;
+    }
+    }
+    accum = (float)pass/(float)(pass+1)*last + sample/(float)(pass+1);
 }
 
-static void dispatcher(void *arg)
+void App::createCanvas()
 {
-    App *self = (App*)arg;
-    ThreadPool pool( self, THREADS );
+    m_canvas = Image3::createEmpty(window()->width(),
+                                   window()->height());
+
+    const int numPixels = m_canvas->width() * m_canvas->height();
+    m_accumArena.reset();
+    m_accum = m_accumArena.alloc<Radiance3>(numPixels);
+    for (int i = 0; i < numPixels; ++i)
+        m_accum[i] = Radiance3::zero();
+
+    m_aovs.resize(m_canvas->width(), m_canvas->height());
+    m_denoised = m_accumArena.alloc<Radiance3>(numPixels);
+    m_denoiseScratch = m_accumArena.alloc<Radiance3>(numPixels);
+    m_denoisedValid = false;
+
+    MemoryTracker::global().set(MemoryTracker::FRAMEBUFFER,
+                                4 * sizeof(Radiance3) * numPixels);
+}
+
+void App::reportMemory()
+{
+    MemoryTracker::global().report("Memory:");
+    m_world.reportTextureCache();
+}
+
+void App::resolveAccum(Radiance3 *out)
+{
+    if (activeMethod != BIDIRECTIONAL) {
+        memcpy(out, m_accum, sizeof(Radiance3) * m_canvas->width() * m_canvas->height());
+        return;
+    }
+
+    // Light tracing splats are summed over the passes, not averaged
+    const float scale = 1.f / float(pass + 1);
+    for (int y = 0; y < m_canvas->height(); ++y)
+        for (int x = 0; x < m_canvas->width(); ++x) {
+            const int i = y * m_canvas->width() + x;
+            out[i] = m_accum[i] + m_bidirectional->splats(x, y) * scale;
+        }
+}
+
+void App::resolveCanvas()
+{
+    if (m_shownAOV != AOV_COLOR && activeMethod == PATH) {
+        m_aovs.resolve(AOV(m_shownAOV), true, (Radiance3*)m_canvas->getCArray());
+        return;
+    }
+    if (m_showDenoised && m_denoisedValid) {
+        std::lock_guard<std::mutex> lock(m_denoisedMutex);
+        memcpy(m_canvas->getCArray(), m_denoised,
+               sizeof(Radiance3) * m_canvas->width() * m_canvas->height());
+        return;
+    }
+    resolveAccum((Radiance3*)m_canvas->getCArray());
+}
 
+void App::denoise()
+{
     Stopwatch watch;
-    float elapsed = 0.f;
+    watch.tick();
+
+    // The display may be copying m_denoised meanwhile; the new image is
+    // filtered in the scratch buffer and swapped in once complete
+    resolveAccum(m_denoiseScratch);
+    m_denoiser.setSettings(m_denoiseSettings);
+    m_denoiser.denoise(m_denoiseScratch, m_aovs.features(), m_canvas->width(), m_canvas->height(),
+                       m_denoiseScratch);
+    {
+        std::lock_guard<std::mutex> lock(m_denoisedMutex);
+        std::swap(m_denoised, m_denoiseScratch);
+        m_denoisedValid = true;
+    }
 
-    for ( int i = 0; self->continueRender && i < self->num_passes; ++i ) {
-        watch.tick();
-        printf("[%.3f s] Pass %d...\n", elapsed, i + 1); fflush( stdout );
-        self->pass = i;
+    watch.tock();
+    printf("Denoised in %.1f ms\n", watch.elapsedTime() * 1000.0); fflush( stdout );
+}
+
+void App::denoiseAfterPass(int passesDone)
+{
+    const bool periodic = m_denoiseEvery > 0 && passesDone % m_denoiseEvery == 0;
+    if (m_denoiseRequested || (m_showDenoised && periodic)) {
+        m_denoiseRequested = false;
+        denoise();
+    }
+}
+
+void App::denoiseNow()
+{
+    // Mid-render the dispatcher runs it between passes, when the buffers
+    // are not being written
+    if (m_dispatch && !m_dispatch->completed())
+        m_denoiseRequested = true;
+    else if (m_canvas)
+        denoise();
+}
+
+void App::setBenchmark(const String &scenePath, int passes, Benchmark::Mode mode)
+{
+    m_benchmarkScene = scenePath;
+    m_benchmarkPasses = passes;
+    m_benchmarkMode = mode;
+}
+
+// Page faults taken by the process so far
+static void pageFaults(long &major, long &minor)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    major = usage.ru_majflt;
+    minor = usage.ru_minflt;
+}
+
+static void writeSceneCache(void *arg)
+{
+    World *world = (World*)arg;
+    world->writeCache();
+}
+
+// Seconds the camera must hold still before a Ray render starts path tracing
+static const RealTime STILL_SECONDS = 0.5;
+
+// Redraws Whitted frames as long as the camera keeps moving
+static void preview(App *self, ThreadPool &pool)
+{
+    RealTime lastMove = System::time();
+    bool drawn = false;
+
+    while (self->continueRender) {
+        if (self->takeCameraMove()) {
+            lastMove = System::time();
+        } else if (drawn) {
+            if (System::time() - lastMove > STILL_SECONDS)
+                return;
+            System::sleep(0.01);
+            continue;
+        }
+
+        // Pass 0 replaces the accumulated pixels
+        self->pass = 0;
         pool.run();
-        watch.tock();
-        elapsed += watch.elapsedTime();
+        drawn = true;
+    }
+}
+
+static void dispatcher(void *arg)
+{
+    App *self = (App*)arg;
+
+    // Geometry processing runs here rather than on the GUI thread; rendering
+    // starts as soon as the BVH is ready and the cache is written alongside
+    shared_ptr<Thread> cacheWriter;
+    if (self->worldPending) {
+        bool loaded = self->world().finishLoad();
+        self->worldPending = false;
+        if (!loaded) {
+            return;
+        }
+
+        cacheWriter = Thread::create("sceneCacheWriter", writeSceneCache, &self->world());
+        cacheWriter->start();
     }
 
+    // A Ray render previews while the camera moves and path traces while
+    // it holds still
+    const bool interactive = self->activeMethod == RAY;
+    const bool photons = self->activeMethod == PHOTON;
+    const bool bidirectional = self->activeMethod == BIDIRECTIONAL;
+
+    ThreadPool pool( self, THREADS );
+
+    do {
+        if (interactive) {
+            self->activeMethod = RAY;
+            preview(self, pool);
+            self->activeMethod = PATH;
+            if (!self->continueRender)
+                break;
+        }
+
+        if (photons)
+            self->photonMapper().beginRender();
+        else if (bidirectional)
+            self->bidirectional().beginRender(self->viewport());
+        else
+            self->renderer().beginRender();
+
+        Stopwatch watch;
+        float elapsed = 0.f;
+
+        for ( int i = 0; self->continueRender && i < self->num_passes; ++i ) {
+            if (interactive && self->cameraMovePending())
+                break;
+
+            watch.tick();
+            printf("[%.3f s] Pass %d...\n", elapsed, i + 1); fflush( stdout );
+            self->pass = i;
+
+            // Photons are shot before the pass so every pixel gathers the
+            // same set
+            if (photons)
+                self->photonMapper().beginPass(i);
+
+            long major0, minor0, major1, minor1;
+            pageFaults(major0, minor0);
+            pool.run();
+            pageFaults(major1, minor1);
+            if (!photons && !bidirectional)
+                self->renderer().endPass();
+            self->denoiseAfterPass(i + 1);
+
+            watch.tock();
+            elapsed += watch.elapsedTime();
+
+            // Major faults are geometry read back from disk
+            if (self->world().isStreaming()) {
+                printf("    %ld major, %ld minor page faults\n", major1 - major0, minor1 - minor0);
+                fflush( stdout );
+            }
+        }
+    } while (interactive && self->continueRender && self->cameraMovePending());
+
+    if (cacheWriter)
+        cacheWriter->waitForCompletion();
+
     printf("Finished rendering.\n"); fflush( stdout );
+
+    if (self->memoryReport) {
+        MemoryTracker::global().report("Memory after rendering:");
+        self->world().reportTextureCache();
+    }
 }
 
 void App::onInit()
@@ -92,73 +345,186 @@ void App::onInit()
     developerWindow->cameraControlWindow->setVisible(false);
     makeGUI();
 
-    m_canvas = Image3::createEmpty(window()->width(),
-                                   window()->height());
+    createCanvas();
+
+    if (!m_benchmarkScene.empty()) {
+        Benchmark benchmark(m_benchmarkScene, m_ptsettings, 512, 512, m_benchmarkPasses);
+        benchmark.run(m_benchmarkMode);
+        setExitCode(0);
+    }
 }
 
 void App::onRender()
 {
     // user clicks the render button
-    if(m_dispatch == NULL || (m_dispatch != NULL && m_dispatch->completed()))
+    if(!m_loadingModels && (m_dispatch == NULL || (m_dispatch != NULL && m_dispatch->completed())))
     {
         continueRender = true;
         String fullpath = m_scenePath + "/" + m_ddl->selectedValue().text();
 
-        m_world.unload();
-        m_world.load(fullpath);
+        // Only the tracer settings and canvas need resetting when the
+        // scene on disk is the one already loaded
+        bool reuse = m_world.isLoaded(fullpath);
+        if (reuse) {
+            printf("Scene unchanged, reusing loaded world\n");
+        } else {
+            m_world.unload();
+            m_world.beginLoad(fullpath);
+        }
 
-//        bool useCubeMap = true;
-        if (m_ptsettings.useImageBasedLighting) {
-
-            String xPos;
-            String xNeg;
-            String yPos;
-            String yNeg;
-            String zPos;
-            String zNeg;
-            int skyImage;
-
-            if (m_ptsettings.si == PTSettings::SPONZA) {
-                xPos = "cubemap/sponza/sponza-PX.png";
-                xNeg = "cubemap/sponza/sponza-NX.png";
-                yPos = "cubemap/sponza/sponza-PY.png";
-                yNeg = "cubemap/sponza/sponza-NY.png";
-                zPos = "cubemap/sponza/sponza-PZ.png";
-                zNeg = "cubemap/sponza/sponza-NZ.png";
-                skyImage = 0;
-            } else if (m_ptsettings.si == PTSettings::HIPSHOT) {
-                xPos = "cubemap/hipshot_m9_sky/16_rt.png";
-                xNeg = "cubemap/hipshot_m9_sky/16_lf.png";
-                yPos = "cubemap/hipshot_m9_sky/16_up.png";
-                yNeg = "cubemap/hipshot_m9_sky/16_dn.png";
-                zPos = "cubemap/hipshot_m9_sky/16_ft.png";
-                zNeg = "cubemap/hipshot_m9_sky/16_bk.png";
-                skyImage = 1;
-            }
+        prepareRender();
 
+        createCanvas();
 
+        if (reuse) {
+            startDispatch();
+        } else {
+            // Models are read one per frame in onSimulation(), which starts
+            // the dispatcher once they are all in
+            m_loadingModels = true;
+        }
+    } else {
+        continueRender=false;
+    }
+}
 
-            m_world.setSkybox(xPos, xNeg,
-                                yPos, yNeg,
-                                zPos, zNeg, skyImage);
+void App::prepareRender()
+{
+//        bool useCubeMap = true;
+    if (m_ptsettings.useImageBasedLighting) {
+
+        String xPos;
+        String xNeg;
+        String yPos;
+        String yNeg;
+        String zPos;
+        String zNeg;
+        int skyImage;
+
+        if (m_ptsettings.si == PTSettings::SPONZA) {
+            xPos = "cubemap/sponza/sponza-PX.png";
+            xNeg = "cubemap/sponza/sponza-NX.png";
+            yPos = "cubemap/sponza/sponza-PY.png";
+            yNeg = "cubemap/sponza/sponza-NY.png";
+            zPos = "cubemap/sponza/sponza-PZ.png";
+            zNeg = "cubemap/sponza/sponza-NZ.png";
+            skyImage = 0;
+        } else if (m_ptsettings.si == PTSettings::HIPSHOT) {
+            xPos = "cubemap/hipshot_m9_sky/16_rt.png";
+            xNeg = "cubemap/hipshot_m9_sky/16_lf.png";
+            yPos = "cubemap/hipshot_m9_sky/16_up.png";
+            yNeg = "cubemap/hipshot_m9_sky/16_dn.png";
+            zPos = "cubemap/hipshot_m9_sky/16_ft.png";
+            zNeg = "cubemap/hipshot_m9_sky/16_bk.png";
+            skyImage = 1;
         }
 
-        m_renderer->setWorld(&m_world);
-        m_renderer->setPTSettings(m_ptsettings);
 
-        shared_ptr<Camera> cam = m_world.camera();
-        cam->depthOfFieldSettings().setEnabled(true);
-        cam->depthOfFieldSettings().setModel(DepthOfFieldModel::PHYSICAL);
 
-        cam->depthOfFieldSettings().setLensRadius(m_ptsettings.dofLens);
-        cam->depthOfFieldSettings().setFocusPlaneZ(m_ptsettings.dofFocus);
+        m_world.setSkybox(xPos, xNeg,
+                            yPos, yNeg,
+                            zPos, zNeg, skyImage);
+    }
 
-        m_canvas = Image3::createEmpty(window()->width(),
-                                       window()->height());
-        m_dispatch = Thread::create("dispatcher", dispatcher, this);
-        m_dispatch->start();
-    } else {
-        continueRender=false;
+    m_renderer->setWorld(&m_world);
+    m_renderer->setPTSettings(m_ptsettings);
+
+    m_photonSettings.useSky = m_ptsettings.useImageBasedLighting;
+    m_photonSettings.sampler = m_ptsettings.sampler;
+    m_photonMapper->setWorld(&m_world);
+    m_photonMapper->setSettings(m_photonSettings);
+
+    m_bdptSettings.sampler = m_ptsettings.sampler;
+    m_bidirectional->setWorld(&m_world);
+    m_bidirectional->setSettings(m_bdptSettings);
+
+    m_raySettings.useSky = m_ptsettings.useImageBasedLighting;
+    m_rayTracer->setWorld(&m_world);
+    m_rayTracer->setSettings(m_raySettings);
+
+    activeMethod = m_currRenderMethod;
+
+    // The debug camera controls drive the scene camera during a Ray render
+    if (activeMethod == RAY) {
+        std::lock_guard<std::mutex> lock(m_cameraMutex);
+        m_cameraFrame = m_world.camera()->frame();
+        m_cameraMoved = false;
+        debugCamera()->setFrame(m_cameraFrame);
+    }
+
+    shared_ptr<Camera> cam = m_world.camera();
+    cam->depthOfFieldSettings().setEnabled(true);
+    cam->depthOfFieldSettings().setModel(DepthOfFieldModel::PHYSICAL);
+
+    cam->depthOfFieldSettings().setLensRadius(m_ptsettings.dofLens);
+    cam->depthOfFieldSettings().setFocusPlaneZ(m_ptsettings.dofFocus);
+}
+
+bool App::takeCameraMove()
+{
+    std::lock_guard<std::mutex> lock(m_cameraMutex);
+    if (!m_cameraMoved)
+        return false;
+
+    m_world.camera()->setFrame(m_cameraFrame);
+    if (m_world.dofCamera())
+        m_world.dofCamera()->setFrame(m_cameraFrame);
+    m_cameraMoved = false;
+    return true;
+}
+
+bool App::cameraMovePending()
+{
+    std::lock_guard<std::mutex> lock(m_cameraMutex);
+    return m_cameraMoved;
+}
+
+void App::startDispatch()
+{
+    m_dispatch = Thread::create("dispatcher", dispatcher, this);
+    m_dispatch->start();
+}
+
+void App::onSimulation(RealTime rdt, SimTime sdt, SimTime idt)
+{
+    GApp::onSimulation(rdt, sdt, idt);
+
+    if (m_loadingModels) {
+        // One model per frame keeps the window responsive while loading
+        if (!continueRender) {
+            // Render was clicked again mid-load; drop the partial scene
+            m_loadingModels = false;
+            m_world.unload();
+            m_statusLabel->setCaption("Load cancelled");
+        } else if (!m_world.loadNextModel()) {
+            m_loadingModels = false;
+            if (m_world.loadFailed()) {
+                // Over the memory budget; give up before building anything
+                printf("Load failed: %s\n", m_world.loadError().c_str());
+                m_world.unload();
+            } else {
+                worldPending = true;
+                startDispatch();
+            }
+        }
+    }
+
+    if (m_currRenderMethod == RAY && m_dispatch && !m_dispatch->completed()) {
+        const CFrame &frame = debugCamera()->frame();
+        std::lock_guard<std::mutex> lock(m_cameraMutex);
+        if (!(frame == m_cameraFrame)) {
+            m_cameraFrame = frame;
+            m_cameraMoved = true;
+        }
+    }
+
+    if (m_loadingModels || worldPending) {
+        m_statusLabel->setCaption(format("%s (%d%%)", m_world.loadStatus().c_str(),
+                                         iRound(100.f * m_world.loadProgress())));
+    } else if (m_dispatch && !m_dispatch->completed()) {
+        m_statusLabel->setCaption(format("Pass %d", pass + 1));
+    } else if (m_world.loadFailed()) {
+        m_statusLabel->setCaption(m_world.loadError());
     }
 }
 
@@ -172,6 +538,7 @@ void App::onGraphics(RenderDevice *rd,
                      Array<shared_ptr<Surface2D> >& posed2D)
 {
 
+    resolveCanvas();
     shared_ptr<Texture> tex = Texture::fromImage("Source", m_canvas);
 
     m_film->exposeAndRender(renderDevice, getFilmSettings(), tex, 0, 0);
@@ -253,6 +620,7 @@ void App::saveCanvas()
     info = localtime(&rawtime);
     strftime(dayHourMinSec, 7, "%d%H%M%S",info);
 
+    resolveCanvas();
     shared_ptr<Texture> colorBuffer = Texture::createEmpty("Color", renderDevice->width(), renderDevice->height());
     m_film->exposeAndRender(renderDevice, getFilmSettings(), Texture::fromImage("Source", m_canvas), 0, 0, colorBuffer);
     colorBuffer->toImage(ImageFormat::RGB8())->save(String("../images/scene-") +
@@ -260,6 +628,32 @@ void App::saveCanvas()
                                                     "-" + dayHourMinSec + ".png");
 }
 
+void App::saveAOVs()
+{
+    if (!m_canvas)
+        return;
+
+    time_t rawtime;
+    struct tm *info;
+    char dayHourMinSec [7];
+    time(&rawtime);
+    info = localtime(&rawtime);
+    strftime(dayHourMinSec, 7, "%d%H%M%S",info);
+
+    const String prefix = String("../images/scene-") + "p" + String(std::to_string(pass).c_str()) +
+                          "-" + dayHourMinSec + "-";
+
+    shared_ptr<Image3> color = Image3::createEmpty(m_canvas->width(), m_canvas->height());
+    resolveAccum((Radiance3*)color->getCArray());
+    color->save(prefix + AOVBuffers::name(AOV_COLOR) + ".exr");
+
+    if (activeMethod == PATH) {
+        m_aovs.save(prefix);
+    } else {
+        printf("AOVs are only filled by the Path renderer\n"); fflush( stdout );
+    }
+}
+
 void App::toggleWindowRendering()
 {
     m_windowRendering->setVisible(!m_windowRendering->visible());
@@ -290,6 +684,9 @@ void App::changeRenderMethod()
     case 2:
         m_currRenderMethod = RenderMethod::PHOTON;
         break;
+    case 3:
+        m_currRenderMethod = RenderMethod::BIDIRECTIONAL;
+        break;
     }
 }
 
@@ -345,12 +742,17 @@ void App::makeGUI()
 
     // RENDERING WINDOW
     GuiControl::Callback changeRender(this, &App::changeRenderMethod);
-    m_renderdl = paneRendering->addDropDownList("Renderer", Array<GuiText>("Ray", "Path", "Photon"), (int*)(&m_currRenderMethod), changeRender);
+    m_renderdl = paneRendering->addDropDownList("Renderer", Array<GuiText>("Ray", "Path", "Photon", "Bidirectional"), (int*)(&m_currRenderMethod), changeRender);
 
     paneRendering->addButton("Save Image", this, &App::saveCanvas);
+    paneRendering->addButton("Save AOVs", this, &App::saveAOVs);
+    paneRendering->addDropDownList("Show", Array<GuiText>("Color", "Emitted", "Direct", "Specular", "Indirect",
+                                                          "Albedo", "Normal", "Depth", "Samples"), &m_shownAOV);
+    paneRendering->addButton("Memory Report", this, &App::reportMemory);
     GuiButton* renderButton = paneRendering->addButton("Render", this, &App::onRender);
     renderButton->setFocused(true);
     renderButton->moveBy(140.0f,0.0f);
+    m_statusLabel = paneRendering->addLabel("");
 
     paneRendering->addLabel("--- Depth of Field ---");
     paneRendering->addCheckBox("Enable", &m_ptsettings.dofEnabled);
@@ -359,28 +761,53 @@ void App::makeGUI()
     paneRendering->addNumberBox(GuiText(""), &m_ptsettings.dofLens, GuiText(""), GuiTheme::LINEAR_SLIDER, 0.0f, 1.0f, 0.05f);
     paneRendering->addLabel("Focus Plane");
     paneRendering->addNumberBox(GuiText(""), &m_ptsettings.dofFocus, GuiText(""), GuiTheme::LINEAR_SLIDER, 0.0f, 20.0f, 0.05f);
-    paneRendering->addLabel("DOF Samples");
-    paneRendering->addNumberBox(GuiText(""), &m_ptsettings.dofSamples, GuiText(""), GuiTheme::LINEAR_SLIDER, 1, 20, 1);
+    paneRendering->addLabel("Max DOF Samples");
+    paneRendering->addNumberBox(GuiText(""), &m_ptsettings.dofMaxSamples, GuiText(""), GuiTheme::LINEAR_SLIDER, 1, 32, 1);
 
     paneRendering->addLabel("--- Stratified Sampling ---");
     paneRendering->addLabel("Subpixel Divisions");
-    paneRendering->addNumberBox(GuiText(""), &m_ptsettings.superSamples, GuiText(""), GuiTheme::LINEAR_SLIDER, 1, 1, 1);
+    paneRendering->addNumberBox(GuiText(""), &m_ptsettings.superSamples, GuiText(""), GuiTheme::LINEAR_SLIDER, 1, 4, 1);
+    paneRendering->addLabel("Sampler");
+    paneRendering->addRadioButton("Random", Sampler::RANDOM, &m_ptsettings.sampler);
+    paneRendering->addRadioButton("Sobol", Sampler::SOBOL, &m_ptsettings.sampler);
+    paneRendering->addRadioButton("Blue Noise", Sampler::BLUE_NOISE, &m_ptsettings.sampler);
 
     paneRendering->addLabel("--- Image Based Lighting ---");
     paneRendering->addCheckBox("Enable", &m_ptsettings.useImageBasedLighting);
     paneRendering->addRadioButton("Sponza", PTSettings::SPONZA, &m_ptsettings.si);
     paneRendering->addRadioButton("Hipshot", PTSettings::HIPSHOT, &m_ptsettings.si);
 
+    paneRendering->addLabel("--- Denoiser ---");
+    paneRendering->addCheckBox("Show Denoised", &m_showDenoised);
+    paneRendering->addNumberBox(GuiText("Every"), &m_denoiseEvery, GuiText("passes"), GuiTheme::LINEAR_SLIDER, 0, 64, 1);
+    paneRendering->addNumberBox(GuiText("Color Sigma"), &m_denoiseSettings.colorSigma, GuiText(""), GuiTheme::LOG_SLIDER, 0.05f, 10.0f, 0.05f);
+    paneRendering->addButton("Denoise Now", this, &App::denoiseNow);
+
+    paneRendering->addLabel("--- Ray Preview ---");
+    paneRendering->addNumberBox(GuiText("Shadow Rays"), &m_raySettings.shadowSamples, GuiText(""), GuiTheme::LINEAR_SLIDER, 1, 16, 1);
+    paneRendering->addNumberBox(GuiText("Ambient"), &m_raySettings.ambient, GuiText(""), GuiTheme::LINEAR_SLIDER, 0.0f, 0.5f, 0.01f);
+
+    paneRendering->addLabel("--- Bidirectional ---");
+    paneRendering->addNumberBox(GuiText("Max Depth"), &m_bdptSettings.maxDepth, GuiText("bounces"), GuiTheme::LINEAR_SLIDER, 1, 16, 1);
+
+    paneRendering->addLabel("--- Photon Mapping ---");
+    paneRendering->addNumberBox(GuiText("Photons"), &m_photonSettings.photonsPerPass, GuiText("per pass"), GuiTheme::LOG_SLIDER, 10000, 2000000, 10000);
+    paneRendering->addNumberBox(GuiText("Radius"), &m_photonSettings.radius, GuiText(""), GuiTheme::LOG_SLIDER, 0.0005f, 0.05f, 0.0005f);
+    paneRendering->addNumberBox(GuiText("Alpha"), &m_photonSettings.alpha, GuiText(""), GuiTheme::LINEAR_SLIDER, 0.1f, 1.0f, 0.05f);
+
 
     // PATH
     panePath->addNumberBox(GuiText("Passes"), &num_passes, GuiText(""), GuiTheme::NO_SLIDER, 1, 10000, 0);
     panePath->addCheckBox("Attenuation", &m_ptsettings.attenuation);
+    panePath->addCheckBox("Path Guiding", &m_ptsettings.pathGuiding);
+    panePath->addCheckBox("Radiance Cache", &m_ptsettings.radianceCache);
+    panePath->addNumberBox(GuiText("Cache After"), &m_ptsettings.radianceCacheBounces, GuiText("bounces"), GuiTheme::LINEAR_SLIDER, 1, 8, 1);
     panePath->addLabel("--- Radiance Components ---");
     panePath->addCheckBox("Emitted Light", &m_ptsettings.useEmitted);
     panePath->addCheckBox("Scattered Direct Light from Diffuse", &m_ptsettings.useDirectDiffuse);
     panePath->addCheckBox("Scattered Direct Light from Specular", &m_ptsettings.useDirectSpecular);
     panePath->addCheckBox("Scattered Indirect Light from Diffuse", &m_ptsettings.useIndirect);
-    panePath->addCheckBox("Participating Media Attenuation", &m_ptsettings.useMedium);
+    panePath->addCheckBox("Participating Media", &m_ptsettings.useMedium);
 
     loadSceneDirectory(m_scenePath);
 
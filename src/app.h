@@ -2,11 +2,19 @@
 #define APP_H
 
 #include "world.h"
+#include "hugepagearena.h"
 #include "threadpool.h"
 #include <ctime>
 #include "pathtracer.h"
+#include "photonmapper.h"
+#include "raytracer.h"
+#include "bidirectional.h"
+#include "denoiser.h"
+#include "benchmark.h"
 
-enum RenderMethod { RAY, PATH, PHOTON };
+#include <mutex>
+
+enum RenderMethod { RAY, PATH, PHOTON, BIDIRECTIONAL };
 
 /** The entry point and main window manager */
 class App : public GApp
@@ -26,6 +34,9 @@ public:
     /** Called once at application shutdown */
     virtual void onCleanup();
 
+    /** Called once per frame; steps an in-progress scene load */
+    virtual void onSimulation(RealTime rdt, SimTime sdt, SimTime idt);
+
     /** Called once per frame to render the scene */
     virtual void onGraphics(RenderDevice *dev,
                             Array<shared_ptr<Surface> >& posed3D,
@@ -37,11 +48,47 @@ public:
     void changeDataDirectory();
 
     void onRender();
+    void prepareRender();
+    void startDispatch();
+    World &world() { return m_world; }
+    PathTracer &renderer() { return *m_renderer; }
+    PhotonMapper &photonMapper() { return *m_photonMapper; }
+    RayTracer &rayTracer() { return *m_rayTracer; }
+    BidirectionalTracer &bidirectional() { return *m_bidirectional; }
+    Rect2D viewport() const { return m_canvas->rect2DBounds(); }
+
+    /** Moves the scene camera to where the debug camera was last seen, if
+      * it has moved since the last call; to be called between passes
+      */
+    bool takeCameraMove();
+
+    /** Whether the debug camera has moved since the last takeCameraMove() */
+    bool cameraMovePending();
     void setScenePath(const char *path);
     void loadDefaultScene();
     void loadCustomScene();
     void loadCS244Scene();
     void saveCanvas();
+
+    /** Writes the color and every AOV of the path tracer as linear EXRs */
+    void saveAOVs();
+
+    /** Filters the current image into the denoised buffer */
+    void denoise();
+
+    /** Denoises if requested or every m_denoiseEvery passes while the
+      * denoised image is shown; called by the dispatcher between passes
+      */
+    void denoiseAfterPass(int passesDone);
+
+    /** GUI button: denoise now, or after the pass in progress */
+    void denoiseNow();
+
+    /** Prints the MemoryTracker report */
+    void reportMemory();
+
+    /** Runs benchmark @p mode on @p scenePath at startup and exits */
+    void setBenchmark(const String &scenePath, int passes, Benchmark::Mode mode = Benchmark::HUGE_PAGES);
     FilmSettings getFilmSettings();
     void toggleWindowRendering();
     void toggleWindowScenes();
@@ -54,12 +101,26 @@ public:
     int             pass; // how many passes we have taken for a given pixel
     int             num_passes;
     bool            continueRender;
+    RenderMethod    activeMethod; // m_currRenderMethod as of the last Render click
+    volatile bool   worldPending; // world needs finishLoad() before rendering
+    bool            memoryReport; // print the memory report after each render
 
 private:
 
     // path flags
     PTSettings          m_ptsettings;
     shared_ptr<PathTracer> m_renderer;
+    PhotonSettings      m_photonSettings;
+    shared_ptr<PhotonMapper> m_photonMapper;
+    RaySettings         m_raySettings;
+    shared_ptr<RayTracer> m_rayTracer;
+    BDPTSettings        m_bdptSettings;
+    shared_ptr<BidirectionalTracer> m_bidirectional;
+
+    // Debug camera moves during a Ray render, handed to the dispatcher
+    std::mutex          m_cameraMutex;
+    CFrame              m_cameraFrame;  // debug camera frame last seen
+    bool                m_cameraMoved;  // m_cameraFrame not yet applied
 
     shared_ptr<GuiWindow> m_windowRendering;
     shared_ptr<GuiWindow> m_windowScenes;
@@ -69,7 +130,33 @@ private:
 
     World               m_world;    // The scene being rendered
     shared_ptr<Image3>  m_canvas;   // Output buffer for raytrace()
+    HugePageArena       m_accumArena;
+    Radiance3 *         m_accum;    // Running average per pixel, copied to m_canvas for display
+    AOVBuffers          m_aovs;     // Path tracer AOVs, filled alongside m_accum
+    int                 m_shownAOV; // AOV shown in place of the color, AOV_COLOR for none
+    Radiance3 *         m_denoised; // Last denoiser output
+    Radiance3 *         m_denoiseScratch; // The next output, swapped with m_denoised when done
+    std::mutex          m_denoisedMutex; // Guards m_denoised while it is copied or swapped
+    volatile bool       m_denoisedValid;
+    bool                m_showDenoised;
+    int                 m_denoiseEvery; // passes between denoises while shown; 0 for on demand only
+    volatile bool       m_denoiseRequested;
+    Denoiser            m_denoiser;
+    DenoiseSettings     m_denoiseSettings;
     shared_ptr<Thread>  m_dispatch; // Spawns rendering threads
+    bool                m_loadingModels; // beginLoad() done, reading models
+    String              m_benchmarkScene;
+    int                 m_benchmarkPasses;
+    Benchmark::Mode     m_benchmarkMode;
+
+    /** Allocates m_canvas and m_accum at the window size */
+    void createCanvas();
+
+    /** The current image: m_accum, plus the light splats of a bidirectional render */
+    void resolveAccum(Radiance3 *out);
+
+    /** Copies the current or denoised image, or the shown AOV, into m_canvas */
+    void resolveCanvas();
 
 
 #if 0
@@ -91,6 +178,7 @@ private:
     GuiDropDownList*    m_renderdl;
     GuiLabel*           m_warningLabel;
     GuiLabel*           m_scenePathLabel;
+    GuiLabel*           m_statusLabel;  // load progress / current pass
     String              m_dirName;
     void updateScenePathLabel();
 };
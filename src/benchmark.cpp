@@ -0,0 +1,414 @@
+#include "benchmark.h"
+#include "hugepagearena.h"
+#include "threadpool.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+/** Process-wide hardware counter for dTLB load misses. Counts threads
+  * started after start(), such as the runTasks() workers; reads -1 where
+  * perf events are unavailable.
+  */
+class TLBMissCounter
+{
+public:
+
+    TLBMissCounter() : m_fd(-1)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_DTLB
+                    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~TLBMissCounter()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    int64 stop()
+    {
+        int64 count = -1;
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+                count = -1;
+        }
+#endif
+        return count;
+    }
+
+private:
+
+    int m_fd;
+};
+
+// Largest transmittance error the marched reference may make
+static const float MEDIUM_TOLERANCE = 1e-3f;
+
+// Segments through the medium per measurement
+static const int MEDIUM_RAYS = 1 << 16;
+
+// Transmittance along @p ray over [0, @p distance] by the midpoint rule,
+// in steps of about @p step
+static Radiance3 marchAttenuation( const Medium &medium, const Ray &ray, float distance, float step )
+{
+    if (distance <= 0.f)
+        return Radiance3::one();
+
+    const float h = medium.fixStepSize(distance, step);
+    const int n = iRound(distance / h);
+    Radiance3 depth = Radiance3::zero();
+    for (int i = 0; i < n; ++i)
+        depth += medium.extinction(ray.origin() + ray.direction() * ((i + 0.5f) * h));
+    return Medium::transmittance(depth * h);
+}
+
+// Distance along @p ray at which channel @p c's optical depth, summed in
+// steps of @p step, reaches @p target; infinite past @p distance
+static float marchDistance( const Medium &medium, const Ray &ray, float distance, float step,
+                            int c, float target )
+{
+    if (distance <= 0.f)
+        return finf();
+
+    const float h = medium.fixStepSize(distance, step);
+    const int n = iRound(distance / h);
+    float depth = 0.f;
+    for (int i = 0; i < n; ++i)
+    {
+        const float d = medium.extinction(ray.origin() + ray.direction() * ((i + 0.5f) * h))[c] * h;
+        if (depth + d >= target)
+            return (i + (target - depth) / d) * h;
+        depth += d;
+    }
+    return finf();
+}
+
+// Largest difference over @p rays between marched and closed form transmittance
+static float marchError( const Medium &medium, const Array<Ray> &rays, const Array<float> &distances, float step )
+{
+    float error = 0.f;
+    for (int i = 0; i < rays.size(); ++i)
+    {
+        const Radiance3 d = marchAttenuation(medium, rays[i], distances[i], step) -
+                            medium.estimateAttenuation(rays[i], distances[i]);
+        error = max(error, max(fabsf(d.r), max(fabsf(d.g), fabsf(d.b))));
+    }
+    return error;
+}
+
+Benchmark::Benchmark( const String &scenePath, const PTSettings &settings,
+                      int width, int height, int passes ) :
+    m_scenePath(scenePath),
+    m_settings(settings),
+    m_width(width),
+    m_height(height),
+    m_passes(passes)
+{
+    // Keep the measurement about geometry and the film
+    m_settings.superSamples = 1;
+    m_settings.useImageBasedLighting = false;
+}
+
+void Benchmark::runHugePages()
+{
+    const HugePageArena::Mode modes[] = { HugePageArena::OFF, HugePageArena::TRANSPARENT, HugePageArena::EXPLICIT };
+    const HugePageArena::Mode previous = HugePageArena::defaultMode();
+
+    printf("\nHuge page benchmark: %s, %dx%d, %d passes\n",
+           m_scenePath.c_str(), m_width, m_height, m_passes);
+
+    for (int m = 0; m < 3; ++m)
+    {
+        HugePageArena::setDefaultMode(modes[m]);
+
+        World world;
+        world.load(m_scenePath);
+
+        PathTracer tracer;
+        tracer.setWorld(&world);
+        tracer.setPTSettings(m_settings);
+
+        HugePageArena film;
+        const int numPixels = m_width * m_height;
+        Radiance3 *accum = film.alloc<Radiance3>(numPixels);
+        for (int i = 0; i < numPixels; ++i)
+            accum[i] = Radiance3::zero();
+
+        const Rect2D viewport = Rect2D::xywh(0, 0, m_width, m_height);
+
+        TLBMissCounter counter;
+        counter.start();
+        const RealTime start = System::time();
+        tracer.beginRender();
+
+        for (int pass = 0; pass < m_passes; ++pass)
+        {
+            // Same accumulation as App::threadCallback()
+            runTasks(m_height, [&](int y) {
+                for (int x = 0; x < m_width; ++x)
+                {
+                    Radiance3 &a = accum[y * m_width + x];
+                    a = a * (float(pass) / (pass + 1)) + tracer.sample(x, y, pass, viewport) / float(pass + 1);
+                }
+            });
+            tracer.endPass();
+        }
+
+        const RealTime seconds = System::time() - start;
+        const int64 misses = counter.stop();
+        const double samples = double(numPixels) * m_passes;
+
+        printf("%-12s %8.3f s  %8.3f Msamples/s  ", HugePageArena::modeName(modes[m]),
+               seconds, samples / seconds * 1e-6);
+        if (misses >= 0)
+            printf("%12lld dTLB misses (%.1f per sample)\n", (long long)misses, misses / samples);
+        else
+            printf("dTLB misses unavailable\n");
+        fflush( stdout );
+
+        world.unload();
+    }
+
+    HugePageArena::setDefaultMode(previous);
+}
+
+void Benchmark::runMedium()
+{
+    World world;
+    world.load(m_scenePath);
+    Vector3 lo, hi;
+    world.bounds(lo, hi);
+    const float extent = max((hi - lo).length(), 1e-3f);
+
+    // The scene's height fog, or one two optical depths across at the
+    // floor that thins out by e^4 up to the ceiling
+    ExponentialDensityMedium fog;
+    const ExponentialDensityMedium *scene = dynamic_cast<const ExponentialDensityMedium*>(world.medium().get());
+    if (scene && scene->attenuates())
+    {
+        fog = *scene;
+    }
+    else
+    {
+        fog.decay = 4.f / max(hi.y - lo.y, 1e-3f);
+        fog.density = 2.f / extent * ::exp(fog.decay * lo.y);
+    }
+    world.unload();
+
+    Random random(0x3ed1, false);
+    Array<Ray> rays;
+    Array<float> distances;
+    Array<float> us;
+    for (int i = 0; i < MEDIUM_RAYS; ++i)
+    {
+        const Point3 origin = lo + (hi - lo) * Vector3(random.uniform(), random.uniform(), random.uniform());
+        rays.append(Ray::fromOriginAndDirection(origin, Vector3::random(random)));
+        distances.append(random.uniform() * extent);
+        us.append(random.uniform());
+    }
+
+    // The coarsest power of two multiple of stepsize * stepscale whose
+    // transmittance is within MEDIUM_TOLERANCE everywhere
+    float step = max(fog.stepsize * fog.stepscale, 1e-6f);
+    float error = marchError(fog, rays, distances, step);
+    while (error <= MEDIUM_TOLERANCE && step < extent)
+    {
+        const float coarser = marchError(fog, rays, distances, 2.f * step);
+        if (coarser > MEDIUM_TOLERANCE)
+            break;
+        step *= 2.f;
+        error = coarser;
+    }
+    for (int halvings = 0; error > MEDIUM_TOLERANCE && halvings < 24; ++halvings)
+    {
+        step *= 0.5f;
+        error = marchError(fog, rays, distances, step);
+    }
+
+    printf("\nMedium benchmark: %s, %d segments, marched step %g (%.0f steps per segment on average), "
+           "max error %.2g\n", m_scenePath.c_str(), MEDIUM_RAYS, step, 0.5f * extent / step, error);
+
+    // Sums keep the compiler from dropping the work
+    float sum = 0.f;
+    RealTime start = System::time();
+    for (int i = 0; i < MEDIUM_RAYS; ++i)
+        sum += fog.estimateAttenuation(rays[i], distances[i]).r;
+    const RealTime closedTr = System::time() - start;
+
+    start = System::time();
+    for (int i = 0; i < MEDIUM_RAYS; ++i)
+        sum += marchAttenuation(fog, rays[i], distances[i], step).r;
+    const RealTime marchedTr = System::time() - start;
+
+    start = System::time();
+    for (int i = 0; i < MEDIUM_RAYS; ++i)
+    {
+        float t;
+        Color3 weight;
+        fog.sampleDistance(rays[i], distances[i], us[i], 0.f, t, weight);
+        sum += weight.r;
+    }
+    const RealTime closedSample = System::time() - start;
+
+    start = System::time();
+    for (int i = 0; i < MEDIUM_RAYS; ++i)
+    {
+        // Channel 0's optical depth for the same u, as sampleDistance()
+        const float target = -::log1p(-us[i]) / fog.attenuation.r;
+        const float t = marchDistance(fog, rays[i], distances[i], step, 0, target);
+        sum += t < finf() ? t : 0.f;
+    }
+    const RealTime marchedSample = System::time() - start;
+
+    const double toNs = 1e9 / MEDIUM_RAYS;
+    printf("Transmittance   closed form %8.1f ns/ray   marched %10.1f ns/ray   %6.0fx\n",
+           closedTr * toNs, marchedTr * toNs, marchedTr / max(closedTr, 1e-9));
+    printf("Free flight     closed form %8.1f ns/ray   marched %10.1f ns/ray   %6.0fx\n",
+           closedSample * toNs, marchedSample * toNs, marchedSample / max(closedSample, 1e-9));
+    printf("(checksum %g)\n", sum);
+    fflush( stdout );
+}
+
+// Major page faults taken by the process so far
+static long majorFaults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_majflt;
+}
+
+// Asks the OS to drop @p filename's cached pages, so the next reads go to disk
+static void dropFromPageCache( const String &filename )
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+RealTime Benchmark::render( PathTracer &tracer )
+{
+    HugePageArena film;
+    const int numPixels = m_width * m_height;
+    Radiance3 *accum = film.alloc<Radiance3>(numPixels);
+    for (int i = 0; i < numPixels; ++i)
+        accum[i] = Radiance3::zero();
+
+    const Rect2D viewport = Rect2D::xywh(0, 0, m_width, m_height);
+
+    const RealTime start = System::time();
+    tracer.beginRender();
+
+    for (int pass = 0; pass < m_passes; ++pass)
+    {
+        // Same accumulation as App::threadCallback()
+        runTasks(m_height, [&](int y) {
+            for (int x = 0; x < m_width; ++x)
+            {
+                Radiance3 &a = accum[y * m_width + x];
+                a = a * (float(pass) / (pass + 1)) + tracer.sample(x, y, pass, viewport) / float(pass + 1);
+            }
+        });
+        tracer.endPass();
+    }
+
+    return System::time() - start;
+}
+
+void Benchmark::runOutOfCore()
+{
+    printf("\nOut-of-core benchmark: %s, %dx%d, %d passes\n",
+           m_scenePath.c_str(), m_width, m_height, m_passes);
+
+    // The streamed runs need the cache; a first out-of-core load writes it
+    {
+        World world;
+        world.overrideOutOfCore(1);
+        world.load(m_scenePath);
+        if (!world.isStreaming())
+        {
+            printf("The scene cannot be streamed (it disables the scene cache, or is instanced or compressed)\n");
+            fflush( stdout );
+            return;
+        }
+        world.unload();
+    }
+
+    const char *names[] = { "in memory", "streamed, cold", "streamed, warm" };
+    const double samples = double(m_width) * m_height * m_passes;
+    RealTime inMemory = 0.0;
+
+    for (int run = 0; run < 3; ++run)
+    {
+        World world;
+        world.overrideOutOfCore(run == 0 ? 0 : 1);
+        if (run == 1)
+            dropFromPageCache(SceneCache::cacheFilename(m_scenePath));
+        world.load(m_scenePath);
+
+        PathTracer tracer;
+        tracer.setWorld(&world);
+        tracer.setPTSettings(m_settings);
+
+        // The warm run follows the cold one, which paged the cache in
+        const long faults = majorFaults();
+        const RealTime seconds = render(tracer);
+        const long major = majorFaults() - faults;
+
+        if (run == 0)
+            inMemory = seconds;
+
+        printf("%-16s %8.3f s  %8.3f Msamples/s  %10ld major faults", names[run],
+               seconds, samples / seconds * 1e-6, major);
+        if (run > 0)
+            printf("  %.2fx the in-memory time", seconds / max(inMemory, 1e-9));
+        printf("\n");
+        fflush( stdout );
+
+        world.unload();
+    }
+}
+
+void Benchmark::run( Mode mode )
+{
+    switch (mode)
+    {
+    case MEDIUM:        runMedium(); break;
+    case OUT_OF_CORE:   runOutOfCore(); break;
+    default:            runHugePages(); break;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <G3D/G3DAll.h>
+
+#include "pathtracer.h"
+
+/** Offline measurements, run with "path --benchmark <scene.Any>" */
+class Benchmark
+{
+public:
+
+    enum Mode { HUGE_PAGES, MEDIUM, OUT_OF_CORE };
+
+    Benchmark( const String &scenePath, const PTSettings &settings,
+               int width = 512, int height = 512, int passes = 4 );
+
+    /** Renders the scene once per huge page mode, with the BVH, triangle
+      * data, emitter table and accumulation buffer in a HugePageArena of
+      * that mode, and prints samples per second and dTLB load misses.
+      *
+      * Needs the GL context, since loading models creates textures.
+      */
+    void runHugePages();
+
+    /** Times transmittance and free-flight sampling in the scene's height
+      * fog (or one fitted to its bounds) along random segments, in closed
+      * form and by ray marching at the coarsest step that matches it to
+      * within MEDIUM_TOLERANCE, and prints the cost per ray of each.
+      */
+    void runMedium();
+
+    /** Renders the scene loaded into memory, then streamed from its scene
+      * cache with the cache file dropped from the page cache and again
+      * with it warm, and prints samples per second, major page faults and
+      * the slowdown of streaming. Writes the cache first if there is none.
+      *
+      * Needs the GL context, like runHugePages().
+      */
+    void runOutOfCore();
+
+    /** Runs the measurement selected by @p mode */
+    void run( Mode mode );
+
+private:
+
+    /** Renders m_passes passes of the film with @p tracer and returns the
+      * time taken
+      */
+    RealTime render( PathTracer &tracer );
+
+    String      m_scenePath;
+    PTSettings  m_settings;
+    int         m_width;
+    int         m_height;
+    int         m_passes;
+};
+
+#endif // BENCHMARK_H
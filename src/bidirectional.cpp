@@ -0,0 +1,518 @@
+#include "bidirectional.h"
+#include "memorytracker.h"
+
+#include <cmath>
+#include <new>
+
+static const int MAX_DEPTH = 16;
+static const int MAX_VERTICES = MAX_DEPTH + 2;
+
+// Sampler dimensions: pixel jitter, then per eye vertex the BSDF lobe and
+// direction followed by the emitter choice and point for a connection to
+// the emitters. The light subpath starts further on with the emitter
+// choice, point and direction, then the same per vertex layout.
+enum
+{
+    CAMERA_DIMENSIONS = 2,
+    VERTEX_DIMENSIONS = 6,
+    EMITTER_OFFSET = 3,
+    LIGHT_DIMENSIONS = 128
+};
+
+struct BidirectionalTracer::PathVertex
+{
+    enum Type { CAMERA, LIGHT, SURFACE };
+
+    Type            type;
+    ShadingPoint    sp;         // SURFACE only
+    Point3          position;
+    Vector3         normal;     // geometric; the emitter's for LIGHT, the view axis for CAMERA
+    Vector3         wo;         // toward the previous vertex
+    Color3          beta;       // throughput from the start of the subpath
+    Radiance3       Le;         // LIGHT only
+    float           pdfFwd;     // area density of sampling this vertex along its subpath
+    float           pdfRev;     // and from the other end
+    bool            delta;      // scattered through an impulse
+};
+
+typedef BidirectionalTracer::PathVertex PathVertex;
+
+static void atomicAdd( std::atomic<float> &a, float value )
+{
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+        ;
+}
+
+// Direction around @p n with density cos / pi
+static Vector3 cosineHemisphere( const Vector3 &n, const Point2 &u )
+{
+    Vector3 t, b;
+    n.getTangents(t, b);
+    const float r = sqrtf(u.x);
+    const float phi = 2.f * pif() * u.y;
+    return t * (r * cosf(phi)) + b * (r * sinf(phi)) + n * sqrtf(max(0.f, 1.f - u.x));
+}
+
+// Densities of zero mark impulses, which count as one in the MIS ratios
+static float remap0( float pdf )
+{
+    return pdf != 0.f ? pdf : 1.f;
+}
+
+// Whether a connection can be made to @p v, i.e. its BSDF has a finite part
+static bool connectible( const PathVertex &v )
+{
+    if (v.type != PathVertex::SURFACE)
+        return true;
+    return v.sp.lambertian.nonZero() || (v.sp.glossy.nonZero() && !BSDF::isMirror(v.sp));
+}
+
+// Solid angle density @p pdfDir at @p from as an area density at @p to
+static float toArea( float pdfDir, const PathVertex &from, const PathVertex &to )
+{
+    const Vector3 w = to.position - from.position;
+    const float d2 = w.squaredLength();
+    if (d2 <= 0.f)
+        return 0.f;
+
+    float pdf = pdfDir / d2;
+    if (to.type != PathVertex::CAMERA)
+        pdf *= fabsf(to.normal.dot(w / sqrtf(d2)));
+    return pdf;
+}
+
+// BSDF at surface vertex @p v for light passing between @p next and the
+// previous vertex
+static Color3 scattering( const PathVertex &v, const PathVertex &next )
+{
+    return BSDF::evaluate(v.sp, (next.position - v.position).direction(), v.wo);
+}
+
+BidirectionalTracer::BidirectionalTracer() :
+    m_world(NULL),
+    m_imageArea(1.f),
+    m_splats(NULL),
+    m_width(0),
+    m_height(0)
+{ }
+
+void BidirectionalTracer::setSettings( const BDPTSettings &settings )
+{
+    m_settings = settings;
+    m_settings.maxDepth = iClamp(m_settings.maxDepth, 1, MAX_DEPTH);
+}
+
+void BidirectionalTracer::beginRender( const Rect2D &viewport )
+{
+    const shared_ptr<Camera> &camera = m_world->camera();
+    m_eye = camera->frame().translation;
+    m_forward = camera->frame().lookVector();
+
+    // Pixel corners projected onto the plane one unit along the view axis
+    const float w = viewport.width(), h = viewport.height();
+    const Vector3 d00 = camera->worldRay(0.f, 0.f, viewport).direction();
+    const Vector3 d10 = camera->worldRay(w, 0.f, viewport).direction();
+    const Vector3 d01 = camera->worldRay(0.f, h, viewport).direction();
+    m_corner = d00 / d00.dot(m_forward);
+    m_dx = d10 / d10.dot(m_forward) - m_corner;
+    m_dy = d01 / d01.dot(m_forward) - m_corner;
+    m_imageArea = max(m_dx.cross(m_dy).length(), 1e-12f);
+
+    // The display reads the film every frame, so it is only reallocated
+    // when the image size changes
+    const int count = 3 * iRound(w) * iRound(h);
+    if (!m_splats || count != 3 * m_width * m_height)
+    {
+        m_splats = NULL;
+        m_width = iRound(w);
+        m_height = iRound(h);
+        m_splatArena.reset();
+        std::atomic<float> *splats = m_splatArena.alloc<std::atomic<float>>(count);
+        for (int i = 0; i < count; ++i)
+            new (&splats[i]) std::atomic<float>(0.f);
+        m_splats = splats;
+    }
+    else
+    {
+        for (int i = 0; i < count; ++i)
+            m_splats[i].store(0.f, std::memory_order_relaxed);
+    }
+
+    MemoryTracker::global().set(MemoryTracker::SPLATS, count * sizeof(std::atomic<float>));
+}
+
+bool BidirectionalTracer::project( const Point3 &p, Point2 &raster ) const
+{
+    const Vector3 v = p - m_eye;
+    const float z = v.dot(m_forward);
+    if (z <= 0.f)
+        return false;
+
+    const Vector3 q = v / z - m_corner;
+    raster.x = q.dot(m_dx) / m_dx.squaredLength() * m_width;
+    raster.y = q.dot(m_dy) / m_dy.squaredLength() * m_height;
+    return raster.x >= 0.f && raster.x < m_width && raster.y >= 0.f && raster.y < m_height;
+}
+
+float BidirectionalTracer::importance( float cosTheta ) const
+{
+    return 1.f / (m_imageArea * square(square(cosTheta)));
+}
+
+void BidirectionalTracer::splat( const Point2 &raster, const Radiance3 &L )
+{
+    const int x = min(int(raster.x), m_width - 1);
+    const int y = min(int(raster.y), m_height - 1);
+    std::atomic<float> *s = &m_splats[3 * (y * m_width + x)];
+    atomicAdd(s[0], clamp(L.r, 0.f, 10.f));
+    atomicAdd(s[1], clamp(L.g, 0.f, 10.f));
+    atomicAdd(s[2], clamp(L.b, 0.f, 10.f));
+}
+
+Radiance3 BidirectionalTracer::splats( int x, int y ) const
+{
+    if (!m_splats || x >= m_width || y >= m_height)
+        return Radiance3::zero();
+
+    const std::atomic<float> *s = &m_splats[3 * (y * m_width + x)];
+    return Radiance3(s[0].load(std::memory_order_relaxed),
+                     s[1].load(std::memory_order_relaxed),
+                     s[2].load(std::memory_order_relaxed));
+}
+
+float BidirectionalTracer::pdfEmission( const PathVertex &v, const PathVertex &next ) const
+{
+    const float cosTheta = v.normal.dot((next.position - v.position).direction());
+    if (cosTheta <= 0.f)
+        return 0.f;
+    return toArea(cosTheta / pif(), v, next);
+}
+
+float BidirectionalTracer::pdf( const PathVertex &v, const PathVertex *prev, const PathVertex &next ) const
+{
+    float pdfDir;
+    switch (v.type)
+    {
+    case PathVertex::CAMERA:
+    {
+        const float cosTheta = (next.position - v.position).direction().dot(m_forward);
+        if (cosTheta <= 0.f)
+            return 0.f;
+        pdfDir = 1.f / (m_imageArea * cosTheta * cosTheta * cosTheta);
+        break;
+    }
+    case PathVertex::LIGHT:
+        return pdfEmission(v, next);
+    default:
+        pdfDir = BSDF::pdf(v.sp, (next.position - v.position).direction(),
+                           (prev->position - v.position).direction());
+        break;
+    }
+    return toArea(pdfDir, v, next);
+}
+
+int BidirectionalTracer::randomWalk( Ray ray, Color3 beta, float pdfDir, Sampler &sampler, int dimension,
+                                     PathVertex *path, int count, int maxVertices ) const
+{
+    float pdfFwd = pdfDir;
+
+    while (count < maxVertices)
+    {
+        float dist;
+        ShadingPoint sp;
+        if (!m_world->intersect(ray, dist, sp, RayDifferential::coarsest()))
+            break;
+
+        PathVertex &prev = path[count - 1];
+        PathVertex &v = path[count];
+        v.type = PathVertex::SURFACE;
+        v.sp = sp;
+        v.position = sp.position;
+        v.normal = sp.geometricNormal;
+        v.wo = -ray.direction();
+        v.beta = beta;
+        v.pdfFwd = toArea(pdfFwd, prev, v);
+        v.pdfRev = 0.f;
+        v.delta = false;
+
+        sampler.setDimension(dimension + count * VERTEX_DIMENSIONS);
+        if (++count >= maxVertices)
+            break;
+
+        Color3 weight;
+        Vector3 wi;
+        bool impulse;
+        const float uLobe = sampler.next();
+        const Point2 uDir = sampler.next2D();
+        if (!BSDF::scatter(sp, v.wo, uLobe, uDir, weight, wi, impulse))
+            break;
+
+        float pdfRevDir;
+        if (impulse)
+        {
+            v.delta = true;
+            pdfFwd = 0.f;
+            pdfRevDir = 0.f;
+        }
+        else
+        {
+            // Weighted by the density of every lobe, which MIS compares
+            pdfFwd = BSDF::pdf(sp, wi, v.wo);
+            pdfRevDir = BSDF::pdf(sp, v.wo, wi);
+            const float cosI = wi.dot(sp.shadingNormal);
+            if (pdfFwd <= 0.f || cosI <= 0.f)
+                break;
+            weight = BSDF::evaluate(sp, wi, v.wo) * (cosI / pdfFwd);
+        }
+
+        beta *= weight;
+        if (beta.isZero())
+            break;
+
+        prev.pdfRev = toArea(pdfRevDir, v, prev);
+        ray = Ray::fromOriginAndDirection(sp.position + wi * 1e-3f, wi);
+    }
+
+    return count;
+}
+
+int BidirectionalTracer::cameraSubpath( int x, int y, Sampler &sampler, const Rect2D &viewport,
+                                        PathVertex *path ) const
+{
+    sampler.setDimension(0);
+    const Point2 jitter = sampler.next2D();
+    const Ray ray = m_world->camera()->worldRay(x + jitter.x, y + jitter.y, viewport);
+
+    PathVertex &c = path[0];
+    c.type = PathVertex::CAMERA;
+    c.position = m_eye;
+    c.normal = m_forward;
+    c.beta = Color3::one();
+    c.pdfFwd = 1.f;
+    c.pdfRev = 0.f;
+    c.delta = false;
+
+    const float cosTheta = ray.direction().dot(m_forward);
+    const float pdfDir = 1.f / (m_imageArea * cosTheta * cosTheta * cosTheta);
+
+    return randomWalk(ray, Color3::one(), pdfDir, sampler, CAMERA_DIMENSIONS,
+                      path, 1, m_settings.maxDepth + 2);
+}
+
+int BidirectionalTracer::lightSubpath( Sampler &sampler, PathVertex *path ) const
+{
+    sampler.setDimension(LIGHT_DIMENSIONS);
+    const float u = sampler.next();
+    const Point2 uv = sampler.next2D();
+    Vector3 point, normal;
+    int material;
+    float prob, area;
+    m_world->emissivePoint(u, uv, point, material, normal, prob, area);
+
+    PathVertex &l = path[0];
+    l.type = PathVertex::LIGHT;
+    l.position = point;
+    l.normal = normal;
+    l.Le = m_world->emittedRadiance(material, area);
+    l.beta = l.Le;
+    l.pdfFwd = prob;
+    l.pdfRev = 0.f;
+    l.delta = false;
+
+    // Cosine distributed emission: Le cos / (p_A cos / pi)
+    const Vector3 dir = cosineHemisphere(normal, sampler.next2D());
+    const float pdfDir = max(dir.dot(normal), 1e-6f) / pif();
+    const Color3 beta = l.Le * (pif() / prob);
+
+    return randomWalk(Ray::fromOriginAndDirection(point + normal * 1e-4f, dir), beta, pdfDir,
+                      sampler, LIGHT_DIMENSIONS, path, 1, m_settings.maxDepth + 1);
+}
+
+float BidirectionalTracer::misWeight( const PathVertex *light, int s, const PathVertex *camera, int t,
+                                      const PathVertex &sampled ) const
+{
+    if (s + t == 2)
+        return 1.f;
+
+    // Densities of the path as this strategy sees it: an endpoint replaced
+    // by the sampled vertex, and the connection's reverse densities
+    float lFwd[MAX_VERTICES], lRev[MAX_VERTICES], cFwd[MAX_VERTICES], cRev[MAX_VERTICES];
+    bool lDelta[MAX_VERTICES], cDelta[MAX_VERTICES];
+    for (int i = 0; i < s; ++i)
+    {
+        const PathVertex &v = (s == 1) ? sampled : light[i];
+        lFwd[i] = v.pdfFwd;
+        lRev[i] = v.pdfRev;
+        lDelta[i] = v.delta;
+    }
+    for (int i = 0; i < t; ++i)
+    {
+        const PathVertex &v = (t == 1) ? sampled : camera[i];
+        cFwd[i] = v.pdfFwd;
+        cRev[i] = v.pdfRev;
+        cDelta[i] = v.delta;
+    }
+
+    const PathVertex &pt = (t == 1) ? sampled : camera[t - 1];
+    const PathVertex *qs = s == 0 ? NULL : (s == 1 ? &sampled : &light[s - 1]);
+    const PathVertex *ptMinus = t > 1 ? &camera[t - 2] : NULL;
+    const PathVertex *qsMinus = s > 1 ? &light[s - 2] : NULL;
+
+    cDelta[t - 1] = false;
+    if (s > 0)
+        lDelta[s - 1] = false;
+
+    cRev[t - 1] = qs ? pdf(*qs, qsMinus, pt) : m_world->emissivePdf(pt.sp);
+    if (ptMinus)
+        cRev[t - 2] = qs ? pdf(pt, qs, *ptMinus) : pdfEmission(pt, *ptMinus);
+    if (qs)
+        lRev[s - 1] = pdf(pt, ptMinus, *qs);
+    if (qsMinus)
+        lRev[s - 2] = pdf(*qs, &pt, *qsMinus);
+
+    // Balance heuristic: the other strategies' densities relative to this one
+    float sum = 0.f;
+    float ri = 1.f;
+    for (int i = t - 1; i > 0; --i)
+    {
+        ri *= remap0(cRev[i]) / remap0(cFwd[i]);
+        if (!cDelta[i] && !cDelta[i - 1])
+            sum += ri;
+    }
+
+    ri = 1.f;
+    for (int i = s - 1; i >= 0; --i)
+    {
+        ri *= remap0(lRev[i]) / remap0(lFwd[i]);
+        const bool deltaBefore = i > 0 && lDelta[i - 1];
+        if (!lDelta[i] && !deltaBefore)
+            sum += ri;
+    }
+
+    return 1.f / (1.f + sum);
+}
+
+Radiance3 BidirectionalTracer::connect( const PathVertex *light, int s, const PathVertex *camera, int t,
+                                        Sampler &sampler )
+{
+    PathVertex sampled;
+    Radiance3 L;
+
+    if (s == 0)
+    {
+        // The eye subpath hit the front of an emitter
+        const PathVertex &pt = camera[t - 1];
+        if (pt.type != PathVertex::SURFACE || pt.sp.backface || pt.sp.emission.isZero())
+            return Radiance3::zero();
+        L = pt.beta * pt.sp.emission;
+    }
+    else if (t == 1)
+    {
+        // Light tracing: the light vertex seen by the camera, splatted
+        const PathVertex &qs = light[s - 1];
+        Point2 raster;
+        if (!connectible(qs) || !project(qs.position, raster))
+            return Radiance3::zero();
+
+        Vector3 w = m_eye - qs.position;
+        const float d2 = w.squaredLength();
+        w /= sqrtf(d2);
+        const float cosTheta = -w.dot(m_forward);
+
+        sampled.type = PathVertex::CAMERA;
+        sampled.position = m_eye;
+        sampled.normal = m_forward;
+        sampled.beta = Color3::one() * (importance(cosTheta) * cosTheta / d2);
+        sampled.pdfFwd = 1.f;
+        sampled.pdfRev = 0.f;
+        sampled.delta = false;
+
+        L = qs.beta * scattering(qs, sampled) * sampled.beta * fabsf(w.dot(qs.sp.shadingNormal));
+        if (L.isZero() || !m_world->lineOfSight(qs.position + qs.normal * 1e-4f, m_eye))
+            return Radiance3::zero();
+
+        splat(raster, L * misWeight(light, s, camera, t, sampled));
+        return Radiance3::zero();
+    }
+    else if (s == 1)
+    {
+        // Next event estimation: a fresh emitter point
+        const PathVertex &pt = camera[t - 1];
+        if (!connectible(pt))
+            return Radiance3::zero();
+
+        sampler.setDimension(CAMERA_DIMENSIONS + (t - 1) * VERTEX_DIMENSIONS + EMITTER_OFFSET);
+        const float u = sampler.next();
+        const Point2 uv = sampler.next2D();
+        Vector3 point, normal;
+        int material;
+        float prob, area;
+        m_world->emissivePoint(u, uv, point, material, normal, prob, area);
+
+        Vector3 w = point - pt.position;
+        const float d2 = w.squaredLength();
+        if (d2 < 1e-8f)
+            return Radiance3::zero();
+        w /= sqrtf(d2);
+        const float cosLight = -w.dot(normal);
+        if (cosLight <= 0.f)
+            return Radiance3::zero();
+
+        sampled.type = PathVertex::LIGHT;
+        sampled.position = point;
+        sampled.normal = normal;
+        sampled.Le = m_world->emittedRadiance(material, area);
+        sampled.beta = sampled.Le * (cosLight / (prob * d2));
+        sampled.pdfFwd = prob;
+        sampled.pdfRev = 0.f;
+        sampled.delta = false;
+
+        L = pt.beta * scattering(pt, sampled) * sampled.beta * fabsf(w.dot(pt.sp.shadingNormal));
+        if (L.isZero() || !m_world->lineOfSight(pt.position + pt.normal * 1e-4f, point))
+            return Radiance3::zero();
+    }
+    else
+    {
+        const PathVertex &qs = light[s - 1];
+        const PathVertex &pt = camera[t - 1];
+        if (!connectible(qs) || !connectible(pt))
+            return Radiance3::zero();
+
+        Vector3 w = pt.position - qs.position;
+        const float d2 = w.squaredLength();
+        if (d2 < 1e-8f)
+            return Radiance3::zero();
+        w /= sqrtf(d2);
+
+        const float G = fabsf(w.dot(qs.sp.shadingNormal)) * fabsf(w.dot(pt.sp.shadingNormal)) / d2;
+        L = qs.beta * scattering(qs, pt) * scattering(pt, qs) * pt.beta * G;
+        if (L.isZero() || !m_world->lineOfSight(qs.position + qs.normal * 1e-4f,
+                                                pt.position + pt.normal * 1e-4f))
+            return Radiance3::zero();
+    }
+
+    return L * misWeight(light, s, camera, t, sampled);
+}
+
+Radiance3 BidirectionalTracer::sample( int x, int y, int pass, const Rect2D &viewport )
+{
+    PathVertex camera[MAX_VERTICES], light[MAX_VERTICES];
+    Sampler sampler(m_settings.sampler, x, y, pass);
+    const int nc = cameraSubpath(x, y, sampler, viewport, camera);
+    const int nl = m_world->lightsExist() ? lightSubpath(sampler, light) : 0;
+
+    Radiance3 L = Radiance3::zero();
+    for (int t = 1; t <= nc; ++t)
+    {
+        for (int s = 0; s <= nl; ++s)
+        {
+            const int depth = s + t - 2;
+            if ((s == 1 && t == 1) || depth < 0 || depth > m_settings.maxDepth)
+                continue;
+            L += connect(light, s, camera, t, sampler);
+        }
+    }
+
+    return Radiance3(clamp(L.r, 0.f, 10.f), clamp(L.g, 0.f, 10.f), clamp(L.b, 0.f, 10.f));
+}
@@ -0,0 +1,113 @@
+#ifndef BIDIRECTIONAL_H
+#define BIDIRECTIONAL_H
+
+#include <G3D/G3DAll.h>
+
+#include <atomic>
+
+#include "world.h"
+#include "sampler.h"
+#include "hugepagearena.h"
+
+class BDPTSettings
+{
+public:
+
+    int maxDepth = 8;           // bounces of a complete path, at most 16
+    Sampler::Type sampler = Sampler::SOBOL;
+};
+
+/** Bidirectional path tracing (Veach, 1997). Every sample traces an eye
+  * subpath from the camera and a light subpath from a point picked on the
+  * emitters, then joins every prefix of one to every prefix of the other:
+  * eye paths that hit an emitter, emitter points sampled from an eye
+  * vertex, connections between inner vertices, and light vertices
+  * connected to the camera. Each strategy is weighted by the balance
+  * heuristic over all the ways the same path could have been sampled, so
+  * light that only reaches the eye through glass or off mirrors (lamps
+  * inside fixtures) is found from the light side.
+  *
+  * Light vertices connected to the camera land on arbitrary pixels, so
+  * they are splatted with atomic adds into a film of their own; the image
+  * is the per pixel average plus the splats divided by the pass count.
+  * The camera is a pinhole here, and only emitters light the scene.
+  */
+class BidirectionalTracer
+{
+public:
+
+    BidirectionalTracer();
+
+    void setWorld( World *world ) { m_world = world; }
+    void setSettings( const BDPTSettings &settings );
+
+    /** Takes the camera's projection and clears the splat film; to be
+      * called before the first pass
+      */
+    void beginRender( const Rect2D &viewport );
+
+    /** Radiance through pixel (x, y) for pass @p pass, excluding what is
+      * splatted
+      */
+    Radiance3 sample( int x, int y, int pass, const Rect2D &viewport );
+
+    /** Sum of the splats onto pixel (x, y) over all passes so far */
+    Radiance3 splats( int x, int y ) const;
+
+    struct PathVertex;
+
+private:
+
+    /** Walks a subpath from @p ray, appending vertices to @p path up to
+      * @p maxVertices; returns the vertex count
+      */
+    int randomWalk( Ray ray, Color3 beta, float pdfDir, Sampler &sampler, int dimension,
+                    PathVertex *path, int count, int maxVertices ) const;
+
+    int cameraSubpath( int x, int y, Sampler &sampler, const Rect2D &viewport, PathVertex *path ) const;
+    int lightSubpath( Sampler &sampler, PathVertex *path ) const;
+
+    /** Contribution of the path made of light vertices [0, s) and eye
+      * vertices [0, t), MIS weighted; for t = 1 it is splatted instead
+      */
+    Radiance3 connect( const PathVertex *light, int s, const PathVertex *camera, int t, Sampler &sampler );
+
+    float misWeight( const PathVertex *light, int s, const PathVertex *camera, int t,
+                     const PathVertex &sampled ) const;
+
+    /** Area density of reaching @p next from @p v, having come from @p prev */
+    float pdf( const PathVertex &v, const PathVertex *prev, const PathVertex &next ) const;
+
+    /** Area density of @p next when emitting from @p v, a point on an emitter */
+    float pdfEmission( const PathVertex &v, const PathVertex &next ) const;
+
+    /** Where a ray from the camera toward @p p crosses the image; false
+      * if it is outside
+      */
+    bool project( const Point3 &p, Point2 &raster ) const;
+
+    /** Camera importance per solid angle and pinhole density of directions
+      * at cosine @p cosTheta to the view axis
+      */
+    float importance( float cosTheta ) const;
+
+    void splat( const Point2 &raster, const Radiance3 &L );
+
+    World *         m_world;
+    BDPTSettings    m_settings;
+
+    // Pinhole projection: image plane one unit in front of the eye
+    Point3          m_eye;
+    Vector3         m_forward;
+    Vector3         m_corner;       // toward pixel (0, 0) on the plane
+    Vector3         m_dx;           // across the image width on the plane
+    Vector3         m_dy;
+    float           m_imageArea;    // of the image on the plane
+
+    HugePageArena       m_splatArena;
+    std::atomic<float> *m_splats;   // three per pixel
+    int                 m_width;
+    int                 m_height;
+};
+
+#endif // BIDIRECTIONAL_H
@@ -0,0 +1,846 @@
+#include "bvh.h"
+#include "compressedgeometry.h"
+#include "hugepagearena.h"
+
+#define TRAVERSAL_COST 1.f
+#define INTERSECTION_COST 1.f
+
+BVH::BVH() :
+    m_nodeData(NULL),
+    m_refData(NULL),
+    m_posData(NULL),
+    m_twoSidedData(NULL),
+    m_geometry(NULL),
+    m_numNodes(0),
+    m_numRefData(0),
+    m_numTris(0),
+    m_rootArea(0.f),
+    m_maxRefs(0),
+    m_numRefs(0)
+{ }
+
+void BVH::clear()
+{
+    m_nodes.fastClear();
+    m_refs.fastClear();
+    m_positions.fastClear();
+    m_twoSided.fastClear();
+    m_buildStats = BuildStats();
+
+    m_nodeData = NULL;
+    m_refData = NULL;
+    m_posData = NULL;
+    m_twoSidedData = NULL;
+    m_geometry = NULL;
+    m_numNodes = m_numRefData = m_numTris = 0;
+}
+
+void BVH::setGeometry( const CompressedGeometry *geometry )
+{
+    debugAssert(geometry->numTris() == m_numTris);
+
+    m_geometry = geometry;
+    m_positions.clear();
+    m_posData = NULL;
+}
+
+size_t BVH::sizeInBytes() const
+{
+    return m_numNodes * sizeof(BVHNode)
+         + m_numRefData * sizeof(int)
+         + m_numTris * ((m_posData ? 3 * sizeof(Vector3) : 0) + sizeof(uint8));
+}
+
+size_t BVH::estimateBytes( int numTris, const BVHSettings &settings )
+{
+    const size_t refs = size_t(numTris * (1.f + (settings.spatialSplits ? max(0.f, settings.splitBudget) : 0.f)));
+    const size_t nodes = 2 * refs + 2;
+    return nodes * sizeof(BVHNode)
+         + refs * (sizeof(int) + sizeof(Ref))
+         + size_t(numTris) * (3 * sizeof(Vector3) + sizeof(uint8));
+}
+
+void BVH::moveToArena( HugePageArena &arena )
+{
+    m_nodeData = arena.copy(m_nodeData, m_numNodes);
+    m_refData = arena.copy(m_refData, m_numRefData);
+    m_twoSidedData = arena.copy(m_twoSidedData, m_numTris);
+    if (m_posData)
+        m_posData = arena.copy(m_posData, 3 * size_t(m_numTris));
+
+    m_nodes.clear();
+    m_refs.clear();
+    m_positions.clear();
+    m_twoSided.clear();
+}
+
+void BVH::attach( const BVHNode *nodes, int numNodes,
+                  const int *refs, int numRefs,
+                  const Vector3 *positions, const uint8 *twoSided, int numTris )
+{
+    clear();
+
+    m_nodeData = nodes;
+    m_refData = refs;
+    m_posData = positions;
+    m_twoSidedData = twoSided;
+    m_numNodes = numNodes;
+    m_numRefData = numRefs;
+    m_numTris = numTris;
+
+    m_buildStats.tris = numTris;
+    m_buildStats.refs = numRefs;
+    m_buildStats.nodes = numNodes;
+}
+
+void BVH::build( const Array<Tri> &tris, const CPUVertexArray &verts, const BVHSettings &settings )
+{
+    // Copy the positions so traversal only touches BVH-owned memory
+    Array<Vector3> positions;
+    Array<uint8> twoSided;
+    positions.resize(tris.size() * 3);
+    twoSided.resize(tris.size());
+
+    for (int i = 0; i < tris.size(); ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+            positions[3 * i + j] = tris[i].position(verts, j);
+        twoSided[i] = tris[i].twoSided() ? 1 : 0;
+    }
+
+    build(positions, twoSided, settings);
+}
+
+void BVH::build( Array<Vector3> &positions, Array<uint8> &twoSided, const BVHSettings &settings )
+{
+    clear();
+
+    RealTime start = System::time();
+    m_settings = settings;
+    m_settings.maxLeafSize = max(1, m_settings.maxLeafSize);
+    m_settings.numBins = max(2, m_settings.numBins);
+
+    m_positions.fastSwap(positions);
+    m_twoSided.fastSwap(twoSided);
+    positions.clear();
+    twoSided.clear();
+    const int numTris = m_twoSided.size();
+
+    Array<Ref> refs;
+    refs.resize(numTris);
+    Bounds bounds;
+
+    for (int i = 0; i < numTris; ++i)
+    {
+        Ref &ref = refs[i];
+        ref.tri = i;
+        for (int j = 0; j < 3; ++j)
+            ref.box.merge(m_positions[3 * i + j]);
+        bounds.merge(ref.box);
+    }
+
+    m_rootArea = bounds.area();
+    m_numRefs = numTris;
+    m_maxRefs = m_settings.spatialSplits
+              ? int(numTris * (1.f + max(0.f, m_settings.splitBudget)))
+              : numTris;
+
+    m_buildStats.tris = numTris;
+
+    if (numTris > 0)
+    {
+        m_nodes.reserve(2 * numTris / m_settings.maxLeafSize + 1);
+        m_nodes.resize(1);
+        buildNode(0, refs, bounds, 0);
+    }
+
+    m_buildStats.refs = m_refs.size();
+    m_buildStats.nodes = m_nodes.size();
+    m_buildStats.seconds = float(System::time() - start);
+
+    m_nodeData = m_nodes.getCArray();
+    m_refData = m_refs.getCArray();
+    m_posData = m_positions.getCArray();
+    m_twoSidedData = m_twoSided.getCArray();
+    m_numNodes = m_nodes.size();
+    m_numRefData = m_refs.size();
+    m_numTris = numTris;
+}
+
+static float nodeArea( const BVHNode &node )
+{
+    const Vector3 d = node.hi - node.lo;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void BVH::clusterForPaging( int pageBytes, Array<int> &triOrder )
+{
+    debugAssert(m_nodeData == m_nodes.getCArray());
+
+    triOrder.fastClear();
+    if (m_nodes.size() == 0)
+        return;
+
+    const int pairsPerPage = max(1, pageBytes / int(2 * sizeof(BVHNode)));
+
+    // The root is followed by an unused slot so that sibling pairs, and
+    // therefore pages, start at even indices
+    Array<BVHNode> nodes;
+    nodes.reserve(m_nodes.size() + 1);
+    nodes.append(m_nodes[0]);
+    {
+        BVHNode &pad = nodes.next();
+        memset(&pad, 0, sizeof(pad));
+    }
+
+    // A sibling pair waiting to be placed: its old index and its parent's new one
+    struct Pending
+    {
+        int     first;
+        int     parent;
+        float   area;
+    };
+
+    Array<Pending> roots, frontier;
+    if (!m_nodes[0].isLeaf())
+    {
+        Pending p = { m_nodes[0].offset, 0, nodeArea(m_nodes[0]) };
+        roots.append(p);
+    }
+
+    for (int head = 0; head < roots.size(); ++head)
+    {
+        // Treelets fill out the current page and never cross into the next
+        int capacity = pairsPerPage - (nodes.size() / 2) % pairsPerPage;
+
+        frontier.fastClear();
+        frontier.append(roots[head]);
+
+        while (frontier.size() > 0 && capacity > 0)
+        {
+            // Expand the pair under the largest parent, which rays are most
+            // likely to reach
+            int best = 0;
+            for (int i = 1; i < frontier.size(); ++i)
+            {
+                if (frontier[i].area > frontier[best].area)
+                    best = i;
+            }
+            const Pending p = frontier[best];
+            frontier.fastRemove(best);
+
+            const int index = nodes.size();
+            nodes.append(m_nodes[p.first], m_nodes[p.first + 1]);
+            nodes[p.parent].offset = index;
+            --capacity;
+
+            for (int k = 0; k < 2; ++k)
+            {
+                const BVHNode &child = nodes[index + k];
+                if (!child.isLeaf())
+                {
+                    Pending c = { child.offset, index + k, nodeArea(child) };
+                    frontier.append(c);
+                }
+            }
+        }
+
+        // Whatever did not fit starts treelets of its own
+        roots.append(frontier);
+    }
+
+    // Renumber triangles in the order the new leaf layout references them
+    Array<int> newIndex;
+    newIndex.resize(m_numTris);
+    for (int i = 0; i < m_numTris; ++i)
+        newIndex[i] = -1;
+
+    Array<int> refs;
+    refs.reserve(m_refs.size());
+    for (int i = 0; i < nodes.size(); ++i)
+    {
+        BVHNode &node = nodes[i];
+        if (!node.isLeaf())
+            continue;
+
+        const int first = refs.size();
+        for (int j = 0; j < node.count; ++j)
+        {
+            const int tri = m_refs[node.offset + j];
+            if (newIndex[tri] < 0)
+            {
+                newIndex[tri] = triOrder.size();
+                triOrder.append(tri);
+            }
+            refs.append(newIndex[tri]);
+        }
+        node.offset = first;
+    }
+
+    // Triangles no leaf references (clipped away entirely) go last
+    for (int i = 0; i < m_numTris; ++i)
+    {
+        if (newIndex[i] < 0)
+        {
+            newIndex[i] = triOrder.size();
+            triOrder.append(i);
+        }
+    }
+
+    Array<Vector3> positions;
+    Array<uint8> twoSided;
+    positions.resize(m_positions.size());
+    twoSided.resize(m_twoSided.size());
+    for (int i = 0; i < triOrder.size(); ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+            positions[3 * i + j] = m_positions[3 * triOrder[i] + j];
+        twoSided[i] = m_twoSided[triOrder[i]];
+    }
+
+    m_nodes = nodes;
+    m_refs = refs;
+    m_positions = positions;
+    m_twoSided = twoSided;
+
+    m_nodeData = m_nodes.getCArray();
+    m_refData = m_refs.getCArray();
+    m_posData = m_positions.getCArray();
+    m_twoSidedData = m_twoSided.getCArray();
+    m_numNodes = m_nodes.size();
+    m_buildStats.nodes = m_nodes.size();
+}
+
+void BVH::makeLeaf( int index, const Array<Ref> &refs, const Bounds &bounds )
+{
+    BVHNode &node = m_nodes[index];
+    node.lo = bounds.lo;
+    node.hi = bounds.hi;
+    node.offset = m_refs.size();
+    node.count = refs.size();
+
+    for (int i = 0; i < refs.size(); ++i)
+        m_refs.append(refs[i].tri);
+
+    ++m_buildStats.leaves;
+}
+
+void BVH::buildNode( int index, Array<Ref> &refs, const Bounds &bounds, int depth )
+{
+    const int n = refs.size();
+    if (n <= 1 || depth >= MAX_DEPTH)
+    {
+        makeLeaf(index, refs, bounds);
+        return;
+    }
+
+    const float nodeArea = max(bounds.area(), 1e-20f);
+    const float leafCost = INTERSECTION_COST * n;
+
+    int axis = 0;
+    float split = 0.f, cost = finf();
+    Bounds leftBox, rightBox;
+    bool haveObjectSplit = findObjectSplit(refs, bounds, axis, split, cost, leftBox, rightBox);
+
+    // Spatial splits are only worth trying where the object split's children
+    // overlap noticeably, and only while there is reference budget left
+    bool useSpatial = false;
+    int spatialAxis = 0;
+    float spatialSplit = 0.f;
+    if (m_settings.spatialSplits && m_numRefs < m_maxRefs)
+    {
+        Bounds overlap = leftBox;
+        overlap.intersect(rightBox);
+        if (!haveObjectSplit || overlap.area() / m_rootArea > m_settings.splitAlpha)
+        {
+            float spatialCost = finf();
+            if (findSpatialSplit(refs, bounds, spatialAxis, spatialSplit, spatialCost) &&
+                spatialCost < cost)
+            {
+                useSpatial = true;
+                cost = spatialCost;
+            }
+        }
+    }
+
+    const float splitCost = TRAVERSAL_COST + INTERSECTION_COST * cost / nodeArea;
+    if (n <= m_settings.maxLeafSize && splitCost >= leafCost)
+    {
+        makeLeaf(index, refs, bounds);
+        return;
+    }
+
+    Array<Ref> left, right;
+    Bounds lb, rb;
+
+    if (useSpatial)
+    {
+        // Straddling references go to both sides, unless keeping them
+        // whole on one side is cheaper ("reference unsplitting")
+        Bounds ls, rs;
+        int nl = 0, nr = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            if (refs[i].box.hi[spatialAxis] <= spatialSplit) { ls.merge(refs[i].box); ++nl; }
+            else if (refs[i].box.lo[spatialAxis] >= spatialSplit) { rs.merge(refs[i].box); ++nr; }
+            else { ++nl; ++nr; }
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            const Ref &ref = refs[i];
+            if (ref.box.hi[spatialAxis] <= spatialSplit)
+            {
+                left.append(ref);
+                lb.merge(ref.box);
+            }
+            else if (ref.box.lo[spatialAxis] >= spatialSplit)
+            {
+                right.append(ref);
+                rb.merge(ref.box);
+            }
+            else
+            {
+                Ref l, r;
+                splitReference(ref, spatialAxis, spatialSplit, l, r);
+
+                Bounds ls1 = ls; ls1.merge(l.box);
+                Bounds rs1 = rs; rs1.merge(r.box);
+                Bounds lAll = ls; lAll.merge(ref.box);
+                Bounds rAll = rs; rAll.merge(ref.box);
+
+                float cSplit = ls1.area() * nl + rs1.area() * nr;
+                float cLeft = lAll.area() * nl + rs.area() * (nr - 1);
+                float cRight = ls.area() * (nl - 1) + rAll.area() * nr;
+
+                if (cLeft < cSplit && cLeft <= cRight)
+                {
+                    left.append(ref);
+                    ls = lAll; lb.merge(ref.box);
+                    --nr;
+                }
+                else if (cRight < cSplit)
+                {
+                    right.append(ref);
+                    rs = rAll; rb.merge(ref.box);
+                    --nl;
+                }
+                else
+                {
+                    left.append(l);
+                    right.append(r);
+                    ls = ls1; rs = rs1;
+                    lb.merge(l.box);
+                    rb.merge(r.box);
+                }
+            }
+        }
+
+        if (left.size() == 0 || right.size() == 0)
+        {
+            // Degenerate spatial split; fall back to the object split below
+            useSpatial = false;
+            left.fastClear();
+            right.fastClear();
+            lb = Bounds();
+            rb = Bounds();
+        }
+        else
+        {
+            m_numRefs += left.size() + right.size() - n;
+            ++m_buildStats.spatialSplits;
+        }
+    }
+
+    if (!useSpatial)
+    {
+        if (haveObjectSplit)
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                if (refs[i].box.center()[axis] < split) { left.append(refs[i]); lb.merge(refs[i].box); }
+                else { right.append(refs[i]); rb.merge(refs[i].box); }
+            }
+        }
+
+        if (left.size() == 0 || right.size() == 0)
+        {
+            // All centroids coincide; split the list in half
+            left.fastClear();
+            right.fastClear();
+            lb = Bounds();
+            rb = Bounds();
+            for (int i = 0; i < n; ++i)
+            {
+                if (i < n / 2) { left.append(refs[i]); lb.merge(refs[i].box); }
+                else { right.append(refs[i]); rb.merge(refs[i].box); }
+            }
+        }
+    }
+
+    // The input list is no longer needed; release it before recursing
+    refs.clear();
+
+    // Both children are allocated together so that they sit side by side
+    const int first = m_nodes.size();
+    m_nodes.resize(first + 2);
+    {
+        BVHNode &node = m_nodes[index];
+        node.lo = bounds.lo;
+        node.hi = bounds.hi;
+        node.offset = first;
+        node.count = 0;
+    }
+
+    // Clip child bounds to the parent; spatial split references may extend past it
+    lb.intersect(bounds);
+    rb.intersect(bounds);
+
+    buildNode(first, left, lb, depth + 1);
+    buildNode(first + 1, right, rb, depth + 1);
+}
+
+bool BVH::findObjectSplit( const Array<Ref> &refs, const Bounds &bounds,
+                           int &bestAxis, float &bestSplit, float &bestCost,
+                           Bounds &bestLeft, Bounds &bestRight ) const
+{
+    Bounds centroids;
+    for (int i = 0; i < refs.size(); ++i)
+        centroids.merge(refs[i].box.center());
+
+    const int numBins = m_settings.numBins;
+    Array<Bin> bins;
+    Array<Bounds> rightBoxes;
+    Array<int> rightCounts;
+    bins.resize(numBins);
+    rightBoxes.resize(numBins);
+    rightCounts.resize(numBins);
+
+    bool found = false;
+    bestCost = finf();
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float lo = centroids.lo[axis], hi = centroids.hi[axis];
+        if (hi - lo <= 1e-12f)
+            continue;
+        float scale = numBins / (hi - lo);
+
+        for (int b = 0; b < numBins; ++b)
+        {
+            bins[b].box = Bounds();
+            bins[b].count = 0;
+        }
+
+        for (int i = 0; i < refs.size(); ++i)
+        {
+            int b = min(numBins - 1, int((refs[i].box.center()[axis] - lo) * scale));
+            bins[b].box.merge(refs[i].box);
+            ++bins[b].count;
+        }
+
+        Bounds acc;
+        int count = 0;
+        for (int b = numBins - 1; b > 0; --b)
+        {
+            acc.merge(bins[b].box);
+            count += bins[b].count;
+            rightBoxes[b] = acc;
+            rightCounts[b] = count;
+        }
+
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < numBins; ++b)
+        {
+            acc.merge(bins[b - 1].box);
+            count += bins[b - 1].count;
+            if (count == 0 || rightCounts[b] == 0)
+                continue;
+
+            float cost = acc.area() * count + rightBoxes[b].area() * rightCounts[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = lo + b / scale;
+                bestLeft = acc;
+                bestRight = rightBoxes[b];
+                found = true;
+            }
+        }
+    }
+
+    (void)bounds;
+    return found;
+}
+
+bool BVH::findSpatialSplit( const Array<Ref> &refs, const Bounds &bounds,
+                            int &bestAxis, float &bestSplit, float &bestCost ) const
+{
+    const int numBins = m_settings.numBins;
+    Array<Bin> bins;
+    Array<Bounds> rightBoxes;
+    Array<int> rightCounts;
+    bins.resize(numBins);
+    rightBoxes.resize(numBins);
+    rightCounts.resize(numBins);
+
+    bool found = false;
+    bestCost = finf();
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float lo = bounds.lo[axis], hi = bounds.hi[axis];
+        if (hi - lo <= 1e-12f)
+            continue;
+        float width = (hi - lo) / numBins;
+        float scale = 1.f / width;
+
+        for (int b = 0; b < numBins; ++b)
+        {
+            bins[b].box = Bounds();
+            bins[b].enter = 0;
+            bins[b].exit = 0;
+        }
+
+        // Chop each reference into the bins it spans
+        for (int i = 0; i < refs.size(); ++i)
+        {
+            const Ref &ref = refs[i];
+            int first = iClamp(int((ref.box.lo[axis] - lo) * scale), 0, numBins - 1);
+            int last = iClamp(int((ref.box.hi[axis] - lo) * scale), first, numBins - 1);
+
+            for (int b = first; b <= last; ++b)
+            {
+                Bounds clipped = ref.box;
+                if (first != last)
+                {
+                    clipped = clipTriangle(ref.tri, axis, lo + b * width, lo + (b + 1) * width);
+                    clipped.intersect(ref.box);
+                }
+                bins[b].box.merge(clipped);
+            }
+            ++bins[first].enter;
+            ++bins[last].exit;
+        }
+
+        Bounds acc;
+        int count = 0;
+        for (int b = numBins - 1; b > 0; --b)
+        {
+            acc.merge(bins[b].box);
+            count += bins[b].exit;
+            rightBoxes[b] = acc;
+            rightCounts[b] = count;
+        }
+
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < numBins; ++b)
+        {
+            acc.merge(bins[b - 1].box);
+            count += bins[b - 1].enter;
+            if (count == 0 || rightCounts[b] == 0)
+                continue;
+
+            float cost = acc.area() * count + rightBoxes[b].area() * rightCounts[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = lo + b * width;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+void BVH::splitReference( const Ref &ref, int axis, float split, Ref &left, Ref &right ) const
+{
+    left.tri = right.tri = ref.tri;
+
+    left.box = clipTriangle(ref.tri, axis, ref.box.lo[axis], split);
+    left.box.intersect(ref.box);
+
+    right.box = clipTriangle(ref.tri, axis, split, ref.box.hi[axis]);
+    right.box.intersect(ref.box);
+}
+
+BVH::Bounds BVH::clipTriangle( int tri, int axis, float lo, float hi ) const
+{
+    Bounds box;
+    const Vector3 *p = &m_positions[3 * tri];
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3 &a = p[i];
+        const Vector3 &b = p[(i + 1) % 3];
+        float ta = a[axis], tb = b[axis];
+
+        if (ta >= lo && ta <= hi)
+            box.merge(a);
+
+        // Add the edge's crossings of both slab planes
+        if ((ta < lo && tb > lo) || (ta > lo && tb < lo))
+            box.merge(a.lerp(b, (lo - ta) / (tb - ta)));
+        if ((ta < hi && tb > hi) || (ta > hi && tb < hi))
+            box.merge(a.lerp(b, (hi - ta) / (tb - ta)));
+    }
+
+    // Flatten the slab faces exactly onto the planes to avoid drift
+    if (!box.isEmpty())
+    {
+        box.lo[axis] = max(box.lo[axis], lo);
+        box.hi[axis] = min(box.hi[axis], hi);
+    }
+
+    return box;
+}
+
+bool BVH::intersectTri( int tri, const Ray &ray, const Vector3 &dir,
+                        bool cullBackfaces, Hit &hit ) const
+{
+    Vector3 p[3];
+    if (m_geometry)
+    {
+        m_geometry->positions(tri, p[0], p[1], p[2]);
+    }
+    else
+    {
+        p[0] = m_posData[3 * tri];
+        p[1] = m_posData[3 * tri + 1];
+        p[2] = m_posData[3 * tri + 2];
+    }
+
+    // Moller-Trumbore
+    const Vector3 e1 = p[1] - p[0];
+    const Vector3 e2 = p[2] - p[0];
+    const Vector3 q = dir.cross(e2);
+    const float det = e1.dot(q);
+
+    // det > 0 for the counter-clockwise (front) side
+    const bool backface = det < 0.f;
+    if (fabsf(det) < 1e-12f || (backface && cullBackfaces && !m_twoSidedData[tri]))
+        return false;
+
+    const float invDet = 1.f / det;
+    const Vector3 s = ray.origin() - p[0];
+    const float u = s.dot(q) * invDet;
+    if (u < 0.f || u > 1.f)
+        return false;
+
+    const Vector3 r = s.cross(e1);
+    const float v = dir.dot(r) * invDet;
+    if (v < 0.f || u + v > 1.f)
+        return false;
+
+    const float t = e2.dot(r) * invDet;
+    if (t < ray.minDistance() || t >= hit.distance)
+        return false;
+
+    hit.triIndex = tri;
+    hit.u = u;
+    hit.v = v;
+    hit.distance = t;
+    hit.backface = backface;
+    return true;
+}
+
+static inline bool intersectBox( const BVHNode &node, const Vector3 &origin, const Vector3 &invDir,
+                                 float tMin, float tMax, float &tEntry )
+{
+    float t0 = (node.lo.x - origin.x) * invDir.x, t1 = (node.hi.x - origin.x) * invDir.x;
+    if (t0 > t1) std::swap(t0, t1);
+    tMin = max(tMin, t0); tMax = min(tMax, t1);
+
+    t0 = (node.lo.y - origin.y) * invDir.y; t1 = (node.hi.y - origin.y) * invDir.y;
+    if (t0 > t1) std::swap(t0, t1);
+    tMin = max(tMin, t0); tMax = min(tMax, t1);
+
+    t0 = (node.lo.z - origin.z) * invDir.z; t1 = (node.hi.z - origin.z) * invDir.z;
+    if (t0 > t1) std::swap(t0, t1);
+    tMin = max(tMin, t0); tMax = min(tMax, t1);
+
+    tEntry = tMin;
+    return tMin <= tMax;
+}
+
+bool BVH::intersect( const Ray &ray, Hit &hit,
+                     bool cullBackfaces,
+                     bool occlusionOnly,
+                     TraversalStats *stats ) const
+{
+    if (m_numNodes == 0)
+        return false;
+
+    const Vector3 origin = ray.origin();
+    const Vector3 dir = ray.direction();
+    const Vector3 invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+    hit = Hit();
+    hit.distance = ray.maxDistance();
+
+    int64 nodesVisited = 0, trisTested = 0;
+    bool found = false;
+
+    int stack[MAX_DEPTH + 4];
+    int sp = 0;
+    int current = 0;
+
+    float tEntry;
+    if (!intersectBox(m_nodeData[0], origin, invDir, ray.minDistance(), hit.distance, tEntry))
+        current = -1;
+
+    while (current >= 0)
+    {
+        const BVHNode &node = m_nodeData[current];
+        ++nodesVisited;
+
+        if (node.isLeaf())
+        {
+            for (int i = 0; i < node.count; ++i)
+            {
+                ++trisTested;
+                if (intersectTri(m_refData[node.offset + i], ray, dir, cullBackfaces, hit))
+                {
+                    found = true;
+                    if (occlusionOnly)
+                        break;
+                }
+            }
+            if (found && occlusionOnly)
+                break;
+            current = sp > 0 ? stack[--sp] : -1;
+        }
+        else
+        {
+            int a = node.offset, b = node.offset + 1;
+            float ta, tb;
+            bool hitA = intersectBox(m_nodeData[a], origin, invDir, ray.minDistance(), hit.distance, ta);
+            bool hitB = intersectBox(m_nodeData[b], origin, invDir, ray.minDistance(), hit.distance, tb);
+
+            if (hitA && hitB)
+            {
+                // Visit the nearer child first
+                if (tb < ta) std::swap(a, b);
+                stack[sp++] = b;
+                current = a;
+            }
+            else if (hitA) current = a;
+            else if (hitB) current = b;
+            else current = sp > 0 ? stack[--sp] : -1;
+        }
+    }
+
+    if (stats)
+    {
+        ++stats->rays;
+        stats->nodesVisited += nodesVisited;
+        stats->trisTested += trisTested;
+    }
+
+    return found;
+}
@@ -0,0 +1,269 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <G3D/G3DAll.h>
+
+class CompressedGeometry;
+class HugePageArena;
+
+/** Build options for the scene BVH. Read from the optional "acceleration"
+  * table of a scene file, e.g.
+  *
+  *     acceleration = { spatialSplits = true; splitBudget = 0.3; };
+  */
+struct BVHSettings
+{
+    bool    spatialSplits;  // allow SBVH spatial splits (Stich et al. 2009)
+    float   splitBudget;    // extra references spatial splits may add, as a fraction of the triangle count
+    float   splitAlpha;     // child overlap (relative to root area) above which spatial splits are tried
+    int     maxLeafSize;    // leaves are forced below this size
+    int     numBins;        // SAH bins per axis
+
+    BVHSettings() :
+        spatialSplits(false),
+        splitBudget(0.3f),
+        splitAlpha(1e-5f),
+        maxLeafSize(4),
+        numBins(32)
+    { }
+
+    void init( const Any &any )
+    {
+        if ( any.containsKey("spatialSplits") )
+            spatialSplits = any["spatialSplits"];
+        if ( any.containsKey("splitBudget") )
+            splitBudget = any["splitBudget"];
+        if ( any.containsKey("splitAlpha") )
+            splitAlpha = any["splitAlpha"];
+        if ( any.containsKey("maxLeafSize") )
+            maxLeafSize = any["maxLeafSize"];
+        if ( any.containsKey("numBins") )
+            numBins = any["numBins"];
+    }
+};
+
+/** A 32 byte BVH node. Interior nodes store their two children side by side
+  * starting at @c offset, so a sibling pair shares a cache line; leaves store
+  * @c count triangle references starting at @c offset.
+  */
+struct BVHNode
+{
+    Vector3 lo;
+    int     offset;
+    Vector3 hi;
+    int     count;  // 0 for interior nodes
+
+    bool isLeaf() const { return count > 0; }
+};
+
+/** Bounding volume hierarchy over the scene's world space triangles, built
+  * with the binned surface area heuristic and, optionally, spatial splits.
+  */
+class BVH
+{
+public:
+
+    struct Hit
+    {
+        enum { NONE = -1 };
+
+        int     triIndex;   // index into the triangle array the BVH was built from
+        float   u, v;       // barycentric weights of vertices 1 and 2
+        float   distance;
+        bool    backface;
+
+        Hit() : triIndex(NONE), u(0.f), v(0.f), distance(finf()), backface(false) { }
+    };
+
+    /** Counters accumulated by intersect() when requested */
+    struct TraversalStats
+    {
+        int64 rays;
+        int64 nodesVisited;
+        int64 trisTested;
+
+        TraversalStats() : rays(0), nodesVisited(0), trisTested(0) { }
+
+        float nodesPerRay() const { return rays ? float(nodesVisited) / rays : 0.f; }
+        float trisPerRay() const { return rays ? float(trisTested) / rays : 0.f; }
+    };
+
+    struct BuildStats
+    {
+        int     tris;
+        int     refs;           // triangle references after spatial splits
+        int     nodes;
+        int     leaves;
+        int     spatialSplits;  // number of nodes split spatially
+        float   seconds;
+
+        BuildStats() : tris(0), refs(0), nodes(0), leaves(0), spatialSplits(0), seconds(0.f) { }
+    };
+
+    BVH();
+
+    // Traversal may point into the BVH's own arrays, so copies are not allowed
+    BVH( const BVH & ) = delete;
+    BVH &operator=( const BVH & ) = delete;
+
+    /** Builds the hierarchy. The triangle positions are copied, so @p verts
+      * does not need to outlive the BVH.
+      */
+    void build( const Array<Tri> &tris, const CPUVertexArray &verts, const BVHSettings &settings );
+
+    /** Builds the hierarchy from triangle positions alone, three per
+      * triangle, for scenes whose full triangles are not in memory. Takes
+      * over @p positions and @p twoSided, leaving them empty.
+      */
+    void build( Array<Vector3> &positions, Array<uint8> &twoSided, const BVHSettings &settings );
+
+    /** Regroups the nodes of a built BVH into treelets of @p pageBytes, each
+      * grown from its root by the children a ray is most likely to enter,
+      * so that traversal touches few pages. Triangles are then renumbered
+      * in the order the leaves reference them.
+      *
+      * @param triOrder receives the previous index of every triangle in its
+      *                 new order; the caller's triangle array must be
+      *                 permuted to match
+      */
+    void clusterForPaging( int pageBytes, Array<int> &triOrder );
+
+    /** Moves the nodes, references and triangle data into @p arena, which
+      * must outlive the BVH or the next call to clear(). Attached arrays are
+      * copied too, so a BVH mapped from a scene cache can be moved off the
+      * file's 4 KB pages.
+      */
+    void moveToArena( HugePageArena &arena );
+
+    /** Uses externally owned arrays, such as a memory-mapped scene cache,
+      * instead of building. The arrays must outlive the BVH or the next
+      * call to clear().
+      */
+    void attach( const BVHNode *nodes, int numNodes,
+                 const int *refs, int numRefs,
+                 const Vector3 *positions, const uint8 *twoSided, int numTris );
+
+    void clear();
+
+    /** Reads triangle positions from @p geometry during traversal and frees
+      * the BVH's own copy. @p geometry must hold the triangles the BVH was
+      * built from, with the same (already quantized) positions, and outlive
+      * the BVH or the next call to clear().
+      */
+    void setGeometry( const CompressedGeometry *geometry );
+
+    /** Finds the closest intersection along @p ray within its min/max distance.
+      *
+      * @param cullBackfaces    ignore back faces of one-sided triangles
+      * @param occlusionOnly    return on the first hit found instead of the closest
+      * @param stats            if not NULL, receives traversal counters
+      */
+    bool intersect( const Ray &ray, Hit &hit,
+                    bool cullBackfaces = true,
+                    bool occlusionOnly = false,
+                    TraversalStats *stats = NULL ) const;
+
+    /** Upper bound on the memory build() needs for @p numTris triangles,
+      * including its temporary reference lists
+      */
+    static size_t estimateBytes( int numTris, const BVHSettings &settings );
+
+    const BuildStats &buildStats() const { return m_buildStats; }
+
+    /** Bytes held by nodes, references and triangle data, not counting
+      * a CompressedGeometry set with setGeometry()
+      */
+    size_t sizeInBytes() const;
+
+    bool empty() const { return m_numNodes == 0; }
+
+    // Raw arrays, for serialization
+    const BVHNode *nodes() const { return m_nodeData; }
+    int numNodes() const { return m_numNodes; }
+    const int *refs() const { return m_refData; }
+    int numRefs() const { return m_numRefData; }
+    const Vector3 *positions() const { return m_posData; }
+    const uint8 *twoSided() const { return m_twoSidedData; }
+    int numTris() const { return m_numTris; }
+
+private:
+
+    /** Axis-aligned bounds that start out empty */
+    struct Bounds
+    {
+        Vector3 lo;
+        Vector3 hi;
+
+        Bounds() : lo(Vector3::inf()), hi(-Vector3::inf()) { }
+
+        void merge( const Vector3 &p ) { lo = lo.min(p); hi = hi.max(p); }
+        void merge( const Bounds &b ) { lo = lo.min(b.lo); hi = hi.max(b.hi); }
+        void intersect( const Bounds &b ) { lo = lo.max(b.lo); hi = hi.min(b.hi); }
+        bool isEmpty() const { return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z; }
+        Vector3 center() const { return (lo + hi) * 0.5f; }
+
+        float area() const
+        {
+            if ( isEmpty() ) return 0.f;
+            Vector3 d = hi - lo;
+            return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+    };
+
+    struct Ref
+    {
+        int     tri;
+        Bounds  box;
+    };
+
+    struct Bin
+    {
+        Bounds  box;
+        int     count;  // object splits: refs whose centroid falls here
+        int     enter;  // spatial splits: refs starting in this bin
+        int     exit;   // spatial splits: refs ending in this bin
+    };
+
+    enum { MAX_DEPTH = 60 };
+
+    void buildNode( int index, Array<Ref> &refs, const Bounds &bounds, int depth );
+    void makeLeaf( int index, const Array<Ref> &refs, const Bounds &bounds );
+
+    bool findObjectSplit( const Array<Ref> &refs, const Bounds &bounds,
+                          int &axis, float &split, float &cost,
+                          Bounds &leftBox, Bounds &rightBox ) const;
+
+    bool findSpatialSplit( const Array<Ref> &refs, const Bounds &bounds,
+                           int &axis, float &split, float &cost ) const;
+
+    void splitReference( const Ref &ref, int axis, float split, Ref &left, Ref &right ) const;
+
+    Bounds clipTriangle( int tri, int axis, float lo, float hi ) const;
+
+    bool intersectTri( int tri, const Ray &ray, const Vector3 &dir,
+                       bool cullBackfaces, Hit &hit ) const;
+
+    // Storage owned by a built BVH
+    Array<BVHNode>  m_nodes;
+    Array<int>      m_refs;         // triangle index per leaf slot
+    Array<Vector3>  m_positions;    // three world space vertices per triangle
+    Array<uint8>    m_twoSided;     // per triangle
+
+    // What traversal reads: either the arrays above or attached memory
+    const BVHNode * m_nodeData;
+    const int *     m_refData;
+    const Vector3 * m_posData;
+    const uint8 *   m_twoSidedData;
+    const CompressedGeometry *m_geometry;   // replaces m_posData if set
+    int             m_numNodes;
+    int             m_numRefData;
+    int             m_numTris;
+
+    BVHSettings     m_settings;
+    BuildStats      m_buildStats;
+    float           m_rootArea;
+    int             m_maxRefs;      // reference budget for spatial splits
+    int             m_numRefs;
+};
+
+#endif // BVH_H
@@ -0,0 +1,249 @@
+#include "compressedgeometry.h"
+
+#include <algorithm>
+
+#define POSITION_BITS 21
+#define POSITION_MAX ((1 << POSITION_BITS) - 1)
+#define UV_MAX 0xffff
+
+static uint32 packSnorm( float v, int bits )
+{
+    const int range = (1 << (bits - 1)) - 1;
+    const int q = iRound(clamp(v, -1.f, 1.f) * range);
+    return uint32(q) & ((1u << bits) - 1);
+}
+
+static float unpackSnorm( uint32 q, int bits )
+{
+    const int range = (1 << (bits - 1)) - 1;
+    const int s = int(q << (32 - bits)) >> (32 - bits);  // sign extend
+    return max(float(s) / range, -1.f);
+}
+
+// Octahedral mapping of unit vectors onto [-1, 1]^2 (Meyer et al. 2010)
+static Vector2 octEncode( const Vector3 &n )
+{
+    const float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (sum == 0.f)
+        return Vector2(0.f, 0.f);
+
+    Vector2 e(n.x / sum, n.y / sum);
+    if (n.z < 0.f)
+    {
+        e = Vector2((1.f - fabsf(e.y)) * (e.x >= 0.f ? 1.f : -1.f),
+                    (1.f - fabsf(e.x)) * (e.y >= 0.f ? 1.f : -1.f));
+    }
+    return e;
+}
+
+static Vector3 octDecode( const Vector2 &e )
+{
+    Vector3 n(e.x, e.y, 1.f - fabsf(e.x) - fabsf(e.y));
+    const float t = max(-n.z, 0.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return n.directionOrZero();
+}
+
+static int quantize( float v, float lo, float step, int maxValue )
+{
+    if (step <= 0.f)
+        return 0;
+    return iClamp(iRound((v - lo) / step), 0, maxValue);
+}
+
+CompressedGeometry::CompressedGeometry() :
+    m_indexBits(0)
+{ }
+
+void CompressedGeometry::clear()
+{
+    m_meshes.clear();
+    m_meshFirstTri.clear();
+    m_positions.clear();
+    m_normals.clear();
+    m_tangents.clear();
+    m_texCoords.clear();
+    m_indices.clear();
+    m_indexBits = 0;
+    m_triInfo.clear();
+    m_materials.clear();
+    m_materialIndex.clear();
+}
+
+void CompressedGeometry::addMesh( CPUVertexArray &verts, const Array<Tri> &tris )
+{
+    Mesh &mesh = m_meshes.next();
+    mesh.firstTri = m_triInfo.size();
+    mesh.firstVertex = m_positions.size();
+    mesh.hasTangent = verts.hasTangent;
+    mesh.hasTexCoord0 = verts.hasTexCoord0;
+    m_meshFirstTri.append(mesh.firstTri);
+
+    const int numVerts = verts.size();
+
+    // Quantization ranges
+    Vector3 lo = Vector3::inf(), hi = -Vector3::inf();
+    Vector2 uvLo = Vector2::inf(), uvHi = -Vector2::inf();
+    for (int i = 0; i < numVerts; ++i)
+    {
+        const CPUVertexArray::Vertex &v = verts.vertex[i];
+        lo = lo.min(v.position);
+        hi = hi.max(v.position);
+        uvLo = uvLo.min(v.texCoord0);
+        uvHi = uvHi.max(v.texCoord0);
+    }
+    if (numVerts == 0)
+    {
+        lo = hi = Vector3::zero();
+        uvLo = uvHi = Vector2::zero();
+    }
+
+    mesh.lo = lo;
+    mesh.step = (hi - lo) / float(POSITION_MAX);
+    mesh.uvLo = uvLo;
+    mesh.uvStep = (uvHi - uvLo) / float(UV_MAX);
+
+    for (int i = 0; i < numVerts; ++i)
+    {
+        CPUVertexArray::Vertex &v = verts.vertex[i];
+
+        uint64 q[3];
+        for (int a = 0; a < 3; ++a)
+            q[a] = quantize(v.position[a], lo[a], mesh.step[a], POSITION_MAX);
+        m_positions.append(q[0] | (q[1] << POSITION_BITS) | (q[2] << (2 * POSITION_BITS)));
+
+        const Vector2 n = octEncode(v.normal);
+        m_normals.append(packSnorm(n.x, 16) | (packSnorm(n.y, 16) << 16));
+
+        const Vector2 t = octEncode(v.tangent.xyz());
+        m_tangents.append(packSnorm(t.x, 15) | (packSnorm(t.y, 15) << 15) |
+                          (v.tangent.w < 0.f ? (1u << 30) : 0u));
+
+        const uint32 s = quantize(v.texCoord0.x, uvLo.x, mesh.uvStep.x, UV_MAX);
+        const uint32 r = quantize(v.texCoord0.y, uvLo.y, mesh.uvStep.y, UV_MAX);
+        m_texCoords.append(s | (r << 16));
+
+        // Hand the quantized position back so the BVH is built around it
+        v.position = position(mesh, mesh.firstVertex + i);
+    }
+
+    // Pack indices with just enough bits for this mesh
+    mesh.indexBits = 1;
+    while ((int64(1) << mesh.indexBits) < numVerts)
+        ++mesh.indexBits;
+    mesh.indexOffset = m_indexBits;
+
+    for (int t = 0; t < tris.size(); ++t)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            const uint64 value = uint64(tris[t].index[j]);
+            const uint64 word = m_indexBits >> 5;
+            const int shift = int(m_indexBits & 31);
+
+            // One word of padding past the end keeps reads two words wide
+            while (uint64(m_indices.size()) < word + 2)
+                m_indices.append(0);
+
+            m_indices[int(word)] |= uint32(value << shift);
+            m_indices[int(word) + 1] |= uint32(value >> (32 - shift));
+            m_indexBits += mesh.indexBits;
+        }
+
+        Material *material = tris[t].material().get();
+        int *index = m_materialIndex.getPointer(material);
+        if (!index)
+        {
+            m_materialIndex.set(material, m_materials.size());
+            m_materials.append(tris[t].material());
+            index = m_materialIndex.getPointer(material);
+        }
+        alwaysAssertM(*index <= MATERIAL_MASK, "Too many materials for compressed geometry");
+
+        m_triInfo.append(uint16(*index | (tris[t].twoSided() ? TWO_SIDED : 0)));
+    }
+}
+
+const CompressedGeometry::Mesh &CompressedGeometry::meshOf( int tri ) const
+{
+    const int *first = m_meshFirstTri.getCArray();
+    const int i = int(std::upper_bound(first, first + m_meshFirstTri.size(), tri) - first) - 1;
+    return m_meshes[i];
+}
+
+void CompressedGeometry::indices( const Mesh &mesh, int tri, int index[3] ) const
+{
+    uint64 bit = mesh.indexOffset + uint64(tri - mesh.firstTri) * 3 * mesh.indexBits;
+    const uint64 mask = (uint64(1) << mesh.indexBits) - 1;
+
+    for (int j = 0; j < 3; ++j, bit += mesh.indexBits)
+    {
+        const int word = int(bit >> 5);
+        const uint64 w = m_indices[word] | (uint64(m_indices[word + 1]) << 32);
+        index[j] = mesh.firstVertex + int((w >> (bit & 31)) & mask);
+    }
+}
+
+Vector3 CompressedGeometry::position( const Mesh &mesh, int vertex ) const
+{
+    const uint64 q = m_positions[vertex];
+    return mesh.lo + mesh.step * Vector3(float(q & POSITION_MAX),
+                                         float((q >> POSITION_BITS) & POSITION_MAX),
+                                         float((q >> (2 * POSITION_BITS)) & POSITION_MAX));
+}
+
+void CompressedGeometry::positions( int tri, Vector3 &p0, Vector3 &p1, Vector3 &p2 ) const
+{
+    const Mesh &mesh = meshOf(tri);
+    int index[3];
+    indices(mesh, tri, index);
+
+    p0 = position(mesh, index[0]);
+    p1 = position(mesh, index[1]);
+    p2 = position(mesh, index[2]);
+}
+
+Tri CompressedGeometry::decode( int tri, CPUVertexArray &verts ) const
+{
+    const Mesh &mesh = meshOf(tri);
+    int index[3];
+    indices(mesh, tri, index);
+
+    verts.vertex.resize(3);
+    verts.hasTangent = mesh.hasTangent;
+    verts.hasTexCoord0 = mesh.hasTexCoord0;
+
+    for (int j = 0; j < 3; ++j)
+    {
+        CPUVertexArray::Vertex &v = verts.vertex[j];
+        const int i = index[j];
+
+        v.position = position(mesh, i);
+
+        const uint32 n = m_normals[i];
+        v.normal = octDecode(Vector2(unpackSnorm(n & 0xffff, 16), unpackSnorm(n >> 16, 16)));
+
+        const uint32 t = m_tangents[i];
+        v.tangent = Vector4(octDecode(Vector2(unpackSnorm(t & 0x7fff, 15),
+                                              unpackSnorm((t >> 15) & 0x7fff, 15))),
+                            (t & (1u << 30)) ? -1.f : 1.f);
+
+        const uint32 uv = m_texCoords[i];
+        v.texCoord0 = mesh.uvLo + mesh.uvStep * Vector2(float(uv & 0xffff), float(uv >> 16));
+    }
+
+    const uint16 info = m_triInfo[tri];
+    return Tri(0, 1, 2, verts, m_materials[info & MATERIAL_MASK], (info & TWO_SIDED) != 0);
+}
+
+size_t CompressedGeometry::sizeInBytes() const
+{
+    return m_meshes.size() * (sizeof(Mesh) + sizeof(int))
+         + m_positions.size() * sizeof(uint64)
+         + m_normals.size() * sizeof(uint32)
+         + m_tangents.size() * sizeof(uint32)
+         + m_texCoords.size() * sizeof(uint32)
+         + m_indices.size() * sizeof(uint32)
+         + m_triInfo.size() * sizeof(uint16);
+}
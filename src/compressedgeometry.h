@@ -0,0 +1,93 @@
+#ifndef COMPRESSEDGEOMETRY_H
+#define COMPRESSEDGEOMETRY_H
+
+#include <G3D/G3DAll.h>
+
+/** Compact storage for triangle meshes, used in place of CPUVertexArray and
+  * Array<Tri> when a scene sets "compressGeometry = true;".
+  *
+  * Per vertex:
+  *   - position: 21 bits per axis relative to the mesh bounds (8 bytes)
+  *   - normal:   octahedral, 16 bits per component (4 bytes)
+  *   - tangent:  octahedral, 15 bits per component plus handedness (4 bytes)
+  *   - texCoord: 16 bits per component relative to the mesh UV bounds (4 bytes)
+  *
+  * Per triangle, vertex indices are bit-packed with just enough bits for
+  * the mesh's vertex count, and material and two-sidedness share 16 bits.
+  *
+  * Traversal only needs positions(); the full vertices and the Tri are
+  * rebuilt by decode() for the closest hit alone.
+  */
+class CompressedGeometry
+{
+public:
+
+    CompressedGeometry();
+
+    /** Appends a mesh. Triangle indices of later meshes continue where the
+      * previous mesh stopped, matching the order the meshes are flattened in.
+      *
+      * The positions of @p verts are replaced with their quantized values, so
+      * an acceleration structure built from them afterwards bounds exactly
+      * the triangles positions() returns.
+      */
+    void addMesh( CPUVertexArray &verts, const Array<Tri> &tris );
+
+    void clear();
+
+    int numTris() const { return m_triInfo.size(); }
+
+    /** Decoded corners of triangle @p tri */
+    void positions( int tri, Vector3 &p0, Vector3 &p1, Vector3 &p2 ) const;
+
+    /** Rebuilds triangle @p tri as a standalone Tri over @p verts, which
+      * receives its three vertices
+      */
+    Tri decode( int tri, CPUVertexArray &verts ) const;
+
+    /** Index of triangle @p tri's material in materials() */
+    int materialIndex( int tri ) const { return m_triInfo[tri] & MATERIAL_MASK; }
+
+    const Array<shared_ptr<Material>> &materials() const { return m_materials; }
+
+    size_t sizeInBytes() const;
+
+private:
+
+    struct Mesh
+    {
+        int     firstTri;
+        int     firstVertex;
+        int     indexBits;      // bits per packed vertex index
+        uint64  indexOffset;    // first bit of the mesh's indices in m_indices
+        Vector3 lo;             // position bounds
+        Vector3 step;           // position quantization step per axis
+        Vector2 uvLo;
+        Vector2 uvStep;
+        bool    hasTangent;
+        bool    hasTexCoord0;
+    };
+
+    enum { TWO_SIDED = 0x8000, MATERIAL_MASK = 0x7fff };
+
+    const Mesh &meshOf( int tri ) const;
+    void indices( const Mesh &mesh, int tri, int index[3] ) const;
+    Vector3 position( const Mesh &mesh, int vertex ) const;
+
+    Array<Mesh>     m_meshes;
+    Array<int>      m_meshFirstTri;     // for finding a triangle's mesh
+
+    Array<uint64>   m_positions;
+    Array<uint32>   m_normals;
+    Array<uint32>   m_tangents;
+    Array<uint32>   m_texCoords;
+
+    Array<uint32>   m_indices;          // bit stream of packed vertex indices
+    uint64          m_indexBits;        // bits used in m_indices
+    Array<uint16>   m_triInfo;          // material index | TWO_SIDED
+
+    Array<shared_ptr<Material>> m_materials;
+    Table<Material*, int>       m_materialIndex;
+};
+
+#endif // COMPRESSEDGEOMETRY_H
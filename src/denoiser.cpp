@@ -0,0 +1,247 @@
+#include "denoiser.h"
+#include "memorytracker.h"
+#include "threadpool.h"
+
+#include <cmath>
+#include <smmintrin.h>
+
+// Rows per parallel task
+static const int BAND_ROWS = 16;
+
+// Planes of the image and its features
+enum { COLOR_PLANES = 0, NORMAL_PLANES = 6, DEPTH_PLANE = 9, NUM_PLANES = 10 };
+
+// Albedo below this is not divided out, which would amplify noise
+static const float MIN_ALBEDO = 0.01f;
+
+// B3-spline taps
+static const float KERNEL[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+// e^x for x <= 0, to about 1e-4 relative error: the integer part of
+// x log2(e) goes into the exponent and 2^f of the rest is a cubic
+static inline __m128 fastExp( __m128 x )
+{
+    x = _mm_max_ps(x, _mm_set1_ps(-80.f));
+    const __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.442695041f));
+    const __m128 i = _mm_floor_ps(t);
+    const __m128 f = _mm_sub_ps(t, i);
+
+    __m128 p = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(0.0794214f)), _mm_set1_ps(0.2244943f));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(0.6960656f));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(1.f));
+
+    const __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(i), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+Denoiser::Denoiser() :
+    m_planes(NULL),
+    m_width(0),
+    m_height(0),
+    m_stride(0)
+{ }
+
+void Denoiser::resize( int width, int height )
+{
+    if (m_planes && width == m_width && height == m_height)
+        return;
+
+    m_width = width;
+    m_height = height;
+    m_stride = (width + 3) & ~3;
+    m_arena.reset();
+    m_planes = m_arena.alloc<float>(size_t(NUM_PLANES) * m_stride * m_height);
+
+    MemoryTracker::global().set(MemoryTracker::DENOISER, sizeInBytes());
+}
+
+size_t Denoiser::sizeInBytes() const
+{
+    return size_t(NUM_PLANES) * m_stride * m_height * sizeof(float);
+}
+
+void Denoiser::filterRows( int y0, int y1, int step, float colorSigma, int src, int dst ) const
+{
+    const float *c[3], *n[3];
+    float *out[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        c[k] = plane(COLOR_PLANES + 3 * src + k);
+        out[k] = plane(COLOR_PLANES + 3 * dst + k);
+        n[k] = plane(NORMAL_PLANES + k);
+    }
+    const float *z = plane(DEPTH_PLANE);
+
+    const float invColor = 1.f / max(colorSigma * colorSigma, 1e-8f);
+    const float invNormal = 1.f / max(m_settings.normalSigma, 1e-6f);
+
+    // Depth differences are compared per pixel of distance to the tap
+    float invDistance[5][5];
+    for (int j = 0; j < 5; ++j)
+        for (int i = 0; i < 5; ++i)
+            invDistance[j][i] = (i == 2 && j == 2) ? 0.f
+                : 1.f / (step * sqrtf(float((i - 2) * (i - 2) + (j - 2) * (j - 2))));
+
+    const int border = 2 * step;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const int row = y * m_stride;
+        int x = 0;
+        while (x < m_width)
+        {
+            // Four pixels at once where all their taps are inside the image
+            if (x >= border && x + 3 + border < m_width)
+            {
+                const int p = row + x;
+                const __m128 cr = _mm_loadu_ps(c[0] + p), cg = _mm_loadu_ps(c[1] + p), cb = _mm_loadu_ps(c[2] + p);
+                const __m128 nx = _mm_loadu_ps(n[0] + p), ny = _mm_loadu_ps(n[1] + p), nz = _mm_loadu_ps(n[2] + p);
+                const __m128 zp = _mm_loadu_ps(z + p);
+                const __m128 invDepth = _mm_div_ps(_mm_set1_ps(1.f / m_settings.depthSigma),
+                                                   _mm_max_ps(zp, _mm_set1_ps(1e-3f)));
+
+                const __m128 center = _mm_set1_ps(KERNEL[2] * KERNEL[2]);
+                __m128 sr = _mm_mul_ps(cr, center), sg = _mm_mul_ps(cg, center), sb = _mm_mul_ps(cb, center);
+                __m128 wsum = center;
+
+                for (int j = 0; j < 5; ++j)
+                {
+                    const int ty = y + (j - 2) * step;
+                    if (ty < 0 || ty >= m_height)
+                        continue;
+
+                    for (int i = 0; i < 5; ++i)
+                    {
+                        if (i == 2 && j == 2)
+                            continue;
+
+                        const int q = ty * m_stride + x + (i - 2) * step;
+                        const __m128 qr = _mm_loadu_ps(c[0] + q), qg = _mm_loadu_ps(c[1] + q), qb = _mm_loadu_ps(c[2] + q);
+
+                        const __m128 dr = _mm_sub_ps(qr, cr), dg = _mm_sub_ps(qg, cg), db = _mm_sub_ps(qb, cb);
+                        const __m128 dc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+                        const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(n[0] + q)),
+                                                                 _mm_mul_ps(ny, _mm_loadu_ps(n[1] + q))),
+                                                      _mm_mul_ps(nz, _mm_loadu_ps(n[2] + q)));
+
+                        const __m128 dz = _mm_andnot_ps(_mm_set1_ps(-0.f), _mm_sub_ps(_mm_loadu_ps(z + q), zp));
+
+                        __m128 e = _mm_mul_ps(dc, _mm_set1_ps(invColor));
+                        e = _mm_add_ps(e, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.f), dot), _mm_set1_ps(invNormal)));
+                        e = _mm_add_ps(e, _mm_mul_ps(_mm_mul_ps(dz, invDepth), _mm_set1_ps(invDistance[j][i])));
+
+                        const __m128 w = _mm_mul_ps(_mm_set1_ps(KERNEL[i] * KERNEL[j]),
+                                                    fastExp(_mm_sub_ps(_mm_setzero_ps(), e)));
+                        sr = _mm_add_ps(sr, _mm_mul_ps(w, qr));
+                        sg = _mm_add_ps(sg, _mm_mul_ps(w, qg));
+                        sb = _mm_add_ps(sb, _mm_mul_ps(w, qb));
+                        wsum = _mm_add_ps(wsum, w);
+                    }
+                }
+
+                const __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), wsum);
+                _mm_storeu_ps(out[0] + p, _mm_mul_ps(sr, inv));
+                _mm_storeu_ps(out[1] + p, _mm_mul_ps(sg, inv));
+                _mm_storeu_ps(out[2] + p, _mm_mul_ps(sb, inv));
+                x += 4;
+                continue;
+            }
+
+            const int p = row + x;
+            const float invDepth = 1.f / (m_settings.depthSigma * max(z[p], 1e-3f));
+            float w0 = KERNEL[2] * KERNEL[2];
+            float sum[3] = { c[0][p] * w0, c[1][p] * w0, c[2][p] * w0 };
+            float wsum = w0;
+
+            for (int j = 0; j < 5; ++j)
+            {
+                const int ty = y + (j - 2) * step;
+                if (ty < 0 || ty >= m_height)
+                    continue;
+
+                for (int i = 0; i < 5; ++i)
+                {
+                    const int tx = x + (i - 2) * step;
+                    if (tx < 0 || tx >= m_width || (i == 2 && j == 2))
+                        continue;
+
+                    const int q = ty * m_stride + tx;
+                    float dc = 0.f;
+                    for (int k = 0; k < 3; ++k)
+                        dc += square(c[k][q] - c[k][p]);
+                    const float dot = n[0][p] * n[0][q] + n[1][p] * n[1][q] + n[2][p] * n[2][q];
+                    const float e = dc * invColor + (1.f - dot) * invNormal +
+                                    fabsf(z[q] - z[p]) * invDepth * invDistance[j][i];
+
+                    const float w = KERNEL[i] * KERNEL[j] * expf(-e);
+                    for (int k = 0; k < 3; ++k)
+                        sum[k] += w * c[k][q];
+                    wsum += w;
+                }
+            }
+
+            for (int k = 0; k < 3; ++k)
+                out[k][p] = sum[k] / wsum;
+            ++x;
+        }
+    }
+}
+
+void Denoiser::denoise( const Radiance3 *color, const PixelFeatures *features, int width, int height,
+                        Radiance3 *out )
+{
+    resize(width, height);
+
+    // Radiance divided by albedo into the first color planes
+    float *r = plane(COLOR_PLANES), *g = plane(COLOR_PLANES + 1), *b = plane(COLOR_PLANES + 2);
+    float *nx = plane(NORMAL_PLANES), *ny = plane(NORMAL_PLANES + 1), *nz = plane(NORMAL_PLANES + 2);
+    float *z = plane(DEPTH_PLANE);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const int i = y * width + x;
+            const int p = y * m_stride + x;
+            const PixelFeatures &f = features[i];
+            r[p] = color[i].r / max(f.albedo.r, MIN_ALBEDO);
+            g[p] = color[i].g / max(f.albedo.g, MIN_ALBEDO);
+            b[p] = color[i].b / max(f.albedo.b, MIN_ALBEDO);
+
+            // Averaged normals are shorter where the pixel straddles an edge
+            const Vector3 n = f.normal.directionOrZero();
+            nx[p] = n.x;
+            ny[p] = n.y;
+            nz[p] = n.z;
+            z[p] = f.depth;
+        }
+    }
+
+    const int numBands = (height + BAND_ROWS - 1) / BAND_ROWS;
+    int src = 0;
+    for (int it = 0; it < m_settings.iterations; ++it)
+    {
+        const int step = 1 << it;
+        const float colorSigma = ldexpf(m_settings.colorSigma, -it);
+        const int dst = 1 - src;
+        runTasks(numBands, [&](int band) {
+            filterRows(band * BAND_ROWS, min((band + 1) * BAND_ROWS, height), step, colorSigma, src, dst);
+        });
+        src = dst;
+    }
+
+    r = plane(COLOR_PLANES + 3 * src);
+    g = plane(COLOR_PLANES + 3 * src + 1);
+    b = plane(COLOR_PLANES + 3 * src + 2);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const int i = y * width + x;
+            const int p = y * m_stride + x;
+            const Color3 &a = features[i].albedo;
+            out[i] = Radiance3(r[p] * max(a.r, MIN_ALBEDO), g[p] * max(a.g, MIN_ALBEDO),
+                               b[p] * max(a.b, MIN_ALBEDO));
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <G3D/G3DAll.h>
+
+#include "hugepagearena.h"
+#include "aov.h"
+
+class DenoiseSettings
+{
+public:
+
+    int iterations = 5;         // filter widths 5, 9, 17, ... pixels
+    float colorSigma = 1.f;     // halved every iteration
+    float normalSigma = 0.03f;  // of 1 - cos between normals
+    float depthSigma = 0.05f;   // relative depth difference per pixel of distance
+};
+
+/** Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+  * A-Trous Wavelet Transform for fast Global Illumination Filtering",
+  * 2010). The radiance is divided by the albedo, so textures do not blur,
+  * then smoothed by repeated 5x5 B3-spline passes whose taps spread out by
+  * a factor of two each time. Each tap is weighted down where its color,
+  * normal or depth differs from the center's, so edges stay sharp.
+  *
+  * The image is kept as planes of floats and every pass runs in parallel
+  * over bands of rows. Four pixels are filtered at once with SSE wherever
+  * all of their taps are inside the image.
+  */
+class Denoiser
+{
+public:
+
+    Denoiser();
+
+    void setSettings( const DenoiseSettings &settings ) { m_settings = settings; }
+
+    /** Filters @p color, guided by @p features, into @p out, which may be
+      * @p color itself
+      */
+    void denoise( const Radiance3 *color, const PixelFeatures *features, int width, int height,
+                  Radiance3 *out );
+
+    size_t sizeInBytes() const;
+
+private:
+
+    /** Allocates the planes for a @p width x @p height image */
+    void resize( int width, int height );
+
+    /** One a-trous pass over rows [y0, y1) from plane set @p src to @p dst */
+    void filterRows( int y0, int y1, int step, float colorSigma, int src, int dst ) const;
+
+    float *plane( int index ) const { return m_planes + size_t(index) * m_stride * m_height; }
+
+    DenoiseSettings     m_settings;
+
+    HugePageArena       m_arena;
+    float *             m_planes;   // r, g, b twice (ping and pong), then nx, ny, nz, depth
+    int                 m_width;
+    int                 m_height;
+    int                 m_stride;   // floats per plane row, a multiple of 4
+};
+
+#endif // DENOISER_H
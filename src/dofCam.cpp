@@ -171,6 +171,25 @@ Ray dofCam::worldRay(float x, float y, const Rect2D& viewport) const {
 }
 
 
+Ray dofCam::worldRay(float x, float y, const Rect2D &viewport, RayDifferential &diff) const {
+
+    const Ray ray = worldRay(x, y, viewport);
+    diff = RayDifferential::fromRays(ray, worldRay(x + 1.f, y, viewport), worldRay(x, y + 1.f, viewport));
+    return ray;
+}
+
+
+Ray dofCam::worldRay(float x, float y, float u, float v, const Rect2D &viewport,
+                     float filmPlaneDepth, RayDifferential &diff) const {
+
+    const Ray ray = worldRay(x, y, u, v, viewport, filmPlaneDepth);
+    diff = RayDifferential::fromRays(ray,
+                                     worldRay(x + 1.f, y, u, v, viewport, filmPlaneDepth),
+                                     worldRay(x, y + 1.f, u, v, viewport, filmPlaneDepth));
+    return ray;
+}
+
+
 void dofCam::getProjectPixelMatrix(const Rect2D& viewport, Matrix4& P) const {
     m_projection.getProjectPixelMatrix(viewport, P);
 }
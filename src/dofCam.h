@@ -21,6 +21,7 @@
 #include "G3D/Plane.h"
 #include "G3D/debugAssert.h"
 #include "G3D/Projection.h"
+#include "raydifferential.h"
 #include "GLG3D/Scene.h"
 #include "GLG3D/DepthOfFieldSettings.h"
 #include "GLG3D/FilmSettings.h"
@@ -426,6 +427,20 @@ public:
      * @return
      */
     Ray worldRay(float x, float y, float u, float v, const class Rect2D &viewport, float filmPlaneDepth) const;
+
+    /**
+     * @brief worldRay: as worldRay(x, y, viewport), also returning the ray's
+     * differentials with respect to the pixel coordinates.
+     */
+    Ray worldRay(float x, float y, const class Rect2D &viewport, RayDifferential &diff) const;
+
+    /**
+     * @brief worldRay: as the depth of field worldRay(), also returning the
+     * differentials for the same lens point (u, v), whose rays converge on
+     * the focus plane.
+     */
+    Ray worldRay(float x, float y, float u, float v, const class Rect2D &viewport, float filmPlaneDepth,
+                 RayDifferential &diff) const;
     
     /** Circle of confusion radius, in pixels, for a point at negative
         position \a z from the center of projection along the
@@ -0,0 +1,364 @@
+#include "guiding.h"
+#include "memorytracker.h"
+
+#include <cmath>
+
+// Leaves holding more recorded samples than this times the square root of
+// the iteration's pass count are split
+static const int SPATIAL_SPLIT_SAMPLES = 12000;
+
+// Fraction of a tree's energy above which a quadrant is subdivided
+static const float DIRECTIONAL_THRESHOLD = 0.01f;
+static const int MAX_DIRECTIONAL_DEPTH = 20;
+static const int MAX_SPATIAL_DEPTH = 24;
+
+static void atomicAdd( std::atomic<float> &a, float value )
+{
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+        ;
+}
+
+// Quadrant of @p p, which is rescaled to the quadrant's own unit square
+static int quadrant( Point2 &p )
+{
+    const int x = p.x >= 0.5f ? 1 : 0;
+    const int y = p.y >= 0.5f ? 1 : 0;
+    p.x = p.x * 2.f - x;
+    p.y = p.y * 2.f - y;
+    return x + 2 * y;
+}
+
+DirectionTree::Node::Node()
+{
+    for (int q = 0; q < 4; ++q)
+    {
+        sum[q].store(0.f, std::memory_order_relaxed);
+        child[q] = 0;
+    }
+}
+
+DirectionTree::Node::Node( const Node &other )
+{
+    *this = other;
+}
+
+DirectionTree::Node &DirectionTree::Node::operator=( const Node &other )
+{
+    for (int q = 0; q < 4; ++q)
+    {
+        sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        child[q] = other.child[q];
+    }
+    return *this;
+}
+
+float DirectionTree::Node::total() const
+{
+    return sum[0].load(std::memory_order_relaxed) + sum[1].load(std::memory_order_relaxed) +
+           sum[2].load(std::memory_order_relaxed) + sum[3].load(std::memory_order_relaxed);
+}
+
+DirectionTree::DirectionTree()
+{
+    m_nodes.resize(1);
+}
+
+Point2 DirectionTree::toSquare( const Vector3 &w )
+{
+    const float cosTheta = clamp(w.z, -1.f, 1.f);
+    float phi = atan2f(w.y, w.x);
+    if (phi < 0.f)
+        phi += 2.f * pif();
+    return Point2(min((cosTheta + 1.f) * 0.5f, 0.99999994f),
+                  min(phi / (2.f * pif()), 0.99999994f));
+}
+
+Vector3 DirectionTree::fromSquare( const Point2 &p )
+{
+    const float cosTheta = 2.f * p.x - 1.f;
+    const float sinTheta = sqrtf(max(0.f, 1.f - cosTheta * cosTheta));
+    const float phi = 2.f * pif() * p.y;
+    return Vector3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+void DirectionTree::record( const Point2 &point, float value )
+{
+    Point2 p = point;
+    int node = 0;
+    for (;;)
+    {
+        const int q = quadrant(p);
+        atomicAdd(m_nodes[node].sum[q], value);
+        if (m_nodes[node].child[q] == 0)
+            return;
+        node = m_nodes[node].child[q];
+    }
+}
+
+float DirectionTree::total() const
+{
+    return m_nodes[0].total();
+}
+
+float DirectionTree::pdf( const Point2 &point ) const
+{
+    Point2 p = point;
+    float density = 1.f;
+    int node = 0;
+    for (;;)
+    {
+        const Node &n = m_nodes[node];
+        const float t = n.total();
+        if (t <= 0.f)
+            return density;
+
+        const int q = quadrant(p);
+        density *= 4.f * n.sum[q].load(std::memory_order_relaxed) / t;
+        if (n.child[q] == 0)
+            return density;
+        node = n.child[q];
+    }
+}
+
+// Picks the lower or upper half with probability proportional to a and b,
+// rescaling u to the chosen half
+static int pickHalf( float a, float b, float &u )
+{
+    const float p = a + b > 0.f ? a / (a + b) : 0.5f;
+    if (u < p)
+    {
+        u = min(u / p, 0.99999994f);
+        return 0;
+    }
+    u = min((u - p) / (1.f - p), 0.99999994f);
+    return 1;
+}
+
+Point2 DirectionTree::sample( Point2 u ) const
+{
+    Point2 origin(0.f, 0.f);
+    float size = 1.f;
+    int node = 0;
+    for (;;)
+    {
+        const Node &n = m_nodes[node];
+        float s[4];
+        for (int q = 0; q < 4; ++q)
+            s[q] = n.sum[q].load(std::memory_order_relaxed);
+        if (s[0] + s[1] + s[2] + s[3] <= 0.f)
+            return origin + u * size;
+
+        const int x = pickHalf(s[0] + s[2], s[1] + s[3], u.x);
+        const int y = pickHalf(s[x], s[x + 2], u.y);
+        const int q = x + 2 * y;
+
+        size *= 0.5f;
+        origin += Point2(float(x), float(y)) * size;
+        if (n.child[q] == 0)
+            return origin + u * size;
+        node = n.child[q];
+    }
+}
+
+int DirectionTree::build( const DirectionTree &recorded, int node, float energy, float total,
+                          float threshold, int depth, int maxDepth )
+{
+    const int index = m_nodes.size();
+    m_nodes.next();
+
+    for (int q = 0; q < 4; ++q)
+    {
+        // Quadrants of a recorded leaf share its energy evenly
+        const float e = node >= 0 ? recorded.m_nodes[node].sum[q].load(std::memory_order_relaxed)
+                                  : energy * 0.25f;
+        if (e <= threshold * total || depth >= maxDepth)
+            continue;
+
+        const int recordedChild = node >= 0 && recorded.m_nodes[node].child[q] ? recorded.m_nodes[node].child[q] : -1;
+        const int c = build(recorded, recordedChild, e, total, threshold, depth + 1, maxDepth);
+        m_nodes[index].child[q] = c;
+    }
+
+    return index;
+}
+
+void DirectionTree::refine( const DirectionTree &recorded, float threshold, int maxDepth )
+{
+    m_nodes.fastClear();
+    const float total = recorded.total();
+    if (total <= 0.f)
+    {
+        m_nodes.resize(1);
+        return;
+    }
+    build(recorded, 0, total, total, threshold, 1, maxDepth);
+}
+
+GuidingField::Leaf::Leaf()
+{
+    samples.store(0, std::memory_order_relaxed);
+}
+
+GuidingField::Leaf::Leaf( const Leaf &other )
+{
+    *this = other;
+}
+
+GuidingField::Leaf &GuidingField::Leaf::operator=( const Leaf &other )
+{
+    sampling = other.sampling;
+    recording = other.recording;
+    samples.store(other.samples.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+}
+
+GuidingField::GuidingField() :
+    m_lo(Vector3::zero()),
+    m_hi(Vector3::zero()),
+    m_iterations(0),
+    m_iteration(0),
+    m_passesLeft(0)
+{ }
+
+void GuidingField::reset( const Vector3 &lo, const Vector3 &hi, int iterations )
+{
+    // A cube, so that splitting axes in turn keeps cells near cubical
+    const Vector3 center = (lo + hi) * 0.5f;
+    const float half = max((hi - lo).max(), 1e-3f) * 0.5f;
+    m_lo = center - Vector3(half, half, half);
+    m_hi = center + Vector3(half, half, half);
+
+    m_nodes.resize(1);
+    m_nodes[0].axis = -1;
+    m_nodes[0].child = 0;
+    m_leaves.resize(1);
+    m_leaves[0] = Leaf();
+
+    m_iterations = iterations;
+    m_iteration = 0;
+    m_passesLeft = 1;
+
+    MemoryTracker::global().set(MemoryTracker::GUIDING, sizeInBytes());
+}
+
+int GuidingField::leafAt( const Point3 &p ) const
+{
+    Vector3 lo = m_lo, hi = m_hi;
+    int node = 0;
+    while (m_nodes[node].axis >= 0)
+    {
+        const int axis = m_nodes[node].axis;
+        const float mid = (lo[axis] + hi[axis]) * 0.5f;
+        if (p[axis] < mid)
+        {
+            hi[axis] = mid;
+            node = m_nodes[node].child;
+        }
+        else
+        {
+            lo[axis] = mid;
+            node = m_nodes[node].child + 1;
+        }
+    }
+    return m_nodes[node].child;
+}
+
+Vector3 GuidingField::sample( const Point3 &p, const Point2 &u, float &pdf ) const
+{
+    const DirectionTree &tree = m_leaves[leafAt(p)].sampling;
+    const Point2 s = tree.sample(u);
+    pdf = tree.pdf(s) / (4.f * pif());
+    return DirectionTree::fromSquare(s);
+}
+
+float GuidingField::pdf( const Point3 &p, const Vector3 &w ) const
+{
+    return m_leaves[leafAt(p)].sampling.pdf(DirectionTree::toSquare(w)) / (4.f * pif());
+}
+
+void GuidingField::record( const Point3 &p, const Vector3 &w, float value )
+{
+    if (!(value > 0.f) || value == finf())
+        return;
+
+    Leaf &leaf = m_leaves[leafAt(p)];
+    leaf.recording.record(DirectionTree::toSquare(w), value);
+    leaf.samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GuidingField::endPass()
+{
+    if (!learning() || --m_passesLeft > 0)
+        return;
+
+    endIteration();
+    ++m_iteration;
+    m_passesLeft = 1 << m_iteration;
+}
+
+void GuidingField::split( int node, int depth, int threshold )
+{
+    if (m_nodes[node].axis >= 0)
+    {
+        const int child = m_nodes[node].child;
+        split(child, depth + 1, threshold);
+        split(child + 1, depth + 1, threshold);
+        return;
+    }
+
+    const int leaf = m_nodes[node].child;
+    if (m_leaves[leaf].samples.load(std::memory_order_relaxed) <= threshold || depth >= MAX_SPATIAL_DEPTH)
+        return;
+
+    // Each half is assumed to have received half the samples
+    m_leaves[leaf].samples.store(m_leaves[leaf].samples.load(std::memory_order_relaxed) / 2,
+                                 std::memory_order_relaxed);
+    const Leaf copy = m_leaves[leaf];
+    const int other = m_leaves.size();
+    m_leaves.append(copy);
+
+    const int child = m_nodes.size();
+    m_nodes.resize(child + 2);
+    m_nodes[child].axis = -1;
+    m_nodes[child].child = leaf;
+    m_nodes[child + 1].axis = -1;
+    m_nodes[child + 1].child = other;
+    m_nodes[node].axis = depth % 3;
+    m_nodes[node].child = child;
+
+    split(child, depth + 1, threshold);
+    split(child + 1, depth + 1, threshold);
+}
+
+void GuidingField::endIteration()
+{
+    for (int i = 0; i < m_leaves.size(); ++i)
+        if (m_leaves[i].recording.total() > 0.f)
+            m_leaves[i].sampling = m_leaves[i].recording;
+
+    split(0, 0, int(SPATIAL_SPLIT_SAMPLES * sqrtf(float(1 << m_iteration))));
+
+    for (int i = 0; i < m_leaves.size(); ++i)
+    {
+        Leaf &leaf = m_leaves[i];
+        DirectionTree refined;
+        refined.refine(leaf.recording, DIRECTIONAL_THRESHOLD, MAX_DIRECTIONAL_DEPTH);
+        leaf.recording = refined;
+        leaf.samples.store(0, std::memory_order_relaxed);
+    }
+
+    MemoryTracker::global().set(MemoryTracker::GUIDING, sizeInBytes());
+
+    printf("Path guiding: iteration %d, %d spatial leaves, %.1f MB\n",
+           m_iteration + 1, m_leaves.size(), sizeInBytes() / (1024.0 * 1024.0));
+    fflush(stdout);
+}
+
+size_t GuidingField::sizeInBytes() const
+{
+    size_t bytes = m_nodes.size() * sizeof(SpatialNode);
+    for (int i = 0; i < m_leaves.size(); ++i)
+        bytes += sizeof(Leaf) + m_leaves[i].sampling.sizeInBytes() + m_leaves[i].recording.sizeInBytes();
+    return bytes;
+}
@@ -0,0 +1,146 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <G3D/G3DAll.h>
+
+#include <atomic>
+
+/** Quadtree over the unit square onto which directions are mapped with the
+  * (area preserving) cylindrical mapping, holding the energy recorded in
+  * each quadrant of each node. Nodes are subdivided where much energy
+  * arrives, so a tree is a piecewise constant distribution over directions
+  * that can be sampled in proportion to it.
+  *
+  * Structure is only changed by refine(); record() adds to a fixed
+  * structure with atomics, so any number of threads can record at once.
+  */
+class DirectionTree
+{
+public:
+
+    DirectionTree();
+
+    /** Adds @p value to every node covering @p p; lock-free */
+    void record( const Point2 &p, float value );
+
+    /** Density at @p p with respect to area on the square */
+    float pdf( const Point2 &p ) const;
+
+    /** Maps @p u, uniform in the square, to a point distributed by pdf() */
+    Point2 sample( Point2 u ) const;
+
+    float total() const;
+
+    /** Makes this tree the structure of @p recorded refined by its energy:
+      * quadrants holding more than @p threshold of the total are
+      * subdivided, down to @p maxDepth, and the others collapse. All
+      * values start at zero.
+      */
+    void refine( const DirectionTree &recorded, float threshold, int maxDepth );
+
+    size_t sizeInBytes() const { return m_nodes.size() * sizeof(Node); }
+
+    static Point2 toSquare( const Vector3 &w );
+    static Vector3 fromSquare( const Point2 &p );
+
+private:
+
+    struct Node
+    {
+        std::atomic<float>  sum[4];     // quadrants (x, y) in order 00, 10, 01, 11
+        int                 child[4];   // node index, 0 for a leaf quadrant
+
+        Node();
+        Node( const Node &other );
+        Node &operator=( const Node &other );
+
+        float total() const;
+    };
+
+    int build( const DirectionTree &recorded, int node, float energy, float total,
+               float threshold, int depth, int maxDepth );
+
+    Array<Node> m_nodes;
+};
+
+/** Incident radiance learned online for path guiding (Müller et al.,
+  * "Practical Path Guiding for Efficient Light-Transport Simulation",
+  * 2017): a binary tree over the scene bounds whose leaves each hold a
+  * DirectionTree to sample from and one to record into.
+  *
+  * Learning runs in iterations of 1, 2, 4, ... passes. During an iteration
+  * paths record() their incident radiance from any number of threads; at
+  * the end endPass() makes what was recorded the sampling distribution,
+  * splits leaves that received many samples, and refines the recording
+  * trees. Nothing changes structure while a pass runs.
+  */
+class GuidingField
+{
+public:
+
+    GuidingField();
+
+    /** Starts learning afresh over the box (@p lo, @p hi), for
+      * @p iterations training iterations
+      */
+    void reset( const Vector3 &lo, const Vector3 &hi, int iterations );
+
+    /** Whether a learned distribution exists to sample from */
+    bool ready() const { return m_iteration > 0; }
+
+    /** Whether record() should be called this pass */
+    bool learning() const { return m_iteration < m_iterations; }
+
+    /** Samples a direction at @p p from the learned distribution, with
+      * @p u uniform in the unit square, returning its solid angle density
+      * in @p pdf
+      */
+    Vector3 sample( const Point3 &p, const Point2 &u, float &pdf ) const;
+
+    /** Solid angle density of sample() at @p p in direction @p w */
+    float pdf( const Point3 &p, const Vector3 &w ) const;
+
+    /** Records radiance @p value arriving at @p p from direction @p w,
+      * divided by the density it was sampled with; thread safe
+      */
+    void record( const Point3 &p, const Vector3 &w, float value );
+
+    /** To be called between passes, never during one */
+    void endPass();
+
+    size_t sizeInBytes() const;
+
+private:
+
+    struct Leaf
+    {
+        DirectionTree       sampling;
+        DirectionTree       recording;
+        std::atomic<int>    samples;
+
+        Leaf();
+        Leaf( const Leaf &other );
+        Leaf &operator=( const Leaf &other );
+    };
+
+    struct SpatialNode
+    {
+        int axis;       // -1 for a leaf
+        int child;      // first of two children, or the Leaf index
+    };
+
+    int leafAt( const Point3 &p ) const;
+
+    void endIteration();
+    void split( int node, int depth, int threshold );
+
+    Array<SpatialNode>  m_nodes;
+    Array<Leaf>         m_leaves;
+    Vector3             m_lo;
+    Vector3             m_hi;
+    int                 m_iterations;
+    int                 m_iteration;        // completed iterations
+    int                 m_passesLeft;       // in the current iteration
+};
+
+#endif // GUIDING_H
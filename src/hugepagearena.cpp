@@ -0,0 +1,180 @@
+#include "hugepagearena.h"
+
+#include <sys/mman.h>
+
+HugePageArena::Mode HugePageArena::s_defaultMode = HugePageArena::TRANSPARENT;
+
+void HugePageArena::setDefaultMode( Mode mode )
+{
+    s_defaultMode = mode;
+}
+
+HugePageArena::Mode HugePageArena::defaultMode()
+{
+    return s_defaultMode;
+}
+
+bool HugePageArena::parseMode( const String &name, Mode &mode )
+{
+    if (name == "off")
+        mode = OFF;
+    else if (name == "transparent" || name == "thp")
+        mode = TRANSPARENT;
+    else if (name == "explicit")
+        mode = EXPLICIT;
+    else
+        return false;
+    return true;
+}
+
+const char *HugePageArena::modeName( Mode mode )
+{
+    switch (mode)
+    {
+    case TRANSPARENT:   return "transparent";
+    case EXPLICIT:      return "explicit";
+    default:            return "off";
+    }
+}
+
+HugePageArena::HugePageArena() :
+    m_mode(s_defaultMode)
+{ }
+
+HugePageArena::~HugePageArena()
+{
+    reset();
+}
+
+void HugePageArena::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (int i = 0; i < m_blocks.size(); ++i)
+        munmap(m_blocks[i].base, m_blocks[i].size);
+    m_blocks.clear();
+
+    m_mode = s_defaultMode;
+}
+
+static size_t roundUp( size_t bytes, size_t multiple )
+{
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+bool HugePageArena::mapBlock( size_t minBytes )
+{
+    const size_t size = roundUp(max(minBytes, size_t(BLOCK_BYTES)), HUGE_PAGE_BYTES);
+
+    Block block;
+    block.base = NULL;
+    block.size = size;
+    block.used = 0;
+    block.backing = m_mode;
+
+#ifdef MAP_HUGETLB
+    if (block.backing == EXPLICIT)
+    {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            block.base = static_cast<uint8*>(p);
+        else
+            block.backing = TRANSPARENT;    // no pages reserved
+    }
+#else
+    if (block.backing == EXPLICIT)
+        block.backing = TRANSPARENT;
+#endif
+
+    if (!block.base)
+    {
+        // Over-map so the block can start on a huge page boundary, then
+        // trim the slack at both ends
+        const size_t span = size + HUGE_PAGE_BYTES;
+        void *p = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+
+        uint8 *raw = static_cast<uint8*>(p);
+        uint8 *aligned = reinterpret_cast<uint8*>(roundUp(reinterpret_cast<size_t>(raw), HUGE_PAGE_BYTES));
+        if (aligned > raw)
+            munmap(raw, aligned - raw);
+        if (raw + span > aligned + size)
+            munmap(aligned + size, (raw + span) - (aligned + size));
+        block.base = aligned;
+
+#ifdef MADV_HUGEPAGE
+        if (block.backing == TRANSPARENT && madvise(block.base, size, MADV_HUGEPAGE) != 0)
+            block.backing = OFF;    // THP disabled in this kernel
+#else
+        block.backing = OFF;
+#endif
+    }
+
+    if (block.backing != m_mode)
+    {
+        printf("Huge pages: %s unavailable, using %s\n", modeName(m_mode), modeName(block.backing));
+        fflush( stdout );
+    }
+
+    m_blocks.append(block);
+    return true;
+}
+
+void *HugePageArena::alloc( size_t bytes, size_t align )
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_blocks.size() > 0)
+    {
+        Block &block = m_blocks.last();
+        const size_t offset = roundUp(block.used, align);
+        if (offset + bytes <= block.size)
+        {
+            block.used = offset + bytes;
+            return block.base + offset;
+        }
+    }
+
+    // Blocks start huge page aligned, which covers any smaller alignment
+    alwaysAssertM(mapBlock(bytes), "HugePageArena: out of memory");
+
+    Block &block = m_blocks.last();
+    block.used = bytes;
+    return block.base;
+}
+
+size_t HugePageArena::bytesUsed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t bytes = 0;
+    for (int i = 0; i < m_blocks.size(); ++i)
+        bytes += m_blocks[i].used;
+    return bytes;
+}
+
+size_t HugePageArena::bytesMapped() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t bytes = 0;
+    for (int i = 0; i < m_blocks.size(); ++i)
+        bytes += m_blocks[i].size;
+    return bytes;
+}
+
+size_t HugePageArena::bytesHuge() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t bytes = 0;
+    for (int i = 0; i < m_blocks.size(); ++i)
+    {
+        if (m_blocks[i].backing != OFF)
+            bytes += m_blocks[i].size;
+    }
+    return bytes;
+}
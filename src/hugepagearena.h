@@ -0,0 +1,94 @@
+#ifndef HUGEPAGEARENA_H
+#define HUGEPAGEARENA_H
+
+#include <G3D/G3DAll.h>
+
+#include <mutex>
+
+/** Bump allocator for large, long-lived arrays (BVH nodes, triangle data,
+  * the emitter table, the accumulation buffer) that are read at random by
+  * every ray and therefore miss the TLB often with 4 KB pages.
+  *
+  * Memory comes in blocks that are, depending on the mode, backed by
+  * explicit 2 MB huge pages (MAP_HUGETLB, needs pages reserved in
+  * /proc/sys/vm/nr_hugepages), 2 MB aligned and advised for transparent huge
+  * pages (MADV_HUGEPAGE), or plain pages. A mode that cannot be had falls
+  * back to the next one down.
+  *
+  * Allocations are never freed individually; reset() releases everything.
+  */
+class HugePageArena
+{
+public:
+
+    enum Mode { OFF, TRANSPARENT, EXPLICIT };
+
+    enum { HUGE_PAGE_BYTES = 2 << 20, BLOCK_BYTES = 64 << 20 };
+
+    /** Mode of newly constructed or reset arenas, e.g. from --hugepages */
+    static void setDefaultMode( Mode mode );
+    static Mode defaultMode();
+
+    /** "off", "transparent" (or "thp") and "explicit" */
+    static bool parseMode( const String &name, Mode &mode );
+    static const char *modeName( Mode mode );
+
+    HugePageArena();
+    ~HugePageArena();
+
+    HugePageArena( const HugePageArena & ) = delete;
+    HugePageArena &operator=( const HugePageArena & ) = delete;
+
+    /** Releases every allocation and switches to the default mode */
+    void reset();
+
+    /** Uninitialized, @p align aligned memory. Safe to call from any thread. */
+    void *alloc( size_t bytes, size_t align = 64 );
+
+    template <class T>
+    T *alloc( size_t count )
+    {
+        return static_cast<T*>(alloc(count * sizeof(T), max(size_t(64), alignof(T))));
+    }
+
+    /** Copy of @p count elements of plain data at @p src */
+    template <class T>
+    T *copy( const T *src, size_t count )
+    {
+        T *dst = alloc<T>(count);
+        if (count > 0)
+            memcpy(dst, src, count * sizeof(T));
+        return dst;
+    }
+
+    Mode mode() const { return m_mode; }
+
+    /** Bytes handed out by alloc() */
+    size_t bytesUsed() const;
+
+    /** Bytes mapped, and how many of them are backed (or, for transparent
+      * huge pages, advised to be backed) by huge pages
+      */
+    size_t bytesMapped() const;
+    size_t bytesHuge() const;
+
+private:
+
+    struct Block
+    {
+        uint8 * base;
+        size_t  size;
+        size_t  used;
+        Mode    backing;    // what the block actually got
+    };
+
+    bool mapBlock( size_t minBytes );
+
+    Array<Block>        m_blocks;
+    Mode                m_mode;
+    mutable std::mutex  m_mutex;
+
+    static Mode         s_defaultMode;
+};
+
+#endif // HUGEPAGEARENA_H
@@ -0,0 +1,67 @@
+#include "instance.h"
+
+#include <algorithm>
+
+void InstanceBVH::build( const Array<Instance> &instances )
+{
+    clear();
+
+    m_order.resize(instances.size());
+    for (int i = 0; i < instances.size(); ++i)
+        m_order[i] = i;
+
+    if (instances.size() > 0)
+    {
+        m_nodes.reserve(2 * instances.size());
+        m_nodes.resize(1);
+        buildNode(0, instances, 0, instances.size(), 0);
+    }
+}
+
+void InstanceBVH::buildNode( int index, const Array<Instance> &instances, int begin, int end, int depth )
+{
+    Vector3 lo = Vector3::inf(), hi = -Vector3::inf();
+    Vector3 clo = Vector3::inf(), chi = -Vector3::inf();
+    for (int i = begin; i < end; ++i)
+    {
+        const Instance &inst = instances[m_order[i]];
+        lo = lo.min(inst.lo);
+        hi = hi.max(inst.hi);
+        Vector3 c = (inst.lo + inst.hi) * 0.5f;
+        clo = clo.min(c);
+        chi = chi.max(c);
+    }
+
+    {
+        BVHNode &node = m_nodes[index];
+        node.lo = lo;
+        node.hi = hi;
+        node.offset = begin;
+        node.count = end - begin;
+    }
+
+    // Instance counts are small next to triangle counts; a median split on
+    // the widest centroid axis is good enough at this level
+    if (end - begin == 1 || depth >= 60)
+        return;
+
+    const Vector3 extent = chi - clo;
+    const int axis = extent.primaryAxis();
+    const int mid = (begin + end) / 2;
+
+    std::nth_element(m_order.getCArray() + begin,
+                     m_order.getCArray() + mid,
+                     m_order.getCArray() + end,
+                     [&](int a, int b) {
+                         return instances[a].lo[axis] + instances[a].hi[axis]
+                              < instances[b].lo[axis] + instances[b].hi[axis];
+                     });
+
+    const int first = m_nodes.size();
+    m_nodes.resize(first + 2);
+    m_nodes[index].offset = first;
+    m_nodes[index].count = 0;
+
+    buildNode(first, instances, begin, mid, depth + 1);
+    buildNode(first + 1, instances, mid, end, depth + 1);
+}
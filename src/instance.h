@@ -0,0 +1,130 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <G3D/G3DAll.h>
+
+#include "bvh.h"
+#include "compressedgeometry.h"
+
+/** The geometry of one unique model, in object space, with its own
+  * bottom-level BVH. Shared by every Instance that places the model.
+  */
+struct InstancedMesh
+{
+    String          name;
+    CPUVertexArray  verts;
+    Array<Tri>      tris;
+    BVH             bvh;
+    CompressedGeometry geometry;    // replaces verts and tris in compressed scenes
+    Array<int>      emitters;   // indices of light-emitting triangles in tris
+    Array<uint16>   materials;  // MaterialTable ids of tris, or of geometry's materials
+    Vector3         lo, hi;     // object space bounds
+
+    size_t sizeInBytes() const
+    {
+        return verts.size() * sizeof(CPUVertexArray::Vertex)
+             + tris.size() * sizeof(Tri)
+             + bvh.sizeInBytes()
+             + geometry.sizeInBytes()
+             + materials.size() * sizeof(uint16);
+    }
+};
+
+/** A placement of an InstancedMesh in the world. Frames are rigid, so distances
+  * along a ray are the same in world and object space.
+  */
+struct Instance
+{
+    int     mesh;       // index of the InstancedMesh
+    CFrame  frame;      // object to world
+    Vector3 lo, hi;     // world space bounds
+};
+
+/** Top-level hierarchy over instance bounds. Leaves hold single instances;
+  * traverse() hands each instance whose box the ray enters to a callback
+  * that intersects its mesh's bottom-level BVH.
+  */
+class InstanceBVH
+{
+public:
+
+    void build( const Array<Instance> &instances );
+
+    void clear() { m_nodes.clear(); m_order.clear(); }
+
+    size_t sizeInBytes() const
+    {
+        return m_nodes.size() * sizeof(BVHNode) + m_order.size() * sizeof(int);
+    }
+
+    /** Calls @p visit(instanceIndex, tMax) for every instance whose bounds
+      * @p ray enters before @p tMax. The callback returns true, and lowers
+      * tMax, when it finds a closer hit; returning true with @p anyHit set
+      * stops the traversal.
+      */
+    template <class Visitor>
+    bool traverse( const Ray &ray, float &tMax, bool anyHit, Visitor visit ) const
+    {
+        if (m_nodes.size() == 0)
+            return false;
+
+        const Vector3 origin = ray.origin();
+        const Vector3 dir = ray.direction();
+        const Vector3 invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+
+        bool found = false;
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        while (sp > 0)
+        {
+            const BVHNode &node = m_nodes[stack[--sp]];
+            if (!overlaps(node, origin, invDir, ray.minDistance(), tMax))
+                continue;
+
+            if (node.isLeaf())
+            {
+                for (int i = 0; i < node.count; ++i)
+                {
+                    if (visit(m_order[node.offset + i], tMax))
+                    {
+                        found = true;
+                        if (anyHit)
+                            return true;
+                    }
+                }
+            }
+            else
+            {
+                stack[sp++] = node.offset + 1;
+                stack[sp++] = node.offset;
+            }
+        }
+
+        return found;
+    }
+
+private:
+
+    void buildNode( int index, const Array<Instance> &instances, int begin, int end, int depth );
+
+    static bool overlaps( const BVHNode &node, const Vector3 &origin, const Vector3 &invDir,
+                          float tMin, float tMax )
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float t0 = (node.lo[a] - origin[a]) * invDir[a];
+            float t1 = (node.hi[a] - origin[a]) * invDir[a];
+            if (t0 > t1) std::swap(t0, t1);
+            tMin = max(tMin, t0);
+            tMax = min(tMax, t1);
+        }
+        return tMin <= tMax;
+    }
+
+    Array<BVHNode>  m_nodes;
+    Array<int>      m_order;    // instance index per leaf
+};
+
+#endif // INSTANCE_H
@@ -1,5 +1,7 @@
 #include <G3D/G3DAll.h>
 #include "app.h"
+#include "hugepagearena.h"
+#include "memorytracker.h"
 
 #ifndef G3D_PATH
 #define G3D_PATH "/contrib/projects/g3d10/G3D10"
@@ -30,14 +32,54 @@ int main(int argc, const char *argv[])
 //    s.window.height = 188;
 //    s.window.width = 300;
 
-    App app(s);
+    // Parse Arguments
+    //   path [scene directory] [--hugepages=off|transparent|explicit]
+    //        [--benchmark <scene.Any>] [--passes=<n>]
+    //        [--benchmark-medium <scene.Any>] [--benchmark-out-of-core <scene.Any>]
+    //        [--memory-budget=<MB>] [--memory-report]
+    const char *scenePath = NULL;
+    const char *benchmarkScene = NULL;
+    int benchmarkPasses = 4;
+    Benchmark::Mode benchmarkMode = Benchmark::HUGE_PAGES;
+    bool memoryReport = false;
+    for (int i = 1; i < argc; ++i) {
+        String arg = argv[i];
+        if (beginsWith(arg, "--hugepages=")) {
+            HugePageArena::Mode mode;
+            if (HugePageArena::parseMode(arg.substr(12), mode)) {
+                HugePageArena::setDefaultMode(mode);
+            } else {
+                std::cerr << "Unknown huge page mode: " << arg.substr(12) << std::endl;
+                return 1;
+            }
+        } else if (arg == "--benchmark" && i + 1 < argc) {
+            benchmarkScene = argv[++i];
+        } else if (arg == "--benchmark-medium" && i + 1 < argc) {
+            benchmarkScene = argv[++i];
+            benchmarkMode = Benchmark::MEDIUM;
+        } else if (arg == "--benchmark-out-of-core" && i + 1 < argc) {
+            benchmarkScene = argv[++i];
+            benchmarkMode = Benchmark::OUT_OF_CORE;
+        } else if (beginsWith(arg, "--passes=")) {
+            benchmarkPasses = max(1, atoi(arg.substr(9).c_str()));
+        } else if (beginsWith(arg, "--memory-budget=")) {
+            MemoryTracker::global().setBudget(size_t(atof(arg.substr(16).c_str()) * 1024.0 * 1024.0));
+        } else if (arg == "--memory-report") {
+            memoryReport = true;
+        } else {
+            scenePath = argv[i];
+        }
+    }
 
+    App app(s);
 
-    // Parse Arguments
-    if (argc > 1) {
-        const char *scenePath = argv[1];
+    if (scenePath) {
         app.setScenePath(scenePath);
     }
+    if (benchmarkScene) {
+        app.setBenchmark(benchmarkScene, benchmarkPasses, benchmarkMode);
+    }
+    app.memoryReport = memoryReport;
 
     return app.run();
 }
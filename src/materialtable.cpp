@@ -0,0 +1,316 @@
+#include "materialtable.h"
+#include "texturecache.h"
+
+// Direction around @p n whose cosine to it is @p cosTheta
+static Vector3 aroundNormal( const Vector3 &n, float cosTheta, float phi )
+{
+    Vector3 t, b;
+    n.getTangents(t, b);
+    const float sinTheta = sqrtf(max(0.f, 1.f - cosTheta * cosTheta));
+    return t * (sinTheta * cosf(phi)) + b * (sinTheta * sinf(phi)) + n * cosTheta;
+}
+
+static Vector3 reflect( const Vector3 &wo, const Vector3 &n )
+{
+    return n * (2.f * wo.dot(n)) - wo;
+}
+
+// Refraction of the ray arriving against @p wo; false on total internal reflection
+static bool refract( const Vector3 &wo, const Vector3 &n, float eta, Vector3 &wi )
+{
+    const float cosI = wo.dot(n);
+    const float k = 1.f - eta * eta * (1.f - cosI * cosI);
+    if (k < 0.f)
+        return false;
+    wi = (-wo * eta + n * (eta * cosI - sqrtf(k))).direction();
+    return true;
+}
+
+MaterialTable::MaterialTable()
+{
+    clear();
+}
+
+void MaterialTable::clear()
+{
+    m_params.clear();
+    m_sources.clear();
+    m_ids.clear();
+
+    MaterialParams &p = m_params.next();
+    p.lambertian = Color3(0.5f);
+    p.glossy = Color3::zero();
+    p.smoothness = 0.f;
+    p.transmissive = Color3::zero();
+    p.etaReflect = 1.f;
+    p.etaTransmit = 1.f;
+    p.emissive = Radiance3::zero();
+    p.lambertianMap = p.glossyMap = p.transmissiveMap = p.emissiveMap = -1;
+    p.textured = false;
+    m_sources.append(shared_ptr<UniversalMaterial>());
+}
+
+static int addMap( const shared_ptr<Texture> &texture, TextureCache *cache, MapEncoding &encoding )
+{
+    if (!texture || !cache)
+        return -1;
+    encoding.scale = texture->encoding().readMultiplyFirst;
+    encoding.bias = texture->encoding().readAddSecond;
+    return cache->add(texture->name());
+}
+
+int MaterialTable::add( const shared_ptr<Material> &material, TextureCache *cache )
+{
+    if (!material)
+        return 0;
+    if (const int *id = m_ids.getPointer(material.get()))
+        return *id;
+
+    shared_ptr<UniversalMaterial> m = dynamic_pointer_cast<UniversalMaterial>(material);
+    if (!m)
+    {
+        m_ids.set(material.get(), 0);
+        return 0;
+    }
+
+    const shared_ptr<UniversalBSDF> &bsdf = m->bsdf();
+    MaterialParams p;
+    p.lambertian = bsdf->lambertian().mean().rgb();
+    const Color4 glossy = bsdf->glossy().mean();
+    p.glossy = glossy.rgb();
+    p.smoothness = glossy.a;
+    p.transmissive = bsdf->transmissive().mean();
+    p.etaReflect = bsdf->etaReflect();
+    p.etaTransmit = bsdf->etaTransmit();
+    p.emissive = m->emissive().mean();
+
+    p.lambertianMap = addMap(bsdf->lambertian().texture(), cache, p.lambertianEncoding);
+    p.glossyMap = addMap(bsdf->glossy().texture(), cache, p.glossyEncoding);
+    p.transmissiveMap = addMap(bsdf->transmissive().texture(), cache, p.transmissiveEncoding);
+    p.emissiveMap = addMap(m->emissive().texture(), cache, p.emissiveEncoding);
+
+    if (cache)
+    {
+        // Textures the cache cannot read fall back to their means
+        p.textured = p.lambertianMap >= 0 || p.glossyMap >= 0 ||
+                     p.transmissiveMap >= 0 || p.emissiveMap >= 0;
+    }
+    else
+    {
+        p.textured = bsdf->lambertian().texture() || bsdf->glossy().texture() ||
+                     bsdf->transmissive().texture() || m->emissive().texture();
+        if (p.textured)
+            m->setStorage(COPY_TO_CPU);
+    }
+
+    const int id = m_params.size();
+    m_params.append(p);
+    m_sources.append(m);
+    m_ids.set(material.get(), id);
+    return id;
+}
+
+int MaterialTable::find( const Material *material ) const
+{
+    const int *id = m_ids.getPointer(material);
+    return id ? *id : 0;
+}
+
+void MaterialTable::evaluate( ShadingPoint &sp, TextureCache *cache, float width ) const
+{
+    const MaterialParams &p = m_params[sp.material];
+    sp.lambertian = p.lambertian;
+    sp.glossy = p.glossy;
+    sp.smoothness = p.smoothness;
+    sp.transmissive = p.transmissive;
+    sp.emission = p.emissive;
+
+    if (!p.textured)
+        return;
+
+    if (cache)
+    {
+        // Raw texels, scaled by the factor G3D would apply on read
+        Color4 c;
+        if (p.lambertianMap >= 0 && cache->sample(p.lambertianMap, sp.texCoord, width, c))
+            sp.lambertian = p.lambertianEncoding.apply(c).rgb();
+        if (p.glossyMap >= 0 && cache->sample(p.glossyMap, sp.texCoord, width, c))
+        {
+            const Color4 g = p.glossyEncoding.apply(c);
+            sp.glossy = g.rgb();
+            sp.smoothness = g.a;
+        }
+        if (p.transmissiveMap >= 0 && cache->sample(p.transmissiveMap, sp.texCoord, width, c))
+            sp.transmissive = p.transmissiveEncoding.apply(c).rgb();
+        if (p.emissiveMap >= 0 && cache->sample(p.emissiveMap, sp.texCoord, width, c))
+            sp.emission = p.emissiveEncoding.apply(c).rgb();
+        return;
+    }
+
+    // CPU copies of the textures, at full resolution
+    const UniversalMaterial &m = *m_sources[sp.material];
+    const UniversalBSDF &bsdf = *m.bsdf();
+    if (bsdf.lambertian().texture())
+        sp.lambertian = bsdf.lambertian().sample(sp.texCoord).rgb();
+    if (bsdf.glossy().texture())
+    {
+        const Color4 g = bsdf.glossy().sample(sp.texCoord);
+        sp.glossy = g.rgb();
+        sp.smoothness = g.a;
+    }
+    if (bsdf.transmissive().texture())
+        sp.transmissive = bsdf.transmissive().sample(sp.texCoord);
+    if (m.emissive().texture())
+        sp.emission = m.emissive().sample(sp.texCoord);
+}
+
+size_t MaterialTable::sizeInBytes() const
+{
+    return m_params.size() * (sizeof(MaterialParams) + sizeof(shared_ptr<UniversalMaterial>));
+}
+
+float BSDF::glossyExponent( float smoothness )
+{
+    const float alpha = max(square(1.f - smoothness), 1e-3f);
+    return 2.f / (alpha * alpha) - 2.f;
+}
+
+Color3 BSDF::evaluate( const ShadingPoint &sp, const Vector3 &wi, const Vector3 &wo )
+{
+    const Vector3 &n = sp.shadingNormal;
+    const float cosI = wi.dot(n), cosO = wo.dot(n);
+    if (cosI <= 0.f || cosO <= 0.f)
+        return Color3::zero();
+
+    Color3 f = sp.lambertian / pif();
+
+    if (!isMirror(sp) && sp.glossy.nonZero())
+    {
+        const Vector3 h = (wi + wo).direction();
+        const float e = glossyExponent(sp.smoothness);
+        f += schlick(sp.glossy, h.dot(wo)) * ((e + 8.f) / (8.f * pif()) * powf(max(h.dot(n), 0.f), e));
+    }
+
+    return f;
+}
+
+bool BSDF::scatter( const ShadingPoint &sp, const Vector3 &wo, float uLobe, const Point2 &uDir,
+                    Color3 &weight, Vector3 &wi, bool &impulse )
+{
+    const Vector3 &n = sp.shadingNormal;
+    const float cosO = max(wo.dot(n), 0.f);
+    const Color3 F = sp.glossy.nonZero() ? schlick(sp.glossy, cosO) : Color3::zero();
+
+    // Lobe probabilities in proportion to reflectance; what is left over
+    // is absorbed
+    const float pd = sp.lambertian.average();
+    const float pg = F.average();
+    const float pt = sp.transmissive.average();
+    const float scale = 1.f / max(1.f, pd + pg + pt);
+
+    weight = Color3::zero();
+    impulse = false;
+
+    float u = uLobe;
+    if (u < pd * scale)
+    {
+        wi = aroundNormal(n, sqrtf(uDir.x), 2.f * pif() * uDir.y);
+        weight = sp.lambertian / (pd * scale);
+        return true;
+    }
+    u -= pd * scale;
+
+    if (u < pg * scale)
+    {
+        if (isMirror(sp))
+        {
+            wi = reflect(wo, n);
+            weight = F / (pg * scale);
+            impulse = true;
+            return true;
+        }
+
+        // Half vector from the Blinn-Phong distribution
+        const float e = glossyExponent(sp.smoothness);
+        const Vector3 h = aroundNormal(n, powf(uDir.x, 1.f / (e + 1.f)),
+                                       2.f * pif() * uDir.y);
+        const float hDotO = wo.dot(h);
+        wi = reflect(wo, h);
+        const float cosI = wi.dot(n);
+        if (cosI <= 0.f || hDotO <= 0.f)
+            return false;
+
+        const float d = powf(max(h.dot(n), 0.f), e);
+        const float pdf = (e + 1.f) / (2.f * pif()) * d / (4.f * hDotO);
+        const Color3 f = schlick(sp.glossy, hDotO) * ((e + 8.f) / (8.f * pif()) * d);
+        weight = f * (cosI / (pdf * pg * scale));
+        return true;
+    }
+    u -= pg * scale;
+
+    if (u < pt * scale)
+    {
+        if (!refract(wo, n, sp.etaRatio, wi))
+            wi = reflect(wo, n);
+        weight = sp.transmissive / (pt * scale);
+        impulse = true;
+        return true;
+    }
+
+    return false;
+}
+
+float BSDF::pdf( const ShadingPoint &sp, const Vector3 &wi, const Vector3 &wo )
+{
+    const Vector3 &n = sp.shadingNormal;
+    const float cosI = wi.dot(n);
+    if (cosI <= 0.f)
+        return 0.f;
+
+    // Same lobe probabilities as scatter()
+    const float cosO = max(wo.dot(n), 0.f);
+    const Color3 F = sp.glossy.nonZero() ? schlick(sp.glossy, cosO) : Color3::zero();
+    const float pd = sp.lambertian.average();
+    const float pg = F.average();
+    const float pt = sp.transmissive.average();
+    const float scale = 1.f / max(1.f, pd + pg + pt);
+
+    float p = pd * scale * cosI / pif();
+
+    if (!isMirror(sp) && pg > 0.f)
+    {
+        const Vector3 h = (wi + wo).direction();
+        const float hDotO = wo.dot(h);
+        if (hDotO > 0.f)
+        {
+            const float e = glossyExponent(sp.smoothness);
+            const float d = powf(max(h.dot(n), 0.f), e);
+            p += pg * scale * (e + 1.f) / (2.f * pif()) * d / (4.f * hDotO);
+        }
+    }
+
+    return p;
+}
+
+int BSDF::impulses( const ShadingPoint &sp, const Vector3 &wo, Vector3 wi[2], Color3 weight[2] )
+{
+    const Vector3 &n = sp.shadingNormal;
+    int count = 0;
+
+    if (isMirror(sp) && sp.glossy.nonZero())
+    {
+        wi[count] = reflect(wo, n);
+        weight[count] = schlick(sp.glossy, max(wo.dot(n), 0.f));
+        ++count;
+    }
+
+    if (sp.transmissive.nonZero())
+    {
+        if (!refract(wo, n, sp.etaRatio, wi[count]))
+            wi[count] = reflect(wo, n);
+        weight[count] = sp.transmissive;
+        ++count;
+    }
+
+    return count;
+}
@@ -0,0 +1,171 @@
+#ifndef MATERIALTABLE_H
+#define MATERIALTABLE_H
+
+#include <G3D/G3DAll.h>
+
+class TextureCache;
+
+/** How a texture's stored texels map to the values it represents: G3D
+  * applies this on every read, and a component's constant factor is the
+  * scale. The TextureCache stores raw texels, so lookups through it apply
+  * it themselves.
+  */
+struct MapEncoding
+{
+    Color4      scale;
+    Color4      bias;
+
+    MapEncoding() : scale(Color4::one()), bias(Color4::zero()) { }
+
+    Color4 apply( const Color4 &texel ) const { return texel * scale + bias; }
+};
+
+/** BSDF parameters of one material in plain data: the constant (mean)
+  * terms of a UniversalMaterial, and for textured terms where to look the
+  * texture up.
+  */
+struct MaterialParams
+{
+    Color3      lambertian;
+    Color3      glossy;         // Fresnel reflectance at normal incidence
+    float       smoothness;     // 1 is a mirror
+    Color3      transmissive;
+    float       etaReflect;     // index of refraction outside the surface
+    float       etaTransmit;    // and inside
+    Radiance3   emissive;
+
+    // TextureCache ids when the scene uses the cache, -1 otherwise
+    int         lambertianMap;
+    int         glossyMap;
+    int         transmissiveMap;
+    int         emissiveMap;
+    MapEncoding lambertianEncoding;
+    MapEncoding glossyEncoding;
+    MapEncoding transmissiveEncoding;
+    MapEncoding emissiveEncoding;
+
+    bool        textured;       // some term varies over the surface
+};
+
+/** A shading point with its material evaluated, in world space. Plain data
+  * replacement for G3D's UniversalSurfel.
+  */
+struct ShadingPoint
+{
+    Point3      position;
+    Vector3     geometricNormal;    // both normals face the incoming ray's side
+    Vector3     shadingNormal;
+    Point2      texCoord;
+    int         material;           // MaterialTable id
+    float       area;               // of the hit triangle
+    bool        backface;           // hit from behind its winding
+
+    Color3      lambertian;
+    Color3      glossy;
+    float       smoothness;
+    Color3      transmissive;
+    float       etaRatio;           // eta on the incoming side over the far side
+    Radiance3   emission;
+};
+
+/** The scene's materials compiled into a table of MaterialParams, indexed
+  * by the material id that each triangle records. Id 0 is a grey default
+  * for materials that are not UniversalMaterials.
+  */
+class MaterialTable
+{
+public:
+
+    MaterialTable();
+
+    /** Compiles @p material and returns its id; adding it again returns the
+      * same id. With a @p cache its textures are registered there; otherwise
+      * they are kept in CPU memory for lookups, which needs the GL thread.
+      */
+    int add( const shared_ptr<Material> &material, TextureCache *cache );
+
+    /** Id of a material passed to add(), 0 if there was none */
+    int find( const Material *material ) const;
+
+    const MaterialParams &operator[]( int id ) const { return m_params[id]; }
+
+    int size() const { return m_params.size(); }
+
+    /** Fills the material terms of @p sp from material sp.material at
+      * sp.texCoord; @p width is the footprint in texture coordinates when
+      * reading from @p cache.
+      */
+    void evaluate( ShadingPoint &sp, TextureCache *cache, float width ) const;
+
+    void clear();
+
+    size_t sizeInBytes() const;
+
+private:
+
+    Array<MaterialParams>                   m_params;
+    Array<shared_ptr<UniversalMaterial>>    m_sources;  // for textured terms without a cache
+    Table<const Material*, int>             m_ids;
+};
+
+/** Non-virtual sampling and evaluation of the BSDF described by a
+  * ShadingPoint: a Lambertian lobe, a normalized Blinn-Phong glossy lobe
+  * (a mirror impulse at smoothness 1) with Schlick Fresnel, and an impulse
+  * for specular transmission. Directions point away from the surface.
+  */
+class BSDF
+{
+public:
+
+    /** The finite (non-impulse) part of the BSDF for light arriving from
+      * @p wi and leaving toward @p wo
+      */
+    static Color3 evaluate( const ShadingPoint &sp, const Vector3 &wi, const Vector3 &wo );
+
+    /** Samples an incoming direction @p wi for light leaving toward @p wo,
+      * picking a lobe in proportion to its reflectance with @p uLobe and
+      * the direction within it with @p uDir (uniform in [0, 1)). @p weight is the
+      * BSDF times the cosine over the probability density of @p wi; false
+      * (and black) when the path is absorbed. @p impulse is set for
+      * mirror and refraction directions.
+      */
+    static bool scatter( const ShadingPoint &sp, const Vector3 &wo, float uLobe, const Point2 &uDir,
+                         Color3 &weight, Vector3 &wi, bool &impulse );
+
+    /** Solid angle density with which scatter() picks @p wi for @p wo,
+      * excluding impulses
+      */
+    static float pdf( const ShadingPoint &sp, const Vector3 &wi, const Vector3 &wo );
+
+    /** Whether scatter() can return an impulse */
+    static bool hasImpulses( const ShadingPoint &sp )
+    {
+        return sp.transmissive.nonZero() || (isMirror(sp) && sp.glossy.nonZero());
+    }
+
+    /** Mirror and refraction directions toward @p wo with their weights;
+      * returns how many were written to @p wi and @p weight (at most 2)
+      */
+    static int impulses( const ShadingPoint &sp, const Vector3 &wo, Vector3 wi[2], Color3 weight[2] );
+
+    /** Light emitted toward @p wo */
+    static Radiance3 emitted( const ShadingPoint &sp, const Vector3 &wo )
+    {
+        (void)wo;
+        return sp.emission;
+    }
+
+    /** Blinn-Phong exponent matching @p smoothness */
+    static float glossyExponent( float smoothness );
+
+    /** Schlick's approximation for reflectance @p F0 at normal incidence */
+    static Color3 schlick( const Color3 &F0, float cosTheta )
+    {
+        const float m = pow5(clamp(1.f - cosTheta, 0.f, 1.f));
+        return F0 + (Color3::one() - F0) * m;
+    }
+
+    static bool isMirror( const ShadingPoint &sp ) { return sp.smoothness >= 0.999f; }
+};
+
+#endif // MATERIALTABLE_H
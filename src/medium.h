@@ -3,18 +3,27 @@
 
 #include <G3D/G3DAll.h>
 
+/** The participating medium filling the space between surfaces. Light
+  * travelling a distance d through it is attenuated by the transmittance
+  * exp(-tau d) per channel, where tau is the extinction coefficient
+  * "attenuation"; a fraction "albedo" of what is taken out is scattered,
+  * equally in every direction, and "emission" is radiance added per unit
+  * of distance.
+  */
 struct Medium
 {
 
-    float stepsize;
-    Radiance3 attenuation;
+    float stepsize;         // of ray marching, which the closed forms below replace
+    Radiance3 attenuation;  // extinction coefficient per unit distance
     Radiance3 emission;
+    Color3 albedo;          // scattered fraction of the extinction
 
     virtual void init()
     {
         stepsize = 0.01f;
         attenuation = Radiance3::zero();
         emission = Radiance3::zero();
+        albedo = Color3::zero();
     }
 
     virtual void init( const Any &any )
@@ -26,6 +35,8 @@ struct Medium
             attenuation = any["attenuation"];
         if ( any.containsKey("emission") )
             emission = any["emission"];
+        if ( any.containsKey("albedo") )
+            albedo = any["albedo"];
     }
 
     float fixStepSize( float distance, float step ) const
@@ -33,14 +44,33 @@ struct Medium
         return distance/max(1.f,round(distance/step));
     }
 
+    /** Transmittance along @p ray over [0, @p distance]; @p distance may
+      * be infinite
+      */
     virtual Radiance3 estimateAttenuation( const Ray&, float distance ) const = 0;
+
+    /** Emission along @p ray over [0, @p distance] reaching its origin */
     virtual Radiance3 estimateAddedRadiance( const Ray&, float distance ) const = 0;
 
+    /** Draws where along @p ray, up to the surface at @p distance, it next
+      * interacts with the medium. @p u picks the distance and @p uChannel
+      * the color channel whose extinction it is drawn from. Returns true
+      * with @p t set if it scatters first; either way @p weight is the
+      * transmittance up to that point, times the scattering coefficient
+      * for a scattering, over the density of the outcome.
+      */
+    virtual bool sampleDistance( const Ray&, float distance, float u, float uChannel,
+                                 float &t, Color3 &weight ) const = 0;
+
+    /** Extinction coefficient at @p p */
+    virtual Radiance3 extinction( const Point3 &p ) const = 0;
+
     static shared_ptr<Medium> create( const Any &any );
 
     virtual bool isVacuum() const = 0;
     virtual bool attenuates() const = 0;
     virtual bool emissive() const = 0;
+    virtual bool scatters() const { return attenuates() && albedo.nonZero(); }
 
 
     static Radiance3 exp( float d, const Radiance3 &tau )
@@ -50,8 +80,28 @@ struct Medium
                           ::exp(-d*tau.b) );
     }
 
+    /** exp(-tau) per channel for optical depth @p tau, which may be
+      * infinite; a channel with no extinction stays 1
+      */
+    static Radiance3 transmittance( const Radiance3 &tau )
+    {
+        return Radiance3( tau.r > 0.f ? ::exp(-tau.r) : 1.f,
+                          tau.g > 0.f ? ::exp(-tau.g) : 1.f,
+                          tau.b > 0.f ? ::exp(-tau.b) : 1.f );
+    }
+
+    /** Channel picked by @p u in [0, 1) */
+    static int channel( float u )
+    {
+        return min(int(u * 3.f), 2);
+    }
+
 };
 
+/** A medium of the same density everywhere. Transmittance is exp(-tau d)
+  * and free-flight distances are drawn from it exactly, so fog costs the
+  * same however thin or large it is.
+  */
 struct HomogeneousMedium : public Medium
 {
 
@@ -64,25 +114,71 @@ struct HomogeneousMedium : public Medium
         init( any );
     }
 
-    // TODO: Implement functions below for homogeneous media
+    virtual Radiance3 extinction( const Point3& ) const
+    {
+        return attenuation;
+    }
+
     virtual Radiance3 estimateAttenuation( const Ray&,
                                            float distance ) const
     {
-        return Radiance3::black();
+        return transmittance( attenuation * distance );
     }
 
     virtual Radiance3 estimateAddedRadiance( const Ray&,
                                              float distance ) const
     {
-        return Radiance3::black();
+        // Integral of emission exp(-tau s) over [0, d]; a channel without
+        // extinction adds emission d, or nothing along rays that leave
+        // the scene
+        Radiance3 added;
+        for (int c = 0; c < 3; ++c) {
+            const float tau = attenuation[c];
+            if (tau > 0.f)
+                added[c] = emission[c] * -::expm1(-tau * distance) / tau;
+            else
+                added[c] = distance < finf() ? emission[c] * distance : 0.f;
+        }
+        return added;
     }
 
-    virtual bool isVacuum() const { return false; }
-    virtual bool attenuates() const { return false; }
-    virtual bool emissive() const { return false; }
+    virtual bool sampleDistance( const Ray&, float distance, float u, float uChannel,
+                                 float &t, Color3 &weight ) const
+    {
+        // Exponential in the extinction of one channel, picked uniformly;
+        // the density is the average over the channels
+        const float tau = attenuation[channel(uChannel)];
+        t = tau > 0.f ? -::log1p(-u) / tau : finf();
+
+        if (t < distance) {
+            const Radiance3 tr = transmittance( attenuation * t );
+            const float pdf = (attenuation * tr).average();
+            weight = pdf > 0.f ? attenuation * albedo * tr / pdf : Color3::zero();
+            return true;
+        }
+
+        const Radiance3 tr = transmittance( attenuation * distance );
+        const float pdf = tr.average();
+        weight = pdf > 0.f ? tr / pdf : Color3::zero();
+        return false;
+    }
+
+    virtual bool isVacuum() const { return !attenuates() && !emissive(); }
+    virtual bool attenuates() const { return attenuation.nonZero(); }
+    virtual bool emissive() const { return emission.nonZero(); }
 
 };
 
+/** Height fog: the extinction is "attenuation" times density exp(-decay y),
+  * thinning out upward from y = 0 ("attenuation" defaults to white here,
+  * so it only colors the fog). Emission scales with the density too.
+  *
+  * Along a ray the density is an exponential in the distance, so the
+  * optical depth, the transmittance and the emission all have closed forms,
+  * and the optical depth can be inverted to draw free-flight distances
+  * exactly. "stepscale" only scales the step of the ray marched reference
+  * in Benchmark::runMedium().
+  */
 struct ExponentialDensityMedium : public Medium
 {
 
@@ -93,6 +189,7 @@ struct ExponentialDensityMedium : public Medium
     virtual void init()
     {
         Medium::init();
+        attenuation = Radiance3::one();
         density = 0.f;
         decay = 0.f;
         stepscale = 1.f;
@@ -118,27 +215,99 @@ struct ExponentialDensityMedium : public Medium
         init(any);
     }
 
-    // TODO: Implement functions below for exponential media
+    virtual Radiance3 extinction( const Point3 &p ) const
+    {
+        return attenuation * (density * ::exp(-decay * p.y));
+    }
+
+    /** Integral of the density along @p ray over [0, @p distance], which
+      * may be infinite
+      */
+    float opticalDepth( const Ray &ray, float distance ) const
+    {
+        const float rho0 = density * ::exp(-decay * ray.origin().y);
+        if (rho0 <= 0.f)
+            return 0.f;
+
+        // rho0 exp(-b s) integrates to rho0 (1 - exp(-b d)) / b
+        const float b = decay * ray.direction().y;
+        if (distance == finf())
+            return b > 0.f ? rho0 / b : finf();
+
+        const float x = b * distance;
+        return fabsf(x) < 1e-4f ? rho0 * distance * (1.f - 0.5f * x)
+                                : rho0 * -::expm1(-x) / b;
+    }
+
+    /** Distance along @p ray at which opticalDepth() reaches @p depth;
+      * infinite if it never does
+      */
+    float distanceAtDepth( const Ray &ray, float depth ) const
+    {
+        const float rho0 = density * ::exp(-decay * ray.origin().y);
+        if (rho0 <= 0.f)
+            return finf();
+
+        const float b = decay * ray.direction().y;
+        const float x = depth * b / rho0;
+        if (x >= 1.f)
+            return finf();
+        return fabsf(x) < 1e-5f ? depth / rho0 * (1.f + 0.5f * x)
+                                : -::log1p(-x) / b;
+    }
 
     virtual Radiance3 estimateAttenuation( const Ray &ray,
                                            float distance ) const
     {
-        return Radiance3::black();
+        return transmittance( attenuation * opticalDepth(ray, distance) );
     }
 
     virtual Radiance3 estimateAddedRadiance( const Ray &ray,
                                              float distance ) const
     {
-        return Radiance3::black();
+        // Integral of emission rho exp(-tau D(s)) over [0, d], where D is
+        // the optical depth: emission (1 - exp(-tau D(d))) / tau
+        const float depth = opticalDepth(ray, distance);
+        Radiance3 added;
+        for (int c = 0; c < 3; ++c) {
+            const float tau = attenuation[c];
+            if (tau > 0.f)
+                added[c] = emission[c] * -::expm1(-tau * depth) / tau;
+            else
+                added[c] = depth < finf() ? emission[c] * depth : 0.f;
+        }
+        return added;
     }
 
-    virtual bool isVacuum() const
+    virtual bool sampleDistance( const Ray &ray, float distance, float u, float uChannel,
+                                 float &t, Color3 &weight ) const
     {
+        // Optical depth drawn for one channel, then inverted to a distance
+        const float tau = attenuation[channel(uChannel)];
+        const float depth = tau > 0.f ? -::log1p(-u) / tau : finf();
+        t = depth < finf() ? distanceAtDepth(ray, depth) : finf();
+
+        if (t < distance) {
+            const Radiance3 tr = transmittance( attenuation * depth );
+            const Radiance3 sigma = extinction( ray.origin() + ray.direction() * t );
+            const float pdf = (sigma * tr).average();
+            weight = pdf > 0.f ? sigma * albedo * tr / pdf : Color3::zero();
+            return true;
+        }
+
+        const Radiance3 tr = estimateAttenuation( ray, distance );
+        const float pdf = tr.average();
+        weight = pdf > 0.f ? tr / pdf : Color3::zero();
         return false;
     }
 
-    virtual bool attenuates() const { return false; }
-    virtual bool emissive() const { return false; }
+    virtual bool isVacuum() const
+    {
+        return !attenuates() && !emissive();
+    }
+
+    virtual bool attenuates() const { return density > 0.f && attenuation.nonZero(); }
+    virtual bool emissive() const { return density > 0.f && emission.nonZero(); }
 
 };
 
@@ -0,0 +1,96 @@
+#include "memorytracker.h"
+
+static double megabytes( size_t bytes )
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+MemoryTracker &MemoryTracker::global()
+{
+    static MemoryTracker tracker;
+    return tracker;
+}
+
+MemoryTracker::MemoryTracker() :
+    m_budget(0)
+{
+    for (int i = 0; i < NUM_CATEGORIES; ++i)
+        m_bytes[i] = 0;
+}
+
+const char *MemoryTracker::categoryName( Category category )
+{
+    switch (category)
+    {
+    case GEOMETRY:      return "Geometry";
+    case BVH:           return "BVH";
+    case EMITTERS:      return "Emitters";
+    case TEXTURES:      return "Textures";
+    case SKYBOX:        return "SkyCube";
+    case FRAMEBUFFER:   return "Framebuffer";
+    case MODELS:        return "Models (loading)";
+    case SCENE_CACHE:   return "Scene cache (mapped)";
+    case GUIDING:       return "Path guiding";
+    case RADIANCE_CACHE: return "Radiance cache";
+    case PHOTON_MAP:     return "Photon map";
+    case SPLATS:        return "Light splats";
+    case DENOISER:      return "Denoiser";
+    case AOVS:          return "AOV buffers";
+    default:            return "?";
+    }
+}
+
+void MemoryTracker::set( Category category, size_t bytes )
+{
+    m_bytes[category] = bytes;
+}
+
+void MemoryTracker::add( Category category, size_t bytes )
+{
+    m_bytes[category] += bytes;
+}
+
+void MemoryTracker::remove( Category category, size_t bytes )
+{
+    m_bytes[category] -= bytes;
+}
+
+size_t MemoryTracker::bytes( Category category ) const
+{
+    return m_bytes[category];
+}
+
+size_t MemoryTracker::total() const
+{
+    size_t sum = 0;
+    for (int i = 0; i < NUM_CATEGORIES; ++i)
+    {
+        if (i != SCENE_CACHE)
+            sum += m_bytes[i];
+    }
+    return sum;
+}
+
+void MemoryTracker::setBudget( size_t bytes )
+{
+    m_budget = bytes;
+}
+
+bool MemoryTracker::exceedsBudget( Category category, size_t bytes ) const
+{
+    if (m_budget == 0 || category == SCENE_CACHE)
+        return false;
+    return total() - m_bytes[category] + bytes > m_budget;
+}
+
+void MemoryTracker::report( const String &title ) const
+{
+    printf("%s\n", title.c_str());
+    for (int i = 0; i < NUM_CATEGORIES; ++i)
+        printf("    %-22s %10.1f MB\n", categoryName(Category(i)), megabytes(m_bytes[i]));
+    printf("    %-22s %10.1f MB", "Total", megabytes(total()));
+    if (m_budget > 0)
+        printf(" of %.1f MB budget", megabytes(m_budget));
+    printf("\n");
+    fflush( stdout );
+}
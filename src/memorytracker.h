@@ -0,0 +1,75 @@
+#ifndef MEMORYTRACKER_H
+#define MEMORYTRACKER_H
+
+#include <G3D/G3DAll.h>
+
+#include <atomic>
+
+/** Process-wide record of how much memory each subsystem holds. Subsystems
+  * set their category's current total whenever it changes; the tracker
+  * prints a per-category report and enforces an optional hard budget,
+  * which World checks before each large allocation of a load so an
+  * oversized scene fails early instead of swapping.
+  */
+class MemoryTracker
+{
+public:
+
+    enum Category
+    {
+        GEOMETRY,       // triangles and vertices (full precision or compressed)
+        BVH,            // nodes, references and triangle positions
+        EMITTERS,       // emitter triangles, vertices and sampling table
+        TEXTURES,       // material textures
+        SKYBOX,         // SkyCube faces
+        FRAMEBUFFER,    // display canvas and accumulation buffer
+        MODELS,         // ArticulatedModels held while a scene loads
+        SCENE_CACHE,    // mapped scene cache file, paged in on demand
+        GUIDING,        // path guiding distributions
+        RADIANCE_CACHE, // hash grid of cached radiance
+        PHOTON_MAP,     // photons of the current pass and their grid
+        SPLATS,         // light tracing film of bidirectional path tracing
+        DENOISER,       // planes of the image being denoised
+        AOVS,           // per pixel AOV averages of the path tracer
+        NUM_CATEGORIES
+    };
+
+    static MemoryTracker &global();
+
+    static const char *categoryName( Category category );
+
+    /** Records that @p category now holds @p bytes */
+    void set( Category category, size_t bytes );
+
+    /** Adds or removes @p bytes of @p category, for categories several
+      * owners share, such as the Worlds of a benchmark and of the app
+      */
+    void add( Category category, size_t bytes );
+    void remove( Category category, size_t bytes );
+
+    size_t bytes( Category category ) const;
+
+    /** Bytes across all categories that count against the budget, which
+      * excludes the mapped scene cache since the OS can drop its pages
+      */
+    size_t total() const;
+
+    /** Hard budget in bytes; 0 disables it */
+    void setBudget( size_t bytes );
+    size_t budget() const { return m_budget; }
+
+    /** Returns true if @p category growing to @p bytes would exceed the budget */
+    bool exceedsBudget( Category category, size_t bytes ) const;
+
+    /** Prints the per-category table */
+    void report( const String &title ) const;
+
+private:
+
+    MemoryTracker();
+
+    std::atomic<size_t> m_bytes[NUM_CATEGORIES];
+    std::atomic<size_t> m_budget;
+};
+
+#endif // MEMORYTRACKER_H
@@ -31,7 +31,24 @@ SOURCES += \
     threadpool.cpp \
     pathtracer.cpp \
     dofCam.cpp \
-    SkyCube.cpp
+    SkyCube.cpp \
+    bvh.cpp \
+    scenecache.cpp \
+    instance.cpp \
+    compressedgeometry.cpp \
+    hugepagearena.cpp \
+    benchmark.cpp \
+    memorytracker.cpp \
+    texturecache.cpp \
+    materialtable.cpp \
+    sampler.cpp \
+    guiding.cpp \
+    radiancecache.cpp \
+    photonmapper.cpp \
+    raytracer.cpp \
+    bidirectional.cpp \
+    denoiser.cpp \
+    aov.cpp
 
 HEADERS += \
     app.h \
@@ -40,7 +57,25 @@ HEADERS += \
     pathtracer.h \
     medium.h \
     dofCam.h \
-    SkyCube.h
+    SkyCube.h \
+    bvh.h \
+    scenecache.h \
+    instance.h \
+    compressedgeometry.h \
+    hugepagearena.h \
+    benchmark.h \
+    memorytracker.h \
+    texturecache.h \
+    raydifferential.h \
+    materialtable.h \
+    sampler.h \
+    guiding.h \
+    radiancecache.h \
+    photonmapper.h \
+    raytracer.h \
+    bidirectional.h \
+    denoiser.h \
+    aov.h
 
 DEFINES += G3D_PATH=\\\"$${G3D_PATH}\\\"
 INCLUDEPATH += $${G3D_PATH}/build/include
@@ -6,72 +6,256 @@
 #define PI 3.1415
 #define funBackGround false // enable to give a fun background color ("clay")
 
-static Random &rng = Random::common();
+// Sampler dimensions: the camera's pixel and lens positions, then a block
+// per bounce laid out as below, so that a decision reads the same
+// dimension in every path whichever branches came before it
+enum {
+    CAMERA_DIMENSIONS = 4,
+
+    SKY_DIRECTION = 0,      // 2D
+    LIGHT_CHOICE = 2,
+    EMITTER = 3,
+    EMITTER_POINT = 4,      // 2D
+    ROULETTE = 6,
+    LOBE = 7,
+    DIRECTION = 8,          // 2D
+    GUIDE_CHOICE = 10,
+    MEDIUM_DISTANCE = 11,   // 2D: distance and channel
+    BOUNCE_DIMENSIONS = 13
+};
+
+// A path scattering in the medium continues with at most this probability,
+// so that paths in media that scatter everything still end
+static const float MEDIUM_SURVIVAL = 0.95f;
+
+// Paths whose footprint is wider than this many radiance cache cells end in
+// the cache at any bounce
+static const float RADIANCE_CACHE_WIDE_CELLS = 4.f;
+
+// Surfaces whose outgoing radiance varies little with direction, which the
+// radiance cache can stand in for
+static bool cacheable(const ShadingPoint &sp)
+{
+    return !BSDF::hasImpulses(sp) && (sp.glossy.isZero() || sp.smoothness < 0.5f);
+}
 
+// Probability of sampling a guided bounce from the learned distribution
+// rather than the BSDF
+static const float GUIDING_FRACTION = 0.5f;
 
-PathTracer::PathTracer() {}
+static void seekDimension(Sampler &sampler, int bounceNum, int offset)
+{
+    sampler.setDimension(CAMERA_DIMENSIONS + bounceNum * BOUNCE_DIMENSIONS + offset);
+}
 
-Radiance3 PathTracer::sample(int x, int y, Rect2D viewport)
+// Direction uniformly distributed over the hemisphere around n, whose
+// density is 1 / (2 pi)
+static Vector3 uniformHemisphere(const Vector3 &n, const Point2 &u)
 {
-    Radiance3 s = Radiance3::zero();
+    Vector3 t, b;
+    n.getTangents(t, b);
+    const float z = u.x;
+    const float r = sqrtf(max(0.f, 1.f - z * z));
+    const float phi = 2.f * pif() * u.y;
+    return t * (r * cosf(phi)) + b * (r * sinf(phi)) + n * z;
+}
 
-    if (m_settings.dofEnabled) { // if depth of field is enabled, super sampling is disabled
 
-        float apertureRad = m_settings.dofLens / 10.f;
+PathTracer::PathTracer() :
+    m_world(NULL),
+    m_sample(&PathTracer::sampleWith<0>),
+    m_medium(NULL)
+{}
 
-        float sampleNum = static_cast<float>(m_settings.dofSamples);
+Ray PathTracer::cameraRay(float x, float y, const Rect2D &viewport, RayDifferential &diff) const
+{
+    const shared_ptr<Camera> &camera = m_world->camera();
+    const Ray ray = camera->worldRay(x, y, viewport);
+    diff = RayDifferential::fromRays(ray, camera->worldRay(x + 1.f, y, viewport),
+                                     camera->worldRay(x, y + 1.f, viewport));
+    return ray;
+}
 
-        // sample points within aperture radius (this sampling favors points towards the center of the lens,
-        // in order to lessen noise
-        for (int i = 0; i < m_settings.dofSamples; i++) {
+// How much a bounce off surf widens the direction differentials of the
+// scattered ray, approximated from the roughness of its lobes: about a
+// radian for a Lambertian lobe, nothing for a mirror. Deep diffuse
+// bounces thus read small mip levels.
+static float scatterSpread(const ShadingPoint &sp)
+{
+    const float diffuse = sp.lambertian.average();
+    const float glossy = sp.glossy.average();
+    const float roughness = square(1.f - sp.smoothness);
+    return (diffuse + glossy * roughness) / max(diffuse + glossy, 1e-6f);
+}
 
-            float randomRad = rng.uniform() * (apertureRad/2.f);
-            float randomAngle = rng.uniform() * (2.f * PI);
-            float dx = randomRad * cos(randomAngle);
-            float dy = randomRad * sin(randomAngle);
+// Shirley and Chiu's concentric mapping of the unit square onto the unit
+// disk. It preserves area, so uniform (u, v) give uniform lens points, and
+// keeps nearby (u, v) nearby, so stratified sequences stay stratified.
+static Vector2 concentricDisk(float u, float v)
+{
+    const float a = 2.f * u - 1.f;
+    const float b = 2.f * v - 1.f;
+    if (a == 0.f && b == 0.f)
+        return Vector2::zero();
+
+    float r, phi;
+    if (fabsf(a) > fabsf(b)) {
+        r = a;
+        phi = (pif() / 4.f) * (b / a);
+    } else {
+        r = b;
+        phi = (pif() / 2.f) - (pif() / 4.f) * (a / b);
+    }
+    return Vector2(r * cosf(phi), r * sinf(phi));
+}
 
-            float dx2 = rng.uniform() * 1.0f;
-            float dy2 = rng.uniform() * 1.0f;
+// Radius in pixels of the blur of a point at depth z, for a thin lens of
+// radius lensRadius focused at depth dofFocus; pixelsPerMeter is measured
+// on the image plane at depth 1
+float PathTracer::circleOfConfusion(float z, float lensRadius, float pixelsPerMeter) const
+{
+    const float focus = max(fabsf(m_settings.dofFocus), 1e-3f);
+    if (z == finf())
+        return lensRadius * pixelsPerMeter / focus;
+    return lensRadius * fabsf(z - focus) / (max(z, 1e-3f) * focus) * pixelsPerMeter;
+}
 
-            Ray testRay = m_world->dofCamera()->worldRay(x + dx2, y + dy2, dx, dy,
-                                                         viewport, m_settings.dofFocus);
-            s += trace(testRay, true);
-        }
-        s = s / sampleNum;
+// Adds the first hit of a camera path along @p dir to a pixel's features
+static void addFeatures(PixelFeatures &features, const Vector3 &dir, const Vector3 &look,
+                        float dist, const ShadingPoint &hit)
+{
+    if (dist == finf()) {
+        // Misses keep the sky's color through demodulation
+        features.albedo += Color3::one();
+        return;
+    }
 
+    features.albedo += (hit.lambertian + hit.glossy + hit.transmissive).min(Color3::one());
+    features.normal += hit.shadingNormal;
+    features.depth += dist * fabsf(dir.dot(look));
+}
 
-    } else {
-        if (m_settings.superSamples == 1) {
-            double dx = rng.uniform(), dy = rng.uniform();
+// Adds one path's parts of radiance to a pixel's
+static void addComponents(RadianceComponents &sum, const RadianceComponents &path)
+{
+    sum.emitted += path.emitted;
+    sum.direct += path.direct;
+    sum.specular += path.specular;
+    sum.indirect += path.indirect;
+}
 
-            Ray ray = m_world->camera()->worldRay(x + dx, y + dy, viewport);
-            s=trace(ray,true);
-        } else {
-            float superSampleFl = static_cast<float>(m_settings.superSamples);
+// Each channel limited to [0, 10], as trace() does to the total
+static Radiance3 clampRadiance(const Radiance3 &L)
+{
+    return Radiance3(G3D::clamp(L.r, 0.f, 10.f), G3D::clamp(L.g, 0.f, 10.f), G3D::clamp(L.b, 0.f, 10.f));
+}
+
+template <unsigned F>
+Radiance3 PathTracer::sampleWith(int x, int y, int pass, const Rect2D &viewport, PixelAOVs *aovs)
+{
+    Radiance3 s = Radiance3::zero();
+    RayDifferential diff;
+
+    // The first hit and radiance parts are only gathered for AOVs
+    float dist;
+    ShadingPoint hit;
+    RadianceComponents parts;
+    ShadingPoint *firstHit = aovs ? &hit : NULL;
+    RadianceComponents *components = aovs ? &parts : NULL;
+    if (aovs)
+        *aovs = PixelAOVs();
+    const Vector3 look = aovs ? m_world->camera()->frame().lookVector() : Vector3::zero();
+    int numPaths;
+
+    if (m_settings.dofEnabled) {
+
+        // A pinhole probe through the pixel center estimates the circle of
+        // confusion; it is not part of the estimate, so the number of lens
+        // samples does not depend on any of them. Blurred pixels then take
+        // up to dofMaxSamples lens samples this pass, in-focus ones one.
+        const shared_ptr<dofCam> &camera = m_world->dofCamera();
+        const float lensRadius = m_settings.dofLens / 20.f;
+        const int maxSamples = max(m_settings.dofMaxSamples, 1);
+
+        int numSamples = 1;
+        if (maxSamples > 1) {
+            RayDifferential probeDiff;
+            const Ray probe = camera->worldRay(x + 0.5f, y + 0.5f, 0.f, 0.f,
+                                               viewport, m_settings.dofFocus, probeDiff);
+            float probeDist;
+            ShadingPoint probeHit;
+            if (!m_world->intersect(probe, probeDist, probeHit, RayDifferential::coarsest()))
+                probeDist = finf();
+            const float z = probeDist * fabsf(probe.direction().dot(camera->frame().lookVector()));
+            const float coc = circleOfConfusion(z, lensRadius, camera->imagePlanePixelsPerMeter(viewport));
+            numSamples = iClamp(iCeil(coc), 1, maxSamples);
+        }
 
-            float incr = 1.f / superSampleFl;
+        for (int i = 0; i < numSamples; i++) {
+            Sampler sampler(m_settings.sampler, x, y, pass * maxSamples + i);
+            const Point2 jitter = sampler.next2D();
+            const Point2 u = sampler.next2D();
+            const Vector2 lens = lensRadius * concentricDisk(u.x, u.y);
 
+            Ray ray = camera->worldRay(x + jitter.x, y + jitter.y, lens.x, lens.y,
+                                       viewport, m_settings.dofFocus, diff);
 
-            for (int i = 0; i < m_settings.superSamples; i++) {
-                for (int j = 0; j < m_settings.superSamples; j++) {
-                    float dx = static_cast<float>(i) * incr;
-                    float dy = static_cast<float>(j) * incr;
-                    Ray ray = m_world->camera()->worldRay(x + dx, y + dy, viewport);
-                    s += trace(ray,true);
-                }
+            s += trace<F>(ray, diff, sampler, true, &dist, firstHit, components);
+
+            if (aovs) {
+                addFeatures(aovs->features, ray.direction(), look, dist, hit);
+                addComponents(aovs->radiance, parts);
             }
+        }
+        s = s / float(numSamples);
+        numPaths = numSamples;
 
-            s = s / (superSampleFl * superSampleFl);
+    } else {
+        // superSamples^2 paths per pass; the sampler stratifies their
+        // pixel positions along with every other dimension
+        const int n = max(m_settings.superSamples, 1);
+        const float incr = 1.f / float(n);
+
+        for (int i = 0; i < n * n; i++) {
+            Sampler sampler(m_settings.sampler, x, y, pass * n * n + i);
+            const Point2 jitter = sampler.next2D();
+
+            Ray ray = cameraRay(x + jitter.x, y + jitter.y, viewport, diff);
+            s += trace<F>(ray, diff.scaled(incr), sampler, true, &dist, firstHit, components);
+            if (aovs) {
+                addFeatures(aovs->features, ray.direction(), look, dist, hit);
+                addComponents(aovs->radiance, parts);
+            }
         }
+
+        s = s / float(n * n);
+        numPaths = n * n;
+    }
+
+    if (aovs) {
+        const float scale = 1.f / float(numPaths);
+        aovs->features.albedo *= scale;
+        aovs->features.normal *= scale;
+        aovs->features.depth *= scale;
+        aovs->radiance.emitted *= scale;
+        aovs->radiance.direct *= scale;
+        aovs->radiance.specular *= scale;
+        aovs->radiance.indirect *= scale;
+        aovs->paths = numPaths;
     }
 
     return s;
 }
 
 
+template <unsigned F>
 Radiance3 PathTracer::trace( const Ray &ray,
+                      const RayDifferential &diff,
+                      Sampler &sampler,
                       bool isEyeRay,
-                      float *distance )
+                      float *distance,
+                      ShadingPoint *firstHit,
+                      RadianceComponents *components )
 {
 
     Radiance3 final = Radiance3::blue();
@@ -79,15 +263,134 @@ Radiance3 PathTracer::trace( const Ray &ray,
 
 //    if (!m_world->lightsExist()) return final;
 
-    Radiance3 preClamped = estimateL(ray, 0);
+    if (components)
+        *components = RadianceComponents();
+    Radiance3 preClamped = estimateL<F>(ray, diff, sampler, 0, distance, firstHit, components);
     float finalR = G3D::clamp(preClamped.r, 0.f, 10.f);
     float finalG = G3D::clamp(preClamped.g, 0.f, 10.f);
     float finalB = G3D::clamp(preClamped.b, 0.f, 10.f);
 
+    if (components) {
+        components->emitted = clampRadiance(components->emitted);
+        components->direct = clampRadiance(components->direct);
+        components->specular = clampRadiance(components->specular);
+        components->indirect = clampRadiance(components->indirect);
+    }
+
     return Radiance3(finalR, finalG, finalB);
 }
 
-Radiance3 PathTracer::estimateL(const Ray &ray, int bounceNum)
+template <unsigned F>
+Radiance3 PathTracer::estimateL(const Ray &ray, const RayDifferential &diff, Sampler &sampler,
+                                int bounceNum, float *distance, ShadingPoint *firstHit,
+                                RadianceComponents *components)
+{
+    // cast ray
+    float dist = 0.0;
+    ShadingPoint surf;
+
+    const bool hit = m_world->intersect(ray, dist, surf, diff);
+    if (distance)
+        *distance = hit ? dist : finf();
+    if (firstHit && hit)
+        *firstHit = surf;
+
+    if (!m_medium)
+        return surfaceL<F>(ray, diff, sampler, bounceNum, hit, dist, surf, components);
+
+    // The medium's emission along the segment is added in closed form; one
+    // free-flight distance then decides between scattering in the medium
+    // and reaching the surface, with the transmittance in the weight
+    const float segment = hit ? dist : finf();
+    const Radiance3 added = m_medium->estimateAddedRadiance(ray, segment);
+
+    Color3 weight;
+    Radiance3 L;
+    float t = segment;
+    bool scattered = false;
+    if (m_medium->scatters()) {
+        seekDimension(sampler, bounceNum, MEDIUM_DISTANCE);
+        const float u = sampler.next();
+        scattered = m_medium->sampleDistance(ray, segment, u, sampler.next(), t, weight);
+    } else {
+        weight = m_medium->estimateAttenuation(ray, segment);
+    }
+
+    if (scattered)
+        L = mediumL<F>(ray.origin() + ray.direction() * t, ray.direction(), sampler, bounceNum, components);
+    else if (weight.nonZero())
+        L = surfaceL<F>(ray, diff, sampler, bounceNum, hit, dist, surf, components);
+    else
+        L = Radiance3::zero();
+
+    if (components) {
+        components->emitted = components->emitted * weight + added;
+        components->direct *= weight;
+        components->specular *= weight;
+        components->indirect *= weight;
+    }
+
+    return added + weight * L;
+}
+
+template <unsigned F>
+Radiance3 PathTracer::mediumL(const Point3 &point, const Vector3 &dir, Sampler &sampler, int bounceNum,
+                              RadianceComponents *components)
+{
+    // The phase function is isotropic, 1 / (4 pi) for every pair of directions
+    const float phase = 1.f / (4.f * pif());
+
+    Radiance3 direct = Radiance3::zero();
+    if ((F & (bounceNum == 0 ? PTSettings::DIRECT_DIFFUSE : PTSettings::INDIRECT)) && m_world->lightsExist()) {
+        Vector3 lightPt, lightNormal;
+        int lightMaterial;
+        float prob, area;
+        seekDimension(sampler, bounceNum, EMITTER);
+        const float uEmitter = sampler.next();
+        m_world->emissivePoint(uEmitter, sampler.next2D(), lightPt, lightMaterial, lightNormal, prob, area);
+
+        const Vector3 toLight = lightPt - point;
+        const float d2 = toLight.squaredLength();
+        const Vector3 wi = toLight / sqrtf(max(d2, 1e-12f));
+        const float cosLight = -wi.dot(lightNormal);
+
+        if (d2 > 1e-8f && cosLight > 0.f && m_world->lineOfSight(point, lightPt)) {
+            direct = m_world->emittedRadiance(lightMaterial, area) *
+                     (phase * cosLight / (d2 * prob));
+            if (m_settings.attenuation)
+                direct *= m_medium->estimateAttenuation(Ray(point, wi), sqrtf(d2));
+        }
+    }
+
+    // The path goes on in a uniformly drawn direction, whose density is
+    // the phase function's, so its weight is one
+    Radiance3 indirect = Radiance3::zero();
+    seekDimension(sampler, bounceNum, ROULETTE);
+    const float p = sampler.next();
+    if (p < MEDIUM_SURVIVAL) {
+        seekDimension(sampler, bounceNum, DIRECTION);
+        const Point2 u = sampler.next2D();
+        const float z = 1.f - 2.f * u.x;
+        const float r = sqrtf(max(0.f, 1.f - z * z));
+        const float phi = 2.f * pif() * u.y;
+        const Vector3 w_i(r * cosf(phi), r * sinf(phi), z);
+
+        // Scattering spreads a ray as widely as a Lambertian bounce does
+        indirect = estimateL<F>(Ray(point, w_i), RayDifferential::coarsest(), sampler, bounceNum + 1) /
+                   MEDIUM_SURVIVAL;
+    }
+
+    if (components) {
+        components->direct = direct;
+        components->indirect = indirect;
+    }
+
+    return direct + indirect;
+}
+
+template <unsigned F>
+Radiance3 PathTracer::surfaceL(const Ray &ray, const RayDifferential &diff, Sampler &sampler, int bounceNum,
+                               bool hit, float dist, const ShadingPoint &surf, RadianceComponents *components)
 {
 
     // set initial results
@@ -95,24 +398,39 @@ Radiance3 PathTracer::estimateL(const Ray &ray, int bounceNum)
     float gVal = 0.f;
     float bVal = 0.f;
 
+    // Paths past radianceCacheBounces, or already wide, end in the radiance
+    // cache where it has light for this surface; the others feed it
+    const bool useCache = m_settings.radianceCache && hit && bounceNum > 0 && cacheable(surf);
+    float footprint = 0.f;
+    if (useCache) {
+        footprint = diff.footprint(ray.direction(), dist, surf.geometricNormal);
+        Radiance3 cached;
+        if ((bounceNum >= m_settings.radianceCacheBounces ||
+             footprint > RADIANCE_CACHE_WIDE_CELLS * m_radianceCache.cellSize()) &&
+            m_radianceCache.lookup(surf.position, surf.geometricNormal, footprint, cached))
+            return cached;
+    }
 
-    // cast ray
-    float dist = 0.0;
-    shared_ptr<Surfel> surf;
-    m_world->intersect(ray, dist, surf);
-
-    if (surf) {
+    if (hit) {
 
-        if (m_settings.useEmitted && bounceNum == 0) {
+        if ((F & PTSettings::EMITTED) && bounceNum == 0) {
             // get emitted light coming from surf to eyepoint
             Radiance3 eLight = calculateEmittedLight(surf, ray);
+            if (components)
+                components->emitted = eLight;
             rVal += eLight.r;
             gVal += eLight.g;
             bVal += eLight.b;
         }
 
         // calculate direct lighting contribution
-        Radiance3 dirLight = calculateDirectLighting(surf, ray, bounceNum);
+        Radiance3 specular = Radiance3::zero();
+        Radiance3 dirLight = calculateDirectLighting<F>(surf, ray, sampler, bounceNum,
+                                                        components ? &specular : NULL);
+        if (components) {
+            components->specular = specular;
+            components->direct = dirLight - specular;
+        }
         rVal += dirLight.r;
         gVal += dirLight.g;
         bVal += dirLight.b;
@@ -121,27 +439,70 @@ Radiance3 PathTracer::estimateL(const Ray &ray, int bounceNum)
         const Vector3& w_o = -1.0 * ray.direction();
 
 //         get reflectivity probability
-        float p = rng.uniform();
+        seekDimension(sampler, bounceNum, ROULETTE);
+        float p = sampler.next();
 
         Color3 weight;
 
         // ray coming into intersection point before having been scattered to eye (in reverse dir)
         Vector3 w_i;
 
-        surf->scatter(PathDirection::EYE_TO_SOURCE, w_o, false, rng,
-                      weight, w_i);
+        bool impulse;
+        const float uLobe = sampler.next();
+        const Point2 uDir = sampler.next2D();
+
+        // Bounces off surfaces without impulses can be guided: w_i is drawn
+        // from a one-sample mixture of the learned incident radiance and the
+        // BSDF, and weighted by the mixture's density
+        const bool guided = m_settings.pathGuiding && !BSDF::hasImpulses(surf);
+        float pdf = 0.f;
+
+        if (guided && m_guiding.ready()) {
+            float guidePdf;
+            if (sampler.next() < GUIDING_FRACTION) {
+                w_i = m_guiding.sample(surf.position, uDir, guidePdf);
+            } else {
+                if (!BSDF::scatter(surf, w_o, uLobe, uDir, weight, w_i, impulse))
+                    w_i = Vector3::zero();
+                guidePdf = w_i.isZero() ? 0.f : m_guiding.pdf(surf.position, w_i);
+            }
+
+            if (w_i.isZero()) {
+                weight = Color3::zero();
+            } else {
+                pdf = GUIDING_FRACTION * guidePdf + (1.f - GUIDING_FRACTION) * BSDF::pdf(surf, w_i, w_o);
+                const float cosI = w_i.dot(surf.shadingNormal);
+                weight = pdf > 0.f && cosI > 0.f ? BSDF::evaluate(surf, w_i, w_o) * (cosI / pdf)
+                                                : Color3::zero();
+            }
+        } else {
+            BSDF::scatter(surf, w_o, uLobe, uDir, weight, w_i, impulse);
+            if (guided)
+                pdf = BSDF::pdf(surf, w_i, w_o);
+        }
 
         w_i = normalize(w_i);
 
-        float r = (weight.r + weight.g + weight.b)/3.f;
-        if (p < r) {
+        // Guided weights are f cos / pdf of the mixture and can average
+        // above 1; such paths always survive and must not be scaled down
+        const float q = min((weight.r + weight.g + weight.b)/3.f, 1.f);
+        if (p < q) {
+
+            Ray outgoingRay = Ray(surf.position + (.001 * w_i), w_i);
 
-            Ray outgoingRay = Ray(surf->position + (.001 * w_i), w_i);
+            RayDifferential atHit = diff;
+            atHit.transfer(ray.direction(), dist, surf.geometricNormal);
+            RayDifferential outgoingDiff = atHit.scatter(ray.direction(), w_i, surf.geometricNormal,
+                                                         scatterSpread(surf));
+            Radiance3 returnedEst = estimateL<F>(outgoingRay, outgoingDiff, sampler, bounceNum+1);
 
-            Radiance3 returnedEst = estimateL(outgoingRay, bounceNum+1);
+            if (guided && pdf > 0.f && m_guiding.learning())
+                m_guiding.record(surf.position, w_i, returnedEst.average() / pdf);
             Radiance3 integrand = returnedEst * weight;
 
-            integrand = integrand / r;
+            integrand = integrand / q;
+            if (components)
+                components->indirect = integrand;
 
             rVal += integrand.r;
             gVal += integrand.g;
@@ -149,59 +510,69 @@ Radiance3 PathTracer::estimateL(const Ray &ray, int bounceNum)
         }
     } else {
 
-        if (m_settings.useImageBasedLighting) {
-            Color4 intersectedColor = m_world->skycube().getIntersectedColor(ray);
+        Radiance3 background;
+        if (F & PTSettings::IMAGE_BASED_LIGHTING) {
+            Color4 intersectedColor = m_world->skycube().getIntersectedColor(ray, diff.spread());
 
-            return Radiance3(intersectedColor.r, intersectedColor.g, intersectedColor.b);
+            background = Radiance3(intersectedColor.r, intersectedColor.g, intersectedColor.b);
 
         } else {
             if (funBackGround) {
-                return Radiance3(0.407f, 0.085f, 0.0f);
+                background = Radiance3(0.407f, 0.085f, 0.0f);
             } else {
-                return Radiance3::black();
+                background = Radiance3::black();
             }
         }
+
+        // Seen directly, the background counts as emitted
+        if (components)
+            components->emitted = background;
+        return background;
     }
 
 
 
     Radiance3 final = Radiance3(rVal, gVal, bVal);
 
-
+    if (useCache)
+        m_radianceCache.record(surf.position, surf.geometricNormal, footprint, final);
 
     return final;
 
 }
 
 // calculates the light coming from surf in direction -1 * ray
-Radiance3 PathTracer::calculateEmittedLight(shared_ptr<Surfel> surf, const Ray &ray)
+Radiance3 PathTracer::calculateEmittedLight(const ShadingPoint &surf, const Ray &ray)
 {
-    Radiance3 emittedLight = surf->emittedRadiance(ray.direction() * -1.0);
+    Radiance3 emittedLight = BSDF::emitted(surf, ray.direction() * -1.0);
     return emittedLight;
 }
 
-Radiance3 PathTracer::calculateDirectLighting(shared_ptr<Surfel> surf, const Ray &ray, int bounceNum)
+template <unsigned F>
+Radiance3 PathTracer::calculateDirectLighting(const ShadingPoint &surf, const Ray &ray, Sampler &sampler, int bounceNum,
+                                              Radiance3 *specular)
 {
     Radiance3 toReturn;
-    if (m_settings.useImageBasedLighting) {
+    if (F & PTSettings::IMAGE_BASED_LIGHTING) {
 
         // choose random ray to sample lighting from, using scatter
         Vector3 wi;
 
         float pdfValue; // 1/PI
-        const Vector3& norm = surf->shadingNormal;
-        Vector3::hemiRandom(norm, rng, wi, pdfValue);
+        const Vector3& norm = surf.shadingNormal;
+        seekDimension(sampler, bounceNum, SKY_DIRECTION);
+        wi = uniformHemisphere(norm, sampler.next2D());
+        pdfValue = 1.f / (2.f * pif());
 
         Ray skySampler = Ray(ray.origin() + (BUMP * wi.direction()), wi.direction());
 
         // check for obstructing objects along wi
         float dist = 0.0;
-        shared_ptr<Surfel> obstructingObj;
-        m_world->intersect(skySampler, dist, obstructingObj);
+        ShadingPoint obstructingObj;
 
         Radiance3 skyLight;
 
-        if (obstructingObj) {
+        if (m_world->intersect(skySampler, dist, obstructingObj, RayDifferential::coarsest())) {
 
             // there is shadow caster in direction of skycube sampling ray
             skyLight = Radiance3::black();
@@ -211,7 +582,7 @@ Radiance3 PathTracer::calculateDirectLighting(shared_ptr<Surfel> surf, const Ray
             Radiance3 returnedLight = Radiance3(skySample.r, skySample.g, skySample.b);
 
             Vector3 lightDir = -1.f * wi;
-            float dotProd1 = lightDir.dot(surf->shadingNormal);
+            float dotProd1 = lightDir.dot(surf.shadingNormal);
             dotProd1 = G3D::clamp(dotProd1, 0.0f, 1.0f);
 
             skyLight = returnedLight * pdfValue * dotProd1;
@@ -221,10 +592,13 @@ Radiance3 PathTracer::calculateDirectLighting(shared_ptr<Surfel> surf, const Ray
         if (m_world->lightsExist()) {
 
 
-            float r = rng.uniform(0.f, 1.f);
+            seekDimension(sampler, bounceNum, LIGHT_CHOICE);
+            float r = sampler.next();
             if (r < 0.5f) {
-                Radiance3 areaLighting = calculateAreaLighting(surf, ray, bounceNum);
+                Radiance3 areaLighting = calculateAreaLighting<F>(surf, ray, sampler, bounceNum, specular);
                 toReturn = 0.5f * areaLighting;
+                if (specular)
+                    *specular *= 0.5f;
             } else {
                 toReturn = 0.5f * skyLight;
             }
@@ -236,25 +610,29 @@ Radiance3 PathTracer::calculateDirectLighting(shared_ptr<Surfel> surf, const Ray
 
 
     } else {
-        toReturn = calculateAreaLighting(surf, ray, bounceNum);
+        toReturn = calculateAreaLighting<F>(surf, ray, sampler, bounceNum, specular);
     }
         return toReturn;
 }
 
-Radiance3 PathTracer::calculateAreaLighting(shared_ptr<Surfel> surf, const Ray &ray, int bounceNum)
+template <unsigned F>
+Radiance3 PathTracer::calculateAreaLighting(const ShadingPoint &surf, const Ray &ray, Sampler &sampler, int bounceNum,
+                                            Radiance3 *specular)
 {   
-    Point3 loc = surf->position;
+    Point3 loc = surf.position;
 
     Radiance3 toReturn = Radiance3::black();
 
     // get random emissive point from scene
     Vector3 lightPt = Vector3();
-    Tri tri = Tri();
+    int lightMaterial = 0;
     Vector3 light_norm = Vector3();
     float prob = 0.0f;
     float area = 0.0f;
 
-    m_world->emissivePoint(rng, lightPt, tri, light_norm, prob, area);
+    seekDimension(sampler, bounceNum, EMITTER);
+    const float uEmitter = sampler.next();
+    m_world->emissivePoint(uEmitter, sampler.next2D(), lightPt, lightMaterial, light_norm, prob, area);
 
 
     // get vector from surfel geom to emissive pt
@@ -263,17 +641,16 @@ Radiance3 PathTracer::calculateAreaLighting(shared_ptr<Surfel> surf, const Ray &
     lightDir = normalize(lightDir);
 
     // check for obstructing geometry between surfel and emissive pt.
-    shared_ptr<Surfel> lightSurf;
-    Ray rayToLight = Ray(surf->position, lightDir);
-    m_world->intersect(rayToLight, distToLight, lightSurf);
+    ShadingPoint lightSurf;
+    Ray rayToLight = Ray(surf.position, lightDir);
 
-    if (lightSurf) {
+    if (m_world->intersect(rayToLight, distToLight, lightSurf, RayDifferential::coarsest())) {
 
         // light from geo intersection point to eye
         Vector3 wo = -1.0 * ray.direction();
 
 
-        float dotProd = lightDir.dot(surf->shadingNormal);
+        float dotProd = lightDir.dot(surf.shadingNormal);
 
         dotProd = G3D::clamp(dotProd, 0.0f, 1.0f);
 
@@ -284,67 +661,68 @@ Radiance3 PathTracer::calculateAreaLighting(shared_ptr<Surfel> surf, const Ray &
         // light from emissive point to geo intersection
 
         Radiance3 emittedRad;
-        if (lightSurf->emittedRadiance(-1.f * lightDir) != Radiance3::black()) {
+        if (BSDF::emitted(lightSurf, -1.f * lightDir) != Radiance3::black()) {
 
-            shared_ptr<UniversalMaterial> material = dynamic_pointer_cast<UniversalMaterial>(tri.material());
-            emittedRad = material->emissive().mean();
+            emittedRad = m_world->emittedRadiance(lightMaterial, area) /
+                         (distToLight * distToLight);
 
-            // account for conversion between radiance and power
-            float otherVal = 1.f/(PI * area * distToLight * distToLight);
-            emittedRad = emittedRad * otherVal;
+            if (m_medium && m_settings.attenuation)
+                emittedRad *= m_medium->estimateAttenuation(rayToLight, distToLight);
 
         } else {
             emittedRad = Radiance3::black();
         }
 
-        Radiance3 fs = surf->finiteScatteringDensity(lightDir, wo);
+        Radiance3 fs = BSDF::evaluate(surf, lightDir, wo);
 
 
         if (bounceNum == 0) {
             // direct diffuse
-            if (m_settings.useDirectDiffuse) {
+            if (F & PTSettings::DIRECT_DIFFUSE) {
                 toReturn += emittedRad * dotProd * dotProd2 * fs / prob;
             }
 
         } else {
             // indirect diffuse
-            if (m_settings.useIndirect) {
+            if (F & PTSettings::INDIRECT) {
                 toReturn += emittedRad * dotProd * dotProd2 * fs / prob;
             }
         }
 
         // add specular components
-        if (m_settings.useDirectSpecular) {
+        if (F & PTSettings::DIRECT_SPECULAR) {
             if (emittedRad != Radiance3::black()) {
                 Radiance3 specAddition = calculateSpecular(surf, ray);
                 toReturn += specAddition;
+                if (specular)
+                    *specular += specAddition;
             }
         }
     }
     return toReturn;
 }
 
-Radiance3 PathTracer::calculateSpecular(shared_ptr<Surfel> surf, const Ray &ray)
+Radiance3 PathTracer::calculateSpecular(const ShadingPoint &surf, const Ray &ray)
 {
     Radiance3 specAddition = Radiance3::black();
-    Point3 loc = surf->position;
+    Point3 loc = surf.position;
 
-    Surfel::ImpulseArray impArray;
-    surf->getImpulses(PathDirection::EYE_TO_SOURCE, -1.0 * ray.direction(), impArray);
+    Vector3 impDirs[2];
+    Color3 impWeights[2];
+    int numImpulses = BSDF::impulses(surf, -1.0 * ray.direction(), impDirs, impWeights);
 
-    if (impArray.size() > 0) {
+    if (numImpulses > 0) {
 
-        for (int i = 0; i < impArray.size(); i++) {
+        for (int i = 0; i < numImpulses; i++) {
 
-            Vector3 impDir = impArray[i].direction;
+            Vector3 impDir = impDirs[i];
 
             Ray impRay = Ray(loc,impDir);
             float dist = 0.0;
-            shared_ptr<Surfel> specSurf;
-            m_world->intersect(impRay, dist, specSurf);
+            ShadingPoint specSurf;
 
-            if (specSurf) {
-                Radiance3 specEmitted = specSurf->emittedRadiance(-1.0 * impDir);
+            if (m_world->intersect(impRay, dist, specSurf, RayDifferential::coarsest())) {
+                Radiance3 specEmitted = BSDF::emitted(specSurf, -1.0 * impDir);
                 if (specEmitted != Radiance3::black()) {
                     specAddition += specEmitted;
                 }
@@ -360,7 +738,45 @@ void PathTracer::setWorld(World *world)
     m_world=world;
 }
 
+// sampleWith<F> for every combination of features, indexed by F
+template <size_t... F>
+const PathTracer::SampleFunc *PathTracer::sampleTable(std::index_sequence<F...>)
+{
+    static const SampleFunc table[] = { &PathTracer::sampleWith<F>... };
+    return table;
+}
+
+void PathTracer::beginRender()
+{
+    const shared_ptr<Medium> medium = m_world->medium();
+    m_medium = m_settings.useMedium && medium && !medium->isVacuum() ? medium.get() : NULL;
+
+    if (m_settings.pathGuiding) {
+        Vector3 lo, hi;
+        m_world->bounds(lo, hi);
+        m_guiding.reset(lo, hi, m_settings.guidingIterations);
+    }
+
+    if (m_settings.radianceCache) {
+        Vector3 lo, hi;
+        m_world->bounds(lo, hi);
+        m_radianceCache.reset((hi - lo).length() / 512.f, 20);
+    }
+}
+
+void PathTracer::endPass()
+{
+    if (m_settings.pathGuiding)
+        m_guiding.endPass();
+    if (m_settings.radianceCache)
+        m_radianceCache.endPass();
+}
+
 void PathTracer::setPTSettings(PTSettings settings)
 {
+    static const SampleFunc *table =
+        sampleTable(std::make_index_sequence<PTSettings::FEATURE_COMBINATIONS>());
+
     m_settings=settings;
+    m_sample = table[settings.features()];
 }
@@ -3,6 +3,12 @@
 
 #include <G3D/G3DAll.h>
 #include "world.h"
+#include "sampler.h"
+#include "guiding.h"
+#include "radiancecache.h"
+#include "aov.h"
+
+#include <utility>
 
 
 
@@ -20,17 +26,49 @@ public:
     bool useEmitted;
 
     int superSamples; // for say, stratified sampling
-    bool attenuation; // refracted path absorption through non-vacuum spaces
+    bool attenuation; // shadow rays attenuated by the medium they cross
     bool useMedium; // enable volumetric mediums
 
     bool dofEnabled;
     float dofFocus;
     float dofLens;
-    int dofSamples;
+    int dofMaxSamples; // lens samples per pass for the most blurred pixels
 
     bool useImageBasedLighting;
     SkyImage si = SPONZA;
 
+    bool pathGuiding = false;   // sample bounces from learned incident radiance
+    int guidingIterations = 5;  // learning runs for 2^n - 1 passes
+
+    bool radianceCache = false; // end paths in cached radiance (biased, fast)
+    int radianceCacheBounces = 2; // bounces traced before a path may end there
+
+    Sampler::Type sampler = Sampler::SOBOL; // source of every random decision
+
+    /** The on/off settings above that choose which terms are summed, as
+      * bits PathTracer specializes on. DOF, path guiding, the radiance
+      * cache and media are tested at run time: each costs one branch per
+      * pixel or bounce next to the work it switches on.
+      */
+    enum Feature
+    {
+        EMITTED             = 1 << 0,
+        DIRECT_DIFFUSE      = 1 << 1,
+        INDIRECT            = 1 << 2,
+        DIRECT_SPECULAR     = 1 << 3,
+        IMAGE_BASED_LIGHTING = 1 << 4,
+        FEATURE_COMBINATIONS = 1 << 5
+    };
+
+    unsigned features() const
+    {
+        return (useEmitted ? EMITTED : 0) |
+               (useDirectDiffuse ? DIRECT_DIFFUSE : 0) |
+               (useIndirect ? INDIRECT : 0) |
+               (useDirectSpecular ? DIRECT_SPECULAR : 0) |
+               (useImageBasedLighting ? IMAGE_BASED_LIGHTING : 0);
+    }
+
 };
 
 class PathTracer
@@ -41,17 +79,50 @@ public:
     /**
      * Generates a single path tracing sample. Samples are averaged in App::threadCallback()
      * You may optionally want to edit this function for supersampling.
+     * @p pass numbers the samples of a pixel, from 0. The first hits of
+     * this pass's paths and the parts of their radiance are averaged into
+     * @p aovs if given.
      */
-    Radiance3 sample(int x, int y, Rect2D viewport);
+    Radiance3 sample(int x, int y, int pass, Rect2D viewport, PixelAOVs *aovs = NULL)
+    {
+        return (this->*m_sample)(x, y, pass, viewport, aovs);
+    }
 
     void setWorld(World* world);
+
+    /** Also picks the integrator compiled for these settings' features,
+      * so the settings are not tested again per path.
+      */
     void setPTSettings(PTSettings settings);
 
+    /** To be called once the world has finished loading, before the first pass */
+    void beginRender();
+
+    /** To be called after every pass, while no samples are being taken */
+    void endPass();
+
 
 
 protected:
+    typedef Radiance3 (PathTracer::*SampleFunc)(int, int, int, const Rect2D &, PixelAOVs *);
+
     World* m_world;
     PTSettings m_settings;
+    SampleFunc m_sample;    // sampleWith<m_settings.features()>
+    GuidingField m_guiding;
+    RadianceCache m_radianceCache;
+    const Medium *m_medium;    // the world's, if media are on and it is not a vacuum
+
+    /** The integrator for the PTSettings::Feature bits F. Each of the
+      * template functions below is compiled once per combination, with the
+      * feature tests folded away.
+      */
+    template <unsigned F>
+    Radiance3 sampleWith(int x, int y, int pass, const Rect2D &viewport, PixelAOVs *aovs);
+
+    /** &sampleWith<F> for each F, indexed by F */
+    template <size_t... F>
+    static const SampleFunc *sampleTable(std::index_sequence<F...>);
 
     /** TODO Your recursive raytracing function. This is the only function you
       * will need to modify for this assignment, but you can add additional
@@ -68,19 +139,59 @@ protected:
       * More info and links to G3D documentation are provided in the handout
       * for this assignment. Read the handout!
       */
+    template <unsigned F>
     Radiance3 trace( const Ray &ray,
+                     const RayDifferential &diff,
+                     Sampler &sampler,
                      bool isEyeRay,
-                     float *distance = NULL );
+                     float *distance = NULL,
+                     ShadingPoint *firstHit = NULL,
+                     RadianceComponents *components = NULL );
+
+    /** Radiance along @p ray, whose differentials are @p diff, with its
+      * random decisions taken from @p sampler; the
+      * distance to its first hit (infinite on a miss) is written to
+      * @p distance if given, and the hit itself to @p firstHit. At bounce
+      * 0 the radiance is also split into @p components if given.
+      */
+    template <unsigned F>
+    Radiance3 estimateL(const Ray &ray, const RayDifferential &diff, Sampler &sampler,
+                        int bounceNum, float *distance = NULL, ShadingPoint *firstHit = NULL,
+                        RadianceComponents *components = NULL);
+
+    /** Radiance leaving the first hit of @p ray, which found @p surf at
+      * @p dist if @p hit, back along it, ignoring any medium on the way
+      */
+    template <unsigned F>
+    Radiance3 surfaceL(const Ray &ray, const RayDifferential &diff, Sampler &sampler, int bounceNum,
+                       bool hit, float dist, const ShadingPoint &surf, RadianceComponents *components);
+
+    /** Radiance scattered toward -@p dir at @p point inside the medium,
+      * per unit scattering coefficient: emitters sampled through the
+      * medium plus one continued path
+      */
+    template <unsigned F>
+    Radiance3 mediumL(const Point3 &point, const Vector3 &dir, Sampler &sampler, int bounceNum,
+                      RadianceComponents *components);
+
+    /** Circle of confusion radius in pixels at camera depth @p z */
+    float circleOfConfusion(float z, float lensRadius, float pixelsPerMeter) const;
 
-    Radiance3 estimateL(const Ray &ray, int bounceNum);
+    /** Camera ray through pixel coordinates (x, y), with its differentials */
+    Ray cameraRay(float x, float y, const Rect2D &viewport, RayDifferential &diff) const;
 
-    Radiance3 calculateEmittedLight(shared_ptr<Surfel> surf, const Ray &ray);
+    Radiance3 calculateEmittedLight(const ShadingPoint &surf, const Ray &ray);
 
-    Radiance3 calculateDirectLighting(shared_ptr<Surfel> surf, const Ray &ray, int bounceNum);
+    /** The part of the result seen in mirrors is added to @p specular if given */
+    template <unsigned F>
+    Radiance3 calculateDirectLighting(const ShadingPoint &surf, const Ray &ray, Sampler &sampler, int bounceNum,
+                                      Radiance3 *specular = NULL);
 
-    Radiance3 calculateAreaLighting(shared_ptr<Surfel> surf, const Ray &ray, int bounceNum);
+    template <unsigned F>
+    Radiance3 calculateAreaLighting(const ShadingPoint &surf, const Ray &ray, Sampler &sampler, int bounceNum,
+                                    Radiance3 *specular = NULL);
 
-    Radiance3 calculateSpecular(shared_ptr<Surfel> surf, const Ray &ray);
+    Radiance3 calculateSpecular(const ShadingPoint &surf, const Ray &ray);
 
 };
 
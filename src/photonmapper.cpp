@@ -0,0 +1,268 @@
+#include "photonmapper.h"
+#include "memorytracker.h"
+#include "threadpool.h"
+
+#include <cmath>
+
+// Photons shot per task; tasks are the unit of parallel work
+static const int PHOTONS_PER_TASK = 4096;
+
+// Sampler dimensions of an eye path: pixel jitter, then per depth the
+// emitter choice and point for direct light
+enum { CAMERA_DIMENSIONS = 2, DEPTH_DIMENSIONS = 3 };
+
+// Direction around @p n with density cos / pi
+static Vector3 cosineHemisphere( const Vector3 &n, float u1, float u2 )
+{
+    Vector3 t, b;
+    n.getTangents(t, b);
+    const float r = sqrtf(u1);
+    const float phi = 2.f * pif() * u2;
+    return t * (r * cosf(phi)) + b * (r * sinf(phi)) + n * sqrtf(max(0.f, 1.f - u1));
+}
+
+// Whether @p sp scatters any light into a spread of directions, which is
+// where photons are stored and gathered
+static bool hasFiniteBSDF( const ShadingPoint &sp )
+{
+    return sp.lambertian.nonZero() || (sp.glossy.nonZero() && !BSDF::isMirror(sp));
+}
+
+PhotonMapper::PhotonMapper() :
+    m_world(NULL),
+    m_cellMask(0),
+    m_cellSize(1.f),
+    m_radius(0.f),
+    m_radius2(0.f)
+{ }
+
+void PhotonMapper::beginRender()
+{
+    Vector3 lo, hi;
+    m_world->bounds(lo, hi);
+    m_radius = max(m_settings.radius * (hi - lo).length(), 1e-4f);
+    m_radius2 = m_radius * m_radius;
+
+    m_photons.clear();
+    m_cellStart.clear();
+}
+
+void PhotonMapper::beginPass( int pass )
+{
+    // r_i^2 = r_{i-1}^2 (i - 1 + alpha) / i keeps the variance and bias of
+    // the average of all passes going to zero
+    if (pass > 0)
+        m_radius2 *= (pass - 1 + m_settings.alpha) / float(pass);
+    m_radius = sqrtf(m_radius2);
+
+    const int total = max(m_settings.photonsPerPass, 1);
+    const int numTasks = (total + PHOTONS_PER_TASK - 1) / PHOTONS_PER_TASK;
+    Array<Array<Photon>> stored;
+    stored.resize(numTasks);
+
+    if (m_world->lightsExist())
+    {
+        runTasks(numTasks, [&](int task) {
+            shoot(pass, task * PHOTONS_PER_TASK, min((task + 1) * PHOTONS_PER_TASK, total), total,
+                  stored[task]);
+        });
+    }
+
+    Array<Photon> photons;
+    for (int i = 0; i < numTasks; ++i)
+        photons.append(stored[i]);
+    buildGrid(photons);
+
+    MemoryTracker::global().set(MemoryTracker::PHOTON_MAP, sizeInBytes());
+}
+
+void PhotonMapper::shoot( int pass, int begin, int end, int total, Array<Photon> &stored )
+{
+    Random random(uint32(pass) * 0x9e3779b9u + uint32(begin), false);
+
+    for (int i = begin; i < end; ++i)
+    {
+        const float u = random.uniform();
+        const Point2 uv(random.uniform(), random.uniform());
+        Vector3 point, normal;
+        int material;
+        float prob, area;
+        m_world->emissivePoint(u, uv, point, material, normal, prob, area);
+
+        // Cosine distributed emission: flux Le cos / (p_A p_w) = Le pi / p_A
+        Power3 power = m_world->emittedRadiance(material, area) * (pif() / (prob * total));
+        const float u1 = random.uniform();
+        Vector3 dir = cosineHemisphere(normal, u1, random.uniform());
+        Ray ray = Ray::fromOriginAndDirection(point + normal * 1e-4f, dir);
+
+        for (int depth = 0; depth < m_settings.maxBounces; ++depth)
+        {
+            float dist;
+            ShadingPoint sp;
+            if (!m_world->intersect(ray, dist, sp, RayDifferential::coarsest()))
+                break;
+
+            const Vector3 wo = -ray.direction();
+
+            // Direct light is sampled at eye hits, so only photons that
+            // have bounced are kept
+            if (depth > 0 && hasFiniteBSDF(sp))
+            {
+                Photon &p = stored.next();
+                p.position = sp.position;
+                p.wi = wo;
+                p.power = power;
+            }
+
+            Color3 weight;
+            Vector3 wi;
+            bool impulse;
+            const float uLobe = random.uniform();
+            const Point2 uDir(random.uniform(), random.uniform());
+            if (!BSDF::scatter(sp, wo, uLobe, uDir, weight, wi, impulse))
+                break;
+
+            // Russian roulette by how much of the power survives
+            const float q = min(weight.max(), 1.f);
+            if (q <= 0.f || random.uniform() >= q)
+                break;
+            power *= weight / q;
+
+            ray = Ray::fromOriginAndDirection(sp.position + wi * 1e-3f, wi);
+        }
+    }
+}
+
+int PhotonMapper::cellHash( int x, int y, int z ) const
+{
+    const uint32 h = uint32(x) * 73856093u ^ uint32(y) * 19349663u ^ uint32(z) * 83492791u;
+    return int(h & uint32(m_cellMask));
+}
+
+void PhotonMapper::buildGrid( Array<Photon> &photons )
+{
+    m_cellSize = 2.f * m_radius;
+
+    int buckets = 1;
+    while (buckets < photons.size())
+        buckets <<= 1;
+    m_cellMask = buckets - 1;
+
+    // Counting sort by bucket, so the photons of a cell are contiguous
+    Array<int> bucketOf;
+    bucketOf.resize(photons.size());
+    m_cellStart.resize(buckets + 1);
+    for (int i = 0; i <= buckets; ++i)
+        m_cellStart[i] = 0;
+
+    for (int i = 0; i < photons.size(); ++i)
+    {
+        const Point3 &p = photons[i].position;
+        bucketOf[i] = cellHash(iFloor(p.x / m_cellSize), iFloor(p.y / m_cellSize), iFloor(p.z / m_cellSize));
+        ++m_cellStart[bucketOf[i] + 1];
+    }
+    for (int i = 0; i < buckets; ++i)
+        m_cellStart[i + 1] += m_cellStart[i];
+
+    Array<int> next;
+    next.resize(buckets);
+    for (int i = 0; i < buckets; ++i)
+        next[i] = m_cellStart[i];
+
+    m_photons.resize(photons.size());
+    for (int i = 0; i < photons.size(); ++i)
+        m_photons[next[bucketOf[i]]++] = photons[i];
+}
+
+Radiance3 PhotonMapper::gather( const ShadingPoint &sp, const Vector3 &wo ) const
+{
+    if (m_photons.size() == 0)
+        return Radiance3::zero();
+
+    const Point3 &p = sp.position;
+    const int x0 = iFloor((p.x - m_radius) / m_cellSize), x1 = iFloor((p.x + m_radius) / m_cellSize);
+    const int y0 = iFloor((p.y - m_radius) / m_cellSize), y1 = iFloor((p.y + m_radius) / m_cellSize);
+    const int z0 = iFloor((p.z - m_radius) / m_cellSize), z1 = iFloor((p.z + m_radius) / m_cellSize);
+
+    // Cells can share a bucket; each bucket is read once. Rounding can
+    // widen the span to three cells on an axis
+    int visited[27];
+    int numVisited = 0;
+
+    Radiance3 sum = Radiance3::zero();
+    for (int z = z0; z <= z1; ++z)
+        for (int y = y0; y <= y1; ++y)
+            for (int x = x0; x <= x1; ++x)
+            {
+                const int bucket = cellHash(x, y, z);
+                bool seen = false;
+                for (int i = 0; i < numVisited; ++i)
+                    seen = seen || visited[i] == bucket;
+                if (seen)
+                    continue;
+                visited[numVisited++] = bucket;
+
+                for (int i = m_cellStart[bucket]; i < m_cellStart[bucket + 1]; ++i)
+                {
+                    const Photon &photon = m_photons[i];
+                    if ((photon.position - p).squaredLength() < m_radius2)
+                        sum += BSDF::evaluate(sp, photon.wi, wo) * photon.power;
+                }
+            }
+
+    return sum / (pif() * m_radius2);
+}
+
+Radiance3 PhotonMapper::trace( const Ray &ray, Sampler &sampler, int depth )
+{
+    float dist;
+    ShadingPoint sp;
+    if (!m_world->intersect(ray, dist, sp, RayDifferential::coarsest()))
+    {
+        if (!m_settings.useSky)
+            return Radiance3::zero();
+        const Color4 sky = m_world->skycube().getIntersectedColor(ray);
+        return Radiance3(sky.r, sky.g, sky.b);
+    }
+
+    const Vector3 wo = -ray.direction();
+
+    // Eye paths only continue through impulses, so emitters they reach
+    // are not sampled by direct lighting
+    Radiance3 L = BSDF::emitted(sp, wo);
+
+    if (hasFiniteBSDF(sp))
+    {
+        sampler.setDimension(CAMERA_DIMENSIONS + depth * DEPTH_DIMENSIONS);
+        const float u = sampler.next();
+        L += m_world->sampleDirect(sp, wo, u, sampler.next2D());
+        L += gather(sp, wo);
+    }
+
+    if (depth + 1 < m_settings.maxBounces)
+    {
+        Vector3 wi[2];
+        Color3 weight[2];
+        const int n = BSDF::impulses(sp, wo, wi, weight);
+        for (int i = 0; i < n; ++i)
+            L += weight[i] * trace(Ray::fromOriginAndDirection(sp.position + wi[i] * 1e-3f, wi[i]),
+                                   sampler, depth + 1);
+    }
+
+    return L;
+}
+
+Radiance3 PhotonMapper::sample( int x, int y, int pass, const Rect2D &viewport )
+{
+    Sampler sampler(m_settings.sampler, x, y, pass);
+    const Point2 jitter = sampler.next2D();
+    const Ray ray = m_world->camera()->worldRay(x + jitter.x, y + jitter.y, viewport);
+
+    const Radiance3 L = trace(ray, sampler, 0);
+    return Radiance3(clamp(L.r, 0.f, 10.f), clamp(L.g, 0.f, 10.f), clamp(L.b, 0.f, 10.f));
+}
+
+size_t PhotonMapper::sizeInBytes() const
+{
+    return m_photons.size() * sizeof(Photon) + m_cellStart.size() * sizeof(int);
+}
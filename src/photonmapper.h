@@ -0,0 +1,89 @@
+#ifndef PHOTONMAPPER_H
+#define PHOTONMAPPER_H
+
+#include <G3D/G3DAll.h>
+#include "world.h"
+#include "sampler.h"
+
+class PhotonSettings
+{
+public:
+
+    int photonsPerPass = 200000;
+    float radius = 0.005f;      // initial gather radius, as a fraction of the scene diagonal
+    float alpha = 0.7f;         // fraction of the photons kept as the radius shrinks
+    int maxBounces = 8;         // of photon paths, and of eye paths through impulses
+    bool useSky = false;        // eye paths that miss see the SkyCube
+    Sampler::Type sampler = Sampler::SOBOL;
+};
+
+/** Light carried by a photon that landed on a surface */
+struct Photon
+{
+    Point3      position;
+    Vector3     wi;         // toward where it came from
+    Power3      power;
+};
+
+/** Progressive photon mapping (Knaus and Zwicker, "Progressive Photon
+  * Mapping: A Probabilistic Approach", 2011). Every pass shoots a new set
+  * of photons from the emitters in parallel and sorts those that have
+  * bounced at least once into a hash grid. Eye paths follow mirror and
+  * refraction impulses; where a surface has a finite BSDF, direct light is
+  * sampled from the emitters and indirect light, caustics included, is
+  * estimated from the density of nearby photons.
+  *
+  * Each pass's image is an independent estimate with a gather radius that
+  * shrinks from pass to pass, so the running average App keeps converges
+  * to the right answer.
+  */
+class PhotonMapper
+{
+public:
+
+    PhotonMapper();
+
+    void setWorld( World *world ) { m_world = world; }
+    void setSettings( const PhotonSettings &settings ) { m_settings = settings; }
+
+    /** To be called once the world has finished loading */
+    void beginRender();
+
+    /** Shoots and sorts this pass's photons; to be called before the pass,
+      * while no samples are being taken
+      */
+    void beginPass( int pass );
+
+    /** Radiance through pixel (x, y) for pass @p pass */
+    Radiance3 sample( int x, int y, int pass, const Rect2D &viewport );
+
+    size_t sizeInBytes() const;
+
+private:
+
+    /** Shoots photons [begin, end) of @p total, appending those stored */
+    void shoot( int pass, int begin, int end, int total, Array<Photon> &stored );
+
+    /** Sorts m_photons by grid cell */
+    void buildGrid( Array<Photon> &photons );
+
+    int cellHash( int x, int y, int z ) const;
+
+    Radiance3 trace( const Ray &ray, Sampler &sampler, int depth );
+
+    /** Density estimate of the photons' light scattered toward @p wo */
+    Radiance3 gather( const ShadingPoint &sp, const Vector3 &wo ) const;
+
+    World *         m_world;
+    PhotonSettings  m_settings;
+
+    Array<Photon>   m_photons;      // sorted by cell
+    Array<int>      m_cellStart;    // m_photons index of each hash bucket, and the end
+    int             m_cellMask;
+    float           m_cellSize;     // twice the radius, so a gather reads 2x2x2 cells
+
+    float           m_radius;       // this pass's gather radius
+    float           m_radius2;      // its square
+};
+
+#endif // PHOTONMAPPER_H
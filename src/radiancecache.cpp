@@ -0,0 +1,158 @@
+#include "radiancecache.h"
+#include "memorytracker.h"
+
+#include <cmath>
+#include <new>
+
+// Cells probed past the hashed one before a lookup or insert gives up
+static const int MAX_PROBES = 8;
+
+// Levels of cell size, each twice the one before
+static const int MAX_LEVEL = 15;
+
+static uint64 mix64( uint64 x )
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static void atomicAdd( std::atomic<float> &a, float value )
+{
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+        ;
+}
+
+RadianceCache::RadianceCache() :
+    m_cells(NULL),
+    m_numCells(0),
+    m_cellSize(1.f),
+    m_full(false)
+{ }
+
+void RadianceCache::reset( float cellSize, int log2Cells )
+{
+    m_arena.reset();
+    m_numCells = 1 << log2Cells;
+    m_cellSize = max(cellSize, 1e-4f);
+    m_full = false;
+    m_cells = m_arena.alloc<Cell>(m_numCells);
+
+    for (int i = 0; i < m_numCells; ++i)
+    {
+        Cell *c = new (&m_cells[i]) Cell;
+        c->key.store(0, std::memory_order_relaxed);
+        for (int k = 0; k < 3; ++k)
+            c->sum[k].store(0.f, std::memory_order_relaxed);
+        c->count.store(0, std::memory_order_relaxed);
+        c->value = Radiance3::zero();
+        c->resolved = false;
+    }
+
+    MemoryTracker::global().set(MemoryTracker::RADIANCE_CACHE, sizeInBytes());
+}
+
+uint64 RadianceCache::hashKey( const Point3 &p, const Vector3 &n, float footprint ) const
+{
+    // Cells at least as wide as the footprint, so that wide rays average
+    // over a matching area
+    int level = 0;
+    if (footprint > m_cellSize)
+        level = min(int(ceilf(log2f(footprint / m_cellSize))), MAX_LEVEL);
+    const float size = ldexpf(m_cellSize, level);
+
+    // Dominant axis and sign of the normal
+    const Vector3 a = n.abs();
+    const int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    const int face = 2 * axis + (n[axis] < 0.f ? 1 : 0);
+
+    const uint64 x = uint64(int64(floorf(p.x / size))) & 0xfffff;
+    const uint64 y = uint64(int64(floorf(p.y / size))) & 0xfffff;
+    const uint64 z = uint64(int64(floorf(p.z / size))) & 0xfffff;
+    return mix64((x | (y << 20) | (z << 40)) ^ (uint64(level * 6 + face) << 60) ^
+                 (uint64(level * 6 + face) * 0x9e3779b97f4a7c15ull));
+}
+
+int RadianceCache::find( uint64 key, bool insert ) const
+{
+    // The high half fingerprints the cell, the low half places it
+    const uint32 fingerprint = uint32(key >> 32) | 1u;
+    const int mask = m_numCells - 1;
+
+    for (int i = 0; i < MAX_PROBES; ++i)
+    {
+        const int index = int((uint32(key) + i) & mask);
+        Cell &c = m_cells[index];
+
+        uint32 k = c.key.load(std::memory_order_acquire);
+        if (k == fingerprint)
+            return index;
+        if (k != 0)
+            continue;
+        if (!insert)
+            return -1;
+
+        if (c.key.compare_exchange_strong(k, fingerprint, std::memory_order_acq_rel) || k == fingerprint)
+            return index;
+    }
+
+    return -1;
+}
+
+bool RadianceCache::lookup( const Point3 &p, const Vector3 &n, float footprint, Radiance3 &value ) const
+{
+    if (!m_cells)
+        return false;
+
+    const int i = find(hashKey(p, n, footprint), false);
+    if (i < 0 || !m_cells[i].resolved)
+        return false;
+
+    value = m_cells[i].value;
+    return true;
+}
+
+void RadianceCache::record( const Point3 &p, const Vector3 &n, float footprint, const Radiance3 &value )
+{
+    if (!m_cells || !value.isFinite())
+        return;
+
+    const int i = find(hashKey(p, n, footprint), true);
+    if (i < 0)
+        return;
+
+    Cell &c = m_cells[i];
+    atomicAdd(c.sum[0], value.r);
+    atomicAdd(c.sum[1], value.g);
+    atomicAdd(c.sum[2], value.b);
+    c.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RadianceCache::endPass()
+{
+    int used = 0;
+    for (int i = 0; i < m_numCells; ++i)
+    {
+        Cell &c = m_cells[i];
+        const uint32 count = c.count.load(std::memory_order_relaxed);
+        if (count == 0)
+            continue;
+
+        c.value = Radiance3(c.sum[0].load(std::memory_order_relaxed),
+                            c.sum[1].load(std::memory_order_relaxed),
+                            c.sum[2].load(std::memory_order_relaxed)) / float(count);
+        c.resolved = true;
+        ++used;
+    }
+
+    if (used > m_numCells / 2 && !m_full)
+    {
+        m_full = true;
+        printf("Radiance cache: %d of %d cells in use; lookups will start to fail\n", used, m_numCells);
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include <G3D/G3DAll.h>
+
+#include <atomic>
+
+#include "hugepagearena.h"
+
+/** World space radiance cache: outgoing radiance of diffuse-looking
+  * surfaces averaged over cells of a spatial hash grid, which paths can
+  * terminate into instead of tracing further bounces.
+  *
+  * A cell is keyed by its position on a grid whose spacing grows in powers
+  * of two with the footprint of the rays that reach it, and by the
+  * dominant axis of the surface normal, so the two sides of a wall and
+  * perpendicular faces meeting at a corner do not share light. The table
+  * has a fixed size and uses open addressing with atomic keys; record()
+  * accumulates with atomic adds, so any number of threads can write while
+  * others read. lookup() reads the averages resolved by endPass(), which
+  * stay fixed during a pass.
+  */
+class RadianceCache
+{
+public:
+
+    RadianceCache();
+
+    /** Empties the cache and sizes it at 2^@p log2Cells cells of at least
+      * @p cellSize world units
+      */
+    void reset( float cellSize, int log2Cells );
+
+    /** Radiance cached at @p p with normal @p n for rays of width
+      * @p footprint; false if the cell has no samples yet
+      */
+    bool lookup( const Point3 &p, const Vector3 &n, float footprint, Radiance3 &value ) const;
+
+    /** Adds a sample of outgoing radiance; lock-free */
+    void record( const Point3 &p, const Vector3 &n, float footprint, const Radiance3 &value );
+
+    /** Makes this pass's samples visible to lookup(); to be called between
+      * passes, never during one
+      */
+    void endPass();
+
+    float cellSize() const { return m_cellSize; }
+
+    size_t sizeInBytes() const { return m_numCells * sizeof(Cell); }
+
+private:
+
+    struct Cell
+    {
+        std::atomic<uint32> key;        // 0 for an empty cell
+        std::atomic<float>  sum[3];     // every sample so far
+        std::atomic<uint32> count;
+        Radiance3           value;      // sum / count as of the last endPass()
+        bool                resolved;
+    };
+
+    uint64 hashKey( const Point3 &p, const Vector3 &n, float footprint ) const;
+
+    /** Index of the cell for @p key, inserting it if @p insert; -1 if it
+      * is missing or the probe sequence is full
+      */
+    int find( uint64 key, bool insert ) const;
+
+    HugePageArena       m_arena;
+    Cell *              m_cells;
+    int                 m_numCells;
+    float               m_cellSize;
+    bool                m_full;         // reported running out of cells
+};
+
+#endif // RADIANCECACHE_H
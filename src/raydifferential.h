@@ -0,0 +1,125 @@
+#ifndef RAYDIFFERENTIAL_H
+#define RAYDIFFERENTIAL_H
+
+#include <G3D/G3DAll.h>
+
+/** Ray differentials (Igehy 1999): how a ray's origin and unit direction
+  * change from one pixel to the next in x and y. They are carried along a
+  * path so that every hit knows how wide its pixel's footprint is, which
+  * picks texture and environment map mip levels.
+  *
+  * Transfer and mirror reflection are exact for flat surfaces; other
+  * bounces widen the direction differentials by the roughness of the lobe
+  * instead of differentiating the BSDF sample.
+  */
+struct RayDifferential
+{
+    Vector3 dPdx, dPdy;     // origin
+    Vector3 dDdx, dDdy;     // direction
+    bool    coarse;         // footprint treated as unbounded
+
+    RayDifferential() :
+        dPdx(Vector3::zero()), dPdy(Vector3::zero()),
+        dDdx(Vector3::zero()), dDdy(Vector3::zero()),
+        coarse(false)
+    { }
+
+    /** Differentials of @p ray from the rays @p rx and @p ry through the
+      * next pixel in x and in y
+      */
+    static RayDifferential fromRays( const Ray &ray, const Ray &rx, const Ray &ry )
+    {
+        RayDifferential d;
+        d.dPdx = rx.origin() - ray.origin();
+        d.dPdy = ry.origin() - ray.origin();
+        d.dDdx = rx.direction() - ray.direction();
+        d.dDdy = ry.direction() - ray.direction();
+        return d;
+    }
+
+    /** Differentials for samples @p s pixels apart, e.g. 1/n for n x n
+      * supersampling
+      */
+    RayDifferential scaled( float s ) const
+    {
+        RayDifferential d = *this;
+        d.dPdx *= s;
+        d.dPdy *= s;
+        d.dDdx *= s;
+        d.dDdy *= s;
+        return d;
+    }
+
+    /** For rays that only test visibility or emission; lookups read the
+      * smallest mip levels
+      */
+    static RayDifferential coarsest()
+    {
+        RayDifferential d;
+        d.coarse = true;
+        return d;
+    }
+
+    /** Moves the origin differentials along a ray with direction @p D to
+      * the hit @p t away, on a surface with normal @p n
+      */
+    void transfer( const Vector3 &D, float t, const Vector3 &n )
+    {
+        const float dn = D.dot(n);
+        dPdx += dDdx * t;
+        dPdy += dDdy * t;
+        if (fabsf(dn) > 1e-6f)
+        {
+            dPdx -= D * (dPdx.dot(n) / dn);
+            dPdy -= D * (dPdy.dot(n) / dn);
+        }
+    }
+
+    /** Width of the footprint on the surface hit @p t along @p D */
+    float footprint( const Vector3 &D, float t, const Vector3 &n ) const
+    {
+        if (coarse)
+            return finf();
+
+        RayDifferential d = *this;
+        d.transfer(D, t, n);
+        return max(d.dPdx.length(), d.dPdy.length());
+    }
+
+    /** Angular width, for environment lookups */
+    float spread() const
+    {
+        return coarse ? finf() : max(dDdx.length(), dDdy.length());
+    }
+
+    /** Differentials of the ray leaving in direction @p wi after a bounce
+      * of a ray in direction @p D, once transferred to the surface with
+      * normal @p n. Reflections mirror the direction differentials and
+      * transmissions keep them; @p roughness radians are added for lobes
+      * that are not perfectly specular.
+      */
+    RayDifferential scatter( const Vector3 &D, const Vector3 &wi, const Vector3 &n, float roughness ) const
+    {
+        RayDifferential out = *this;
+        if (coarse)
+            return out;
+
+        if (D.dot(n) * wi.dot(n) < 0.f)
+        {
+            out.dDdx = dDdx - n * (2.f * dDdx.dot(n));
+            out.dDdy = dDdy - n * (2.f * dDdy.dot(n));
+        }
+
+        if (roughness > 0.f)
+        {
+            Vector3 t1, t2;
+            wi.getTangents(t1, t2);
+            out.dDdx = t1 * (out.dDdx.length() + roughness);
+            out.dDdy = t2 * (out.dDdy.length() + roughness);
+        }
+
+        return out;
+    }
+};
+
+#endif // RAYDIFFERENTIAL_H
@@ -0,0 +1,58 @@
+#include "raytracer.h"
+#include "sampler.h"
+
+// Sampler dimensions of each depth: emitter choice and point
+static const int DEPTH_DIMENSIONS = 3;
+
+RayTracer::RayTracer() :
+    m_world(NULL)
+{ }
+
+Radiance3 RayTracer::trace( const Ray &ray, int x, int y, int depth )
+{
+    float dist;
+    ShadingPoint sp;
+    if (!m_world->intersect(ray, dist, sp, RayDifferential::coarsest()))
+    {
+        if (!m_settings.useSky)
+            return Radiance3::zero();
+        const Color4 sky = m_world->skycube().getIntersectedColor(ray);
+        return Radiance3(sky.r, sky.g, sky.b);
+    }
+
+    const Vector3 wo = -ray.direction();
+    Radiance3 L = BSDF::emitted(sp, wo) + sp.lambertian * m_settings.ambient;
+
+    if (m_world->lightsExist() && (sp.lambertian.nonZero() || (sp.glossy.nonZero() && !BSDF::isMirror(sp))))
+    {
+        const int n = max(m_settings.shadowSamples, 1);
+        Radiance3 direct = Radiance3::zero();
+        for (int s = 0; s < n; ++s)
+        {
+            Sampler sampler(Sampler::SOBOL, x, y, s);
+            sampler.setDimension(depth * DEPTH_DIMENSIONS);
+            const float u = sampler.next();
+            direct += m_world->sampleDirect(sp, wo, u, sampler.next2D());
+        }
+        L += direct / float(n);
+    }
+
+    if (depth + 1 < m_settings.maxBounces)
+    {
+        Vector3 wi[2];
+        Color3 weight[2];
+        const int n = BSDF::impulses(sp, wo, wi, weight);
+        for (int i = 0; i < n; ++i)
+            L += weight[i] * trace(Ray::fromOriginAndDirection(sp.position + wi[i] * 1e-3f, wi[i]),
+                                   x, y, depth + 1);
+    }
+
+    return L;
+}
+
+Radiance3 RayTracer::sample( int x, int y, const Rect2D &viewport )
+{
+    const Ray ray = m_world->camera()->worldRay(x + 0.5f, y + 0.5f, viewport);
+    const Radiance3 L = trace(ray, x, y, 0);
+    return Radiance3(clamp(L.r, 0.f, 10.f), clamp(L.g, 0.f, 10.f), clamp(L.b, 0.f, 10.f));
+}
@@ -0,0 +1,43 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include <G3D/G3DAll.h>
+#include "world.h"
+
+class RaySettings
+{
+public:
+
+    int shadowSamples = 4;      // emitter points per hit with a finite BSDF
+    int maxBounces = 6;         // mirror and refraction hops
+    float ambient = 0.05f;      // flat fill light on the Lambertian lobe
+    bool useSky = false;        // rays that miss see the SkyCube
+};
+
+/** Whitted-style ray tracing for interactive preview: one ray through each
+  * pixel center, direct light from a few emitter samples with shadow rays,
+  * a flat ambient term and perfect mirror and refraction impulses only.
+  * The shadow samples are the first points of the pixel's Sobol sequence,
+  * so the image is the same from frame to frame for a still camera.
+  */
+class RayTracer
+{
+public:
+
+    RayTracer();
+
+    void setWorld( World *world ) { m_world = world; }
+    void setSettings( const RaySettings &settings ) { m_settings = settings; }
+
+    /** Radiance through the center of pixel (x, y) */
+    Radiance3 sample( int x, int y, const Rect2D &viewport );
+
+private:
+
+    Radiance3 trace( const Ray &ray, int x, int y, int depth );
+
+    World *         m_world;
+    RaySettings     m_settings;
+};
+
+#endif // RAYTRACER_H
@@ -0,0 +1,228 @@
+#include "sampler.h"
+
+#include <cmath>
+
+static uint32 mix32(uint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32 reverseBits(uint32 x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Laine and Karras' hash, which only lets bits affect higher bits, so
+// applied to bit-reversed values it is an Owen scramble
+static uint32 laineKarras(uint32 x, uint32 seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static uint32 owenScramble(uint32 x, uint32 seed)
+{
+    return reverseBits(laineKarras(reverseBits(x), seed));
+}
+
+// Sobol direction numbers for the first four dimensions, from Joe and
+// Kuo's primitive polynomials and initial values
+struct SobolDirections
+{
+    uint32 v[4][32];
+
+    SobolDirections()
+    {
+        for (int k = 0; k < 32; ++k)
+            v[0][k] = 1u << (31 - k);
+
+        static const int s[3] = { 1, 2, 3 };
+        static const uint32 a[3] = { 0, 1, 1 };
+        static const uint32 m[3][3] = { { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+        for (int d = 1; d < 4; ++d)
+        {
+            const int sd = s[d - 1];
+            for (int k = 0; k < 32; ++k)
+            {
+                if (k < sd)
+                {
+                    v[d][k] = m[d - 1][k] << (31 - k);
+                    continue;
+                }
+                uint32 x = v[d][k - sd] ^ (v[d][k - sd] >> sd);
+                for (int j = 1; j < sd; ++j)
+                    if ((a[d - 1] >> (sd - 1 - j)) & 1)
+                        x ^= v[d][k - j];
+                v[d][k] = x;
+            }
+        }
+    }
+};
+
+static uint32 sobol(uint32 index, int dim)
+{
+    static const SobolDirections directions;
+
+    uint32 x = 0;
+    for (int k = 0; index; index >>= 1, ++k)
+        if (index & 1)
+            x ^= directions.v[dim][k];
+    return x;
+}
+
+// A 64x64 tileable blue noise mask with values in [0, 1), made with
+// Ulichney's void-and-cluster method: points are ranked by repeatedly
+// taking the tightest cluster out of, or filling the largest void in, a
+// binary pattern, measured by a Gaussian energy on the torus.
+struct BlueNoiseMask
+{
+    enum { N = 64 };
+
+    float value[N * N];
+
+    BlueNoiseMask()
+    {
+        float kernel[N * N];
+        const float sigma2 = 2.f * 1.5f * 1.5f;
+        for (int y = 0; y < N; ++y)
+            for (int x = 0; x < N; ++x)
+            {
+                const int dx = min(x, N - x), dy = min(y, N - y);
+                kernel[y * N + x] = expf(-float(dx * dx + dy * dy) / sigma2);
+            }
+
+        bool on[N * N];
+        float energy[N * N];
+        int rank[N * N];
+        for (int i = 0; i < N * N; ++i)
+        {
+            on[i] = false;
+            energy[i] = 0.f;
+        }
+
+        auto toggle = [&](int i) {
+            on[i] = !on[i];
+            const float sign = on[i] ? 1.f : -1.f;
+            const int ix = i % N, iy = i / N;
+            for (int y = 0; y < N; ++y)
+                for (int x = 0; x < N; ++x)
+                    energy[y * N + x] += sign * kernel[((y - iy + N) % N) * N + (x - ix + N) % N];
+        };
+        auto tightestCluster = [&]() {
+            int best = -1;
+            for (int i = 0; i < N * N; ++i)
+                if (on[i] && (best < 0 || energy[i] > energy[best]))
+                    best = i;
+            return best;
+        };
+        auto largestVoid = [&]() {
+            int best = -1;
+            for (int i = 0; i < N * N; ++i)
+                if (!on[i] && (best < 0 || energy[i] < energy[best]))
+                    best = i;
+            return best;
+        };
+
+        // Initial pattern: a tenth of the points at random, relaxed by
+        // moving the tightest cluster into the largest void until stable
+        Random random(0x5eed, false);
+        int ones = 0;
+        while (ones < N * N / 10)
+        {
+            const int i = random.integer(0, N * N - 1);
+            if (!on[i])
+            {
+                toggle(i);
+                ++ones;
+            }
+        }
+        for (int iter = 0; iter < N * N; ++iter)
+        {
+            const int c = tightestCluster();
+            toggle(c);
+            const int v = largestVoid();
+            toggle(v);
+            if (v == c)
+                break;
+        }
+
+        bool initial[N * N];
+        float initialEnergy[N * N];
+        memcpy(initial, on, sizeof(on));
+        memcpy(initialEnergy, energy, sizeof(energy));
+
+        for (int r = ones - 1; r >= 0; --r)
+        {
+            const int c = tightestCluster();
+            toggle(c);
+            rank[c] = r;
+        }
+
+        memcpy(on, initial, sizeof(on));
+        memcpy(energy, initialEnergy, sizeof(energy));
+        for (int r = ones; r < N * N; ++r)
+        {
+            const int v = largestVoid();
+            toggle(v);
+            rank[v] = r;
+        }
+
+        for (int i = 0; i < N * N; ++i)
+            value[i] = (rank[i] + 0.5f) / float(N * N);
+    }
+};
+
+static float blueNoise(int x, int y)
+{
+    static const BlueNoiseMask mask;
+    return mask.value[(y & (BlueNoiseMask::N - 1)) * BlueNoiseMask::N + (x & (BlueNoiseMask::N - 1))];
+}
+
+Sampler::Sampler( Type type, int x, int y, int index ) :
+    m_type(type),
+    m_index(uint32(index)),
+    m_seed(type == SOBOL ? mix32(uint32(x) * 0x8da6b343u ^ uint32(y) * 0xd8163841u) : 0x3c6ef372u),
+    m_x(x),
+    m_y(y),
+    m_dim(0)
+{ }
+
+float Sampler::next()
+{
+    const int dim = m_dim++;
+
+    if (m_type == RANDOM)
+        return Random::common().uniform();
+
+    // Each group of four dimensions is a differently shuffled copy of the
+    // 4D Sobol points, scrambled per dimension
+    const uint32 group = mix32(m_seed ^ mix32(uint32(dim / 4) + 1u));
+    const uint32 i = owenScramble(m_index, group);
+    uint32 v = owenScramble(sobol(i, dim % 4), mix32(group + uint32(dim % 4)));
+
+    if (m_type == BLUE_NOISE)
+    {
+        // Toroidal shift by the mask, read at a different offset for each
+        // dimension so that dimensions are not correlated
+        const uint32 h = mix32(uint32(dim) + 0x9e3779b9u);
+        const float shift = blueNoise(m_x + int(h & 63u), m_y + int((h >> 6) & 63u));
+        v += uint32(double(shift) * 4294967296.0);
+    }
+
+    return float(v >> 8) * (1.f / 16777216.f);
+}
@@ -0,0 +1,51 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <G3D/G3DAll.h>
+
+/** Sample values in [0, 1) for one path, one dimension at a time. A path is
+  * sample @p index of pixel (x, y); the integrator assigns every random
+  * decision along it (pixel jitter, lens position, lobe and direction
+  * choices, roulette, light selection) its own dimension, so that
+  * low discrepancy types stratify each of them across a pixel's samples.
+  *
+  * SOBOL is the Sobol sequence with hash-based Owen scrambling (Burley,
+  * "Practical Hash-based Owen Scrambling", JCGT 2020), padded past four
+  * dimensions by scrambling the index per group of four. BLUE_NOISE uses
+  * the same points with a scramble shared by all pixels, each pixel offset
+  * toroidally by a blue noise mask, so that the error left after a few
+  * samples looks like high frequency noise rather than blotches.
+  */
+class Sampler
+{
+public:
+
+    enum Type { RANDOM, SOBOL, BLUE_NOISE };
+
+    Sampler( Type type, int x, int y, int index );
+
+    /** Next dimension's value */
+    float next();
+
+    Point2 next2D()
+    {
+        const float u = next();
+        return Point2(u, next());
+    }
+
+    /** Continues at dimension @p dim, e.g. the start of a bounce */
+    void setDimension( int dim ) { m_dim = dim; }
+
+    int dimension() const { return m_dim; }
+
+private:
+
+    Type        m_type;
+    uint32      m_index;
+    uint32      m_seed;     // per pixel for SOBOL, shared for BLUE_NOISE
+    int         m_x;
+    int         m_y;
+    int         m_dim;
+};
+
+#endif // SAMPLER_H
@@ -0,0 +1,713 @@
+#include "scenecache.h"
+
+#include <cctype>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIR ".scenecache"
+#define SECTION_ALIGN SceneCache::PAGE_BYTES
+
+static const char MAGIC[8] = { 'P', 'A', 'T', 'H', 'S', 'C', 'N', '\0' };
+
+// 64-bit FNV-1a
+static uint64 hashBytes( uint64 h, const void *data, size_t size )
+{
+    const uint8 *p = static_cast<const uint8*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64 hashString( uint64 h, const String &s )
+{
+    return hashBytes(h, s.c_str(), s.size());
+}
+
+// Size and modification time; cheaper than hashing the contents of large models
+static uint64 hashFileStamp( uint64 h, const String &filename )
+{
+    struct stat st;
+    h = hashString(h, filename);
+    if (stat(filename.c_str(), &st) == 0)
+    {
+        int64 stamp[2] = { int64(st.st_size), int64(st.st_mtime) };
+        h = hashBytes(h, stamp, sizeof(stamp));
+    }
+    return h;
+}
+
+// Appends the images a .mtl file references (map_Kd, map_Ks, bump, ...),
+// named by the last token of their line, relative to the .mtl
+static void materialTextures( const String &mtlFilename, Array<String> &files )
+{
+    if (!FileSystem::exists(mtlFilename))
+        return;
+
+    const String base = FilePath::parent(mtlFilename);
+    const std::string text = readWholeFile(mtlFilename).c_str();
+
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = text.find('\n', begin);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string line = text.substr(begin, end - begin);
+        begin = end + 1;
+
+        while (!line.empty() && isspace((unsigned char)line[line.size() - 1]))
+            line.erase(line.size() - 1);
+        const size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        line = line.substr(first);
+
+        const bool texture = line.compare(0, 4, "map_") == 0 || line.compare(0, 4, "bump") == 0 ||
+                             line.compare(0, 4, "disp") == 0 || line.compare(0, 4, "norm") == 0 ||
+                             line.compare(0, 5, "decal") == 0;
+        const size_t last = line.find_last_of(" \t");
+        if (!texture || last == std::string::npos)
+            continue;
+
+        const String name = line.substr(last + 1).c_str();
+        files.append(FileSystem::exists(name) ? name : FilePath::concat(base, name));
+    }
+}
+
+static uint64 align( uint64 offset )
+{
+    return (offset + SECTION_ALIGN - 1) & ~uint64(SECTION_ALIGN - 1);
+}
+
+SceneCache::SceneCache() :
+    m_data(NULL),
+    m_size(0),
+    m_header(NULL)
+{ }
+
+SceneCache::~SceneCache()
+{
+    close();
+}
+
+String SceneCache::cacheFilename( const String &scenePath )
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin",
+             (unsigned long long)hashString(14695981039346656037ull, FilePath::canonicalize(scenePath)));
+    return FilePath::concat(CACHE_DIR, name);
+}
+
+uint64 SceneCache::sourceHash( const String &scenePath, const Any &scene, const BVHSettings &settings )
+{
+    uint64 h = 14695981039346656037ull;
+
+    uint32 version = VERSION;
+    h = hashBytes(h, &version, sizeof(version));
+
+    // The scene file itself is small; hash its contents
+    h = hashString(h, scene.unparse());
+
+    int32 bvh[4] = { settings.spatialSplits, settings.maxLeafSize, settings.numBins, 0 };
+    float bvhf[2] = { settings.splitBudget, settings.splitAlpha };
+    h = hashBytes(h, bvh, sizeof(bvh));
+    h = hashBytes(h, bvhf, sizeof(bvhf));
+
+    Array<String> files;
+    sourceFiles(scenePath, scene, files);
+    for (int i = 0; i < files.size(); ++i)
+        h = hashFileStamp(h, files[i]);
+
+    return h;
+}
+
+void SceneCache::sourceFiles( const String &scenePath, const Any &scene, Array<String> &files )
+{
+    if (!scene.containsKey("models"))
+        return;
+
+    const String base = FilePath::parent(scenePath);
+    const Table<String, Any> &models = scene["models"].table();
+
+    const Array<String> &keys = models.getKeys();
+
+    for (int i = 0; i < keys.size(); ++i)
+    {
+        const Any &spec = models[keys[i]];
+        if (spec.type() != Any::TABLE || !spec.containsKey("filename"))
+            continue;
+
+        String filename = spec["filename"].string();
+        if (!FileSystem::exists(filename))
+            filename = FilePath::concat(base, filename);
+
+        const String mtl = FilePath::concat(FilePath::parent(filename), FilePath::base(filename) + ".mtl");
+        files.append(filename);
+        files.append(mtl);
+        materialTextures(mtl, files);
+    }
+}
+
+// Texture::Specification of an image loaded from a file, with the encoding
+// G3D reads it through (the material's constant factor on the map)
+static Any textureSpecAny( const shared_ptr<Texture> &texture )
+{
+    Any spec(Any::TABLE, "Texture::Specification");
+    spec["filename"] = texture->name();
+    spec["encoding"] = texture->encoding().toAny();
+    return spec;
+}
+
+// A component as its source image, or where it is constant as its value;
+// constants are 1x1 textures, whose mean is exact in every channel
+static Any componentAny( const shared_ptr<Texture> &texture, const Any &constant )
+{
+    if (texture && FileSystem::exists(texture->name()))
+        return textureSpecAny(texture);
+    return constant;
+}
+
+Any SceneCache::materialToAny( const shared_ptr<Material> &material )
+{
+    Any any(Any::TABLE, "UniversalMaterial::Specification");
+
+    shared_ptr<UniversalMaterial> m = dynamic_pointer_cast<UniversalMaterial>(material);
+    if (!m)
+        return any;
+
+    const shared_ptr<UniversalBSDF> &bsdf = m->bsdf();
+    any["lambertian"] = componentAny(bsdf->lambertian().texture(), bsdf->lambertian().mean().toAny());
+    any["glossy"] = componentAny(bsdf->glossy().texture(), bsdf->glossy().mean().toAny());
+    any["transmissive"] = componentAny(bsdf->transmissive().texture(), bsdf->transmissive().mean().toAny());
+    any["emissive"] = componentAny(m->emissive().texture(), m->emissive().mean().toAny());
+    any["etaTransmit"] = bsdf->etaTransmit();
+    any["etaReflect"] = bsdf->etaReflect();
+
+    const shared_ptr<BumpMap> &bump = m->bump();
+    if (bump && bump->normalBumpMap() && bump->normalBumpMap()->texture() &&
+        FileSystem::exists(bump->normalBumpMap()->texture()->name()))
+    {
+        Any spec(Any::TABLE, "BumpMap::Specification");
+        spec["texture"] = textureSpecAny(bump->normalBumpMap()->texture());
+        spec["settings"] = bump->settings().toAny();
+        any["bump"] = spec;
+    }
+
+    return any;
+}
+
+void SceneCache::layoutSections( Header &header, uint64 hash, int numBlobIndices, uint64 blobSize )
+{
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.headerSize = sizeof(Header);
+    header.hash = hash;
+
+    uint64 offset = align(sizeof(Header));
+    header.vertexOffset = offset;           offset = align(offset + uint64(header.numVertices) * sizeof(Vertex));
+    header.triangleOffset = offset;         offset = align(offset + uint64(header.numTriangles) * sizeof(Triangle));
+    header.materialIndexOffset = offset;    offset = align(offset + numBlobIndices * sizeof(uint64));
+    header.materialBlobOffset = offset;     offset = align(offset + blobSize);
+    header.emitterOffset = offset;          offset = align(offset + header.numEmitters * sizeof(int));
+    header.nodeOffset = offset;             offset = align(offset + uint64(header.numNodes) * sizeof(BVHNode));
+    header.refOffset = offset;              offset = align(offset + uint64(header.numRefs) * sizeof(int));
+    header.positionOffset = offset;         offset = align(offset + uint64(header.numTriangles) * 3 * sizeof(Vector3));
+    header.twoSidedOffset = offset;         offset = align(offset + uint64(header.numTriangles) * sizeof(uint8));
+    header.fileSize = offset;
+}
+
+bool SceneCache::write( const String &filename, uint64 hash,
+                        const CPUVertexArray &verts, const Array<Tri> &tris,
+                        const Array<int> &emitters, const BVH &bvh )
+{
+    FileSystem::createDirectory(FilePath::parent(filename));
+
+    // Material table
+    Table<Material*, int> materialIndex;
+    Array<String> materials;
+    Array<Triangle> triangles;
+    triangles.resize(tris.size());
+
+    for (int i = 0; i < tris.size(); ++i)
+    {
+        const Tri &tri = tris[i];
+        const shared_ptr<Material> &m = tri.material();
+
+        int *index = materialIndex.getPointer(m.get());
+        if (!index)
+        {
+            materialIndex.set(m.get(), materials.size());
+            materials.append(materialToAny(m).unparse());
+            index = materialIndex.getPointer(m.get());
+        }
+
+        Triangle &t = triangles[i];
+        for (int j = 0; j < 3; ++j)
+            t.index[j] = tri.index[j];
+        t.material = *index;
+        t.twoSided = tri.twoSided() ? 1 : 0;
+    }
+
+    Array<Vertex> vertices;
+    vertices.resize(verts.size());
+    for (int i = 0; i < verts.size(); ++i)
+    {
+        const CPUVertexArray::Vertex &v = verts.vertex[i];
+        vertices[i].position = v.position;
+        vertices[i].normal = v.normal;
+        vertices[i].tangent = v.tangent;
+        vertices[i].texCoord0 = v.texCoord0;
+    }
+
+    Array<uint64> blobIndex;
+    uint64 blobSize = 0;
+    for (int i = 0; i < materials.size(); ++i)
+    {
+        blobIndex.append(blobSize);
+        blobSize += materials[i].size();
+    }
+    blobIndex.append(blobSize);
+
+    // Lay out the sections
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.numVertices = vertices.size();
+    header.numTriangles = triangles.size();
+    header.numMaterials = materials.size();
+    header.numEmitters = emitters.size();
+    header.numNodes = bvh.numNodes();
+    header.numRefs = bvh.numRefs();
+    layoutSections(header, hash, blobIndex.size(), blobSize);
+
+    const String tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+
+    bool ok = true;
+    uint64 pos = 0;
+    const uint8 zeros[SECTION_ALIGN] = { 0 };
+
+    // Writes @p size bytes at @p at, padding from the current position
+    #define WRITE_SECTION(at, data, size) \
+        if (ok) { \
+            ok = fwrite(zeros, 1, size_t((at) - pos), f) == size_t((at) - pos); \
+            pos = (at); \
+            if ((size) > 0) ok = ok && fwrite((data), 1, size_t(size), f) == size_t(size); \
+            pos += (size); \
+        }
+
+    WRITE_SECTION(0, &header, sizeof(header));
+    WRITE_SECTION(header.vertexOffset, vertices.getCArray(), vertices.size() * sizeof(Vertex));
+    WRITE_SECTION(header.triangleOffset, triangles.getCArray(), triangles.size() * sizeof(Triangle));
+    WRITE_SECTION(header.materialIndexOffset, blobIndex.getCArray(), blobIndex.size() * sizeof(uint64));
+    for (int i = 0; i < materials.size(); ++i)
+    {
+        WRITE_SECTION(header.materialBlobOffset + blobIndex[i], materials[i].c_str(), materials[i].size());
+    }
+    WRITE_SECTION(header.emitterOffset, emitters.getCArray(), emitters.size() * sizeof(int));
+    WRITE_SECTION(header.nodeOffset, bvh.nodes(), bvh.numNodes() * sizeof(BVHNode));
+    WRITE_SECTION(header.refOffset, bvh.refs(), bvh.numRefs() * sizeof(int));
+    WRITE_SECTION(header.positionOffset, bvh.positions(), bvh.numTris() * 3 * sizeof(Vector3));
+    WRITE_SECTION(header.twoSidedOffset, bvh.twoSided(), bvh.numTris() * sizeof(uint8));
+    WRITE_SECTION(header.fileSize, zeros, 0);
+
+    #undef WRITE_SECTION
+
+    ok = (fclose(f) == 0) && ok;
+    if (ok)
+        ok = rename(tmp.c_str(), filename.c_str()) == 0;
+    if (!ok)
+        unlink(tmp.c_str());
+
+    return ok;
+}
+
+bool SceneCache::open( const String &filename, uint64 hash )
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const Header *header = static_cast<const Header*>(data);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->version != VERSION ||
+        header->headerSize != sizeof(Header) ||
+        header->hash != hash ||
+        header->fileSize != uint64(st.st_size))
+    {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    m_data = data;
+    m_size = st.st_size;
+    m_header = header;
+    return true;
+}
+
+void SceneCache::close()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+
+    m_data = NULL;
+    m_size = 0;
+    m_header = NULL;
+}
+
+int SceneCache::numVertices() const
+{
+    return m_header->numVertices;
+}
+
+const SceneCache::Vertex *SceneCache::vertices() const
+{
+    return section<Vertex>(m_header->vertexOffset);
+}
+
+int SceneCache::numTriangles() const
+{
+    return m_header->numTriangles;
+}
+
+const SceneCache::Triangle *SceneCache::triangles() const
+{
+    return section<Triangle>(m_header->triangleOffset);
+}
+
+int SceneCache::numMaterials() const
+{
+    return m_header->numMaterials;
+}
+
+Any SceneCache::material( int i ) const
+{
+    const uint64 *index = section<uint64>(m_header->materialIndexOffset);
+    const char *blob = section<char>(m_header->materialBlobOffset);
+    return Any::parse(String(blob + index[i], size_t(index[i + 1] - index[i])));
+}
+
+Tri SceneCache::triangle( int i, CPUVertexArray &verts, const Array<shared_ptr<Material>> &materials ) const
+{
+    const Triangle &t = triangles()[i];
+    const Vertex *vertices = this->vertices();
+
+    verts.vertex.resize(3);
+    verts.hasTangent = true;
+    verts.hasTexCoord0 = true;
+    for (int j = 0; j < 3; ++j)
+    {
+        const Vertex &src = vertices[t.index[j]];
+        CPUVertexArray::Vertex &v = verts.vertex[j];
+        v.position = src.position;
+        v.normal = src.normal;
+        v.tangent = src.tangent;
+        v.texCoord0 = src.texCoord0;
+    }
+
+    return Tri(0, 1, 2, verts, materials[t.material], t.twoSided != 0);
+}
+
+int SceneCache::numEmitters() const
+{
+    return m_header->numEmitters;
+}
+
+const int *SceneCache::emitters() const
+{
+    return section<int>(m_header->emitterOffset);
+}
+
+void SceneCache::attach( BVH &bvh ) const
+{
+    bvh.attach(section<BVHNode>(m_header->nodeOffset), m_header->numNodes,
+               section<int>(m_header->refOffset), m_header->numRefs,
+               section<Vector3>(m_header->positionOffset),
+               section<uint8>(m_header->twoSidedOffset),
+               m_header->numTriangles);
+}
+
+// Writes @p size bytes at @p at, padding with zeros from @p pos, which
+// moves past them
+static bool writeAt( FILE *f, uint64 &pos, uint64 at, const void *data, size_t size )
+{
+    static const uint8 zeros[SECTION_ALIGN] = { 0 };
+    bool ok = fwrite(zeros, 1, size_t(at - pos), f) == size_t(at - pos);
+    if (size > 0)
+        ok = ok && fwrite(data, 1, size, f) == size;
+    pos = at + size;
+    return ok;
+}
+
+// Maps a spill file written through @p file, which is closed
+static const void *mapSpill( FILE *&file, const String &filename, size_t &size )
+{
+    const bool ok = fclose(file) == 0;
+    file = NULL;
+    size = 0;
+    if (!ok)
+        return NULL;
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    size = st.st_size;
+    return data;
+}
+
+SceneCache::Stream::Stream() :
+    m_vertexFile(NULL),
+    m_triangleFile(NULL),
+    m_numVertices(0),
+    m_numTriangles(0)
+{ }
+
+SceneCache::Stream::~Stream()
+{
+    close();
+}
+
+bool SceneCache::Stream::begin( const String &filename )
+{
+    close();
+    FileSystem::createDirectory(FilePath::parent(filename));
+
+    m_filename = filename;
+    m_vertexFile = fopen((filename + ".vertices.tmp").c_str(), "wb");
+    m_triangleFile = fopen((filename + ".triangles.tmp").c_str(), "wb");
+    if (!m_vertexFile || !m_triangleFile)
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool SceneCache::Stream::append( const CPUVertexArray &verts, const Array<Tri> &tris,
+                                 Array<Vector3> &positions, Array<uint8> &twoSided )
+{
+    if (!m_vertexFile || !m_triangleFile)
+        return false;
+
+    Array<Vertex> vertices;
+    vertices.resize(verts.size());
+    for (int i = 0; i < verts.size(); ++i)
+    {
+        const CPUVertexArray::Vertex &v = verts.vertex[i];
+        vertices[i].position = v.position;
+        vertices[i].normal = v.normal;
+        vertices[i].tangent = v.tangent;
+        vertices[i].texCoord0 = v.texCoord0;
+    }
+
+    Array<Triangle> triangles;
+    triangles.resize(tris.size());
+    for (int i = 0; i < tris.size(); ++i)
+    {
+        const Tri &tri = tris[i];
+        const shared_ptr<Material> &m = tri.material();
+
+        int *index = m_materialIndex.getPointer(m.get());
+        if (!index)
+        {
+            m_materialIndex.set(m.get(), m_materials.size());
+            m_materials.append(m);
+            index = m_materialIndex.getPointer(m.get());
+        }
+
+        Triangle &t = triangles[i];
+        for (int j = 0; j < 3; ++j)
+        {
+            t.index[j] = tri.index[j] + m_numVertices;
+            positions.append(tri.position(verts, j));
+        }
+        t.material = *index;
+        t.twoSided = tri.twoSided() ? 1 : 0;
+        twoSided.append(uint8(t.twoSided));
+    }
+
+    const bool ok =
+        fwrite(vertices.getCArray(), sizeof(Vertex), vertices.size(), m_vertexFile) == size_t(vertices.size()) &&
+        fwrite(triangles.getCArray(), sizeof(Triangle), triangles.size(), m_triangleFile) == size_t(triangles.size());
+
+    m_numVertices += vertices.size();
+    m_numTriangles += triangles.size();
+    return ok;
+}
+
+bool SceneCache::Stream::finish( uint64 hash, const BVH &bvh, const Array<int> &triOrder,
+                                 const Array<int> &emitters )
+{
+    if (!m_vertexFile || !m_triangleFile)
+        return false;
+
+    size_t vertexBytes, triangleBytes;
+    const Vertex *vertices = static_cast<const Vertex*>(
+        mapSpill(m_vertexFile, m_filename + ".vertices.tmp", vertexBytes));
+    const Triangle *triangles = static_cast<const Triangle*>(
+        mapSpill(m_triangleFile, m_filename + ".triangles.tmp", triangleBytes));
+
+    bool ok = vertices && triangles &&
+              vertexBytes == size_t(m_numVertices) * sizeof(Vertex) &&
+              triangleBytes == size_t(m_numTriangles) * sizeof(Triangle) &&
+              triOrder.size() == m_numTriangles;
+
+    // Vertices in the order the reordered triangles first use them, as
+    // World::clusterGeometry() lays out an in-memory build
+    Array<int> newVertex, vertexOrder;
+    Array<int> emitterIndex;
+    if (ok)
+    {
+        newVertex.resize(m_numVertices);
+        for (int i = 0; i < m_numVertices; ++i)
+            newVertex[i] = -1;
+        for (int i = 0; i < triOrder.size(); ++i)
+        {
+            const Triangle &t = triangles[triOrder[i]];
+            for (int j = 0; j < 3; ++j)
+            {
+                if (newVertex[t.index[j]] < 0)
+                {
+                    newVertex[t.index[j]] = vertexOrder.size();
+                    vertexOrder.append(t.index[j]);
+                }
+            }
+        }
+
+        Array<int> newTri;
+        newTri.resize(triOrder.size());
+        for (int i = 0; i < triOrder.size(); ++i)
+            newTri[triOrder[i]] = i;
+        for (int i = 0; i < emitters.size(); ++i)
+            emitterIndex.append(newTri[emitters[i]]);
+        emitterIndex.sort();
+    }
+
+    Array<String> materials;
+    Array<uint64> blobIndex;
+    uint64 blobSize = 0;
+    for (int i = 0; i < m_materials.size(); ++i)
+    {
+        materials.append(materialToAny(m_materials[i]).unparse());
+        blobIndex.append(blobSize);
+        blobSize += materials[i].size();
+    }
+    blobIndex.append(blobSize);
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.numVertices = vertexOrder.size();
+    header.numTriangles = m_numTriangles;
+    header.numMaterials = materials.size();
+    header.numEmitters = emitterIndex.size();
+    header.numNodes = bvh.numNodes();
+    header.numRefs = bvh.numRefs();
+    layoutSections(header, hash, blobIndex.size(), blobSize);
+
+    const String tmp = m_filename + ".tmp";
+    FILE *f = ok ? fopen(tmp.c_str(), "wb") : NULL;
+    ok = ok && f;
+
+    // Vertices and triangles go through a small buffer each, gathered
+    // from the mapped spill files
+    enum { CHUNK = 1 << 14 };
+    uint64 pos = 0;
+    if (ok)
+    {
+        ok = writeAt(f, pos, 0, &header, sizeof(header));
+
+        Array<Vertex> vertexChunk;
+        for (int i = 0; ok && i < vertexOrder.size(); i += CHUNK)
+        {
+            vertexChunk.fastClear();
+            for (int k = i; k < min(i + int(CHUNK), vertexOrder.size()); ++k)
+                vertexChunk.append(vertices[vertexOrder[k]]);
+            ok = writeAt(f, pos, i == 0 ? header.vertexOffset : pos,
+                         vertexChunk.getCArray(), vertexChunk.size() * sizeof(Vertex));
+        }
+
+        Array<Triangle> triangleChunk;
+        for (int i = 0; ok && i < triOrder.size(); i += CHUNK)
+        {
+            triangleChunk.fastClear();
+            for (int k = i; k < min(i + int(CHUNK), triOrder.size()); ++k)
+            {
+                Triangle t = triangles[triOrder[k]];
+                for (int j = 0; j < 3; ++j)
+                    t.index[j] = newVertex[t.index[j]];
+                triangleChunk.append(t);
+            }
+            ok = writeAt(f, pos, i == 0 ? header.triangleOffset : pos,
+                         triangleChunk.getCArray(), triangleChunk.size() * sizeof(Triangle));
+        }
+
+        ok = ok && writeAt(f, pos, header.materialIndexOffset, blobIndex.getCArray(), blobIndex.size() * sizeof(uint64));
+        for (int i = 0; ok && i < materials.size(); ++i)
+            ok = writeAt(f, pos, header.materialBlobOffset + blobIndex[i], materials[i].c_str(), materials[i].size());
+        ok = ok && writeAt(f, pos, header.emitterOffset, emitterIndex.getCArray(), emitterIndex.size() * sizeof(int));
+        ok = ok && writeAt(f, pos, header.nodeOffset, bvh.nodes(), bvh.numNodes() * sizeof(BVHNode));
+        ok = ok && writeAt(f, pos, header.refOffset, bvh.refs(), bvh.numRefs() * sizeof(int));
+        ok = ok && writeAt(f, pos, header.positionOffset, bvh.positions(), bvh.numTris() * 3 * sizeof(Vector3));
+        ok = ok && writeAt(f, pos, header.twoSidedOffset, bvh.twoSided(), bvh.numTris() * sizeof(uint8));
+        ok = ok && writeAt(f, pos, header.fileSize, NULL, 0);
+        ok = (fclose(f) == 0) && ok;
+    }
+
+    if (vertices)
+        munmap(const_cast<Vertex*>(vertices), vertexBytes);
+    if (triangles)
+        munmap(const_cast<Triangle*>(triangles), triangleBytes);
+
+    if (ok)
+        ok = rename(tmp.c_str(), m_filename.c_str()) == 0;
+    if (!ok)
+        unlink(tmp.c_str());
+    return ok;
+}
+
+void SceneCache::Stream::close()
+{
+    if (m_vertexFile)
+        fclose(m_vertexFile);
+    if (m_triangleFile)
+        fclose(m_triangleFile);
+    m_vertexFile = m_triangleFile = NULL;
+
+    if (!m_filename.empty())
+    {
+        unlink((m_filename + ".vertices.tmp").c_str());
+        unlink((m_filename + ".triangles.tmp").c_str());
+    }
+    m_filename = "";
+    m_numVertices = m_numTriangles = 0;
+    m_materialIndex.clear();
+    m_materials.clear();
+}
@@ -0,0 +1,195 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <G3D/G3DAll.h>
+
+#include "bvh.h"
+
+/** Versioned binary snapshot of a processed World: vertices, triangles,
+  * material table, emitter table and BVH. The file is memory-mapped on load
+  * and the BVH traverses the mapped pages directly.
+  *
+  * Sections start on page boundaries. Written from a World whose BVH was
+  * laid out with BVH::clusterForPaging(PAGE_BYTES), each page of nodes is
+  * one treelet and triangles and vertices follow leaf order, so a scene
+  * that does not fit in memory can be rendered straight from the file
+  * with the OS paging geometry in as rays reach it.
+  *
+  * A cache is keyed by a hash of the scene file contents, the size and
+  * modification time of every model, its .mtl and the images that
+  * references, the BVH settings and the format version. Any change misses the cache
+  * and the scene is loaded from source.
+  */
+class SceneCache
+{
+public:
+
+    enum { VERSION = 3, PAGE_BYTES = 4096 };
+
+    struct Vertex
+    {
+        Point3  position;
+        Vector3 normal;
+        Vector4 tangent;
+        Point2  texCoord0;
+    };
+
+    struct Triangle
+    {
+        int index[3];
+        int material;   // index into the material table
+        int twoSided;
+    };
+
+    SceneCache();
+    ~SceneCache();
+
+    /** Where the cache for the scene file @p scenePath lives */
+    static String cacheFilename( const String &scenePath );
+
+    /** Appends the files the scene's models are read from: each model,
+      * its .mtl (which may not exist) and the images that references
+      */
+    static void sourceFiles( const String &scenePath, const Any &scene, Array<String> &files );
+
+    /** Hash of everything the processed geometry depends on */
+    static uint64 sourceHash( const String &scenePath, const Any &scene, const BVHSettings &settings );
+
+    /** Serializes a loaded world. Writes to a temporary file and renames it,
+      * so a crash never leaves a truncated cache behind.
+      */
+    static bool write( const String &filename, uint64 hash,
+                       const CPUVertexArray &verts, const Array<Tri> &tris,
+                       const Array<int> &emitters, const BVH &bvh );
+
+    /** Writes a cache without the scene's geometry in memory, for the first
+      * load of an out-of-core scene. Triangles are appended model by model
+      * to spill files beside the cache, and only their positions are kept,
+      * to build the BVH from. finish() then writes the cache in the BVH's
+      * leaf order, reading vertices and triangles back from the spill files.
+      */
+    class Stream
+    {
+    public:
+
+        Stream();
+        ~Stream();
+
+        /** Starts spilling for the cache @p filename */
+        bool begin( const String &filename );
+
+        /** Appends @p tris over @p verts, adding their positions (three per
+          * triangle) and two-sided flags to @p positions and @p twoSided
+          */
+        bool append( const CPUVertexArray &verts, const Array<Tri> &tris,
+                     Array<Vector3> &positions, Array<uint8> &twoSided );
+
+        int numTriangles() const { return m_numTriangles; }
+
+        /** The appended triangles' materials, in the cache's order */
+        const Array<shared_ptr<Material>> &materials() const { return m_materials; }
+
+        /** Writes the cache. @p bvh was built from the appended positions
+          * and reordered by BVH::clusterForPaging(), which returned
+          * @p triOrder; @p emitters are indices of appended triangles.
+          * The spill files stay until close().
+          */
+        bool finish( uint64 hash, const BVH &bvh, const Array<int> &triOrder,
+                     const Array<int> &emitters );
+
+        /** Deletes the spill files */
+        void close();
+
+    private:
+
+        String      m_filename;
+        FILE *      m_vertexFile;
+        FILE *      m_triangleFile;
+        int         m_numVertices;
+        int         m_numTriangles;
+        Table<Material*, int> m_materialIndex;
+        Array<shared_ptr<Material>> m_materials;
+    };
+
+    /** Maps @p filename. Returns false, leaving nothing mapped, if the file
+      * is missing, truncated, of another version or stale relative to @p hash.
+      */
+    bool open( const String &filename, uint64 hash );
+
+    void close();
+
+    bool isOpen() const { return m_header != NULL; }
+
+    /** Size of the mapping */
+    size_t sizeInBytes() const { return m_size; }
+
+    int numVertices() const;
+    const Vertex *vertices() const;
+
+    int numTriangles() const;
+    const Triangle *triangles() const;
+
+    int numMaterials() const;
+
+    /** UniversalMaterial::Specification for material @p i */
+    Any material( int i ) const;
+
+    /** Copies the vertices of triangle @p i into @p verts and returns the
+      * triangle over them, with its material taken from @p materials
+      */
+    Tri triangle( int i, CPUVertexArray &verts, const Array<shared_ptr<Material>> &materials ) const;
+
+    int numEmitters() const;
+    const int *emitters() const;
+
+    /** Points @p bvh at the mapped hierarchy; valid until close() */
+    void attach( BVH &bvh ) const;
+
+private:
+
+    struct Header
+    {
+        char    magic[8];
+        uint32  version;
+        uint32  headerSize;
+        uint64  hash;
+        uint64  fileSize;
+
+        int32   numVertices;
+        int32   numTriangles;
+        int32   numMaterials;
+        int32   numEmitters;
+        int32   numNodes;
+        int32   numRefs;
+
+        // Byte offsets of each section from the start of the file
+        uint64  vertexOffset;
+        uint64  triangleOffset;
+        uint64  materialIndexOffset;    // numMaterials + 1 uint64 offsets into the string blob
+        uint64  materialBlobOffset;
+        uint64  emitterOffset;
+        uint64  nodeOffset;
+        uint64  refOffset;
+        uint64  positionOffset;
+        uint64  twoSidedOffset;
+    };
+
+    template <class T>
+    const T *section( uint64 offset ) const
+    {
+        return reinterpret_cast<const T*>(static_cast<const uint8*>(m_data) + offset);
+    }
+
+    static Any materialToAny( const shared_ptr<Material> &material );
+
+    /** Fills in everything of @p header but the counts, which must be set,
+      * and lays the sections out after it
+      */
+    static void layoutSections( Header &header, uint64 hash, int numBlobIndices, uint64 blobSize );
+
+    void *          m_data;
+    size_t          m_size;
+    const Header *  m_header;
+};
+
+#endif // SCENECACHE_H
@@ -0,0 +1,496 @@
+#include "texturecache.h"
+#include "memorytracker.h"
+#include "threadpool.h"
+
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEXTURE_DIR ".scenecache/textures"
+#define TILES_OFFSET 4096   // tiles start page aligned, after the header
+
+static const char MAGIC[8] = { 'P', 'A', 'T', 'H', 'T', 'E', 'X', '\0' };
+
+struct TextureFileHeader
+{
+    char    magic[8];
+    uint32  version;
+    int32   width;
+    int32   height;
+    int32   levels;
+    uint64  stamp;      // source size and modification time
+};
+
+// 64-bit FNV-1a, as in the scene cache
+static uint64 hashBytes( uint64 h, const void *data, size_t size )
+{
+    const uint8 *p = static_cast<const uint8*>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64 fileStamp( const String &filename )
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return 0;
+    int64 stamp[2] = { int64(st.st_size), int64(st.st_mtime) };
+    return hashBytes(14695981039346656037ull, stamp, sizeof(stamp));
+}
+
+static float srgbToLinear( float c )
+{
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linearToSrgb( float c )
+{
+    c = clamp(c, 0.f, 1.f);
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.f / 2.4f) - 0.055f;
+}
+
+static const float *srgbTable()
+{
+    static float table[256];
+    static bool init = [] {
+        for (int i = 0; i < 256; ++i)
+            table[i] = srgbToLinear(i / 255.f);
+        return true;
+    }();
+    (void)init;
+    return table;
+}
+
+static int levelSize( int size, int level )
+{
+    return max(1, size >> level);
+}
+
+static int numTiles( int size )
+{
+    return (size + TextureCache::TILE_SIZE - 1) / TextureCache::TILE_SIZE;
+}
+
+// Spreads consecutive tiles over the shards
+static int shardOf( uint64 key )
+{
+    return int((key * 0x9E3779B97F4A7C15ull) >> 58) % TextureCache::NUM_SHARDS;
+}
+
+TextureCache::TextureCache() :
+    m_capacity(0),
+    m_residentTiles(0),
+    m_hits(0),
+    m_misses(0)
+{
+    setCapacity(size_t(256) << 20);
+}
+
+TextureCache::~TextureCache()
+{
+    clear();
+}
+
+void TextureCache::setCapacity( size_t bytes )
+{
+    m_capacity = bytes;
+    for (int i = 0; i < NUM_SHARDS; ++i)
+        m_shards[i].capacity = max(1, int(bytes / TILE_BYTES / NUM_SHARDS));
+}
+
+int TextureCache::add( const String &filename )
+{
+    if (!FileSystem::exists(filename))
+        return -1;
+
+    std::lock_guard<std::mutex> lock(m_texturesMutex);
+
+    const String key = FilePath::canonicalize(filename);
+    if (const int *id = m_ids.getPointer(key))
+        return *id;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tex",
+             (unsigned long long)hashBytes(14695981039346656037ull, key.c_str(), key.size()));
+
+    Texture *texture = new Texture();
+    texture->source = filename;
+    texture->tiled = FilePath::concat(TEXTURE_DIR, name);
+
+    const int id = m_textures.size();
+    m_textures.append(texture);
+    m_ids.set(key, id);
+    return id;
+}
+
+void TextureCache::prepare()
+{
+    runTasks(m_textures.size(), [&](int i) {
+        Texture &texture = *m_textures[i];
+        std::lock_guard<std::mutex> lock(texture.mutex);
+        if (!texture.ready)
+            open(texture);
+    });
+}
+
+void TextureCache::clear()
+{
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        Shard &shard = m_shards[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (int t = 0; t < shard.tiles.size(); ++t)
+            delete shard.tiles[t];
+        shard.tiles.clear();
+        shard.hand = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_texturesMutex);
+    for (int i = 0; i < m_textures.size(); ++i)
+    {
+        if (m_textures[i]->fd >= 0)
+            ::close(m_textures[i]->fd);
+        delete m_textures[i];
+    }
+    m_textures.clear();
+    m_ids.clear();
+
+    MemoryTracker::global().remove(MemoryTracker::TEXTURES, bytesResident());
+    m_residentTiles = 0;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+bool TextureCache::build( const String &source, const String &tiled, uint64 stamp )
+{
+    shared_ptr<Image> image;
+    try
+    {
+        image = Image::fromFile(source);
+    }
+    catch (...)
+    {
+        return false;
+    }
+    if (!image || image->width() <= 0 || image->height() <= 0)
+        return false;
+
+    TextureFileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.width = image->width();
+    header.height = image->height();
+    header.levels = 1;
+    while ((max(header.width, header.height) >> header.levels) > 0)
+        ++header.levels;
+    header.stamp = stamp;
+
+    // Color is filtered in linear space and stored sRGB encoded
+    Array<Color4> level;
+    level.resize(header.width * header.height);
+    for (int y = 0; y < header.height; ++y)
+    {
+        for (int x = 0; x < header.width; ++x)
+        {
+            Color4 c;
+            image->get(Point2int32(x, y), c);
+            level[y * header.width + x] = Color4(srgbToLinear(c.r), srgbToLinear(c.g), srgbToLinear(c.b), c.a);
+        }
+    }
+    image.reset();
+
+    FileSystem::createDirectory(FilePath::parent(tiled));
+    const String temp = tiled + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (!file)
+        return false;
+
+    uint8 page[TILES_OFFSET];
+    memset(page, 0, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    bool ok = fwrite(page, sizeof(page), 1, file) == 1;
+
+    uint8 tile[TILE_BYTES];
+    int w = header.width, h = header.height;
+    for (int l = 0; l < header.levels && ok; ++l)
+    {
+        // Texels past the edge of partial tiles repeat the edge
+        for (int ty = 0; ty < numTiles(h) && ok; ++ty)
+        {
+            for (int tx = 0; tx < numTiles(w); ++tx)
+            {
+                for (int y = 0; y < TILE_SIZE; ++y)
+                {
+                    const int sy = min(ty * TILE_SIZE + y, h - 1);
+                    for (int x = 0; x < TILE_SIZE; ++x)
+                    {
+                        const int sx = min(tx * TILE_SIZE + x, w - 1);
+                        const Color4 &c = level[sy * w + sx];
+                        uint8 *t = tile + 4 * (y * TILE_SIZE + x);
+                        t[0] = uint8(iRound(linearToSrgb(c.r) * 255.f));
+                        t[1] = uint8(iRound(linearToSrgb(c.g) * 255.f));
+                        t[2] = uint8(iRound(linearToSrgb(c.b) * 255.f));
+                        t[3] = uint8(iRound(clamp(c.a, 0.f, 1.f) * 255.f));
+                    }
+                }
+                ok = ok && fwrite(tile, sizeof(tile), 1, file) == 1;
+            }
+        }
+
+        // 2x2 box filter down to the next level
+        const int nw = levelSize(header.width, l + 1), nh = levelSize(header.height, l + 1);
+        Array<Color4> next;
+        next.resize(nw * nh);
+        for (int y = 0; y < nh; ++y)
+        {
+            for (int x = 0; x < nw; ++x)
+            {
+                const int x0 = min(2 * x, w - 1), x1 = min(2 * x + 1, w - 1);
+                const int y0 = min(2 * y, h - 1), y1 = min(2 * y + 1, h - 1);
+                next[y * nw + x] = (level[y0 * w + x0] + level[y0 * w + x1] +
+                                    level[y1 * w + x0] + level[y1 * w + x1]) * 0.25f;
+            }
+        }
+        level.fastSwap(next);
+        w = nw;
+        h = nh;
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(temp.c_str(), tiled.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void TextureCache::open( Texture &texture )
+{
+    const uint64 stamp = fileStamp(texture.source);
+
+    for (int attempt = 0; attempt < 2 && texture.fd < 0; ++attempt)
+    {
+        int fd = ::open(texture.tiled.c_str(), O_RDONLY);
+        TextureFileHeader header;
+        if (fd >= 0 &&
+            pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+            memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+            header.version == VERSION && header.stamp == stamp &&
+            header.width > 0 && header.height > 0 && header.levels > 0)
+        {
+            texture.fd = fd;
+            texture.width = header.width;
+            texture.height = header.height;
+            texture.levels = header.levels;
+            break;
+        }
+
+        if (fd >= 0)
+            ::close(fd);
+
+        if (attempt == 0 && !build(texture.source, texture.tiled, stamp))
+        {
+            printf("TextureCache: could not read %s\n", texture.source.c_str());
+            break;
+        }
+    }
+
+    if (texture.fd >= 0)
+    {
+        uint64 offset = TILES_OFFSET;
+        int tiles = 0;
+        for (int l = 0; l < texture.levels; ++l)
+        {
+            const int tilesX = numTiles(levelSize(texture.width, l));
+            const int tilesY = numTiles(levelSize(texture.height, l));
+            texture.levelOffset.append(offset);
+            texture.tilesX.append(tilesX);
+            texture.levelTile.append(tiles);
+            offset += uint64(tilesX) * tilesY * TILE_BYTES;
+            tiles += tilesX * tilesY;
+        }
+
+        texture.resident = new std::atomic<Tile*>[tiles];
+        for (int i = 0; i < tiles; ++i)
+            texture.resident[i] = NULL;
+    }
+
+    texture.ready = true;
+}
+
+std::atomic<TextureCache::Tile*> &TextureCache::entry( uint64 key )
+{
+    const Texture &texture = *m_textures[int(key >> 40)];
+    const int level = int(key >> 32) & 0xff, ty = int(key >> 16) & 0xffff, tx = int(key) & 0xffff;
+    return texture.resident[texture.levelTile[level] + ty * texture.tilesX[level] + tx];
+}
+
+TextureCache::Tile *TextureCache::claim( Shard &shard )
+{
+    if (shard.tiles.size() < shard.capacity)
+    {
+        shard.tiles.append(new Tile());
+        ++m_residentTiles;
+        MemoryTracker::global().add(MemoryTracker::TEXTURES, TILE_BYTES);
+        return shard.tiles.last();
+    }
+
+    // Tiles looked up since the hand last passed get another round
+    for (int i = 0; i < 2 * shard.tiles.size(); ++i)
+    {
+        Tile *tile = shard.tiles[shard.hand];
+        shard.hand = (shard.hand + 1) % shard.tiles.size();
+        if ((tile->version.load(std::memory_order_relaxed) & 1) != 0)
+            continue;
+        if (tile->referenced.exchange(false, std::memory_order_relaxed))
+            continue;
+        return tile;
+    }
+    return NULL;
+}
+
+bool TextureCache::load( uint64 key )
+{
+    std::atomic<Tile*> &published = entry(key);
+    Shard &shard = m_shards[shardOf(key)];
+    Tile *tile;
+    {
+        // Tiles only ever hold keys of their own shard, so the entries of
+        // those keys only change under this lock
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (Tile *current = published.load(std::memory_order_relaxed))
+            return (current->version.load(std::memory_order_acquire) & 1) == 0;
+
+        tile = claim(shard);
+        if (!tile)
+            return false;
+
+        // Readers still holding the old entry see the version change
+        const uint64 old = tile->key.load(std::memory_order_relaxed);
+        if (old != ~0ull)
+            entry(old).store(NULL, std::memory_order_relaxed);
+        tile->version.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        tile->key.store(key, std::memory_order_relaxed);
+        tile->referenced.store(true, std::memory_order_relaxed);
+        published.store(tile, std::memory_order_release);
+    }
+    ++m_misses;
+
+    const Texture &texture = *m_textures[int(key >> 40)];
+    const int level = int(key >> 32) & 0xff, ty = int(key >> 16) & 0xffff, tx = int(key) & 0xffff;
+    const uint64 offset = texture.levelOffset[level] +
+                          (uint64(ty) * texture.tilesX[level] + tx) * TILE_BYTES;
+    if (pread(texture.fd, tile->texels, TILE_BYTES, off_t(offset)) != TILE_BYTES)
+        memset(tile->texels, 0, TILE_BYTES);
+
+    tile->version.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+Color4 TextureCache::texel( Texture &texture, int id, int level, int x, int y )
+{
+    const int tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+    const uint64 key = (uint64(id) << 40) | (uint64(level) << 32) | (uint64(ty) << 16) | uint64(tx);
+    const std::atomic<Tile*> &published =
+        texture.resident[texture.levelTile[level] + ty * texture.tilesX[level] + tx];
+    const int offset = 4 * ((y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE));
+
+    uint8 t[4];
+    bool missed = false;
+    for (;;)
+    {
+        // A seqlock read: the copy only counts if the tile held this key,
+        // fully loaded, both before and after it
+        if (Tile *tile = published.load(std::memory_order_acquire))
+        {
+            const uint32 version = tile->version.load(std::memory_order_acquire);
+            if ((version & 1) == 0 && tile->key.load(std::memory_order_relaxed) == key)
+            {
+                memcpy(t, tile->texels + offset, 4);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (tile->version.load(std::memory_order_relaxed) == version)
+                {
+                    if (!tile->referenced.load(std::memory_order_relaxed))
+                        tile->referenced.store(true, std::memory_order_relaxed);
+                    if (!missed)
+                        m_hits.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+            }
+        }
+
+        missed = true;
+        if (!load(key))
+            std::this_thread::yield();
+    }
+
+    const float *srgb = srgbTable();
+    return Color4(srgb[t[0]], srgb[t[1]], srgb[t[2]], t[3] / 255.f);
+}
+
+static int wrap( int i, int size )
+{
+    i %= size;
+    return i < 0 ? i + size : i;
+}
+
+Color4 TextureCache::bilinear( Texture &texture, int id, int level, const Point2 &uv )
+{
+    const int w = levelSize(texture.width, level), h = levelSize(texture.height, level);
+    const float x = uv.x * w - 0.5f, y = uv.y * h - 0.5f;
+    const float fx = floorf(x), fy = floorf(y);
+    const float ax = x - fx, ay = y - fy;
+
+    // Far-off coordinates lose their fraction in float anyway
+    const int x0 = wrap(int(fmodf(fx, float(w))), w), x1 = wrap(x0 + 1, w);
+    const int y0 = wrap(int(fmodf(fy, float(h))), h), y1 = wrap(y0 + 1, h);
+
+    return (texel(texture, id, level, x0, y0) * (1.f - ax) + texel(texture, id, level, x1, y0) * ax) * (1.f - ay)
+         + (texel(texture, id, level, x0, y1) * (1.f - ax) + texel(texture, id, level, x1, y1) * ax) * ay;
+}
+
+bool TextureCache::sample( int id, const Point2 &uv, float width, Color4 &value )
+{
+    if (id < 0 || id >= m_textures.size())
+        return false;
+    Texture *texture = m_textures[id];
+
+    if (!texture->ready)
+    {
+        std::lock_guard<std::mutex> lock(texture->mutex);
+        if (!texture->ready)
+            open(*texture);
+    }
+    if (texture->fd < 0)
+        return false;
+
+    // Mip level whose texels are as wide as the footprint
+    const float texels = width * max(texture->width, texture->height);
+    const float lod = clamp(texels > 0.f ? log2f(texels) : 0.f, 0.f, float(texture->levels - 1));
+    const int level = int(lod);
+    const float t = lod - level;
+
+    value = bilinear(*texture, id, level, uv);
+    if (t > 0.f && level + 1 < texture->levels)
+        value = value * (1.f - t) + bilinear(*texture, id, level + 1, uv) * t;
+
+    return true;
+}
+
+void TextureCache::report() const
+{
+    const int64 hits = m_hits, misses = m_misses;
+    printf("Texture cache: %d textures, %.1f / %.1f MB resident, %.2f%% tile hit rate\n",
+           m_textures.size(), bytesResident() / (1024.0 * 1024.0), m_capacity / (1024.0 * 1024.0),
+           100.0 * hits / max(int64(1), hits + misses));
+    fflush( stdout );
+}
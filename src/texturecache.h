@@ -0,0 +1,145 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <G3D/G3DAll.h>
+
+#include <atomic>
+#include <mutex>
+
+/** CPU texture storage for shading, used instead of keeping every material
+  * texture in memory at full resolution (setStorage(COPY_TO_CPU)).
+  *
+  * Each texture is converted once into a mip-mapped file of 64x64 texel
+  * tiles (8-bit sRGB color, linear alpha) under .scenecache/textures/.
+  * Lookups read tiles from there on demand into a fixed-size cache, which
+  * evicts tiles not used recently (the clock approximation of LRU), and
+  * filter trilinearly at the mip level matching the caller's footprint,
+  * so wide footprints (deep bounces, distant surfaces) touch small levels
+  * only.
+  *
+  * Thread-safe. Hits take no lock: each texture maps its tiles to resident
+  * ones directly, and a reader checks the tile's version after copying a
+  * texel, retrying if the tile was reloaded meanwhile. A miss locks the
+  * shard of its tile only to claim a resident tile, and reads the file
+  * after releasing the lock.
+  */
+class TextureCache
+{
+public:
+
+    enum { TILE_SIZE = 64, NUM_SHARDS = 64, VERSION = 1 };
+
+    TextureCache();
+    ~TextureCache();
+
+    /** Upper bound on resident tile memory */
+    void setCapacity( size_t bytes );
+    size_t capacity() const { return m_capacity; }
+
+    /** Registers the image file @p filename and returns its id, or -1 if
+      * the file does not exist. Registering a file twice returns the same
+      * id. The tiled file is built by prepare() or the first lookup.
+      * Not to be called while other threads sample().
+      */
+    int add( const String &filename );
+
+    /** Builds or validates the tiled files of all registered textures, in
+      * parallel
+      */
+    void prepare();
+
+    /** Releases all textures and tiles */
+    void clear();
+
+    /** Trilinearly filtered, linear space value of @p texture at @p uv
+      * (repeating) for a footprint @p width wide in texture coordinates.
+      * Returns false if the texture could not be read.
+      */
+    bool sample( int texture, const Point2 &uv, float width, Color4 &value );
+
+    size_t bytesResident() const { return size_t(m_residentTiles) * TILE_BYTES; }
+
+    /** Prints hit rate and resident memory */
+    void report() const;
+
+private:
+
+    enum { TILE_BYTES = TILE_SIZE * TILE_SIZE * 4 };
+
+    struct Tile
+    {
+        std::atomic<uint64> key;        // the texture, level and position it holds
+        std::atomic<uint32> version;    // odd while being loaded
+        std::atomic<bool>   referenced; // looked up since the clock hand passed
+        uint8               texels[TILE_BYTES];
+
+        Tile() : key(~0ull), version(0), referenced(false) { }
+    };
+
+    struct Texture
+    {
+        String          source;
+        String          tiled;      // tiled mip file
+        std::mutex      mutex;      // guards opening
+        std::atomic<bool> ready;    // opened, successfully or not
+        int             fd;         // -1 if the texture is unusable
+        int             width;
+        int             height;
+        int             levels;
+        Array<uint64>   levelOffset;    // file offset of each level's tiles
+        Array<int>      tilesX;         // tiles per row of each level
+        Array<int>      levelTile;      // index in resident of each level's first tile
+        std::atomic<Tile*> *resident;   // the resident Tile of each tile, or NULL
+
+        Texture() : ready(false), fd(-1), width(0), height(0), levels(0), resident(NULL) { }
+        ~Texture() { delete[] resident; }
+    };
+
+    struct Shard
+    {
+        std::mutex          mutex;  // guards claiming tiles, not reading them
+        Array<Tile*>        tiles;
+        int                 hand;   // next tile the clock looks at
+        int                 capacity;   // in tiles
+
+        Shard() : hand(0), capacity(1) { }
+    };
+
+    /** Opens the tiled file of @p texture, building it first if missing or
+      * older than the source
+      */
+    void open( Texture &texture );
+    static bool build( const String &source, const String &tiled, uint64 stamp );
+
+    /** Linear value of texel (x, y) of @p level, with x and y in range */
+    Color4 texel( Texture &texture, int id, int level, int x, int y );
+
+    Color4 bilinear( Texture &texture, int id, int level, const Point2 &uv );
+
+    /** Where the resident copy of tile @p key is published */
+    std::atomic<Tile*> &entry( uint64 key );
+
+    /** Reads tile @p key into a resident tile after a missed lookup.
+      * Returns false if another thread is loading it, or every tile of its
+      * shard is being loaded, and the caller should retry later.
+      */
+    bool load( uint64 key );
+
+    /** A tile of @p shard to load into, growing the shard up to its
+      * capacity and then evicting with the clock; NULL if all are loading.
+      * Called with the shard locked.
+      */
+    Tile *claim( Shard &shard );
+
+    Array<Texture*>         m_textures;
+    Table<String, int>      m_ids;
+    std::mutex              m_texturesMutex;    // guards add()
+
+    Shard                   m_shards[NUM_SHARDS];
+    size_t                  m_capacity;
+    std::atomic<int>        m_residentTiles;
+    std::atomic<int64>      m_hits;
+    std::atomic<int64>      m_misses;
+};
+
+#endif // TEXTURECACHE_H
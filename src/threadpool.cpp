@@ -91,3 +91,51 @@ void ThreadPool::run()
             wait();
 }
 
+
+namespace {
+
+struct TaskQueue
+{
+    const std::function<void(int)> *task;
+    std::atomic<int>                next;
+    int                             count;
+};
+
+}
+
+static void taskWorker(void *arg)
+{
+    TaskQueue *queue = (TaskQueue*)arg;
+
+    for (int i = queue->next++; i < queue->count; i = queue->next++)
+        (*queue->task)(i);
+}
+
+void runTasks(int count, const std::function<void(int)> &task, int numThreads)
+{
+    if (count <= 0)
+        return;
+
+    TaskQueue queue;
+    queue.task = &task;
+    queue.next = 0;
+    queue.count = count;
+
+    numThreads = min(numThreads, count);
+    if (numThreads <= 1)
+    {
+        taskWorker(&queue);
+        return;
+    }
+
+    Array<shared_ptr<Thread>> threads;
+    for (int i = 0; i < numThreads; ++i)
+    {
+        shared_ptr<Thread> thr = Thread::create("TaskWorker", taskWorker, &queue);
+        threads.append(thr);
+        thr->start();
+    }
+
+    for (int i = 0; i < threads.size(); ++i)
+        threads[i]->waitForCompletion();
+}
@@ -3,6 +3,9 @@
 
 #include <G3D/G3DAll.h>
 
+#include <atomic>
+#include <functional>
+
 class App;
 
 /** A worker thread */
@@ -59,4 +62,14 @@ private:
     Array<ThreadPoolThread::Ref>    m_threads;
 };
 
+/** Runs task(i) for every i in [0, count) on a set of short-lived worker
+  * threads and returns once all of them are done. Tasks are handed out one
+  * at a time, so uneven task sizes balance across the workers.
+  *
+  * Meant for one-off parallel work outside the render loop (scene loading,
+  * preprocessing), where the per-pass ThreadPool does not fit.
+  */
+void runTasks(int count, const std::function<void(int)> &task,
+              int numThreads = Thread::numCores());
+
 #endif
@@ -1,36 +1,182 @@
 
 #include "world.h"
+#include "threadpool.h"
 
 World::World() :
-    m_skyCube()
-{ }
+    m_compress(false),
+    m_outOfCore(false),
+    m_outOfCoreOverride(-1),
+    m_streaming(false),
+    m_instancing(false),
+    m_skyCube(),
+    m_skyImage(-1),
+    m_sourceHash(0),
+    m_useCache(true),
+    m_cached(false),
+    m_modelsLoaded(0),
+    m_spilling(false),
+    m_modelBytes(0),
+    m_textureBytes(0),
+    m_useTextureCache(false),
+    m_loadProgress(0.f),
+    m_emitTable(NULL)
+{
+    for (int i = 0; i < MemoryTracker::NUM_CATEGORIES; ++i)
+        m_tracked[i] = 0;
+}
+
+World::~World()
+{
+    joinPrefetch();
+    for (int i = 0; i < MemoryTracker::NUM_CATEGORIES; ++i)
+        track(MemoryTracker::Category(i), 0);
+}
+
+// Bytes read per call when prefetching a file
+static const size_t PREFETCH_CHUNK = 1 << 20;
+
+// Reads @p filename through once, so that G3D's own reads of it come from
+// the page cache
+static void readAhead(const String &filename)
+{
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return;
+
+    Array<uint8> buffer;
+    buffer.resize(PREFETCH_CHUNK);
+    while (fread(buffer.getCArray(), 1, PREFETCH_CHUNK, f) == PREFETCH_CHUNK) { }
+    fclose(f);
+}
+
+void World::prefetch(const Array<String> &files)
+{
+    joinPrefetch();
+
+    // A thread of its own, so that beginLoad() returns and the GL thread
+    // starts reading models while the workers run ahead of it
+    m_prefetch = std::thread([files]() {
+        runTasks(files.size(), [&](int i) { readAhead(files[i]); });
+    });
+}
 
-World::~World() { }
+void World::joinPrefetch()
+{
+    if (m_prefetch.joinable())
+        m_prefetch.join();
+}
 
 void World::load(const String &path )
+{
+    beginLoad(path);
+    while (loadNextModel()) { }
+    alwaysAssertM(finishLoad(), loadError());
+    writeCache();
+}
+
+void World::beginLoad(const String &path )
 {
 
     printf("Loading scene %s...\n", path.c_str());
+    setLoadStatus("Reading " + FilePath::baseExt(path), 0.f);
+    {
+        std::lock_guard<std::mutex> lock(m_statusMutex);
+        m_loadError = "";
+    }
 
     Any scene;
     scene.load(path);
 
     // Read the model table
     debugAssert( scene.containsKey("models") );
-    const Table<String, Any> models = scene["models"].table();
+    m_modelSpecs = scene["models"].table();
 
     // Dump it to stdout
-    printf("%d model(s)\n", (int)models.size());
-    for (int i = 0; i < (int)models.size(); ++i)
-        printf("    %s\n", models.getKeys()[i].c_str());
+    printf("%d model(s)\n", (int)m_modelSpecs.size());
+    for (int i = 0; i < (int)m_modelSpecs.size(); ++i)
+        printf("    %s\n", m_modelSpecs.getKeys()[i].c_str());
+
+    // Optional acceleration structure settings
+    m_bvhSettings = BVHSettings();
+    m_instancing = false;
+    if (scene.containsKey("acceleration"))
+    {
+        m_bvhSettings.init(scene["acceleration"]);
+
+        const Table<String, Any> &accel = scene["acceleration"].table();
+        if (accel.containsKey("instancing"))
+            m_instancing = accel["instancing"];
+    }
+
+    // Processed geometry is cached unless the scene opts out with "cache = false"
+    m_useCache = true;
+    if (scene.containsKey("cache"))
+        m_useCache = scene["cache"];
+
+    // Optional quantized geometry storage, see CompressedGeometry
+    m_compress = false;
+    if (scene.containsKey("compressGeometry"))
+        m_compress = scene["compressGeometry"];
+
+    // The cache stores flattened, full precision geometry only
+    if ((m_instancing || m_compress) && m_useCache)
+    {
+        printf("Scene cache disabled for %s scenes\n", m_instancing ? "instanced" : "compressed");
+        m_useCache = false;
+    }
+
+    // Out-of-core scenes render straight from the mapped cache
+    m_outOfCore = false;
+    if (scene.containsKey("outOfCore"))
+        m_outOfCore = scene["outOfCore"];
+    if (m_outOfCoreOverride >= 0)
+        m_outOfCore = m_outOfCoreOverride != 0;
+    if (m_outOfCore && !m_useCache)
+    {
+        printf("outOfCore needs the scene cache; loading into memory\n");
+        m_outOfCore = false;
+    }
+
+    // Optional texture cache, with its capacity in MB
+    m_useTextureCache = false;
+    if (scene.containsKey("textureCache"))
+    {
+        const size_t bytes = size_t(double(scene["textureCache"].number()) * 1024 * 1024);
+        m_useTextureCache = bytes > 0 && fitsBudget(MemoryTracker::TEXTURES, bytes, "Texture cache");
+        if (m_useTextureCache)
+        {
+            m_textureCache.setCapacity(bytes);
+            printf("Texture cache: %.0f MB\n", bytes / (1024.0 * 1024.0));
+        }
+    }
+
+    m_sourceHash = SceneCache::sourceHash(path, scene, m_bvhSettings);
+    m_sourcePath = path;
+    m_cacheFile = SceneCache::cacheFilename(path);
+    m_cached = m_useCache && m_cache.open(m_cacheFile, m_sourceHash);
+    if (m_cached)
+        printf("Using scene cache %s\n", m_cacheFile.c_str());
+
+    // Without a cache, an out-of-core scene writes one model by model and
+    // then streams from it, so it never has to fit in memory
+    m_spilling = m_outOfCore && !m_cached && m_stream.begin(m_cacheFile);
+    m_spillPositions.clear();
+    m_spillTwoSided.clear();
+    m_emitIndex.clear();
+    if (m_spilling)
+        printf("No scene cache yet; writing it model by model\n");
+    else if (m_outOfCore && !m_cached)
+        printf("Could not create scene cache %s; loading into memory\n", m_cacheFile.c_str());
 
     // Read the entity table
     debugAssert(scene.containsKey("entities"));
     const Table<String, Any> &entities = scene["entities"].table();
 
-    // Parse entities
+    // Parse entities. Models are only queued here; loadNextModel() reads them.
     printf("%d entities(s)\n", (int)entities.size());
-    Array<shared_ptr<Surface>> geometry;
+    m_pending.clear();
+    m_modelQueue.clear();
+    m_models.clear();
     for (int i = 0; i < (int)entities.size(); ++i)
     {
         String key = entities.getKeys()[i];
@@ -57,27 +203,36 @@ void World::load(const String &path )
             m_medium = Medium::create(e);
             printf("done\n");
         }
+        else if (type == "VisibleEntity" && m_cached)
+        {
+            printf("cached\n");
+        }
         else if (type == "VisibleEntity")
         {
             const Table<String, Any> &props = e.table();
 
-            // Read the model from disk
-            shared_ptr<ArticulatedModel> model =
-                ArticulatedModel::create(models[props["model"]]);
+            PendingEntity &entity = m_pending.next();
+            entity.name = key;
+            entity.model = props["model"].string();
 
             // Pose it in world space
-            Vector3 pos = Vector3::zero();
-            if (props.containsKey("position"))
-                pos = Vector3(props["position"]);
-
-            Array<shared_ptr<Surface>> posed;
-            model->pose(posed, CFrame(pos));
+            if (props.containsKey("frame"))
+            {
+                entity.frame = CFrame(props["frame"]);
+            }
+            else
+            {
+                Vector3 pos = Vector3::zero();
+                if (props.containsKey("position"))
+                    pos = Vector3(props["position"]);
+                entity.frame = CFrame(pos);
+            }
 
-            // Add it to the scene
-            for (int i = 0; i < posed.size(); ++i)
-                geometry.append(posed[i]);
+            // Each model is read once, however many entities place it
+            if (!m_modelQueue.contains(entity.model))
+                m_modelQueue.append(entity.model);
 
-            printf("done\n");
+            printf("queued\n");
         }
         else {
             printf("ignored (unknown entity type)\n");
@@ -86,46 +241,907 @@ void World::load(const String &path )
 
     if ( !m_medium ) m_medium = shared_ptr<Medium>( new HomogeneousMedium );
 
-    // Build bounding interval hierarchy for scene geometry
-    Array<Tri> triArray;
+    // Model files are read on workers; only parsing them and creating
+    // their textures is left to loadNextModel() on the GL thread
+    if (!m_cached && m_modelQueue.size() > 0)
+    {
+        Array<String> files;
+        SceneCache::sourceFiles(path, scene, files);
+        prefetch(files);
+    }
 
-    Surface::getTris( geometry, m_verts, triArray );
-    for (int i = 0; i < triArray.size(); ++i)
+    if (m_cached)
     {
-        triArray[i].material()->setStorage(COPY_TO_CPU);
+        // Materials own GPU textures, so they are created here rather than
+        // in finishLoad()
+        m_cachedMaterials.clear();
+        for (int i = 0; i < m_cache.numMaterials(); ++i)
+        {
+            shared_ptr<UniversalMaterial> m =
+                UniversalMaterial::create(UniversalMaterial::Specification(m_cache.material(i)));
+            m_cachedMaterials.append(m);
+            addMaterial(m);
+        }
+    }
+
+    m_modelsLoaded = 0;
+    fflush( stdout );
+}
+
+bool World::loadNextModel()
+{
+    if (m_modelsLoaded >= m_modelQueue.size() || loadFailed())
+        return false;
+
+    const String &key = m_modelQueue[m_modelsLoaded];
+    setLoadStatus(format("Loading model %s (%d/%d)", key.c_str(),
+                         m_modelsLoaded + 1, m_modelQueue.size()),
+                  0.5f * m_modelsLoaded / m_modelQueue.size());
+
+    // Read the model from disk. Materials keep CPU copies of their textures
+    // for sampling, or go through the texture cache; like the textures
+    // themselves this needs the GL thread.
+    shared_ptr<ArticulatedModel> model = ArticulatedModel::create(m_modelSpecs[key]);
+    const Array<ArticulatedModel::Mesh*> &meshes = model->meshArray();
+    for (int i = 0; i < meshes.size(); ++i)
+    {
+        if (meshes[i]->material)
+            addMaterial(meshes[i]->material);
+        m_modelBytes += meshes[i]->cpuIndexArray.size() * sizeof(int);
+    }
+
+    const Array<ArticulatedModel::Geometry*> &geometry = model->geometryArray();
+    for (int i = 0; i < geometry.size(); ++i)
+        m_modelBytes += geometry[i]->cpuVertexArray.size() * sizeof(CPUVertexArray::Vertex);
+
+    ++m_modelsLoaded;
+
+    track(MemoryTracker::MODELS, m_modelBytes);
+    if (!fitsBudget(MemoryTracker::TEXTURES, m_textureBytes, "Textures of " + key) ||
+        !fitsBudget(MemoryTracker::MODELS, m_modelBytes, "Model " + key))
+        return false;
+
+    // Spilled models are dropped right away; only their materials stay
+    if (m_spilling)
+    {
+        if (!spillModel(key, model))
+            return false;
+        m_modelBytes = 0;
+        track(MemoryTracker::MODELS, 0);
+    }
+    else
+    {
+        m_models.set(key, model);
+    }
+
+    printf("    loaded model %s\n", key.c_str());
+    fflush( stdout );
+
+    return m_modelsLoaded < m_modelQueue.size();
+}
+
+bool World::finishLoad()
+{
+    joinPrefetch();
+
+    if (loadFailed())
+    {
+        unload();
+        return false;
+    }
+
+    if (m_cached)
+    {
+        setLoadStatus("Mapping scene cache", 0.5f);
+        loadFromCache();
+    }
+    else if (m_spilling)
+    {
+        buildFromStream();
+    }
+    else if (m_instancing)
+    {
+        buildInstanced();
+    }
+    else
+    {
+        buildFromModels();
+    }
+
+    m_pending.clear();
+    m_models.clear();
+    m_modelBytes = 0;
+    track(MemoryTracker::MODELS, 0);
+
+    if (loadFailed())
+    {
+        printf("Load failed: %s\n", loadError().c_str());
+        setLoadStatus(loadError(), 1.f);
+        unload();
+        return false;
+    }
+
+    // Material ids per triangle, in the final triangle order
+    if (m_streaming)
+    {
+        m_triMaterials.clear();
+        for (int i = 0; i < m_cachedMaterials.size(); ++i)
+            m_triMaterials.append(uint16(m_materials.find(m_cachedMaterials[i].get())));
+    }
+    else
+    {
+        assignMaterials(m_triArray, m_geometry, m_triMaterials);
+    }
+    for (int i = 0; i < m_meshes.size(); ++i)
+        assignMaterials(m_meshes[i]->tris, m_meshes[i]->geometry, m_meshes[i]->materials);
+
+    // Streamed triangles are rebuilt per hit and need the materials
+    if (!m_streaming)
+        m_cachedMaterials.clear();
+
+    if (m_useTextureCache)
+    {
+        setLoadStatus("Tiling textures", 0.97f);
+        m_textureCache.prepare();
+    }
 
+    // Everything traversal and light sampling read per ray moves to the
+    // arena; streamed BVHs stay in the mapped file
+    setLoadStatus("Moving geometry to huge pages", 0.98f);
+    if (!m_streaming)
+        m_bvh.moveToArena(m_arena);
+    for (int i = 0; i < m_meshes.size(); ++i)
+        m_meshes[i]->bvh.moveToArena(m_arena);
+    buildEmitterTable();
+
+    printf("Arena: %.1f MB used, %.1f MB mapped, %.1f MB on huge pages (%s)\n",
+           m_arena.bytesUsed() / (1024.0 * 1024.0), m_arena.bytesMapped() / (1024.0 * 1024.0),
+           m_arena.bytesHuge() / (1024.0 * 1024.0), HugePageArena::modeName(m_arena.mode()));
+
+    int numTris = m_bvh.numTris();
+    for (int i = 0; i < m_instances.size(); ++i)
+        numTris += m_meshes[m_instances[i].mesh]->bvh.numTris();
+
+    setLoadStatus(format("Loaded %d triangles", numTris), 1.f);
+    printf( "%d triangle(s), %d light-emitting triangle(s) in scene.\n",
+            numTris, (int) m_emit.size() );
+    fflush( stdout );
+
+    updateMemory();
+    MemoryTracker::global().report("Memory after loading " + FilePath::baseExt(m_sourcePath) + ":");
+
+    return true;
+}
+
+bool World::fitsBudget(MemoryTracker::Category category, size_t bytes, const String &what)
+{
+    // The category as a whole grows by what this world adds to its share
+    const MemoryTracker &tracker = MemoryTracker::global();
+    const size_t grown = tracker.bytes(category) - m_tracked[category] + bytes;
+    if (!tracker.exceedsBudget(category, grown))
+        return true;
+
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    if (m_loadError.empty())
+    {
+        m_loadError = format("%s needs %.1f MB more than the %.1f MB memory budget allows",
+                             what.c_str(),
+                             (tracker.total() - tracker.bytes(category) + grown - tracker.budget()) / (1024.0 * 1024.0),
+                             tracker.budget() / (1024.0 * 1024.0));
+    }
+    return false;
+}
+
+void World::track(MemoryTracker::Category category, size_t bytes)
+{
+    MemoryTracker &tracker = MemoryTracker::global();
+    if (bytes > m_tracked[category])
+        tracker.add(category, bytes - m_tracked[category]);
+    else
+        tracker.remove(category, m_tracked[category] - bytes);
+    m_tracked[category] = bytes;
+}
+
+bool World::loadFailed() const
+{
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return !m_loadError.empty();
+}
+
+String World::loadError() const
+{
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return m_loadError;
+}
+
+void World::countTextures(const shared_ptr<Material> &material)
+{
+    shared_ptr<UniversalMaterial> m = dynamic_pointer_cast<UniversalMaterial>(material);
+    if (!m)
+        return;
+
+    const shared_ptr<Texture> textures[] = {
+        m->bsdf()->lambertian().texture(),
+        m->bsdf()->glossy().texture(),
+        m->bsdf()->transmissive().texture(),
+        m->emissive().texture()
+    };
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (textures[i] && !m_countedTextures.containsKey(textures[i].get()))
+        {
+            m_countedTextures.set(textures[i].get(), true);
+            m_textureBytes += size_t(textures[i]->sizeInMemory());
+        }
+    }
+
+    track(MemoryTracker::TEXTURES, m_textureBytes);
+}
+
+void World::reportTextureCache() const
+{
+    if (m_useTextureCache)
+        m_textureCache.report();
+}
+
+void World::addMaterial(const shared_ptr<Material> &material)
+{
+    m_materials.add(material, m_useTextureCache ? &m_textureCache : NULL);
+    alwaysAssertM(m_materials.size() <= 0xffff, "Too many materials");
+
+    // Cached textures count as the cache's resident tiles instead
+    if (!m_useTextureCache)
+        countTextures(material);
+}
+
+void World::assignMaterials(const Array<Tri> &tris, const CompressedGeometry &geometry,
+                            Array<uint16> &ids) const
+{
+    ids.clear();
+    if (geometry.numTris() > 0)
+    {
+        const Array<shared_ptr<Material>> &materials = geometry.materials();
+        for (int i = 0; i < materials.size(); ++i)
+            ids.append(uint16(m_materials.find(materials[i].get())));
+    }
+    else
+    {
+        ids.resize(tris.size());
+        for (int i = 0; i < tris.size(); ++i)
+            ids[i] = uint16(m_materials.find(tris[i].material().get()));
+    }
+}
+
+void World::updateMemory()
+{
+    size_t geometry = m_verts.size() * sizeof(CPUVertexArray::Vertex)
+                    + m_triArray.size() * sizeof(Tri)
+                    + m_geometry.sizeInBytes()
+                    + m_triMaterials.size() * sizeof(uint16)
+                    + m_materials.sizeInBytes();
+    size_t bvh = m_bvh.sizeInBytes() + m_tlas.sizeInBytes() + m_instances.size() * sizeof(Instance);
+
+    for (int i = 0; i < m_meshes.size(); ++i)
+    {
+        const InstancedMesh &mesh = *m_meshes[i];
+        geometry += mesh.verts.size() * sizeof(CPUVertexArray::Vertex)
+                  + mesh.tris.size() * sizeof(Tri)
+                  + mesh.geometry.sizeInBytes();
+        bvh += mesh.bvh.sizeInBytes();
+    }
+
+    // A streamed BVH is part of the mapped cache
+    if (m_streaming)
+        bvh -= m_bvh.sizeInBytes();
+
+    // The texture cache reports its own tiles
+    track(MemoryTracker::GEOMETRY, geometry);
+    track(MemoryTracker::BVH, bvh);
+    track(MemoryTracker::EMITTERS, m_emit.size() * (sizeof(Tri) + sizeof(Emitter))
+                                   + m_emitVerts.size() * sizeof(CPUVertexArray::Vertex));
+    track(MemoryTracker::TEXTURES, m_useTextureCache ? 0 : m_textureBytes);
+    track(MemoryTracker::SCENE_CACHE, m_cache.sizeInBytes());
+}
+
+void World::buildFromModels()
+{
+    // Pose and extract every entity's triangles in parallel
+    struct EntityGeometry
+    {
+        CPUVertexArray  verts;
+        Array<Tri>      tris;
+    };
+
+    Array<EntityGeometry> parts;
+    parts.resize(m_pending.size());
+    std::atomic<int> done(0);
+    const int numEntities = m_pending.size();
+
+    setLoadStatus("Extracting triangles", 0.5f);
+    runTasks(numEntities, [&](int i) {
+        const PendingEntity &entity = m_pending[i];
+
+        Array<shared_ptr<Surface>> posed;
+        m_models[entity.model]->pose(posed, entity.frame);
+        Surface::getTris(posed, parts[i].verts, parts[i].tris);
+
+        int n = ++done;
+        setLoadStatus(format("Extracting triangles (%d/%d)", n, numEntities),
+                      0.5f + 0.3f * n / numEntities);
+    });
+
+    // The per-entity arrays and their concatenation coexist for a moment
+    {
+        size_t bytes = 0;
+        for (int i = 0; i < parts.size(); ++i)
+        {
+            bytes += parts[i].verts.size() * sizeof(CPUVertexArray::Vertex)
+                   + parts[i].tris.size() * sizeof(Tri);
+        }
+        if (!fitsBudget(MemoryTracker::GEOMETRY, 2 * bytes, "Scene geometry"))
+            return;
+    }
+
+    // Each entity is its own mesh, with its own quantization bounds. This
+    // also quantizes the positions in parts, which the BVH is built from.
+    if (m_compress)
+    {
+        setLoadStatus("Compressing geometry", 0.8f);
+        for (int i = 0; i < parts.size(); ++i)
+            m_geometry.addMesh(parts[i].verts, parts[i].tris);
+    }
+
+    // Concatenate the per-entity arrays, offsetting vertex indices
+    int numVerts = 0, numTris = 0;
+    for (int i = 0; i < parts.size(); ++i)
+    {
+        numVerts += parts[i].verts.size();
+        numTris += parts[i].tris.size();
+        m_verts.hasTangent = m_verts.hasTangent || parts[i].verts.hasTangent;
+        m_verts.hasTexCoord0 = m_verts.hasTexCoord0 || parts[i].verts.hasTexCoord0;
+    }
+
+    m_verts.vertex.reserve(numVerts);
+    m_triArray.reserve(numTris);
+
+    for (int i = 0; i < parts.size(); ++i)
+    {
+        const int base = m_verts.size();
+        m_verts.vertex.append(parts[i].verts.vertex);
+
+        const Array<Tri> &tris = parts[i].tris;
+        for (int t = 0; t < tris.size(); ++t)
+        {
+            m_triArray.append(Tri(tris[t].index[0] + base,
+                                  tris[t].index[1] + base,
+                                  tris[t].index[2] + base,
+                                  m_verts, tris[t].material(), tris[t].twoSided()));
+        }
+    }
+    parts.clear();
+
+    track(MemoryTracker::GEOMETRY,
+                                m_verts.size() * sizeof(CPUVertexArray::Vertex) +
+                                m_triArray.size() * sizeof(Tri) + m_geometry.sizeInBytes());
+    if (!fitsBudget(MemoryTracker::BVH, BVH::estimateBytes(m_triArray.size(), m_bvhSettings), "BVH"))
+        return;
+
+    // Build bounding volume hierarchy for scene geometry
+    setLoadStatus(format("Building BVH over %d triangles", m_triArray.size()), 0.8f);
+
+    if (m_bvhSettings.spatialSplits)
+    {
+        // Build the plain object-split hierarchy first so the two can be
+        // compared on the same probe rays
+        BVHSettings objectSettings = m_bvhSettings;
+        objectSettings.spatialSplits = false;
+
+        BVH::TraversalStats before, after;
+        m_bvh.build(m_triArray, m_verts, objectSettings);
+        measureTraversal(m_bvh, before);
+        const BVH::BuildStats objectBuild = m_bvh.buildStats();
+
+        m_bvh.build(m_triArray, m_verts, m_bvhSettings);
+        measureTraversal(m_bvh, after);
+        const BVH::BuildStats &spatialBuild = m_bvh.buildStats();
+
+        printf("BVH (object splits):  %d nodes, %d refs, %.2f s, %.1f nodes/ray, %.1f tris/ray\n",
+               objectBuild.nodes, objectBuild.refs, objectBuild.seconds,
+               before.nodesPerRay(), before.trisPerRay());
+        printf("BVH (spatial splits): %d nodes, %d refs (+%.1f%%), %d spatial splits, %.2f s, %.1f nodes/ray, %.1f tris/ray\n",
+               spatialBuild.nodes, spatialBuild.refs,
+               100.f * (spatialBuild.refs - spatialBuild.tris) / max(1, spatialBuild.tris),
+               spatialBuild.spatialSplits, spatialBuild.seconds,
+               after.nodesPerRay(), after.trisPerRay());
+    }
+    else
+    {
+        m_bvh.build(m_triArray, m_verts, m_bvhSettings);
+
+        const BVH::BuildStats &build = m_bvh.buildStats();
+        printf("BVH: %d nodes, %d triangles, %.2f s\n", build.nodes, build.tris, build.seconds);
+    }
+
+    // Compressed geometry keeps the order it was added in
+    if (!m_compress)
+    {
+        setLoadStatus("Clustering BVH", 0.95f);
+        clusterGeometry();
+    }
+
+    m_emitIndex.clear();
+    for (int i = 0; i < m_triArray.size(); ++i)
+    {
         // Check if this triangle emits light
-        shared_ptr<Material> m = triArray[i].material();
-        if (m)
+        if (isEmissive(m_triArray[i]))
         {
-            shared_ptr<UniversalMaterial> mtl =
-                dynamic_pointer_cast<UniversalMaterial>(m);
+            addEmitter(m_triArray[i], m_verts, CFrame());
+            m_emitIndex.append(i);
+        }
+    }
+
+    if (m_compress)
+    {
+        const size_t before = m_verts.size() * sizeof(CPUVertexArray::Vertex)
+                            + m_triArray.size() * sizeof(Tri)
+                            + m_bvh.sizeInBytes();
 
-            if ( mtl->emissive().notBlack() ) {
-                m_emit.append(triArray[i]);
+        // Traversal decodes positions from here on; the full precision
+        // vertices and triangles are no longer needed
+        m_bvh.setGeometry(&m_geometry);
+        m_verts.clear();
+        m_triArray.clear();
+
+        const size_t after = m_geometry.sizeInBytes() + m_bvh.sizeInBytes();
+        printCompression(before, after, m_geometry.numTris());
+    }
+}
+
+bool World::spillModel(const String &key, const shared_ptr<ArticulatedModel> &model)
+{
+    setLoadStatus(format("Writing model %s to the scene cache", key.c_str()),
+                  0.5f * m_modelsLoaded / m_modelQueue.size());
+
+    for (int i = 0; i < m_pending.size(); ++i)
+    {
+        const PendingEntity &entity = m_pending[i];
+        if (entity.model != key)
+            continue;
+
+        CPUVertexArray verts;
+        Array<Tri> tris;
+        Array<shared_ptr<Surface>> posed;
+        model->pose(posed, entity.frame);
+        Surface::getTris(posed, verts, tris);
+
+        const int base = m_stream.numTriangles();
+        for (int t = 0; t < tris.size(); ++t)
+        {
+            if (isEmissive(tris[t]))
+                m_emitIndex.append(base + t);
+        }
+
+        if (!m_stream.append(verts, tris, m_spillPositions, m_spillTwoSided))
+        {
+            std::lock_guard<std::mutex> lock(m_statusMutex);
+            if (m_loadError.empty())
+                m_loadError = "Could not write scene cache " + m_cacheFile;
+            return false;
+        }
+    }
+
+    // The positions become the BVH's own copy
+    track(MemoryTracker::BVH, m_spillPositions.size() * sizeof(Vector3) + m_spillTwoSided.size());
+    return fitsBudget(MemoryTracker::BVH, BVH::estimateBytes(m_stream.numTriangles(), m_bvhSettings), "BVH");
+}
+
+void World::buildFromStream()
+{
+    setLoadStatus(format("Building BVH over %d triangles", m_stream.numTriangles()), 0.6f);
+    m_bvh.build(m_spillPositions, m_spillTwoSided, m_bvhSettings);
+
+    const BVH::BuildStats &build = m_bvh.buildStats();
+    printf("BVH: %d nodes, %d triangles, %.2f s\n", build.nodes, build.tris, build.seconds);
+
+    setLoadStatus("Clustering BVH", 0.7f);
+    Array<int> triOrder;
+    m_bvh.clusterForPaging(SceneCache::PAGE_BYTES, triOrder);
+
+    setLoadStatus("Writing scene cache", 0.8f);
+    const bool written = m_stream.finish(m_sourceHash, m_bvh, triOrder, m_emitIndex);
+    m_cachedMaterials = m_stream.materials();
+    m_stream.close();
+    m_spilling = false;
+    m_bvh.clear();
+    m_emitIndex.clear();
+    track(MemoryTracker::BVH, 0);
+
+    if (!written || !m_cache.open(m_cacheFile, m_sourceHash))
+    {
+        std::lock_guard<std::mutex> lock(m_statusMutex);
+        if (m_loadError.empty())
+            m_loadError = "Could not write scene cache " + m_cacheFile;
+        return;
+    }
+    printf("Wrote scene cache %s\n", m_cacheFile.c_str());
+    fflush( stdout );
+
+    // From here on the load is the same as from an existing cache
+    m_cached = true;
+    setLoadStatus("Mapping scene cache", 0.9f);
+    loadFromCache();
+}
+
+void World::clusterGeometry()
+{
+    Array<int> triOrder;
+    m_bvh.clusterForPaging(SceneCache::PAGE_BYTES, triOrder);
+
+    // Triangles in leaf order, and vertices in the order those first use them
+    Array<int> vertexIndex;
+    vertexIndex.resize(m_verts.size());
+    for (int i = 0; i < vertexIndex.size(); ++i)
+        vertexIndex[i] = -1;
+
+    CPUVertexArray verts;
+    verts.hasTangent = m_verts.hasTangent;
+    verts.hasTexCoord0 = m_verts.hasTexCoord0;
+    verts.vertex.reserve(m_verts.size());
+
+    Array<Tri> tris;
+    tris.reserve(m_triArray.size());
+
+    for (int i = 0; i < triOrder.size(); ++i)
+    {
+        const Tri &tri = m_triArray[triOrder[i]];
+        int index[3];
+        for (int j = 0; j < 3; ++j)
+        {
+            int &v = vertexIndex[tri.index[j]];
+            if (v < 0)
+            {
+                v = verts.size();
+                verts.vertex.append(m_verts.vertex[tri.index[j]]);
             }
+            index[j] = v;
+        }
+        tris.append(Tri(index[0], index[1], index[2], verts, tri.material(), tri.twoSided()));
+    }
+
+    m_verts = verts;
+    m_triArray = tris;
+}
+
+void World::printCompression(size_t before, size_t after, int numTris)
+{
+    printf("Geometry: %.1f bytes/triangle uncompressed, %.1f compressed (%.1f MB -> %.1f MB)\n",
+           double(before) / max(1, numTris), double(after) / max(1, numTris),
+           before / (1024.0 * 1024.0), after / (1024.0 * 1024.0));
+}
+
+void World::buildInstanced()
+{
+    // One mesh per unique model, in object space
+    const int numModels = m_modelQueue.size();
+    Table<String, int> meshIndex;
+    m_meshes.resize(numModels);
+    for (int i = 0; i < numModels; ++i)
+    {
+        m_meshes[i] = std::make_shared<InstancedMesh>();
+        m_meshes[i]->name = m_modelQueue[i];
+        meshIndex.set(m_modelQueue[i], i);
+    }
+
+    std::atomic<int> done(0);
+    std::atomic<size_t> reserved(0);
+    setLoadStatus("Building mesh BVHs", 0.5f);
+    runTasks(numModels, [&](int i) {
+        InstancedMesh &mesh = *m_meshes[i];
+
+        Array<shared_ptr<Surface>> posed;
+        m_models[mesh.name]->pose(posed, CFrame());
+        Surface::getTris(posed, mesh.verts, mesh.tris);
+
+        // Stop before building anything else once the meshes would not fit
+        const size_t bytes = mesh.verts.size() * sizeof(CPUVertexArray::Vertex)
+                           + mesh.tris.size() * sizeof(Tri)
+                           + BVH::estimateBytes(mesh.tris.size(), m_bvhSettings);
+        if (loadFailed() || !fitsBudget(MemoryTracker::GEOMETRY, reserved += bytes, "Instanced meshes"))
+        {
+            mesh.verts.clear();
+            mesh.tris.clear();
+            return;
+        }
+
+        mesh.lo = Vector3::inf();
+        mesh.hi = -Vector3::inf();
+        for (int v = 0; v < mesh.verts.size(); ++v)
+        {
+            mesh.lo = mesh.lo.min(mesh.verts.vertex[v].position);
+            mesh.hi = mesh.hi.max(mesh.verts.vertex[v].position);
         }
+
+        for (int t = 0; t < mesh.tris.size(); ++t)
+        {
+            if (isEmissive(mesh.tris[t]))
+                mesh.emitters.append(t);
+        }
+
+        if (m_compress)
+            mesh.geometry.addMesh(mesh.verts, mesh.tris);
+
+        mesh.bvh.build(mesh.tris, mesh.verts, m_bvhSettings);
+
+        int n = ++done;
+        setLoadStatus(format("Building mesh BVHs (%d/%d)", n, numModels),
+                      0.5f + 0.4f * n / numModels);
+    });
+
+    if (loadFailed())
+        return;
+
+    // Place the meshes
+    m_instances.resize(m_pending.size());
+    for (int i = 0; i < m_pending.size(); ++i)
+    {
+        Instance &inst = m_instances[i];
+        inst.mesh = meshIndex[m_pending[i].model];
+        inst.frame = m_pending[i].frame;
+
+        // World bounds from the transformed corners of the mesh bounds
+        const InstancedMesh &mesh = *m_meshes[inst.mesh];
+        inst.lo = Vector3::inf();
+        inst.hi = -Vector3::inf();
+        for (int c = 0; c < 8; ++c)
+        {
+            Vector3 corner((c & 1) ? mesh.hi.x : mesh.lo.x,
+                           (c & 2) ? mesh.hi.y : mesh.lo.y,
+                           (c & 4) ? mesh.hi.z : mesh.lo.z);
+            corner = inst.frame.pointToWorldSpace(corner);
+            inst.lo = inst.lo.min(corner);
+            inst.hi = inst.hi.max(corner);
+        }
+
+        // Lights are sampled in world space, so emitters are copied per instance
+        for (int e = 0; e < mesh.emitters.size(); ++e)
+            addEmitter(mesh.tris[mesh.emitters[e]], mesh.verts, inst.frame);
     }
 
-    m_tris.setContents(triArray, m_verts);
+    setLoadStatus(format("Building instance BVH over %d instances", m_instances.size()), 0.9f);
+    m_tlas.build(m_instances);
 
-    printf( "%d light-emitting triangle(s) in scene.\n", (int) m_emit.size() );
+    if (m_compress)
+    {
+        size_t before = 0, after = 0;
+        int numTris = 0;
+        for (int i = 0; i < m_meshes.size(); ++i)
+        {
+            InstancedMesh &mesh = *m_meshes[i];
+            before += mesh.sizeInBytes();
+
+            mesh.bvh.setGeometry(&mesh.geometry);
+            mesh.verts.clear();
+            mesh.tris.clear();
+
+            after += mesh.sizeInBytes();
+            numTris += mesh.geometry.numTris();
+        }
+        printCompression(before, after, numTris);
+    }
+
+    // Memory of the unique meshes against what flattening would have stored
+    size_t unique = m_tlas.sizeInBytes() + m_instances.size() * sizeof(Instance);
+    size_t flattened = 0;
+    int flatTris = 0;
+    for (int i = 0; i < m_meshes.size(); ++i)
+        unique += m_meshes[i]->sizeInBytes();
+    for (int i = 0; i < m_instances.size(); ++i)
+    {
+        flattened += m_meshes[m_instances[i].mesh]->sizeInBytes();
+        flatTris += m_meshes[m_instances[i].mesh]->bvh.numTris();
+    }
+
+    printf("Instancing: %d meshes, %d instances, %d triangles flattened\n",
+           m_meshes.size(), m_instances.size(), flatTris);
+    printf("Instancing: %.1f MB instanced, %.1f MB flattened\n",
+           unique / (1024.0 * 1024.0), flattened / (1024.0 * 1024.0));
+}
+
+bool World::isEmissive(const Tri &tri)
+{
+    shared_ptr<UniversalMaterial> mtl =
+        dynamic_pointer_cast<UniversalMaterial>(tri.material());
+
+    return mtl && mtl->emissive().notBlack();
+}
+
+void World::addEmitter(const Tri &tri, const CPUVertexArray &verts, const CFrame &frame)
+{
+    const int base = m_emitVerts.size();
+    for (int i = 0; i < 3; ++i)
+    {
+        CPUVertexArray::Vertex v = verts.vertex[tri.index[i]];
+        v.position = frame.pointToWorldSpace(v.position);
+        v.normal = frame.vectorToWorldSpace(v.normal);
+        m_emitVerts.vertex.append(v);
+    }
+
+    m_emit.append(Tri(base, base + 1, base + 2, m_emitVerts, tri.material(), tri.twoSided()));
+}
+
+void World::buildEmitterTable()
+{
+    m_emitTable = m_arena.alloc<Emitter>(m_emit.size());
+    for (int i = 0; i < m_emit.size(); ++i)
+    {
+        const Tri &tri = m_emit[i];
+        Emitter &e = m_emitTable[i];
+        e.p0 = tri.position(m_emitVerts, 0);
+        e.p1 = tri.position(m_emitVerts, 1);
+        e.p2 = tri.position(m_emitVerts, 2);
+        e.normal = tri.normal(m_emitVerts);
+        e.area = tri.area();
+        e.material = m_materials.find(tri.material().get());
+    }
+}
+
+void World::writeCache()
+{
+    if (!m_useCache || m_cached || m_sourceHash == 0)
+        return;
+
+    if (SceneCache::write(m_cacheFile, m_sourceHash, m_verts, m_triArray, m_emitIndex, m_bvh))
+        printf("Wrote scene cache %s\n", m_cacheFile.c_str());
+    else
+        printf("Could not write scene cache %s\n", m_cacheFile.c_str());
     fflush( stdout );
+}
+
+void World::setLoadStatus(const String &status, float progress)
+{
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    m_loadStatus = status;
+    m_loadProgress = progress;
+}
+
+String World::loadStatus() const
+{
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return m_loadStatus;
+}
+
+float World::loadProgress() const
+{
+    std::lock_guard<std::mutex> lock(m_statusMutex);
+    return m_loadProgress;
+}
+
+void World::loadFromCache()
+{
+    // Traverse the mapped hierarchy in place
+    m_cache.attach(m_bvh);
+
+    if (m_outOfCore)
+    {
+        // Only the emitters are copied; everything else stays in the file
+        // and is paged in as rays reach it
+        m_streaming = true;
+        const int *emitters = m_cache.emitters();
+        for (int i = 0; i < m_cache.numEmitters(); ++i)
+        {
+            CPUVertexArray verts;
+            Tri tri = m_cache.triangle(emitters[i], verts, m_cachedMaterials);
+            addEmitter(tri, verts, CFrame());
+        }
+        return;
+    }
+
+    // The BVH is copied off the mapping as well, see finishLoad()
+    if (!fitsBudget(MemoryTracker::GEOMETRY,
+                    m_cache.numVertices() * sizeof(CPUVertexArray::Vertex) +
+                    m_cache.numTriangles() * sizeof(Tri) + m_bvh.sizeInBytes(),
+                    "Cached geometry"))
+        return;
+
+    const SceneCache::Vertex *vertices = m_cache.vertices();
+    m_verts.vertex.resize(m_cache.numVertices());
+    for (int i = 0; i < m_cache.numVertices(); ++i)
+    {
+        CPUVertexArray::Vertex &v = m_verts.vertex[i];
+        v.position = vertices[i].position;
+        v.normal = vertices[i].normal;
+        v.tangent = vertices[i].tangent;
+        v.texCoord0 = vertices[i].texCoord0;
+    }
+    m_verts.hasTangent = true;
+    m_verts.hasTexCoord0 = true;
+
+    const SceneCache::Triangle *triangles = m_cache.triangles();
+    m_triArray.reserve(m_cache.numTriangles());
+    for (int i = 0; i < m_cache.numTriangles(); ++i)
+    {
+        const SceneCache::Triangle &t = triangles[i];
+        m_triArray.append(Tri(t.index[0], t.index[1], t.index[2], m_verts,
+                              m_cachedMaterials[t.material], t.twoSided != 0));
+    }
 
+    const int *emitters = m_cache.emitters();
+    for (int i = 0; i < m_cache.numEmitters(); ++i)
+        addEmitter(m_triArray[emitters[i]], m_verts, CFrame());
+}
+
+bool World::isLoaded(const String &path)
+{
+    if (m_sourceHash == 0 || path != m_sourcePath || loadFailed())
+        return false;
+
+    Any scene;
+    scene.load(path);
+
+    BVHSettings settings;
+    if (scene.containsKey("acceleration"))
+        settings.init(scene["acceleration"]);
+
+    return SceneCache::sourceHash(path, scene, settings) == m_sourceHash;
 }
 
 void World::setSkybox(String xPos, String xNeg,
                       String yPos, String yNeg,
                       String zPos, String zNeg, int image)
 {
+    if (image == m_skyImage)
+        return;
+
+    m_skyImage = image;
     m_skyCube = SkyCube(xPos, xNeg, yPos, yNeg, zPos, zNeg, image);
+    track(MemoryTracker::SKYBOX, m_skyCube.sizeInBytes());
     printf("loaded SkyCube\n");
 }
 
 void World::unload()
 {
-    m_tris.clear();
+    joinPrefetch();
+    m_stream.close();
+    m_spilling = false;
+    m_spillPositions.clear();
+    m_spillTwoSided.clear();
+    m_bvh.clear();
+    m_cache.close();
+    m_cachedMaterials.clear();
+    m_streaming = false;
+    m_sourcePath = "";
+    m_sourceHash = 0;
+    m_triArray.clear();
+    m_verts.clear();
+    m_geometry.clear();
+    m_meshes.clear();
+    m_instances.clear();
+    m_tlas.clear();
     m_emit.clear();
+    m_emitVerts.clear();
+    m_emitIndex.clear();
+    m_pending.clear();
+    m_models.clear();
+
+    // Nothing points into the arena any more
+    m_emitTable = NULL;
+    m_arena.reset();
+
+    m_modelBytes = 0;
+    m_textureBytes = 0;
+    m_countedTextures.clear();
+    m_materials.clear();
+    m_triMaterials.clear();
+    m_textureCache.clear();
+
+    // Only what this world added; another World may still be loaded
+    track(MemoryTracker::GEOMETRY, 0);
+    track(MemoryTracker::BVH, 0);
+    track(MemoryTracker::EMITTERS, 0);
+    track(MemoryTracker::TEXTURES, 0);
+    track(MemoryTracker::MODELS, 0);
+    track(MemoryTracker::SCENE_CACHE, 0);
 }
 
 shared_ptr<Camera> World::camera()
@@ -143,50 +1159,203 @@ shared_ptr<Medium> World::medium()
     return m_medium;
 }
 
-SkyCube World::skycube()
+const SkyCube &World::skycube() const
 {
     return m_skyCube;
 }
 
-void World::emissivePoint( Random &random,
+void World::bounds( Vector3 &lo, Vector3 &hi ) const
+{
+    lo = Vector3::inf();
+    hi = -Vector3::inf();
+
+    for (int i = 0; i < m_instances.size(); ++i)
+    {
+        lo = lo.min(m_instances[i].lo);
+        hi = hi.max(m_instances[i].hi);
+    }
+
+    if (!m_bvh.empty())
+    {
+        lo = lo.min(m_bvh.nodes()[0].lo);
+        hi = hi.max(m_bvh.nodes()[0].hi);
+    }
+
+    if (lo.x > hi.x)
+        lo = hi = Vector3::zero();
+}
+
+void World::emissivePoint( float u,
+                           const Point2 &uv,
                            Vector3 &point,
-                           Tri &tri,
+                           int &material,
                            Vector3 &normal,
                            float &prob,
                            float &area )
 {
     // Pick an emissive triangle uniformly at random
-    int i = random.integer(0, m_emit.size() - 1);
-    tri = m_emit[i];
-    normal = tri.normal(m_verts);
+    int i = min(int(u * m_emit.size()), m_emit.size() - 1);
+    const Emitter &e = m_emitTable[i];
+    material = e.material;
+    normal = e.normal;
 
     // Pick a point in that triangle uniformly at random
     // http://books.google.com/books?id=fvA7zLEFWZgC&pg=PA24#v=onepage&q&f=false
-    float s = random.uniform(),
-          t = random.uniform(),
+    float s = uv.x,
+          t = uv.y,
           sqrtT = sqrt(t),
           a = (1.f - sqrtT),
           b = (1.f - s) * sqrtT,
           c = s * sqrtT;
 
-    point = tri.position(m_verts, 0) * a
-          + tri.position(m_verts, 1) * b
-          + tri.position(m_verts, 2) * c;
+    point = e.p0 * a
+          + e.p1 * b
+          + e.p2 * c;
 
     // assumes all light emitting triangles are the same area
-    prob = 1.f / m_emit.size() / tri.area();
-    area = tri.area();
+    prob = 1.f / m_emit.size() / e.area;
+    area = e.area;
+}
+
+void World::shade(const Tri &tri, const CPUVertexArray &verts, int material, const BVH::Hit &hit,
+                  const Ray &ray, const RayDifferential &diff, const CFrame *frame,
+                  ShadingPoint &sp)
+{
+    const CPUVertexArray::Vertex &v0 = verts.vertex[tri.index[0]];
+    const CPUVertexArray::Vertex &v1 = verts.vertex[tri.index[1]];
+    const CPUVertexArray::Vertex &v2 = verts.vertex[tri.index[2]];
+    const float w = 1.f - hit.u - hit.v;
+
+    const Vector3 e1 = v1.position - v0.position, e2 = v2.position - v0.position;
+    const Vector3 cross = e1.cross(e2);
+
+    sp.position = v0.position * w + v1.position * hit.u + v2.position * hit.v;
+    sp.geometricNormal = cross.directionOrZero();
+    sp.shadingNormal = (v0.normal * w + v1.normal * hit.u + v2.normal * hit.v).directionOrZero();
+    if (sp.shadingNormal.isZero())
+        sp.shadingNormal = sp.geometricNormal;
+    sp.texCoord = v0.texCoord0 * w + v1.texCoord0 * hit.u + v2.texCoord0 * hit.v;
+    sp.material = material;
+    sp.area = 0.5f * cross.length();
+    sp.backface = hit.backface;
+
+    if (frame)
+    {
+        sp.position = frame->pointToWorldSpace(sp.position);
+        sp.geometricNormal = frame->vectorToWorldSpace(sp.geometricNormal);
+        sp.shadingNormal = frame->vectorToWorldSpace(sp.shadingNormal);
+    }
+
+    // Normals face the side the ray came from; from behind, the ray is
+    // inside the surface
+    const MaterialParams &params = m_materials[material];
+    if (hit.backface)
+    {
+        sp.geometricNormal = -sp.geometricNormal;
+        sp.shadingNormal = -sp.shadingNormal;
+        sp.etaRatio = params.etaTransmit / params.etaReflect;
+    }
+    else
+    {
+        sp.etaRatio = params.etaReflect / params.etaTransmit;
+    }
+
+    float uvWidth = 0.f;
+    if (m_useTextureCache && params.textured)
+    {
+        // Footprint on the triangle, then in texture space from how much
+        // the triangle's texture mapping stretches it
+        const float width = diff.footprint(ray.direction(), hit.distance, sp.geometricNormal);
+
+        const Vector2 t1 = v1.texCoord0 - v0.texCoord0, t2 = v2.texCoord0 - v0.texCoord0;
+        const float uvArea = 0.5f * fabsf(t1.x * t2.y - t1.y * t2.x);
+        uvWidth = width * sqrtf(uvArea / max(0.5f * cross.length(), 1e-12f));
+    }
+
+    m_materials.evaluate(sp, m_useTextureCache ? &m_textureCache : NULL, uvWidth);
 }
 
-void World::intersect(const Ray &ray, float &dist, shared_ptr<Surfel> &surf)
+void World::sample(const BVH::Hit &hit, int instance, const Ray &ray,
+                   const RayDifferential &diff, ShadingPoint &sp)
 {
-    TriTree::Hit hit;
-    if (m_tris.intersectRay(ray, hit)) {
-        dist = hit.distance;
-        m_tris.sample(hit, surf);
+    const CFrame *frame = instance >= 0 ? &m_instances[instance].frame : NULL;
+    const Array<Tri> *tris = &m_triArray;
+    const CPUVertexArray *verts = &m_verts;
+    const CompressedGeometry *geometry = &m_geometry;
+    const Array<uint16> *materials = &m_triMaterials;
+
+    if (instance >= 0)
+    {
+        const InstancedMesh &mesh = *m_meshes[m_instances[instance].mesh];
+        tris = &mesh.tris;
+        verts = &mesh.verts;
+        geometry = &mesh.geometry;
+        materials = &mesh.materials;
+    }
+
+    if (m_streaming)
+    {
+        CPUVertexArray decoded;
+        Tri tri = m_cache.triangle(hit.triIndex, decoded, m_cachedMaterials);
+        const int material = (*materials)[m_cache.triangles()[hit.triIndex].material];
+        shade(tri, decoded, material, hit, ray, diff, frame, sp);
+    }
+    else if (geometry->numTris() > 0)
+    {
+        // Only the closest hit is ever decoded
+        CPUVertexArray decoded;
+        Tri tri = geometry->decode(hit.triIndex, decoded);
+        const int material = (*materials)[geometry->materialIndex(hit.triIndex)];
+        shade(tri, decoded, material, hit, ray, diff, frame, sp);
+    }
+    else
+    {
+        shade((*tris)[hit.triIndex], *verts, (*materials)[hit.triIndex], hit, ray, diff, frame, sp);
     }
 }
 
+bool World::intersectInstances(const Ray &ray, BVH::Hit &hit, int &instance,
+                               bool cullBackfaces, bool anyHit) const
+{
+    float tMax = ray.maxDistance();
+    instance = -1;
+
+    return m_tlas.traverse(ray, tMax, anyHit, [&](int i, float &t) {
+        const Instance &inst = m_instances[i];
+
+        // Rigid frames preserve distance, so t carries over unchanged
+        Ray local = Ray::fromOriginAndDirection(inst.frame.pointToObjectSpace(ray.origin()),
+                                                inst.frame.vectorToObjectSpace(ray.direction()),
+                                                ray.minDistance(), t);
+
+        BVH::Hit h;
+        if (!m_meshes[inst.mesh]->bvh.intersect(local, h, cullBackfaces, anyHit))
+            return false;
+
+        hit = h;
+        instance = i;
+        t = h.distance;
+        return true;
+    });
+}
+
+bool World::intersect(const Ray &ray, float &dist, ShadingPoint &sp, const RayDifferential &diff)
+{
+    BVH::Hit hit;
+    int instance = -1;
+
+    bool found = m_instances.size() > 0
+               ? intersectInstances(ray, hit, instance, true, false)
+               : m_bvh.intersect(ray, hit);
+
+    if (!found)
+        return false;
+
+    dist = hit.distance;
+    sample(hit, instance, ray, diff, sp);
+    return true;
+}
+
 bool World::lineOfSight(const Vector3 &beg, const Vector3 &end)
 {
     Vector3 d = end - beg;
@@ -199,8 +1368,74 @@ bool World::lineOfSight(const Vector3 &beg, const Vector3 &end)
     // ~vn6
     Ray ray = Ray::fromOriginAndDirection(beg, d / dist, 1e-4, dist - 1e-4);
 
-    TriTreeBase::Hit hit;
+    BVH::Hit hit;
+
+    if (m_instances.size() > 0)
+    {
+        int instance;
+        return !intersectInstances(ray, hit, instance, false, true);
+    }
+
+    return !m_bvh.intersect(ray, hit, false, true);
+}
+
+Radiance3 World::sampleDirect( const ShadingPoint &sp, const Vector3 &wo, float u, const Point2 &uv )
+{
+    if (m_emit.size() == 0)
+        return Radiance3::zero();
+
+    Vector3 point, normal;
+    int material;
+    float prob, area;
+    emissivePoint(u, uv, point, material, normal, prob, area);
+
+    const Vector3 toLight = point - sp.position;
+    const float d2 = toLight.squaredLength();
+    if (d2 < 1e-8f)
+        return Radiance3::zero();
+
+    // Emitters light the side their normal faces
+    const Vector3 wi = toLight / sqrtf(d2);
+    const float cosLight = -wi.dot(normal);
+    const float cosSurface = wi.dot(sp.shadingNormal);
+    if (cosLight <= 0.f || cosSurface <= 0.f)
+        return Radiance3::zero();
+
+    const Color3 f = BSDF::evaluate(sp, wi, wo);
+    if (f.isZero() || !lineOfSight(sp.position + sp.geometricNormal * 1e-4f, point))
+        return Radiance3::zero();
 
-    return !m_tris.intersectRay(ray, hit, TriTree::DO_NOT_CULL_BACKFACES | TriTree::OCCLUSION_TEST_ONLY);
+    return emittedRadiance(material, area) * f * (cosSurface * cosLight / (d2 * prob));
+}
+
+void World::measureTraversal(const BVH &bvh, BVH::TraversalStats &stats)
+{
+    if (!m_camera) return;
+
+    // Fixed seed so that different builds see identical rays
+    Random random(0xB5, false);
+    const int res = 64;
+    Rect2D viewport = Rect2D::xywh(0, 0, res, res);
+
+    for (int y = 0; y < res; ++y)
+    {
+        for (int x = 0; x < res; ++x)
+        {
+            Ray ray = m_camera->worldRay(x + 0.5f, y + 0.5f, viewport);
+
+            BVH::Hit hit;
+            if (!bvh.intersect(ray, hit, true, false, &stats))
+                continue;
+
+            // One bounce in a random direction from the hit point
+            const Vector3 n = m_triArray[hit.triIndex].normal(m_verts);
+            Vector3 w = Vector3::hemiRandom(hit.backface ? -n : n, random);
+            Point3 p = ray.origin() + ray.direction() * hit.distance;
+            Ray bounce = Ray::fromOriginAndDirection(p + w * 1e-4f, w);
+
+            BVH::Hit bounceHit;
+            bvh.intersect(bounce, bounceHit, true, false, &stats);
+        }
+    }
 }
 
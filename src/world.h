@@ -3,8 +3,20 @@
 
 #include <G3D/G3DAll.h>
 
+#include <mutex>
+#include <thread>
+
+#include "bvh.h"
+#include "compressedgeometry.h"
 #include "dofCam.h"
+#include "hugepagearena.h"
+#include "instance.h"
+#include "materialtable.h"
+#include "memorytracker.h"
+#include "raydifferential.h"
+#include "scenecache.h"
 #include "SkyCube.h"
+#include "texturecache.h"
 
 #include "medium.h"
 
@@ -21,15 +33,64 @@ public:
     /** Loads the geometry, lights and camera from a scene file.
       * Fails an assert if anything goes wrong.
       *
+      * Processed geometry is read from a memory-mapped SceneCache when one
+      * exists for the scene and its models are unchanged, and written
+      * after loading from source otherwise.
+      *
       * @param path The file to load (*.scn.any)
       */
     void load(const String &path);
 
+    /** Incremental version of load(), for loading without blocking the GUI:
+      *
+      *     beginLoad(path); while (loadNextModel()) {...} finishLoad(); writeCache();
+      *
+      * beginLoad() parses the scene file and queues its models.
+      * loadNextModel() reads one model and returns false when none are
+      * left; models create GPU textures, so both must run on the thread
+      * owning the GL context. Meanwhile worker threads read the model
+      * files, their .mtl files and images ahead of it, so that the GL
+      * thread only parses and never waits on the disk. finishLoad() poses the entities and extracts
+      * their triangles in parallel, gathers emitters and builds the BVH,
+      * and may run on any thread. The world is ready to render after
+      * finishLoad(); writeCache() can follow while rendering.
+      *
+      * The first load of an out-of-core scene never holds it in memory:
+      * loadNextModel() spills each model's triangles to the cache as it is
+      * read and drops the model, and finishLoad() builds the BVH from their
+      * positions, writes the cache and streams from it.
+      */
+    void beginLoad(const String &path);
+    bool loadNextModel();
+    bool finishLoad();
+    void writeCache();
+
+    /** Returns true if the load stopped because the scene would not fit in
+      * the MemoryTracker budget. loadNextModel() then returns false and
+      * finishLoad() unloads what was built and returns false; loadError()
+      * says what did not fit.
+      */
+    bool loadFailed() const;
+    String loadError() const;
+
+    /** Progress of the current load in [0, 1] and a description of the
+      * current step. Safe to call from any thread.
+      */
+    float loadProgress() const;
+    String loadStatus() const;
+
+    /** Returns true if @p path is the scene currently loaded and neither it
+      * nor any model it references has changed since, so load() can be
+      * skipped.
+      */
+    bool isLoaded(const String &path);
+
     /** Clears the contents of this world object
       * Geometry and lights are cleared. The camera is not affected.
       */
     void unload();
 
+    /** Loads the skybox faces. Does nothing if @p image is already loaded. */
     void setSkybox(String xPos, String xNeg,
                    String yPos, String yNeg,
                    String zPos, String zNeg, int image);
@@ -46,7 +107,10 @@ public:
      * @brief returns scene's skycube
      * @return skycube
      */
-    SkyCube skycube();
+    const SkyCube &skycube() const;
+
+    /** World space bounds of the scene's geometry, once finishLoad() is done */
+    void bounds( Vector3 &lo, Vector3 &hi ) const;
 
 
 
@@ -63,23 +127,42 @@ public:
      * @brief emissivePoint picks a point on an emitter from the scene.
      * the light's power is assumed to be emitted over a hemisphere (rather than
      * a double-sided light)
-     * @param random    A random number generator
+     * @param u         uniform in [0, 1), picks the emitter
+     * @param uv        uniform in [0, 1)^2, picks the point on it
      * @param point     set to the point from which light is emitted
-     * @param tri       triangle that contains the point
+     * @param material  MaterialTable id of the emitter
      * @param normal    face normal of the triangle
      * @param prob      probability of picking this point out of all light-emitting points in the scene
      * @param area      area of the triangle
      */
-    void emissivePoint( Random &random, Vector3 &point, Tri &tri, Vector3 &normal, float &prob, float &area );
+    void emissivePoint( float u, const Point2 &uv, Vector3 &point, int &material, Vector3 &normal, float &prob, float &area );
+
+    /** Radiance leaving a point of an emitter triangle of area @p area with
+      * material @p material, as picked by emissivePoint(): the emissive term
+      * is the triangle's power spread over its area and hemisphere, so
+      * L = emissive / (pi area). Every integrator converts through here.
+      */
+    Radiance3 emittedRadiance( int material, float area ) const
+    {
+        return m_materials[material].emissive / (pif() * max(area, 1e-12f));
+    }
+
+    /** The scene's compiled materials */
+    const MaterialTable &materials() const { return m_materials; }
 
     /** Finds the first point a ray intersects with this scene
       *
       * @param ray  The ray to intersect
       * @param dist The distance from the ray origin to the point of
-//      *             intersection
-      * @param surf The surface at the point of intersection
+      *             intersection
+      * @param sp   The shading point at the intersection
+      * @param diff The ray's differentials, for texture filtering when the
+      *             scene uses the TextureCache; the default reads full
+      *             resolution
+      * @return     False if the ray hits nothing
       */
-    void intersect(const Ray &ray, float &dist, shared_ptr<Surfel> &surf );
+    bool intersect(const Ray &ray, float &dist, ShadingPoint &sp,
+                   const RayDifferential &diff = RayDifferential() );
 
 
 
@@ -92,17 +175,218 @@ public:
       */
     bool lineOfSight( const Vector3 &beg, const Vector3 &end );
 
+    /** One-sample estimate of the light reaching @p sp directly from the
+      * emitters and scattered toward @p wo: an emitter point picked with
+      * @p u and @p uv as in emissivePoint(), tested with a shadow ray.
+      */
+    Radiance3 sampleDirect( const ShadingPoint &sp, const Vector3 &wo, float u, const Point2 &uv );
+
+    /** Area density with which emissivePoint() picks @p sp, a point on an
+      * emitter
+      */
+    float emissivePdf( const ShadingPoint &sp ) const
+    {
+        return m_emit.size() > 0 ? 1.f / (m_emit.size() * max(sp.area, 1e-12f)) : 0.f;
+    }
+
+    /** Returns true if geometry is read from the mapped scene cache on
+      * demand rather than held in memory ("outOfCore = true;")
+      */
+    bool isStreaming() const { return m_streaming; }
+
+    /** Overrides the scene's "outOfCore" setting for later loads: 1 forces
+      * streaming, 0 loading into memory, -1 restores the scene's choice
+      */
+    void overrideOutOfCore( int outOfCore ) { m_outOfCoreOverride = outOfCore; }
+
+    /** Prints texture cache statistics, if the scene uses the cache */
+    void reportTextureCache() const;
+
     /** Returns true if there are any lights in the scene */
     bool lightsExist() { return m_emit.size() > 0; }
 
+    /** Traces a fixed set of probe rays (camera rays plus one diffuse bounce)
+      * through @p bvh and accumulates the traversal counters in @p stats.
+      */
+    void measureTraversal( const BVH &bvh, BVH::TraversalStats &stats );
+
 private:
 
-    TriTree             m_tris;     // The scene's geometry in world space
+    /** An entity whose model is being loaded */
+    struct PendingEntity
+    {
+        String  name;
+        String  model;
+        CFrame  frame;
+    };
+
+    /** Rebuilds vertices, triangles and emitters from m_cache */
+    void loadFromCache();
+
+    /** Poses m_pending, extracts triangles and builds the BVH */
+    void buildFromModels();
+
+    /** Poses the entities of model @p key and appends their triangles to
+      * m_stream, for a first out-of-core load
+      */
+    bool spillModel( const String &key, const shared_ptr<ArticulatedModel> &model );
+
+    /** Builds the BVH over the spilled triangles, writes the cache from
+      * m_stream and maps it
+      */
+    void buildFromStream();
+
+    /** Builds one InstancedMesh per model and the instance hierarchy over
+      * m_pending, instead of flattening
+      */
+    void buildInstanced();
+
+    /** Lays the BVH out in page-sized treelets and reorders m_triArray
+      * and m_verts to match, see BVH::clusterForPaging()
+      */
+    void clusterGeometry();
+
+    /** Copies m_emit into m_emitTable */
+    void buildEmitterTable();
+
+    static bool isEmissive( const Tri &tri );
+
+    static void printCompression( size_t before, size_t after, int numTris );
+
+    /** Copies an emitting triangle, moved by @p frame, into m_emitVerts */
+    void addEmitter( const Tri &tri, const CPUVertexArray &verts, const CFrame &frame );
+
+    /** Closest (or, with @p anyHit, any) hit among the instances */
+    bool intersectInstances( const Ray &ray, BVH::Hit &hit, int &instance,
+                             bool cullBackfaces, bool anyHit ) const;
+
+    void setLoadStatus(const String &status, float progress);
+
+    /** Starts reading @p files on worker threads, to bring them into the
+      * page cache before G3D reads them
+      */
+    void prefetch(const Array<String> &files);
+
+    /** Waits for prefetch() to finish */
+    void joinPrefetch();
+
+    /** Returns false, failing the load, if growing this world's share of
+      * @p category to @p bytes would exceed the memory budget
+      */
+    bool fitsBudget( MemoryTracker::Category category, size_t bytes, const String &what );
+
+    /** Sets this world's share of @p category to @p bytes, leaving what
+      * other Worlds hold in the MemoryTracker alone
+      */
+    void track( MemoryTracker::Category category, size_t bytes );
+
+    /** Adds the textures of @p material to m_textureBytes */
+    void countTextures( const shared_ptr<Material> &material );
+
+    /** Reports what the loaded world holds to the MemoryTracker */
+    void updateMemory();
+
+    /** Compiles @p material into m_materials. GL thread only. */
+    void addMaterial( const shared_ptr<Material> &material );
+
+    /** MaterialTable ids of @p tris, or of the materials of @p geometry
+      * if it holds the triangles
+      */
+    void assignMaterials( const Array<Tri> &tris, const CompressedGeometry &geometry,
+                          Array<uint16> &ids ) const;
+
+    /** Builds the shading point for a hit of @p ray, in @p instance if it
+      * is not -1, filtering textures for the footprint of @p diff
+      */
+    void sample( const BVH::Hit &hit, int instance, const Ray &ray,
+                 const RayDifferential &diff, ShadingPoint &sp );
+
+    /** Interpolates @p tri's vertices and evaluates @p material at the hit.
+      * @p frame places the triangle in world space, NULL if it is there.
+      */
+    void shade( const Tri &tri, const CPUVertexArray &verts, int material, const BVH::Hit &hit,
+                const Ray &ray, const RayDifferential &diff, const CFrame *frame,
+                ShadingPoint &sp );
+
+    /** What emissivePoint() needs of an emitter, in plain data */
+    struct Emitter
+    {
+        Point3  p0, p1, p2;
+        Vector3 normal;
+        float   area;
+        int     material;
+    };
+
+    // Huge page backed storage for the BVH nodes and triangle data and the
+    // emitter table; declared first so it outlives what points into it
+    HugePageArena       m_arena;
+
+    BVH                 m_bvh;      // Acceleration structure over m_triArray
+    BVHSettings         m_bvhSettings;
+    SceneCache          m_cache;    // Mapped cache backing m_bvh, if any
+    Array<Tri>          m_triArray; // The scene's geometry in world space
+    bool                m_compress;
+    CompressedGeometry  m_geometry; // Replaces m_triArray and m_verts if m_compress
+    bool                m_outOfCore;
+    int                 m_outOfCoreOverride; // see overrideOutOfCore()
+    bool                m_streaming;    // Geometry is read from m_cache per hit
+
+    // Instanced geometry, used instead of m_bvh/m_triArray when the scene
+    // sets "acceleration = { instancing = true; }"
+    bool                m_instancing;
+    Array<shared_ptr<InstancedMesh>> m_meshes;
+    Array<Instance>     m_instances;
+    InstanceBVH         m_tlas;
+
     shared_ptr<Camera>  m_camera;   // The scene's camera
     shared_ptr<dofCam>  m_dofCam;   // The scene's camera
     shared_ptr<Medium>  m_medium;   // The scene's homogeneous participating medium
     SkyCube  m_skyCube;   // The scene's skybox
-    Array<Tri>          m_emit;     // Triangles that emit light
+    int                 m_skyImage; // Which skybox m_skyCube holds, -1 if none
+    String              m_sourcePath;   // Scene file the world was built from
+    uint64              m_sourceHash;   // SceneCache::sourceHash() of that build
+
+    // Load in progress
+    bool                m_useCache;
+    bool                m_cached;       // Geometry comes from m_cache
+    String              m_cacheFile;
+    Table<String, Any>  m_modelSpecs;
+    Array<String>       m_modelQueue;   // Model keys still to be read
+    std::thread         m_prefetch;     // Reads model sources ahead of loadNextModel()
+    int                 m_modelsLoaded;
+    Table<String, shared_ptr<ArticulatedModel>> m_models;
+    Array<PendingEntity> m_pending;
+    Array<shared_ptr<Material>> m_cachedMaterials;
+    Array<int>          m_emitIndex;    // Indices of m_emit in m_triArray
+
+    // First out-of-core load: triangles spilled model by model, and the
+    // positions the BVH is built from
+    bool                m_spilling;
+    SceneCache::Stream  m_stream;
+    Array<Vector3>      m_spillPositions;
+    Array<uint8>        m_spillTwoSided;
+
+    size_t              m_tracked[MemoryTracker::NUM_CATEGORIES]; // this world's share, see track()
+    size_t              m_modelBytes;   // CPU geometry of m_models
+    size_t              m_textureBytes;
+    Table<Texture*, bool> m_countedTextures;
+
+    // Material textures through a tiled, mip-mapped cache instead of full
+    // resolution CPU copies ("textureCache = <MB>;")
+    bool                m_useTextureCache;
+    TextureCache        m_textureCache;
+
+    MaterialTable       m_materials;
+    Array<uint16>       m_triMaterials; // MaterialTable ids of m_triArray, of m_geometry's
+                                        // materials, or of the cache's when streaming
+
+    mutable std::mutex  m_statusMutex;
+    String              m_loadStatus;
+    float               m_loadProgress;
+    String              m_loadError;    // Why the load failed, if it did
+    Array<Tri>          m_emit;     // Triangles that emit light, in world space
+    CPUVertexArray      m_emitVerts;    // Vertices of m_emit
+    Emitter *           m_emitTable;    // m_emit for sampling, in m_arena
     CPUVertexArray      m_verts;    // The scene's vertices
 
 };